@@ -9,19 +9,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <cdc.h>
 
-static int exitRequested = 0;
+static volatile int exitRequested = 0;
+static sigset_t exitSignals;
 /*
- * sigintHandler --
+ * signalThread --
  *
- *    SIGINT handler, so we can gracefully exit when the user hits ctrl-C.
+ *    Waits for SIGINT or SIGTERM, so we can gracefully exit when the user
+ *    hits ctrl-C without waiting for a blocked read or write to time out.
  */
-static void
-sigintHandler(int signum)
+static void *
+signalThread(void *arg)
 {
+    int signum;
+
+    sigwait(&exitSignals, &signum);
     exitRequested = 1;
+    cdc_cancel_io((struct cdc_ctx *)arg);
+    return NULL;
 }
 
 int main(int argc, char **argv)
@@ -36,6 +44,7 @@ int main(int argc, char **argv)
     int do_write = 0;
     unsigned int pattern = 0xffff;
     int retval = EXIT_FAILURE;
+    pthread_t thread;
 
     while ((i = getopt(argc, argv, "i:v:p:b:w::")) != -1)
     {
@@ -131,19 +140,26 @@ int main(int argc, char **argv)
     }
     
     if (do_write)
+    {
         for(i=0; i<1024; i++)
             buf[i] = pattern;
+        /* release the data at line rate rather than flooding the device */
+        cdc_set_write_pacing(cdc, 64);
+    }
 
-    signal(SIGINT, sigintHandler);
+    /* block the signals in every thread but the one waiting for them */
+    sigemptyset(&exitSignals);
+    sigaddset(&exitSignals, SIGINT);
+    sigaddset(&exitSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &exitSignals, NULL);
+    pthread_create(&thread, NULL, signalThread, cdc);
     while (!exitRequested)
     {
         if (do_write)
-            f = cdc_write_data(cdc, buf, 
-                                (baudrate/512 >sizeof(buf))?sizeof(buf):
-                                (baudrate/512)?baudrate/512:1);
+            f = cdc_write_data(cdc, buf, sizeof(buf));
         else
             f = cdc_read_data(cdc, buf, sizeof(buf));
-        if (f<0)
+        if (f<0 && !exitRequested)
             usleep(1 * 1000000);
         else if(f> 0 && !do_write)
         {
@@ -153,7 +169,8 @@ int main(int argc, char **argv)
             fflush(stdout);
         }
     }
-    signal(SIGINT, SIG_DFL);
+    pthread_join(thread, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &exitSignals, NULL);
     retval =  EXIT_SUCCESS;
             
     cdc_usb_close(cdc);
@@ -0,0 +1,216 @@
+/* tty_bench.c
+
+   Measure cdc_read_data/cdc_write_data throughput.
+
+   Without a device, the kernel tty backend is exercised against the slave
+   side of an openpty() pair.  With -v/-p, a device with a loopback plug is
+   opened through the backend picked by -m, so the kernel tty and libusb
+   paths can be compared side by side.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include <cdc.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char const *what, long bytes, long calls, double seconds)
+{
+    printf("%-6s %ld bytes in %.3f s: %.2f MB/s, %ld calls, %.1f calls/MB\n",
+           what, bytes, seconds, bytes / seconds / 1e6, calls,
+           calls / (bytes / 1e6));
+}
+
+/* pump a pty master: send or swallow total bytes, then exit */
+static void pty_child(int master, int sending, long total, int chunk)
+{
+    unsigned char *buf = malloc(chunk);
+    long done = 0;
+    memset(buf, 0x55, chunk);
+    while (done < total) {
+        long want = total - done < chunk ? total - done : chunk;
+        ssize_t n = sending ? write(master, buf, want) : read(master, buf, want);
+        if (n <= 0)
+            _exit(EXIT_FAILURE);
+        done += n;
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static int bench_pty(struct cdc_ctx *cdc, long total, int chunk)
+{
+    char errbuf[256], name[64];
+    unsigned char *buf;
+    int master, slave, status;
+    long done, calls;
+    double start;
+    pid_t pid;
+
+    if (openpty(&master, &slave, name, NULL, NULL) < 0)
+    {
+        perror("openpty");
+        return EXIT_FAILURE;
+    }
+    if (cdc_tty_open(cdc, name) < 0)
+    {
+        fprintf(stderr, "unable to open %s: %s\n", name, cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+        return EXIT_FAILURE;
+    }
+    close(slave);
+    buf = malloc(chunk);
+    memset(buf, 0xaa, chunk);
+
+    /* device to host */
+    if ((pid = fork()) == 0)
+        pty_child(master, 1, total, chunk);
+    start = now();
+    for (done = calls = 0; done < total; calls ++)
+    {
+        int f = cdc_read_data(cdc, buf, chunk);
+        if (f < 0)
+        {
+            fprintf(stderr, "read failed: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+            break;
+        }
+        done += f;
+    }
+    report("read", done, calls, now() - start);
+    waitpid(pid, &status, 0);
+
+    /* host to device */
+    if ((pid = fork()) == 0)
+        pty_child(master, 0, total, chunk);
+    start = now();
+    for (done = calls = 0; done < total; calls ++)
+    {
+        int f = cdc_write_data(cdc, buf, total - done < chunk ? total - done : chunk);
+        if (f < 0)
+        {
+            fprintf(stderr, "write failed: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+            break;
+        }
+        done += f;
+    }
+    waitpid(pid, &status, 0);
+    report("write", done, calls, now() - start);
+
+    free(buf);
+    cdc_usb_close(cdc);
+    close(master);
+    return EXIT_SUCCESS;
+}
+
+static int bench_loopback(struct cdc_ctx *cdc, long total, int chunk)
+{
+    char errbuf[256];
+    unsigned char *buf = malloc(chunk);
+    long done = 0, calls = 0;
+    double start, rtt_max = 0;
+
+    printf("backend: %s\n", cdc->backend == CDC_BACKEND_TTY ? "kernel tty" : "libusb");
+    memset(buf, 0x55, chunk);
+    start = now();
+    while (done < total)
+    {
+        double t = now();
+        int f = cdc_write_data(cdc, buf, chunk);
+        int got = 0;
+        while (f > 0 && got < f)
+        {
+            int r = cdc_read_data(cdc, buf, f - got);
+            if (r < 0)
+            {
+                f = r;
+                break;
+            }
+            got += r;
+            calls ++;
+        }
+        if (f < 0)
+        {
+            fprintf(stderr, "loopback failed: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+            break;
+        }
+        if (now() - t > rtt_max)
+            rtt_max = now() - t;
+        done += got;
+        calls ++;
+    }
+    report("loop", done, calls, now() - start);
+    printf("worst round trip: %.1f us\n", rtt_max * 1e6);
+    free(buf);
+    cdc_usb_close(cdc);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    struct cdc_ctx *cdc;
+    char errbuf[256];
+    int vid = 0, pid = 0, chunk = 4096, i, ret;
+    long total = 16 * 1024 * 1024;
+    char const *mode = "tty";
+
+    while ((i = getopt(argc, argv, "v:p:m:n:s:")) != -1)
+    {
+        switch (i)
+        {
+            case 'v':
+                vid = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pid = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                mode = optarg;
+                break;
+            case 'n':
+                total = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                chunk = strtol(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v vid -p pid [-m tty|usb]] [-n bytes] [-s chunk]\n", *argv);
+                exit(-1);
+        }
+    }
+
+    if ((cdc = cdc_new()) == 0)
+    {
+        fprintf(stderr, "cdc_new failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!vid && !pid)
+    {
+        ret = bench_pty(cdc, total, chunk);
+    }
+    else
+    {
+        cdc->module_detach_mode = strcmp(mode, "usb") ? USE_KERNEL_CDC_MODULE : AUTO_DETACH_CDC_MODULE;
+        if (cdc_usb_open(cdc, vid, pid) < 0)
+        {
+            fprintf(stderr, "unable to open cdc device: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+            cdc_free(cdc);
+            return EXIT_FAILURE;
+        }
+        ret = bench_loopback(cdc, total, chunk);
+    }
+
+    cdc_free(cdc);
+    return ret;
+}
@@ -0,0 +1,259 @@
+/* uring_bench.c
+
+   Compare receiving on many tty backed ports with epoll + read against
+   the io_uring engine, using openpty() pairs so no hardware is needed.
+   Reports system calls and CPU time per MB received.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <cdc.h>
+
+static int nports = 64;
+static long per_port = 1024 * 1024;
+static int bufsize = 4096;
+
+static struct cdc_ctx **cdcs;
+static int *masters;
+static long received;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int open_ports(void)
+{
+    char errbuf[256], name[64];
+    int i, slave;
+
+    for (i = 0; i < nports; i++)
+    {
+        if (openpty(&masters[i], &slave, name, NULL, NULL) < 0)
+        {
+            perror("openpty");
+            return -1;
+        }
+        if (cdc_tty_open(cdcs[i], name) < 0)
+        {
+            fprintf(stderr, "unable to open %s: %s\n", name, cdc_get_error_string(cdcs[i], errbuf, sizeof(errbuf)));
+            return -1;
+        }
+        close(slave);
+        fcntl(masters[i], F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+static void close_ports(void)
+{
+    int i;
+    for (i = 0; i < nports; i++)
+    {
+        cdc_usb_close(cdcs[i]);
+        close(masters[i]);
+    }
+}
+
+/* feed per_port bytes into every pty master from a child process */
+static pid_t start_producer(void)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        struct pollfd *pfds = calloc(nports, sizeof(struct pollfd));
+        long *sent = calloc(nports, sizeof(long));
+        unsigned char *buf = malloc(bufsize);
+        int i, active = nports;
+
+        memset(buf, 0x55, bufsize);
+        for (i = 0; i < nports; i++)
+        {
+            pfds[i].fd = masters[i];
+            pfds[i].events = POLLOUT;
+        }
+        while (active && poll(pfds, nports, -1) > 0)
+        {
+            for (i = 0; i < nports; i++)
+            {
+                long want = per_port - sent[i] < bufsize ? per_port - sent[i] : bufsize;
+                ssize_t n;
+                if (!(pfds[i].revents & POLLOUT))
+                    continue;
+                n = write(masters[i], buf, want);
+                if (n > 0)
+                    sent[i] += n;
+                if (sent[i] == per_port)
+                {
+                    pfds[i].fd = -1;
+                    active--;
+                }
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+static void report(char const *what, long syscalls, double wall, double cpu_s)
+{
+    double mb = received / 1e6;
+    printf("%-6s %d ports, %.1f MB in %.3f s: %.1f syscalls/MB, %.2f ms CPU/MB\n",
+           what, nports, mb, wall, syscalls / mb, cpu_s * 1e3 / mb);
+}
+
+static void bench_epoll(void)
+{
+    struct epoll_event *events = calloc(nports, sizeof(struct epoll_event));
+    unsigned char *buf = malloc(bufsize);
+    long total = per_port * nports, syscalls = 0;
+    double wall, cpu_s;
+    int ep, i, status;
+    pid_t pid;
+
+    if (open_ports() < 0)
+        exit(EXIT_FAILURE);
+    ep = epoll_create1(0);
+    for (i = 0; i < nports; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, cdcs[i]->tty_fd, &ev);
+    }
+
+    received = 0;
+    pid = start_producer();
+    wall = now();
+    cpu_s = cpu();
+    while (received < total)
+    {
+        int n = epoll_wait(ep, events, nports, -1);
+        syscalls++;
+        for (i = 0; i < n; i++)
+        {
+            ssize_t r;
+            while ((r = read(cdcs[events[i].data.u32]->tty_fd, buf, bufsize)) > 0)
+            {
+                received += r;
+                syscalls++;
+            }
+            syscalls++;
+        }
+    }
+    report("epoll", syscalls, now() - wall, cpu() - cpu_s);
+
+    waitpid(pid, &status, 0);
+    close(ep);
+    close_ports();
+    free(buf);
+    free(events);
+}
+
+static void on_rx(struct cdc_ctx *cdc, unsigned char *buf, int len, void *user_data)
+{
+    if (len > 0)
+        received += len;
+}
+
+static void bench_uring(void)
+{
+    struct cdc_uring_stats stats;
+    struct cdc_uring *ring;
+    long total = per_port * nports;
+    double wall, cpu_s;
+    int i, status;
+    pid_t pid;
+
+    if ((ring = cdc_uring_new(nports, bufsize)) == NULL)
+    {
+        perror("cdc_uring_new");
+        return;
+    }
+    if (open_ports() < 0)
+        exit(EXIT_FAILURE);
+    for (i = 0; i < nports; i++)
+        cdc_uring_add(ring, cdcs[i], on_rx, NULL);
+
+    received = 0;
+    pid = start_producer();
+    wall = now();
+    cpu_s = cpu();
+    while (received < total)
+    {
+        if (cdc_uring_run(ring, -1) < 0)
+            break;
+    }
+    cdc_uring_get_stats(ring, &stats);
+    report("uring", stats.syscalls, now() - wall, cpu() - cpu_s);
+
+    waitpid(pid, &status, 0);
+    cdc_uring_free(ring);
+    close_ports();
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    while ((i = getopt(argc, argv, "n:b:s:")) != -1)
+    {
+        switch (i)
+        {
+            case 'n':
+                nports = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                per_port = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                bufsize = strtol(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n ports] [-b bytes per port] [-s buffer size]\n", *argv);
+                exit(-1);
+        }
+    }
+
+    cdcs = calloc(nports, sizeof(struct cdc_ctx *));
+    masters = calloc(nports, sizeof(int));
+    for (i = 0; i < nports; i++)
+    {
+        if ((cdcs[i] = cdc_new()) == 0)
+        {
+            fprintf(stderr, "cdc_new failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    bench_epoll();
+    bench_uring();
+
+    for (i = 0; i < nports; i++)
+        cdc_free(cdcs[i]);
+    free(cdcs);
+    free(masters);
+    return EXIT_SUCCESS;
+}
@@ -17,35 +17,187 @@
 /** \addtogroup libcdc */
 /* @{ */
 
+/* ppoll() */
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <libusb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-#include "cdc.h"
+#include "cdc_i.h"
 #include "cdc_version_i.h"
 
-#define cdc_return(code, str, ...) \
-    if (cdc) {                     \
-        if (str) {                 \
-            cdc->error_str = (str);\
-        }                          \
-        cdc->error_code = (code);  \
-        __VA_ARGS__;               \
-        return cdc->error_code;    \
-    } else {                       \
-        return (code);             \
+/** last error of the calling thread, see cdc_get_thread_error() */
+static __thread char const *cdc_thread_error_str;
+static __thread int cdc_thread_error_code;
+
+/**
+    Internal function to record an error, in the context for
+    cdc_get_error_string() and in the calling thread for
+    cdc_get_thread_error().  The context fields are stored atomically, as
+    several threads may fail at once on a shared context.
+    \internal
+
+    \param cdc pointer to cdc_ctx, or NULL
+    \param code CDC_ERROR code
+    \param str description, or NULL to keep the previous one
+*/
+void cdc_set_error_internal(struct cdc_ctx *cdc, int code, char const *str)
+{
+    if (str) {
+        cdc_thread_error_str = str;
+    }
+    cdc_thread_error_code = code;
+    if (cdc) {
+        if (str) {
+            __atomic_store_n(&cdc->error_str, str, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&cdc->error_code, code, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+    Internal function to consume the wakeup of cdc_cancel_io(), once the
+    waiting call it was meant for has returned or a new call found it
+    already set.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+void cdc_cancel_drain_internal(struct cdc_ctx *cdc)
+{
+    uint64_t count;
+
+    if (read(cdc->cancel_fd, &count, sizeof(count)) < 0) {
+        /* nothing to drain */
+    }
+}
+
+static void LIBUSB_CALL cdc_bulk_callback_internal(struct libusb_transfer *transfer)
+{
+    *(int *)transfer->user_data = 1;
+}
+
+/**
+    Internal function to get the transfer kept in a context slot,
+    allocating it on first use.
+    \internal
+
+    \param slot cdc->read_transfer or cdc->write_transfer
+
+    \return the transfer, or NULL if out of memory
+*/
+static struct libusb_transfer *cdc_transfer_get_internal(struct libusb_transfer **slot)
+{
+    struct libusb_transfer *transfer = *slot;
+
+    if (transfer == NULL) {
+        transfer = cdc_pool_transfer_get_internal();
+        if (transfer != NULL) {
+            __atomic_store_n(slot, transfer, __ATOMIC_RELEASE);
+        }
+    }
+    return transfer;
+}
+
+/**
+    Internal function to handle libusb events until a transfer completed.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param completed flag set by the transfer's callback
+
+    \return CDC_SUCCESS, or the CDC_ERROR code of a failure to handle events
+*/
+static int cdc_usb_wait_internal(struct cdc_ctx *cdc, int *completed)
+{
+    while (!*completed) {
+        int result = libusb_handle_events_completed(cdc->usb_ctx, completed);
+        if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+            return result;
+        }
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to cancel a transfer after a failure and collect it,
+    so that its buffer can be reused.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param transfer the transfer
+    \param completed flag set by the transfer's callback
+*/
+static void cdc_usb_abort_internal(struct cdc_ctx *cdc, struct libusb_transfer *transfer, int *completed)
+{
+    if (*completed) {
+        return;
+    }
+    libusb_cancel_transfer(transfer);
+    while (!*completed) {
+        if (libusb_handle_events_completed(cdc->usb_ctx, completed) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+    Internal function performing a blocking bulk transfer like
+    libusb_bulk_transfer(), but through a transfer kept in the context so
+    that cdc_cancel_io() can cancel it from another thread.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param slot where the transfer of this direction is kept
+    \param endpoint endpoint address
+    \param buf data buffer
+    \param size size of the buffer
+    \param actual_size storage for the number of bytes transferred, also on failure
+    \param timeout timeout in milliseconds, 0 for none
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure,
+            CDC_ERROR_INTERRUPTED if cancelled by cdc_cancel_io()
+*/
+static int cdc_bulk_transfer_internal(struct cdc_ctx *cdc, struct libusb_transfer **slot,
+                                      unsigned char endpoint, unsigned char *buf, int size,
+                                      int *actual_size, int timeout)
+{
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    struct libusb_transfer *transfer = cdc_transfer_get_internal(slot);
+    int completed = 0, result;
+
+    *actual_size = 0;
+    if (transfer == NULL) {
+        return CDC_ERROR_NO_MEM;
+    }
+
+    libusb_fill_bulk_transfer(transfer, cdc->usb_dev, endpoint, buf, size,
+                              cdc_bulk_callback_internal, &completed, timeout);
+    result = libusb_submit_transfer(transfer);
+    if (result < 0) {
+        return result;
+    }
+    /* a cdc_cancel_io() racing with the submission may have missed it */
+    if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+        libusb_cancel_transfer(transfer);
+    }
+
+    result = cdc_usb_wait_internal(cdc, &completed);
+    if (result < 0) {
+        cdc_usb_abort_internal(cdc, transfer, &completed);
+        return result;
     }
 
-#define cdc_check(code, str, ...)    \
-    do {                             \
-        int __code = (code);         \
-        if (__code < 0) {            \
-            cdc_return(__code, str,  \
-                       __VA_ARGS__); \
-        }                            \
-    } while(0);
+    *actual_size = transfer->actual_length;
+    cdc_tap_feed_internal(cdc, endpoint == cdc->out_ep ? CDC_TAP_RX : CDC_TAP_TX, buf, *actual_size, 0);
+    return cdc_transfer_status_internal(transfer->status);
+}
 
 /**
     Internal function to find the interface descriptors for a device.
@@ -94,7 +246,7 @@ static int cdc_usb_desc_internal (struct cdc_ctx *cdc, libusb_device *dev, struc
 
 /**
     Internal function to close usb device pointer.
-    Sets cdc->usb_dev to NULL.
+    Sets cdc->usb_dev to NULL and closes a kernel tty if one is open.
     \internal
 
     \param cdc pointer to cdc_ctx
@@ -103,11 +255,29 @@ static int cdc_usb_desc_internal (struct cdc_ctx *cdc, libusb_device *dev, struc
 */
 static void cdc_usb_close_internal (struct cdc_ctx *cdc)
 {
+    cdc_broadcast_stop(cdc);
+    cdc_write_queue_stop(cdc);
+    cdc_async_stop(cdc);
+    if (cdc && cdc->read_transfer)
+    {
+        cdc_pool_transfer_put_internal(cdc->read_transfer);
+        cdc->read_transfer = NULL;
+    }
+    if (cdc && cdc->write_transfer)
+    {
+        cdc_pool_transfer_put_internal(cdc->write_transfer);
+        cdc->write_transfer = NULL;
+    }
     if (cdc && cdc->usb_dev)
     {
         libusb_close (cdc->usb_dev);
         cdc->usb_dev = NULL;
     }
+    if (cdc)
+    {
+        cdc_tty_close_internal(cdc);
+        cdc->backend = CDC_BACKEND_NONE;
+    }
 }
 
 /**
@@ -129,11 +299,39 @@ int cdc_init(struct cdc_ctx *cdc)
     cdc->readbuffer = NULL;
     cdc->readbuffer_offset = 0;
     cdc->readbuffer_remaining = 0;
+    cdc->readbuffer_time = 0;
+    cdc->readbuffer_size = 0;
     cdc->max_packet_size = 0;
     cdc->error_str = "cdc_init";
     cdc->module_detach_mode = AUTO_DETACH_CDC_MODULE;
-
-    cdc_check(libusb_init(&cdc->usb_ctx), "libusb_init");
+    cdc->backend = CDC_BACKEND_NONE;
+    cdc->tty_fd = -1;
+    cdc->async = NULL;
+    cdc->write_queue = NULL;
+    cdc->broadcast = NULL;
+    cdc->taps = NULL;
+    cdc->read_transfer = NULL;
+    cdc->write_transfer = NULL;
+    cdc->cancel_seq = 0;
+    cdc->read_nonblocking = 0;
+    cdc->read_min_bytes = 0;
+    cdc->read_inter_byte_timeout = 0;
+    cdc->read_coalesce_bytes = 0;
+    cdc->read_coalesce_usecs = 0;
+    cdc->read_frame_gap_chars = 0;
+    cdc->read_frame_gap_usecs = 0;
+    cdc->line_baudrate = 0;
+    cdc->line_bits = BITS_8;
+    cdc->line_sbit = STOP_BIT_1;
+    cdc->line_parity = NONE;
+    cdc->write_pacing_burst = 0;
+    cdc->write_pacing_char_ns = 0;
+    cdc->write_pacing_full = 0;
+
+    cdc_check(cdc_mem_port_get_internal(), "all static ports in use");
+    cdc->cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    cdc_check(cdc->cancel_fd >= 0 ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "eventfd", cdc_mem_port_put_internal());
+    cdc_check(libusb_init(&cdc->usb_ctx), "libusb_init", close(cdc->cancel_fd), cdc_mem_port_put_internal());
 
     return CDC_SUCCESS;
 }
@@ -145,13 +343,13 @@ int cdc_init(struct cdc_ctx *cdc)
 */
 struct cdc_ctx *cdc_new(void)
 {
-    struct cdc_ctx *cdc = (struct cdc_ctx *)malloc(sizeof(struct cdc_ctx));
+    struct cdc_ctx *cdc = (struct cdc_ctx *)cdc_malloc_internal(sizeof(struct cdc_ctx));
     if (cdc == NULL) {
         return NULL;
     }
 
     if (cdc_init(cdc) != CDC_SUCCESS) {
-        free(cdc);
+        cdc_free_internal(cdc);
         return NULL;
     }
 
@@ -170,17 +368,26 @@ void cdc_deinit(struct cdc_ctx *cdc)
     }
 
     cdc_usb_close_internal(cdc);
+    cdc_tap_release_internal(cdc);
 
     if (cdc->readbuffer != NULL)
     {
-        free(cdc->readbuffer);
+        cdc_free_internal(cdc->readbuffer);
         cdc->readbuffer = NULL;
+        cdc->readbuffer_size = 0;
     }
 
     if (cdc->usb_ctx)
     {
         libusb_exit(cdc->usb_ctx);
         cdc->usb_ctx = NULL;
+        cdc_mem_port_put_internal();
+    }
+
+    if (cdc->cancel_fd >= 0)
+    {
+        close(cdc->cancel_fd);
+        cdc->cancel_fd = -1;
     }
 }
 
@@ -192,7 +399,7 @@ void cdc_deinit(struct cdc_ctx *cdc)
 void cdc_free(struct cdc_ctx *cdc)
 {
     cdc_deinit(cdc);
-    free(cdc);
+    cdc_free_internal(cdc);
 }
 
 /**
@@ -208,6 +415,7 @@ void cdc_set_usbdev (struct cdc_ctx *cdc, libusb_device_handle *usb)
     }
 
     cdc->usb_dev = usb;
+    cdc->backend = usb ? CDC_BACKEND_LIBUSB : CDC_BACKEND_NONE;
 }
 
 /**
@@ -271,7 +479,7 @@ int cdc_usb_find_all(struct cdc_ctx *cdc, struct cdc_device_list **devlist, int
             }
         }
 
-        *curdev = (struct cdc_device_list*)malloc(sizeof(struct cdc_device_list));
+        *curdev = (struct cdc_device_list*)cdc_malloc_internal(sizeof(struct cdc_device_list));
         if (!*curdev) {
             cdc_return(CDC_ERROR_NO_MEM, "out of memory", libusb_free_device_list(devs,1));
         }
@@ -298,7 +506,7 @@ void cdc_list_free(struct cdc_device_list **devlist)
     {
         next = curdev->next;
         libusb_unref_device(curdev->dev);
-        free(curdev);
+        cdc_free_internal(curdev);
         curdev = next;
     }
 
@@ -416,8 +624,19 @@ int cdc_usb_open_dev(struct cdc_ctx *cdc, libusb_device *dev)
     /* open device */
     cdc_check(libusb_open(dev, &cdc->usb_dev), "libusb_open");
 
+    /* use the kernel tty if the cdc_acm module is bound */
+    if (cdc->module_detach_mode == USE_KERNEL_CDC_MODULE &&
+        libusb_kernel_driver_active(cdc->usb_dev, cdc->data_if) == 1) {
+        char path[64];
+        if (cdc_tty_find_internal(cdc, dev, config_num, path, sizeof(path)) == CDC_SUCCESS) {
+            cdc_usb_close_internal(cdc);
+            return cdc_tty_open(cdc, path);
+        }
+    }
+
     /* detach kernel module */
-    if (cdc->module_detach_mode == AUTO_DETACH_CDC_MODULE) {
+    if (cdc->module_detach_mode == AUTO_DETACH_CDC_MODULE ||
+        cdc->module_detach_mode == USE_KERNEL_CDC_MODULE) {
         for (int ifnum = 0; ifnum <= cdc->data_if + 1; ifnum ++) {
             libusb_detach_kernel_driver(cdc->usb_dev, ifnum);
         }
@@ -445,6 +664,7 @@ int cdc_usb_open_dev(struct cdc_ctx *cdc, libusb_device *dev)
         "libusb_claim_interface",
         cdc_usb_close_internal(cdc)
     );
+    cdc->backend = CDC_BACKEND_LIBUSB;
 
     /* Set line state to 9600 8N1 */
     cdc_check(
@@ -618,6 +838,15 @@ int cdc_usb_close(struct cdc_ctx *cdc)
 {
     cdc_check(cdc ? CDC_SUCCESS: CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
 
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        cdc_usb_close_internal (cdc);
+        return CDC_SUCCESS;
+    }
+
+    cdc_broadcast_stop(cdc);
+    cdc_write_queue_stop(cdc);
+    cdc_async_stop(cdc);
+
     cdc_check(
         libusb_release_interface(cdc->usb_dev, cdc->data_if),
         "libusb_release_interface",
@@ -629,6 +858,34 @@ int cdc_usb_close(struct cdc_ctx *cdc)
     return CDC_SUCCESS;
 }
 
+/**
+    Internal function to remember the line coding of the port, and the
+    time a character takes on the line for write pacing.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param baudrate baud rate
+    \param bits Number of bits
+    \param sbit Number of stop bits
+    \param parity Parity mode
+*/
+static void cdc_line_coding_cache_internal(struct cdc_ctx *cdc, int baudrate,
+                                           enum cdc_bits_type bits, enum cdc_stopbits_type sbit,
+                                           enum cdc_parity_type parity)
+{
+    /* start bit, data bits, parity bit and stop bits, in half bits */
+    uint64_t half_bits = 2 * (1 + (uint64_t)bits + (parity != NONE)) +
+                         (sbit == STOP_BIT_1 ? 2 : sbit == STOP_BIT_15 ? 3 : 4);
+
+    cdc->line_bits = bits;
+    cdc->line_sbit = sbit;
+    cdc->line_parity = parity;
+    __atomic_store_n(&cdc->line_baudrate, baudrate, __ATOMIC_RELAXED);
+    __atomic_store_n(&cdc->write_pacing_char_ns,
+                     baudrate > 0 ? half_bits * 1000000000 / (2 * (uint64_t)baudrate) : 0,
+                     __ATOMIC_RELAXED);
+}
+
 /**
     Set (RS232) line characteristics and baud rate.
 
@@ -645,6 +902,11 @@ int cdc_set_line_coding(struct cdc_ctx *cdc, int baudrate,
                         enum cdc_parity_type parity)
 {
     cdc_check(cdc ? CDC_SUCCESS: CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        cdc_check(cdc_tty_set_line_coding(cdc, baudrate, bits, sbit, parity), NULL);
+        cdc_line_coding_cache_internal(cdc, baudrate, bits, sbit, parity);
+        return CDC_SUCCESS;
+    }
     cdc_check(cdc->usb_dev ? CDC_SUCCESS: CDC_ERROR_NO_DEVICE, "not opened");
 
     uint8_t coding[7] = {
@@ -660,12 +922,92 @@ int cdc_set_line_coding(struct cdc_ctx *cdc, int baudrate,
         libusb_control_transfer(cdc->usb_dev, 0x21, 0x20, 0, 0, coding, sizeof(coding), 0),
         "libusb_control_transfer"
     );
+    cdc_line_coding_cache_internal(cdc, baudrate, bits, sbit, parity);
     
     return CDC_SUCCESS;
 }
 
 /**
-    Writes data
+    Internal function to take bytes out of the write pacing bucket,
+    waiting until the bucket holds some.  The bucket fills at the rate
+    characters go out on the line and holds write_pacing_burst bytes; it
+    is kept as the time at which it is full again.  Does not set the
+    error of cdc, as the write queue's drain thread calls it too.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param size bytes about to be written
+    \param seq cdc->cancel_seq when the calling function started
+
+    \retval <0: CDC_ERROR_INTERRUPTED if cancelled while waiting
+    \retval >0: bytes that may be written now, at most size
+*/
+int cdc_pace_internal(struct cdc_ctx *cdc, int size, unsigned int seq)
+{
+    int burst = __atomic_load_n(&cdc->write_pacing_burst, __ATOMIC_RELAXED);
+    uint64_t char_ns = __atomic_load_n(&cdc->write_pacing_char_ns, __ATOMIC_RELAXED);
+    uint64_t now, full;
+
+    if (burst == 0 || char_ns == 0) {
+        return size;
+    }
+    if (size > burst) {
+        size = burst;
+    }
+    for (;;) {
+        now = cdc_now_ns_internal();
+        full = cdc->write_pacing_full > now ? cdc->write_pacing_full : now;
+        /* room for size bytes once the bucket is at most burst - size short of full */
+        if (full + size * char_ns <= now + burst * char_ns) {
+            break;
+        }
+        uint64_t wait = full + size * char_ns - now - burst * char_ns;
+        struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+        struct pollfd pfd = { cdc->cancel_fd, POLLIN, 0 };
+
+        if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+            return CDC_ERROR_INTERRUPTED;
+        }
+        if (ppoll(&pfd, 1, &ts, NULL) > 0 &&
+            __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq) {
+            /* a cancellation of an earlier call is left over: consume it */
+            cdc_cancel_drain_internal(cdc);
+        }
+    }
+    cdc->write_pacing_full = full + size * char_ns;
+    return size;
+}
+
+/**
+    Paces writes to the rate the device sends them out on its line, for
+    bridges that take bulk data far faster than their UART drains it and
+    then stall or drop data.  A token bucket filling at the character
+    rate of the line coding, start, parity and stop bits included, lets
+    burst bytes through at once after a pause and keeps longer writes at
+    line rate, so the device's FIFO stays shallow and the latency of each
+    byte predictable.  cdc_write_data() waits for the bucket, splitting
+    larger writes; with the write queue its drain thread does.  Pacing
+    takes effect once cdc_set_line_coding() was called, and follows later
+    changes of the line coding.
+
+    \param cdc pointer to cdc_ctx
+    \param burst bytes that may be written at once, e.g. the size of the
+                 device's FIFO, or 0 to turn pacing off, the default
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_write_pacing(struct cdc_ctx *cdc, int burst)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(burst >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "burst");
+
+    __atomic_store_n(&cdc->write_pacing_burst, burst, __ATOMIC_RELAXED);
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to write data through the backend in use.
+    \internal
 
     \param cdc pointer to cdc_ctx
     \param buf Buffer with the data
@@ -674,17 +1016,22 @@ int cdc_set_line_coding(struct cdc_ctx *cdc, int baudrate,
     \retval <0: CDC_ERROR code
     \retval >=0: number of bytes written
 */
-int cdc_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
+static int cdc_write_data_internal(struct cdc_ctx *cdc, unsigned char *buf, int size)
 {
     int result, actual_size = 0;
 
-    if (size == 0) {
-        return CDC_SUCCESS;
+    if (cdc->async) {
+        return cdc_async_write_data(cdc, buf, size);
+    }
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        return cdc_tty_write_data(cdc, buf, size);
     }
 
-    result = libusb_bulk_transfer(cdc->usb_dev, cdc->in_ep, buf, size, &actual_size, cdc->usb_write_timeout);
+    result = cdc_bulk_transfer_internal(cdc, &cdc->write_transfer, cdc->in_ep, buf, size, &actual_size,
+                                        cdc->usb_write_timeout);
 
-    if (result == LIBUSB_ERROR_TIMEOUT && actual_size != 0) {
+    /* a timed out or cancelled write still reports what was sent */
+    if ((result == LIBUSB_ERROR_TIMEOUT || result == LIBUSB_ERROR_INTERRUPTED) && actual_size != 0) {
         result = LIBUSB_SUCCESS;
     }
     cdc_check(
@@ -695,49 +1042,175 @@ int cdc_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
 }
 
 /**
-    Reads data
+    Writes data
 
     \param cdc pointer to cdc_ctx
-    \param buf Buffer to fill
+    \param buf Buffer with the data
     \param size Size of the buffer
 
     \retval <0: CDC_ERROR code
-    \retval >=0: number of bytes read
+    \retval >=0: number of bytes written
 */
-int cdc_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
+int cdc_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
 {
+    unsigned int seq;
     int result, actual_size = 0;
 
     if (size == 0) {
         return CDC_SUCCESS;
     }
 
-    /** process any buffered data */
+    if (cdc->write_queue) {
+        return cdc_queue_write_data(cdc, buf, size);
+    }
+    if (__atomic_load_n(&cdc->write_pacing_burst, __ATOMIC_RELAXED) == 0) {
+        return cdc_write_data_internal(cdc, buf, size);
+    }
+
+    seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    while (actual_size < size) {
+        int chunk = cdc_pace_internal(cdc, size - actual_size, seq);
+        if (chunk < 0) {
+            if (actual_size) {
+                break;
+            }
+            cdc_return(chunk, "cdc_cancel_io");
+        }
+        result = cdc_write_data_internal(cdc, buf + actual_size, chunk);
+        if (result < 0) {
+            return actual_size ? actual_size : result;
+        }
+        actual_size += result;
+        if (result < chunk) {
+            break;
+        }
+    }
+    return actual_size;
+}
+
+/**
+    Internal function to make sure the read buffer holds at least size bytes.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param size bytes needed, the buffered data included
+
+    \return CDC_SUCCESS on success or CDC_ERROR_NO_MEM
+*/
+static int cdc_readbuffer_alloc_internal(struct cdc_ctx *cdc, unsigned int size)
+{
+    unsigned char *readbuffer;
+
+    if (size < cdc->max_packet_size) {
+        size = cdc->max_packet_size;
+    }
+    if (size <= cdc->readbuffer_size) {
+        return CDC_SUCCESS;
+    }
+    readbuffer = (unsigned char *)cdc_malloc_internal(size);
+    if (readbuffer == NULL) {
+        return CDC_ERROR_NO_MEM;
+    }
     if (cdc->readbuffer_remaining > 0) {
-        actual_size = cdc->readbuffer_remaining > size ? size : cdc->readbuffer_remaining;
-        memcpy(buf, cdc->readbuffer_offset, actual_size);
-        cdc->readbuffer_remaining -= actual_size;
-        cdc->readbuffer_offset += actual_size;
-        return actual_size;
+        memcpy(readbuffer, cdc->readbuffer_offset, cdc->readbuffer_remaining);
+    }
+    cdc_free_internal(cdc->readbuffer);
+    cdc->readbuffer = cdc->readbuffer_offset = readbuffer;
+    cdc->readbuffer_size = size;
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to take data left in the read buffer.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+
+    \return number of bytes taken
+*/
+static int cdc_readbuffer_take_internal(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    int actual_size = cdc->readbuffer_remaining > size ? size : cdc->readbuffer_remaining;
+
+    memcpy(buf, cdc->readbuffer_offset, actual_size);
+    cdc->readbuffer_remaining -= actual_size;
+    cdc->readbuffer_offset += actual_size;
+    return actual_size;
+}
+
+/**
+    Internal function to put data read too far back in front of the read
+    buffer, for the next read to return it first.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf the data, just returned by a read
+    \param size number of bytes
+
+    \return CDC_SUCCESS on success or CDC_ERROR_NO_MEM
+*/
+static int cdc_readbuffer_unread_internal(struct cdc_ctx *cdc, unsigned char const *buf, int size)
+{
+    if (size == 0) {
+        return CDC_SUCCESS;
+    }
+    if (cdc->readbuffer_offset - cdc->readbuffer >= size &&
+        memcmp(cdc->readbuffer_offset - size, buf, size) == 0) {
+        /* it was taken from the read buffer and is still there */
+        cdc->readbuffer_offset -= size;
+        cdc->readbuffer_remaining += size;
+        return CDC_SUCCESS;
+    }
+    if (cdc_readbuffer_alloc_internal(cdc, cdc->readbuffer_remaining + size) < 0) {
+        return CDC_ERROR_NO_MEM;
     }
+    memmove(cdc->readbuffer + size, cdc->readbuffer_offset, cdc->readbuffer_remaining);
+    memcpy(cdc->readbuffer, buf, size);
+    cdc->readbuffer_offset = cdc->readbuffer;
+    cdc->readbuffer_remaining += size;
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to read through libusb without an engine.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param timeout milliseconds to wait for data, 0 to only poll the
+                   device, -1 to wait forever
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read, 0 if none arrived in time
+*/
+static int cdc_usb_read_internal(struct cdc_ctx *cdc, unsigned char *buf, int size, int timeout)
+{
+    int result, actual_size = 0;
+
+    /* libusb has no zero timeout, its 0 means forever */
+    timeout = timeout < 0 ? 0 : timeout == 0 ? 1 : timeout;
 
     if (size >= cdc->max_packet_size) {
         /** if buf size is greater than packet size, read straight into buf */
-        result = libusb_bulk_transfer(cdc->usb_dev, cdc->out_ep, buf, size, &actual_size, cdc->usb_read_timeout);
+        result = cdc_bulk_transfer_internal(cdc, &cdc->read_transfer, cdc->out_ep, buf, size, &actual_size,
+                                            timeout);
     } else {
         /** otherwise, buffer a packet of data */
-        if (cdc->readbuffer == NULL) {
-            cdc->readbuffer = malloc(cdc->max_packet_size);
-        }
-        result = libusb_bulk_transfer(cdc->usb_dev, cdc->out_ep, cdc->readbuffer, cdc->max_packet_size, &actual_size, cdc->usb_read_timeout);
+        cdc_check(cdc_readbuffer_alloc_internal(cdc, cdc->max_packet_size), "out of memory");
+        result = cdc_bulk_transfer_internal(cdc, &cdc->read_transfer, cdc->out_ep, cdc->readbuffer,
+                                            cdc->max_packet_size, &actual_size, timeout);
         if (actual_size > size) {
+            cdc->readbuffer_time = cdc_now_ns_internal();
             cdc->readbuffer_remaining = actual_size - size;
             cdc->readbuffer_offset = cdc->readbuffer + size;
             actual_size = size;
         }
         memcpy(buf, cdc->readbuffer, actual_size);
     }
-    if (result == LIBUSB_ERROR_TIMEOUT && actual_size != 0) {
+    if (result == LIBUSB_ERROR_TIMEOUT || (result == LIBUSB_ERROR_INTERRUPTED && actual_size != 0)) {
         result = LIBUSB_SUCCESS;
     }
     cdc_check(
@@ -748,44 +1221,897 @@ int cdc_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
 }
 
 /**
-    Set dtr and rts line
+    Internal function to read once through the port's backend.
+    \internal
 
-    \param cdc pointer to cdc_context
-    \param dtr DTR state to set line to (1 or 0)
-    \param rts RTS state to set line to (1 or 0)
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param want bytes the asynchronous engine collects before waking the
+                caller, where possible
+    \param timeout milliseconds to wait for data, 0 not to wait, -1 to wait forever
 
-    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read, 0 if none arrived in time
 */
-int cdc_setdtr_rts(struct cdc_ctx *cdc, int dtr, int rts)
+static int cdc_read_once_internal(struct cdc_ctx *cdc, unsigned char *buf, int size, int want, int timeout)
 {
-    unsigned short usb_val;
-
-    cdc_check(cdc ? CDC_SUCCESS: CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
-    cdc_check(cdc->usb_dev ? CDC_SUCCESS: CDC_ERROR_NO_DEVICE, "not opened");
-
-    usb_val = 0;
-    if (dtr) {
-        usb_val |= 0x01;
+    /** process any buffered data */
+    if (cdc->readbuffer_remaining > 0) {
+        return cdc_readbuffer_take_internal(cdc, buf, size);
     }
-    if (rts) {
-        usb_val |= 0x02;
+    if (cdc->async) {
+        return cdc_async_read_data(cdc, buf, size, want, timeout, NULL, NULL);
     }
-    cdc_check(
-        libusb_control_transfer(cdc->usb_dev, 0x21, 0x22, usb_val, 0, NULL, 0, 0),
-        "libusb_control_transfer"
-    );
-    
-    return CDC_SUCCESS;
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        return cdc_tty_read_data(cdc, buf, size, timeout);
+    }
+    return cdc_usb_read_internal(cdc, buf, size, timeout);
 }
 
 /**
-    Produce a string representation for the last error code
+    Reads data
 
-    \param cdc pointer to cdc_context
-    \param buf string storage
-    \param size length of storage
+    By default, waits up to usb_read_timeout for data and returns what
+    arrived.  cdc_set_read_min() and cdc_set_read_coalesce() make it
+    collect more data before returning, cdc_set_nonblocking() makes it not
+    wait at all.
 
-    \return The passed storage buffer containing error string
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read
+*/
+int cdc_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    unsigned int seq;
+    uint64_t deadline, first = 0;
+    int result, timeout, want, min_bytes, coalesce_bytes, actual_size = 0;
+
+    if (size == 0) {
+        return CDC_SUCCESS;
+    }
+
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "use cdc_broadcast_peek");
+    if (cdc->read_nonblocking) {
+        return cdc_read_once_internal(cdc, buf, size, 1, 0);
+    }
+
+    seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    deadline = cdc_deadline_internal(cdc->usb_read_timeout);
+    min_bytes = cdc->read_min_bytes < size ? cdc->read_min_bytes : size;
+    coalesce_bytes = __atomic_load_n(&cdc->read_coalesce_bytes, __ATOMIC_RELAXED);
+    coalesce_bytes = coalesce_bytes < size ? coalesce_bytes : size;
+    do {
+        if (actual_size == 0 || actual_size < min_bytes) {
+            /* the inter-byte timer replaces usb_read_timeout once data arrived */
+            if (actual_size == 0 || cdc->read_inter_byte_timeout == 0) {
+                timeout = cdc_remaining_internal(deadline);
+            } else {
+                timeout = cdc->read_inter_byte_timeout;
+            }
+            want = cdc->read_inter_byte_timeout ? 1 : min_bytes - actual_size;
+        } else {
+            /* the latency timer runs from the first byte, in whole milliseconds */
+            int64_t left = (int64_t)(first + (uint64_t)__atomic_load_n(&cdc->read_coalesce_usecs, __ATOMIC_RELAXED) * 1000 - cdc_now_ns_internal());
+            if (left <= 0) {
+                break;
+            }
+            timeout = (int)((left + 999999) / 1000000);
+            want = coalesce_bytes - actual_size;
+        }
+        result = cdc_read_once_internal(cdc, buf + actual_size, size - actual_size, want, timeout);
+        if (result <= 0) {
+            break;
+        }
+        if (actual_size == 0) {
+            first = cdc_now_ns_internal();
+        }
+        actual_size += result;
+    } while ((actual_size < min_bytes || actual_size < coalesce_bytes) &&
+             __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq);
+
+    if (actual_size > 0) {
+        return actual_size;
+    }
+    if (result < 0) {
+        return result;
+    }
+    cdc_return(CDC_ERROR_TIMEOUT, "read timeout");
+}
+
+/**
+    Internal function to read one message through libusb without an
+    engine: transfers until one ends with a short or zero length packet.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param timeout milliseconds to wait for data, 0 to only poll the
+                   device, -1 to wait forever
+    \param stamp storage for the CLOCK_MONOTONIC nanoseconds at which the
+                 first transfer of the message completed
+
+    \retval <0: CDC_ERROR code, CDC_ERROR_OVERFLOW if the message was
+                larger than the buffer and has been discarded
+    \retval >=0: length of the message, 0 if none arrived in time
+*/
+static int cdc_usb_read_message_internal(struct cdc_ctx *cdc, unsigned char *buf, int size, int timeout,
+                                         uint64_t *stamp)
+{
+    int result, actual_size, got = 0, overflow = 0;
+
+    /* libusb has no zero timeout, its 0 means forever */
+    timeout = timeout < 0 ? 0 : timeout == 0 ? 1 : timeout;
+    cdc_check(cdc_readbuffer_alloc_internal(cdc, cdc->max_packet_size), "out of memory");
+
+    for (;;) {
+        unsigned char *dst = cdc->readbuffer;
+        int len = cdc->max_packet_size;
+
+        if (!overflow && size - got >= cdc->max_packet_size) {
+            /** whole packets go straight into buf, the last one may be short */
+            dst = buf + got;
+            len = (size - got) / cdc->max_packet_size * cdc->max_packet_size;
+        }
+        actual_size = 0;
+        result = cdc_bulk_transfer_internal(cdc, &cdc->read_transfer, cdc->out_ep, dst, len, &actual_size,
+                                            timeout);
+        if (result == LIBUSB_ERROR_TIMEOUT || (result == LIBUSB_ERROR_INTERRUPTED && actual_size != 0)) {
+            /* return what arrived of a message cut short */
+            result = LIBUSB_SUCCESS;
+            len = -1;
+        }
+        cdc_check(
+            result,
+            "libusb_bulk_transfer"
+        );
+        if (got == 0 && !overflow) {
+            *stamp = cdc_now_ns_internal();
+        }
+        if (dst == cdc->readbuffer) {
+            if (actual_size > size - got) {
+                overflow = 1;
+            }
+            if (!overflow) {
+                memcpy(buf + got, dst, actual_size);
+            }
+        }
+        if (!overflow) {
+            got += actual_size;
+        }
+        if (actual_size == 0 && got == 0 && len > 0 && !overflow) {
+            /** a zero length packet on its own ends an empty message */
+            continue;
+        }
+        if (actual_size < len || len < 0) {
+            break;
+        }
+    }
+    if (overflow) {
+        cdc_return(CDC_ERROR_OVERFLOW, "message larger than the buffer");
+    }
+    return got;
+}
+
+/**
+    Internal function to read one frame without an engine: the data up to
+    a pause of the line longer than the frame gap, see
+    cdc_set_read_frame_gap().  Data read past the pause is kept in the
+    read buffer as the start of the next frame.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param timeout milliseconds to wait for the frame to start, 0 to only
+                   poll, -1 to wait forever
+    \param stamp storage for the CLOCK_MONOTONIC nanoseconds at which the
+                 first data of the frame was read
+
+    \retval <0: CDC_ERROR code, CDC_ERROR_OVERFLOW if the frame was
+                larger than the buffer and has been discarded
+    \retval >=0: length of the frame, 0 if none arrived in time
+*/
+static int cdc_read_frame_internal(struct cdc_ctx *cdc, unsigned char *buf, int size, int timeout,
+                                   uint64_t *stamp)
+{
+    uint64_t gap = cdc_frame_gap_ns_internal(cdc);
+    uint64_t char_ns = __atomic_load_n(&cdc->write_pacing_char_ns, __ATOMIC_RELAXED);
+    uint64_t now, last = 0;
+    int gap_ms = (int)((gap + 999999) / 1000000);
+    int result, len, got = 0, overflow = 0;
+
+    cdc_check(cdc_readbuffer_alloc_internal(cdc, cdc->backend == CDC_BACKEND_TTY ? CDC_FRAME_TTY_CHUNK : 0),
+              "out of memory");
+
+    for (;;) {
+        /** once the frame started, it ends when nothing follows within the gap */
+        int wait = got || overflow ? gap_ms : timeout;
+
+        if (cdc->readbuffer_remaining > 0) {
+            /* the start of this frame, read by the previous call */
+            len = cdc->readbuffer_remaining;
+            now = cdc->readbuffer_time;
+            memmove(cdc->readbuffer, cdc->readbuffer_offset, len);
+            cdc->readbuffer_remaining = 0;
+            cdc->readbuffer_offset = cdc->readbuffer;
+        } else if (cdc->backend == CDC_BACKEND_TTY) {
+            len = cdc_tty_read_data(cdc, cdc->readbuffer, cdc->readbuffer_size, wait);
+            cdc_check(len, NULL);
+            now = cdc_now_ns_internal();
+        } else {
+            len = 0;
+            /* libusb has no zero timeout, its 0 means forever */
+            result = cdc_bulk_transfer_internal(cdc, &cdc->read_transfer, cdc->out_ep, cdc->readbuffer,
+                                                cdc->max_packet_size, &len,
+                                                wait < 0 ? 0 : wait == 0 ? 1 : wait);
+            if (result == LIBUSB_ERROR_TIMEOUT || (result == LIBUSB_ERROR_INTERRUPTED && len != 0)) {
+                result = LIBUSB_SUCCESS;
+            }
+            cdc_check(
+                result,
+                "libusb_bulk_transfer"
+            );
+            now = cdc_now_ns_internal();
+        }
+        if (len == 0) {
+            break;
+        }
+        if ((got || overflow) && now - len * char_ns > last + gap) {
+            /** the data started after the gap: keep it for the next frame */
+            cdc->readbuffer_remaining = len;
+            cdc->readbuffer_offset = cdc->readbuffer;
+            cdc->readbuffer_time = now;
+            break;
+        }
+        if (got == 0 && !overflow) {
+            *stamp = now;
+        }
+        if (len > size - got) {
+            overflow = 1;
+        }
+        if (!overflow) {
+            memcpy(buf + got, cdc->readbuffer, len);
+            got += len;
+        }
+        last = now;
+    }
+    if (overflow) {
+        cdc_return(CDC_ERROR_OVERFLOW, "frame larger than the buffer");
+    }
+    return got;
+}
+
+/**
+    Reads whole messages, keeping the boundaries of the USB transfers
+    instead of merging them into a stream: a message ends with a packet
+    shorter than the endpoint's packet size, or a zero length packet, as
+    devices framing their data in transfers send it.
+
+    Waits like cdc_read_data() for the first message, then adds those
+    already received and fitting into buf, up to count of them.  Without
+    the asynchronous engine, see cdc_async_start(), each call returns one
+    message.  A message larger than buf, or than the engine's receive
+    queue, is discarded and reported with CDC_ERROR_OVERFLOW, so the next
+    call starts at a boundary again; empty
+    messages are skipped.  tty backed ports are not supported, as the
+    kernel driver merges the transfers.
+
+    With cdc_set_read_frame_gap() the messages are frames of the line
+    instead, ending at a pause of it, on tty backed ports too.
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param msgs storage for the offset and length of each message in buf
+    \param count number of entries in msgs
+
+    \retval <0: CDC_ERROR code
+    \retval >0: number of messages read
+*/
+int cdc_read_messages(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                      struct cdc_message *msgs, int count)
+{
+    int result, timeout;
+    uint64_t gap;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(buf && size > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "buf");
+    cdc_check(msgs && count > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "msgs");
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "use cdc_broadcast_peek");
+    gap = cdc_frame_gap_ns_internal(cdc);
+    cdc_check(cdc->backend != CDC_BACKEND_TTY || gap ? CDC_SUCCESS : CDC_ERROR_NOT_SUPPORTED,
+              "the tty driver merges transfers");
+
+    /** data left over by cdc_read_data() or cdc_transact() counts as one
+        message; without an engine, frames start with it instead */
+    if (cdc->readbuffer_remaining > 0 && (cdc->async || gap == 0)) {
+        msgs[0].offset = 0;
+        msgs[0].time = cdc->readbuffer_time;
+        msgs[0].len = cdc_readbuffer_take_internal(cdc, buf, size);
+        return 1;
+    }
+
+    timeout = cdc->read_nonblocking ? 0 : cdc->usb_read_timeout ? cdc->usb_read_timeout : -1;
+    if (cdc->async) {
+        if (gap) {
+            result = cdc_async_read_frames(cdc, buf, size, msgs, count, timeout);
+        } else {
+            result = cdc_async_read_messages(cdc, buf, size, msgs, count, timeout);
+        }
+    } else {
+        if (gap) {
+            result = cdc_read_frame_internal(cdc, buf, size, timeout, &msgs[0].time);
+        } else {
+            result = cdc_usb_read_message_internal(cdc, buf, size, timeout, &msgs[0].time);
+        }
+        if (result > 0) {
+            msgs[0].offset = 0;
+            msgs[0].len = result;
+            result = 1;
+        }
+    }
+    if (result == 0 && timeout != 0) {
+        cdc_return(CDC_ERROR_TIMEOUT, "read timeout");
+    }
+    return result;
+}
+
+/**
+    Reads one whole message, see cdc_read_messages().
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code, CDC_ERROR_OVERFLOW if the message was
+                larger than the buffer and has been discarded
+    \retval >=0: length of the message, 0 if none arrived in
+                 nonblocking mode
+*/
+int cdc_read_message(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    struct cdc_message msg;
+    int result = cdc_read_messages(cdc, buf, size, &msg, 1);
+
+    return result > 0 ? msg.len : result;
+}
+
+/**
+    Reads data with the time it was received: each block of the data
+    returned comes from one transfer, and carries the CLOCK_MONOTONIC time
+    at which that transfer completed, free of the delay until the call.
+    The engine takes the time when it handles the completion, see
+    cdc_async_start(); without it, or on a tty, when the read returns.
+
+    Waits up to usb_read_timeout for data, or not at all with
+    cdc_set_nonblocking(), then returns the data already received up to
+    the size of buf or count blocks.  cdc_set_read_min() and
+    cdc_set_read_coalesce() do not apply.
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param blocks storage for the offset, length and time of each block
+    \param count number of entries in blocks
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of blocks read, 0 if none arrived in
+                 nonblocking mode
+*/
+int cdc_read_stamped(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                     struct cdc_message *blocks, int count)
+{
+    int result, timeout;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(buf && size > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "buf");
+    cdc_check(blocks && count > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "blocks");
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "use cdc_broadcast_peek");
+
+    blocks[0].offset = 0;
+    if (cdc->readbuffer_remaining > 0) {
+        blocks[0].time = cdc->readbuffer_time;
+        blocks[0].len = cdc_readbuffer_take_internal(cdc, buf, size);
+        return 1;
+    }
+
+    timeout = cdc->read_nonblocking ? 0 : cdc->usb_read_timeout ? cdc->usb_read_timeout : -1;
+    if (cdc->async) {
+        result = cdc_async_read_data(cdc, buf, size, 1, timeout, blocks, &count);
+        result = result > 0 ? count : result;
+    } else {
+        if (cdc->backend == CDC_BACKEND_TTY) {
+            result = cdc_tty_read_data(cdc, buf, size, timeout);
+        } else {
+            result = cdc_usb_read_internal(cdc, buf, size, timeout);
+        }
+        blocks[0].time = cdc_now_ns_internal();
+        if (result > 0) {
+            blocks[0].len = result;
+            result = 1;
+        }
+    }
+    if (result == 0 && timeout != 0) {
+        cdc_return(CDC_ERROR_TIMEOUT, "read timeout");
+    }
+    return result;
+}
+
+/**
+    Makes cdc_read_data() return at once with the data received so far,
+    0 bytes if there is none, instead of waiting up to usb_read_timeout.
+    On a libusb port the asynchronous engine, see cdc_async_start(),
+    reads ahead in the background; without it, each read polls the device
+    for up to a millisecond.
+
+    \param cdc pointer to cdc_ctx
+    \param nonblocking 1 not to wait, 0 to wait again
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_nonblocking(struct cdc_ctx *cdc, int nonblocking)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+
+    cdc->read_nonblocking = nonblocking ? 1 : 0;
+    return CDC_SUCCESS;
+}
+
+/**
+    Sets when blocking cdc_read_data() calls return, like VMIN and VTIME
+    of termios: after waiting up to usb_read_timeout for the first byte,
+    it collects data until min_bytes arrived or, if inter_byte_timeout is
+    set, until no byte arrived for that long.  The data is taken from the
+    read-ahead buffer of the asynchronous engine or the tty where there
+    is one, so a reader wakes up once per message rather than per packet.
+
+    \param cdc pointer to cdc_ctx
+    \param min_bytes bytes to collect, at most the buffer size; 0 or 1 to
+                     return as soon as any data arrived, the default
+    \param inter_byte_timeout milliseconds of silence after which fewer
+                              bytes are returned, 0 to wait up to
+                              usb_read_timeout for all of them
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_read_min(struct cdc_ctx *cdc, int min_bytes, int inter_byte_timeout)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(min_bytes >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "min_bytes");
+    cdc_check(inter_byte_timeout >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "inter_byte_timeout");
+
+    cdc->read_min_bytes = min_bytes;
+    cdc->read_inter_byte_timeout = inter_byte_timeout;
+    return CDC_SUCCESS;
+}
+
+/**
+    Sets the latency timer of blocking cdc_read_data() calls, which
+    coalesces small transfers into fewer, larger reads: once data arrived,
+    the call returns when bytes have accumulated or usecs have passed
+    since the first byte, whichever comes first.  Smaller values favour
+    latency, larger ones throughput; they can be changed at any time.
+    With the asynchronous engine the data is left in its buffers meanwhile,
+    and the real-time event thread, see cdc_rt_start(), only wakes the
+    reader once enough arrived.  The timer has millisecond resolution.
+
+    \param cdc pointer to cdc_ctx
+    \param bytes bytes to accumulate, at most the buffer size; 0 or 1 to
+                 return as soon as any data arrived, the default
+    \param usecs microseconds to wait for them after the first byte
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_read_coalesce(struct cdc_ctx *cdc, int bytes, int usecs)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(bytes >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "bytes");
+    cdc_check(usecs >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "usecs");
+
+    __atomic_store_n(&cdc->read_coalesce_usecs, usecs, __ATOMIC_RELAXED);
+    __atomic_store_n(&cdc->read_coalesce_bytes, usecs ? bytes : 0, __ATOMIC_RELAXED);
+    return CDC_SUCCESS;
+}
+
+/**
+    Splits the data of cdc_read_message() and cdc_read_messages() into
+    frames at pauses of the line instead of at the ends of USB transfers,
+    for protocols such as Modbus RTU that end a frame with silence rather
+    than a delimiter.  A frame ends once nothing followed it for longer
+    than chars character times of the line coding, see
+    cdc_set_line_coding(), or usecs, whichever is longer.
+
+    The pause is taken between the completion of a transfer ending with a
+    short packet and the estimated start of the next one: its completion
+    less the time its bytes took on the line.  A transfer is never split,
+    and the completions carry the jitter of the USB frames, so pauses
+    shorter than a millisecond or two are not told apart reliably; for a
+    bridge holding data back, e.g. with a latency timer, usecs must exceed
+    that delay.  With the asynchronous engine, see cdc_async_start(),
+    pauses are also seen while nobody reads, as long as events are handled
+    and the receive queue has room; without it only while a read waits.
+    Once a frame started, a read waits for its end.  Works on tty backed
+    ports too, with the times their reads return.
+
+    \param cdc pointer to cdc_ctx
+    \param chars character times of silence ending a frame, e.g. 3 for
+                 the 3.5 of Modbus RTU, or 0
+    \param usecs least silence ending a frame in microseconds, e.g. 1750
+                 for Modbus RTU above 19200 baud, or 0; used alone while
+                 the line coding is unknown.  Both 0 turn frames off, the
+                 default.
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_read_frame_gap(struct cdc_ctx *cdc, int chars, int usecs)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(chars >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "chars");
+    cdc_check(usecs >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "usecs");
+
+    __atomic_store_n(&cdc->read_frame_gap_chars, chars, __ATOMIC_RELAXED);
+    __atomic_store_n(&cdc->read_frame_gap_usecs, usecs, __ATOMIC_RELAXED);
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to get the pause of the line that ends a frame, see
+    cdc_set_read_frame_gap().
+    \internal
+
+    \param cdc pointer to cdc_ctx
+
+    \return the pause in nanoseconds, 0 if frames are off
+*/
+uint64_t cdc_frame_gap_ns_internal(struct cdc_ctx *cdc)
+{
+    uint64_t chars = (uint64_t)__atomic_load_n(&cdc->read_frame_gap_chars, __ATOMIC_RELAXED) *
+                     __atomic_load_n(&cdc->write_pacing_char_ns, __ATOMIC_RELAXED);
+    uint64_t usecs = (uint64_t)__atomic_load_n(&cdc->read_frame_gap_usecs, __ATOMIC_RELAXED) * 1000;
+
+    return chars > usecs ? chars : usecs;
+}
+
+/**
+    Internal function to add received bytes to a transaction's response
+    and check whether it is complete.
+    \internal
+
+    \param resp the response
+    \param got bytes of it so far, updated to end at the terminator if found
+    \param size bytes just added at resp + *got
+    \param resp_max size of the response buffer
+    \param terminator byte ending the response, or CDC_TRANSACT_LENGTH
+
+    \return number of added bytes past the end of the response, or -1 if
+            it is not complete yet
+*/
+static int cdc_transact_add_internal(unsigned char *resp, int *got, int size, int resp_max, int terminator)
+{
+    unsigned char *end;
+
+    if (terminator != CDC_TRANSACT_LENGTH &&
+        (end = (unsigned char *)memchr(resp + *got, terminator, size)) != NULL) {
+        size -= end + 1 - (resp + *got);
+        *got = end + 1 - resp;
+        return size;
+    }
+    *got += size;
+    return *got == resp_max ? 0 : -1;
+}
+
+/**
+    Internal function performing a transaction on a libusb port without an
+    engine: the read is submitted before the request, so the response is
+    received as soon as the device sends it.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param req the request
+    \param req_len length of the request
+    \param resp buffer for the response
+    \param resp_max size of the response buffer
+    \param got bytes of the response already taken from the read buffer
+    \param terminator byte ending the response, or CDC_TRANSACT_LENGTH
+    \param deadline CLOCK_MONOTONIC deadline in milliseconds, 0 for none
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: length of the response
+*/
+static int cdc_usb_transact_internal(struct cdc_ctx *cdc, unsigned char const *req, int req_len,
+                                     unsigned char *resp, int resp_max, int got, int terminator,
+                                     uint64_t deadline)
+{
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    struct libusb_transfer *rx = cdc_transfer_get_internal(&cdc->read_transfer);
+    struct libusb_transfer *tx = cdc_transfer_get_internal(&cdc->write_transfer);
+    int rx_done, tx_done = 1, tx_tapped = req_len <= 0, extra = -1, result, size, timeout;
+    unsigned char *dest;
+
+    cdc_check(rx && tx ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    cdc_check(cdc_readbuffer_alloc_internal(cdc, cdc->max_packet_size), "out of memory");
+
+    do {
+        timeout = cdc_remaining_internal(deadline);
+        if (timeout == 0) {
+            result = CDC_ERROR_TIMEOUT;
+            break;
+        }
+        /* whole packets straight into resp, a smaller rest through the read buffer */
+        size = (resp_max - got) / cdc->max_packet_size * cdc->max_packet_size;
+        dest = size ? resp + got : cdc->readbuffer;
+        rx_done = 0;
+        libusb_fill_bulk_transfer(rx, cdc->usb_dev, cdc->out_ep, dest, size ? size : cdc->max_packet_size,
+                                  cdc_bulk_callback_internal, &rx_done, timeout < 0 ? 0 : timeout);
+        result = libusb_submit_transfer(rx);
+        if (result < 0) {
+            break;
+        }
+        /* the request goes out once the read waits for the response */
+        if (req_len > 0) {
+            tx_done = 0;
+            libusb_fill_bulk_transfer(tx, cdc->usb_dev, cdc->in_ep, (unsigned char *)req, req_len,
+                                      cdc_bulk_callback_internal, &tx_done, cdc->usb_write_timeout);
+            result = libusb_submit_transfer(tx);
+            if (result < 0) {
+                tx_done = tx_tapped = 1;
+                libusb_cancel_transfer(rx);
+            }
+            req_len = 0;
+        }
+        /* a cdc_cancel_io() racing with the submissions may have missed them */
+        if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+            libusb_cancel_transfer(rx);
+        }
+        timeout = cdc_usb_wait_internal(cdc, &rx_done);
+        if (timeout < 0) {
+            cdc_usb_abort_internal(cdc, rx, &rx_done);
+            cdc_usb_abort_internal(cdc, tx, &tx_done);
+            cdc_return(timeout, "libusb_handle_events");
+        }
+
+        cdc->readbuffer_time = cdc_now_ns_internal();
+        if (tx_done && !tx_tapped) {
+            cdc_tap_feed_internal(cdc, CDC_TAP_TX, tx->buffer, tx->actual_length, 0);
+            tx_tapped = 1;
+        }
+        cdc_tap_feed_internal(cdc, CDC_TAP_RX, dest, rx->actual_length, cdc->readbuffer_time);
+        if (dest == cdc->readbuffer) {
+            cdc->readbuffer_offset = cdc->readbuffer;
+            cdc->readbuffer_remaining = rx->actual_length;
+            size = cdc_readbuffer_take_internal(cdc, resp + got, resp_max - got);
+        } else {
+            size = rx->actual_length;
+        }
+        extra = cdc_transact_add_internal(resp, &got, size, resp_max, terminator);
+        if (extra > 0) {
+            cdc_readbuffer_unread_internal(cdc, resp + got, extra);
+        }
+        if (result == CDC_SUCCESS && extra < 0) {
+            result = cdc_transfer_status_internal(rx->status);
+        }
+    } while (result == CDC_SUCCESS && extra < 0);
+
+    /* the response may complete before the request does */
+    if (!tx_done) {
+        if (result < 0) {
+            libusb_cancel_transfer(tx);
+        }
+        timeout = cdc_usb_wait_internal(cdc, &tx_done);
+        if (timeout < 0) {
+            cdc_usb_abort_internal(cdc, tx, &tx_done);
+            result = timeout;
+        } else if (result == CDC_SUCCESS) {
+            result = cdc_transfer_status_internal(tx->status);
+        }
+    }
+    if (tx_done && !tx_tapped) {
+        cdc_tap_feed_internal(cdc, CDC_TAP_TX, tx->buffer, tx->actual_length, 0);
+    }
+    if (result < 0) {
+        /* keep what arrived for the next read */
+        cdc_readbuffer_unread_internal(cdc, resp, got);
+        cdc_return(result, "cdc_transact");
+    }
+    return got;
+}
+
+/**
+    Sends a request and receives its response in one call, for command
+    and response devices.  The response is read from data arriving after
+    the call started: on a libusb port without the asynchronous engine the
+    read is submitted before the request, and the engine or the tty keep
+    reading ahead anyway, so a quick reply is picked up without a new
+    submission and the round trip takes little more than the wire time.
+    Data received before the request was sent and not read yet counts as
+    part of the response, as it would with cdc_write_data() followed by
+    cdc_read_data().
+
+    Bytes received after the terminator, or all of an incomplete response
+    when the call fails, are kept and returned first by the next
+    cdc_read_data() or cdc_transact().
+
+    \param cdc pointer to cdc_ctx
+    \param req the request
+    \param req_len length of the request, 0 to only wait for a response
+    \param resp buffer for the response
+    \param resp_max size of the response buffer
+    \param terminator byte ending the response, included in it, or
+                      CDC_TRANSACT_LENGTH for a response of exactly resp_max bytes
+    \param timeout milliseconds for the whole round trip, 0 for
+                   usb_read_timeout, -1 to wait forever
+
+    \retval <0: CDC_ERROR code, CDC_ERROR_TIMEOUT if the response is incomplete
+    \retval >0: length of the response; resp_max without the terminator
+                if that many bytes came before it
+*/
+int cdc_transact(struct cdc_ctx *cdc, unsigned char const *req, int req_len,
+                 unsigned char *resp, int resp_max, int terminator, int timeout)
+{
+    unsigned int seq;
+    uint64_t deadline;
+    int result, got, extra;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(req_len >= 0 && (req || req_len == 0) ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "req");
+    cdc_check(resp && resp_max > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "resp");
+    cdc_check(terminator >= CDC_TRANSACT_LENGTH && terminator <= 0xff ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "terminator");
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "use cdc_broadcast_peek");
+    cdc_check(cdc->backend != CDC_BACKEND_NONE ? CDC_SUCCESS : CDC_ERROR_NO_DEVICE, "port not open");
+
+    seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    deadline = timeout < 0 ? 0 : cdc_deadline_internal(timeout ? timeout : cdc->usb_read_timeout);
+
+    /* unread data may complete the response already; the request is sent anyway */
+    got = 0;
+    extra = cdc_transact_add_internal(resp, &got, cdc_readbuffer_take_internal(cdc, resp, resp_max),
+                                      resp_max, terminator);
+    if (extra > 0) {
+        cdc_readbuffer_unread_internal(cdc, resp + got, extra);
+    }
+
+    if (extra < 0 && cdc->backend == CDC_BACKEND_LIBUSB && !cdc->async && !cdc->write_queue) {
+        return cdc_usb_transact_internal(cdc, req, req_len, resp, resp_max, got, terminator, deadline);
+    }
+
+    /* the engine and the tty read ahead: the response waits for us there */
+    if (req_len > 0) {
+        result = cdc_write_data(cdc, (unsigned char *)req, req_len);
+        if (result >= 0 && result < req_len) {
+            result = CDC_ERROR_INTERRUPTED;
+        }
+        if (result < 0) {
+            cdc_readbuffer_unread_internal(cdc, resp, got);
+            return result;
+        }
+    }
+    while (extra < 0) {
+        int remaining = cdc_remaining_internal(deadline);
+
+        result = remaining == 0 ? CDC_ERROR_TIMEOUT :
+                 __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq ? CDC_ERROR_INTERRUPTED :
+                 cdc_read_once_internal(cdc, resp + got, resp_max - got,
+                                        terminator == CDC_TRANSACT_LENGTH ? resp_max - got : 1, remaining);
+        if (result < 0) {
+            cdc_readbuffer_unread_internal(cdc, resp, got);
+            cdc_return(result, result == CDC_ERROR_TIMEOUT ? "response timeout" : "cdc_transact");
+        }
+        extra = cdc_transact_add_internal(resp, &got, result, resp_max, terminator);
+        if (extra > 0) {
+            cdc_readbuffer_unread_internal(cdc, resp + got, extra);
+        }
+    }
+    return got;
+}
+
+/**
+    Makes cdc_read_data() and cdc_write_data() calls blocked on the port
+    return without waiting for their timeout, for example to stop a
+    reader thread or to reconfigure the port.  Calls that already
+    transferred data return that count, the others CDC_ERROR_INTERRUPTED;
+    calls made afterwards are not affected.  Sleeping
+    cdc_write_queue_submit() and cdc_broadcast_peek() calls are woken
+    the same way.
+
+    Callable from any thread, but not from a signal handler: have a
+    thread wait for the signal with sigwait() instead.
+
+    \param cdc pointer to cdc_ctx
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_cancel_io(struct cdc_ctx *cdc)
+{
+    struct libusb_transfer *transfer;
+    uint64_t one = 1;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+
+    __atomic_add_fetch(&cdc->cancel_seq, 1, __ATOMIC_SEQ_CST);
+
+    /* transfers not in flight report LIBUSB_ERROR_NOT_FOUND, which is fine */
+    if ((transfer = __atomic_load_n(&cdc->read_transfer, __ATOMIC_ACQUIRE)) != NULL) {
+        libusb_cancel_transfer(transfer);
+    }
+    if ((transfer = __atomic_load_n(&cdc->write_transfer, __ATOMIC_ACQUIRE)) != NULL) {
+        libusb_cancel_transfer(transfer);
+    }
+    if (cdc->async && cdc->backend == CDC_BACKEND_LIBUSB) {
+        libusb_interrupt_event_handler(cdc->usb_ctx);
+    }
+    if (write(cdc->cancel_fd, &one, sizeof(one)) < 0) {
+        /* the counter is already set */
+    }
+
+    if (cdc->async) {
+        pthread_mutex_lock(&cdc->async->rx_lock);
+        pthread_cond_broadcast(&cdc->async->rx_cond);
+        pthread_mutex_unlock(&cdc->async->rx_lock);
+        pthread_mutex_lock(&cdc->async->tx_lock);
+        pthread_cond_broadcast(&cdc->async->tx_cond);
+        pthread_mutex_unlock(&cdc->async->tx_lock);
+    }
+    if (cdc->write_queue) {
+        pthread_mutex_lock(&cdc->write_queue->lock);
+        pthread_cond_broadcast(&cdc->write_queue->space);
+        pthread_mutex_unlock(&cdc->write_queue->lock);
+    }
+    if (cdc->broadcast) {
+        pthread_mutex_lock(&cdc->broadcast->lock);
+        pthread_cond_broadcast(&cdc->broadcast->data);
+        pthread_mutex_unlock(&cdc->broadcast->lock);
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Set dtr and rts line
+
+    \param cdc pointer to cdc_context
+    \param dtr DTR state to set line to (1 or 0)
+    \param rts RTS state to set line to (1 or 0)
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_setdtr_rts(struct cdc_ctx *cdc, int dtr, int rts)
+{
+    unsigned short usb_val;
+
+    cdc_check(cdc ? CDC_SUCCESS: CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        return cdc_tty_setdtr_rts(cdc, dtr, rts);
+    }
+    cdc_check(cdc->usb_dev ? CDC_SUCCESS: CDC_ERROR_NO_DEVICE, "not opened");
+
+    usb_val = 0;
+    if (dtr) {
+        usb_val |= 0x01;
+    }
+    if (rts) {
+        usb_val |= 0x02;
+    }
+    cdc_check(
+        libusb_control_transfer(cdc->usb_dev, 0x21, 0x22, usb_val, 0, NULL, 0, 0),
+        "libusb_control_transfer"
+    );
+    
+    return CDC_SUCCESS;
+}
+
+/**
+    Produce a string representation for the last error code
+
+    \param cdc pointer to cdc_context
+    \param buf string storage
+    \param size length of storage
+
+    \return The passed storage buffer containing error string
 */
 char *cdc_get_error_string(struct cdc_ctx *cdc, char *buf, int size)
 {
@@ -795,11 +2121,47 @@ char *cdc_get_error_string(struct cdc_ctx *cdc, char *buf, int size)
         ctx = "struct cdc_ctx *cdc";
         code = CDC_ERROR_INVALID_PARAM;
     } else {
-        ctx = cdc->error_str;
-        code = cdc->error_code;
+        ctx = __atomic_load_n(&cdc->error_str, __ATOMIC_RELAXED);
+        code = __atomic_load_n(&cdc->error_code, __ATOMIC_RELAXED);
     }
     snprintf(buf, size, "%s %s %s", ctx, libusb_error_name(code), libusb_strerror(code));
     return buf;
 }
 
+/**
+    Get the last error of a libcdc call made by the calling thread.
+    Unlike the error stored in the context, it is not overwritten by
+    failures in other threads using the same context.
+
+    \param str storage for a pointer to the error description, may be NULL
+
+    \return CDC_ERROR code of the last failed call of this thread, or
+            CDC_SUCCESS if none failed yet
+*/
+int cdc_get_thread_error(char const **str)
+{
+    if (str) {
+        *str = cdc_thread_error_str ? cdc_thread_error_str : "no error";
+    }
+    return cdc_thread_error_code;
+}
+
+/**
+    Produce a string representation for the last error of the calling
+    thread, see cdc_get_thread_error()
+
+    \param buf string storage
+    \param size length of storage
+
+    \return The passed storage buffer containing error string
+*/
+char *cdc_get_thread_error_string(char *buf, int size)
+{
+    char const *ctx;
+    int code = cdc_get_thread_error(&ctx);
+
+    snprintf(buf, size, "%s %s %s", ctx, libusb_error_name(code), libusb_strerror(code));
+    return buf;
+}
+
 /* @} end of doxygen libcdc group */
@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <poll.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /** Parity mode for cdc_set_line_coding()
@@ -32,14 +34,55 @@ enum cdc_stopbits_type { STOP_BIT_1=0, STOP_BIT_15=1, STOP_BIT_2=2 };
 */
 enum cdc_bits_type { BITS_5=5, BITS_6=6, BITS_7=7, BITS_8=8, BITS_16=16 };
 
-/** Automatic loading / unloading of kernel modules */
+/** Automatic loading / unloading of kernel modules
+    USE_KERNEL_CDC_MODULE, which must be chosen explicitly, drives the
+    kernel's tty device when the cdc_acm module is bound to the port, and
+    only falls back to detaching it when no tty can be found.
+*/
 enum cdc_module_detach_mode
 {
     AUTO_DETACH_CDC_MODULE = 0,
     DONT_DETACH_CDC_MODULE = 1,
-    AUTO_DETACH_REATTACH_CDC_MODULE = 2
+    AUTO_DETACH_REATTACH_CDC_MODULE = 2,
+    USE_KERNEL_CDC_MODULE = 3
+};
+
+/** Backend used to drive an opened port */
+enum cdc_backend_type
+{
+    /** No port opened */
+    CDC_BACKEND_NONE = 0,
+    /** Interface claimed and driven through libusb */
+    CDC_BACKEND_LIBUSB = 1,
+    /** Kernel tty device driven through termios */
+    CDC_BACKEND_TTY = 2
 };
 
+/** Asynchronous engine state, see cdc_async_start() */
+struct cdc_async;
+
+/** Write submission queue state, see cdc_write_queue_start() */
+struct cdc_write_queue;
+
+/** Receive broadcast state, see cdc_broadcast_start() */
+struct cdc_broadcast;
+
+/** Traffic taps of a context, see cdc_tap_attach() */
+struct cdc_taps;
+
+/**
+    \brief Main context structure for all libcdc functions.
+
+    A context may be used by two threads at once, one reading and one
+    writing: cdc_read_data() and the cdc_rx_ functions on one side,
+    cdc_write_data() and the cdc_tx_ functions on the other, with
+    cdc_set_line_coding() and cdc_setdtr_rts() allowed from either.
+    Opening, closing and starting or stopping an engine must not overlap
+    with anything else.  More writers can share a context through
+    cdc_write_queue_start(), more readers through cdc_broadcast_start().
+    Use cdc_get_thread_error() rather than error_code and error_str to
+    learn why a call failed when threads share a context.
+*/
 struct cdc_ctx
 {
     /** libusb */
@@ -57,7 +100,7 @@ struct cdc_ctx
     unsigned char *readbuffer_offset;
     /** number of remaining data in internal read buffer */
     unsigned int readbuffer_remaining;
-    /** maximum packet size: also read buffer allocated size */
+    /** maximum packet size */
     unsigned int max_packet_size;
 
     /** Device addresses */
@@ -71,6 +114,62 @@ struct cdc_ctx
 
     /** Defines behavior in case a kernel module is already attached to the device */
     enum cdc_module_detach_mode module_detach_mode;
+
+    /* fields below were added with SOVERSION 3; new fields go at the
+       end, so that the offsets of the older ones never change */
+
+    /** CLOCK_MONOTONIC nanoseconds at which the read buffer was received */
+    uint64_t readbuffer_time;
+    /** read buffer allocated size, at least max_packet_size */
+    unsigned int readbuffer_size;
+
+    /** read semantics, see cdc_set_nonblocking(), cdc_set_read_min(),
+        cdc_set_read_coalesce() and cdc_set_read_frame_gap() */
+    int read_nonblocking;
+    int read_min_bytes;
+    int read_inter_byte_timeout;
+    int read_coalesce_bytes;
+    int read_coalesce_usecs;
+    int read_frame_gap_chars;
+    int read_frame_gap_usecs;
+
+    /** line coding last set with cdc_set_line_coding(), baudrate 0 if unknown */
+    int line_baudrate;
+    enum cdc_bits_type line_bits;
+    enum cdc_stopbits_type line_sbit;
+    enum cdc_parity_type line_parity;
+
+    /** write pacing, see cdc_set_write_pacing(): bucket size in bytes,
+        0 when off, nanoseconds one character takes on the line, and the
+        CLOCK_MONOTONIC nanoseconds at which the bucket is full again */
+    int write_pacing_burst;
+    uint64_t write_pacing_char_ns;
+    uint64_t write_pacing_full;
+
+    /** Backend the opened port is driven through */
+    enum cdc_backend_type backend;
+    /** tty file descriptor for CDC_BACKEND_TTY */
+    int tty_fd;
+
+    /** asynchronous engine, NULL unless started by cdc_async_start() */
+    struct cdc_async *async;
+
+    /** write submission queue, NULL unless started by cdc_write_queue_start() */
+    struct cdc_write_queue *write_queue;
+
+    /** receive broadcast, NULL unless started by cdc_broadcast_start() */
+    struct cdc_broadcast *broadcast;
+
+    /** taps, NULL until the first cdc_tap_attach() */
+    struct cdc_taps *taps;
+
+    /** transfers of blocking libusb reads and writes, see cdc_cancel_io() */
+    struct libusb_transfer *read_transfer;
+    struct libusb_transfer *write_transfer;
+    /** eventfd waking blocking tty reads and writes, see cdc_cancel_io() */
+    int cancel_fd;
+    /** number of cdc_cancel_io() calls so far */
+    unsigned int cancel_seq;
 };
 
 /**
@@ -149,6 +248,254 @@ struct cdc_version_info
     char const *snapshot_str;
 };
 
+/**
+    Counters of a port's asynchronous engine, see cdc_get_stats()
+*/
+struct cdc_stats
+{
+    /** bytes received */
+    uint64_t rx_bytes;
+    /** bytes sent */
+    uint64_t tx_bytes;
+    /** completed receive transfers or tty reads */
+    uint64_t rx_transfers;
+    /** completed transmit transfers or tty writes */
+    uint64_t tx_transfers;
+    /** number of receive transfers kept queued, currently */
+    unsigned int rx_depth;
+    /** size of each receive transfer, currently */
+    unsigned int rx_size;
+    /** changes of rx_depth or rx_size made by cdc_async_autotune() */
+    uint64_t rx_retunes;
+    /** times the receive queue shrank for want of a reader, see
+        cdc_async_set_idle() */
+    uint64_t rx_idles;
+    /** receive transfers and bytes discarded above the high watermark,
+        and times receiving paused at it, see cdc_rx_set_watermarks() */
+    uint64_t rx_overruns;
+    uint64_t rx_overrun_bytes;
+    uint64_t rx_pauses;
+    /** messages submitted to the write queue */
+    uint64_t tx_messages;
+    /** of which through cdc_write_queue_submit_urgent() */
+    uint64_t tx_urgent;
+    /** with the real-time event thread, see cdc_rt_start(): nanoseconds
+        from the completion of a receive transfer until a reader got it */
+    uint64_t rt_latency_min;
+    uint64_t rt_latency_max;
+    uint64_t rt_latency_mean;
+    /** achieved jitter: rt_latency_max - rt_latency_min */
+    uint64_t rt_jitter;
+    /** writes sent by cdc_write_at(), and nanoseconds from their
+        deadline until they were handed to the port */
+    uint64_t tx_scheduled;
+    uint64_t tx_lateness_max;
+    uint64_t tx_lateness_mean;
+};
+
+/**
+    Position of a message in the buffer of cdc_read_messages(), or of a
+    block of data in that of cdc_read_stamped()
+*/
+struct cdc_message
+{
+    /** offset of the first byte in the buffer */
+    int offset;
+    /** length in bytes */
+    int len;
+    /** CLOCK_MONOTONIC nanoseconds at which the transfer holding the
+        first byte completed */
+    uint64_t time;
+};
+
+/** terminator of cdc_transact() for responses of exactly resp_max bytes */
+#define CDC_TRANSACT_LENGTH (-1)
+
+/**
+    What the asynchronous engine does once the received data waiting for
+    the reader reaches the high watermark, see cdc_rx_set_watermarks()
+*/
+enum cdc_overflow_policy
+{
+    /** stop queueing receive transfers, so that the device is NAKed,
+        until the reader drained the data to the low watermark */
+    CDC_OVERFLOW_BLOCK = 0,
+    /** keep receiving, discarding the oldest data */
+    CDC_OVERFLOW_DROP_OLDEST = 1,
+    /** keep receiving, discarding the data just received */
+    CDC_OVERFLOW_DROP_NEWEST = 2
+};
+
+/**
+    Callback reporting that the received data waiting for the reader
+    reached the high watermark (above 1) or fell to the low one (above 0);
+    buffered is the number of bytes waiting.
+*/
+typedef void (*cdc_watermark_cb)(struct cdc_ctx *cdc, int above, int buffered, void *user_data);
+
+/**
+    Callback reporting a write of cdc_write_at() handed to the port:
+    when is its deadline and lateness the nanoseconds it went out after
+    it.  Called by the thread handling the events of the port.
+*/
+typedef void (*cdc_write_at_cb)(struct cdc_ctx *cdc, uint64_t when, uint64_t lateness,
+                                void *user_data);
+
+/**
+    Usage of the pool of transfer buffers shared by all contexts, see
+    cdc_pool_set_budget()
+*/
+struct cdc_pool_stats
+{
+    /** limit of the buffer memory, 0 if there is none */
+    size_t budget;
+    /** bytes of buffers in use and kept for reuse */
+    size_t used;
+    size_t cached;
+    /** most bytes of buffers in use and kept at any time */
+    size_t high_water;
+    /** buffers taken from the pool and newly allocated */
+    uint64_t hits;
+    uint64_t misses;
+    /** buffers refused for the budget or lack of memory */
+    uint64_t failures;
+    /** libusb transfers in use, kept for reuse, and at most */
+    int transfers_used;
+    int transfers_cached;
+    int transfers_high_water;
+};
+
+/**
+    Allocation functions for cdc_set_allocator()
+*/
+typedef void *(*cdc_malloc_fn)(size_t size, void *user_data);
+typedef void (*cdc_free_fn)(void *ptr, void *user_data);
+
+/**
+    Settings of the real-time event thread, see cdc_rt_start()
+*/
+struct cdc_rt_config
+{
+    /** SCHED_FIFO priority of the event thread, or 0 for the normal scheduler */
+    int priority;
+    /** CPU the event thread is pinned to, or -1 for any */
+    int cpu;
+    /** lock all memory of the process with mlockall() */
+    int lock_memory;
+    /** handle events in a loop without ever sleeping in poll() */
+    int busy_poll;
+};
+
+/**
+    What the receive broadcast does when a subscriber falls behind by the
+    whole ring, see cdc_broadcast_subscribe()
+*/
+enum cdc_broadcast_policy
+{
+    /** stop receiving until the subscriber catches up */
+    CDC_BROADCAST_BLOCK = 0,
+    /** let the subscriber skip the oldest data, counting what it lost */
+    CDC_BROADCAST_DROP = 1
+};
+
+/**
+    \brief subscriber of a port's receive broadcast
+*/
+struct cdc_subscriber;
+
+/**
+    Counters of a broadcast subscriber, see cdc_broadcast_get_stats()
+*/
+struct cdc_subscriber_stats
+{
+    /** bytes the subscriber released */
+    uint64_t rx_bytes;
+    /** bytes skipped because the subscriber was overtaken */
+    uint64_t dropped_bytes;
+    /** transfers skipped because the subscriber was overtaken */
+    uint64_t dropped_transfers;
+    /** bytes received but not yet released by the subscriber */
+    uint64_t lag_bytes;
+    /** highest number of transfers the subscriber was behind */
+    unsigned int max_lag;
+};
+
+/**
+    Directions of the traffic a tap mirrors, see cdc_tap_attach()
+*/
+enum cdc_tap_direction
+{
+    /** data received from the device */
+    CDC_TAP_RX = 1,
+    /** data sent to the device */
+    CDC_TAP_TX = 2
+};
+
+/**
+    \brief tap mirroring a port's traffic, see cdc_tap_attach()
+*/
+struct cdc_tap;
+
+/**
+    Chunk of traffic read from a tap, see cdc_tap_read()
+*/
+struct cdc_tap_record
+{
+    /** CDC_TAP_RX or CDC_TAP_TX */
+    enum cdc_tap_direction direction;
+    /** length of the chunk, more than was returned if the buffer was too small */
+    int len;
+    /** CLOCK_MONOTONIC nanoseconds at which the chunk was transferred */
+    uint64_t time;
+};
+
+/**
+    Counters of a tap, see cdc_tap_get_stats()
+*/
+struct cdc_tap_stats
+{
+    /** chunks put into the tap */
+    uint64_t records;
+    /** bytes put into the tap */
+    uint64_t bytes;
+    /** chunks dropped because the tap was full */
+    uint64_t dropped_records;
+    /** bytes dropped because the tap was full */
+    uint64_t dropped_bytes;
+    /** bytes of the tap not yet read, headers included */
+    uint64_t lag_bytes;
+};
+
+/**
+    \brief io_uring engine for tty backed ports, see cdc_uring_new()
+*/
+struct cdc_uring;
+
+/**
+    Callback receiving data read by an io_uring engine.
+    len is the number of bytes in buf, or a CDC_ERROR code once the port
+    failed and is no longer read.
+*/
+typedef void (*cdc_uring_rx_cb)(struct cdc_ctx *cdc, unsigned char *buf, int len,
+                                void *user_data);
+
+/**
+    Counters of an io_uring engine, see cdc_uring_get_stats()
+*/
+struct cdc_uring_stats
+{
+    /** io_uring_enter() calls made */
+    uint64_t syscalls;
+    /** submission queue entries handed to the kernel */
+    uint64_t submissions;
+    /** completion queue entries handled */
+    uint64_t completions;
+    /** bytes read from all ports */
+    uint64_t rx_bytes;
+    /** bytes written to all ports */
+    uint64_t tx_bytes;
+};
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -163,6 +510,13 @@ extern "C"
     
     struct cdc_version_info cdc_get_library_version(void);
 
+    int cdc_set_allocator(cdc_malloc_fn malloc_fn, cdc_free_fn free_fn, void *user_data);
+    int cdc_set_arena(void *mem, size_t size);
+    void cdc_get_memory_usage(size_t *used, size_t *peak);
+    int cdc_pool_set_budget(size_t bytes);
+    void cdc_pool_trim(void);
+    int cdc_pool_get_stats(struct cdc_pool_stats *stats);
+
     int cdc_usb_find_all(struct cdc_ctx *cdc, struct cdc_device_list **devlist,
                          int vendor, int product);
     void cdc_list_free(struct cdc_device_list **devlist);
@@ -180,6 +534,7 @@ extern "C"
     int cdc_usb_open_bus_addr(struct cdc_ctx *cdc, uint8_t bus, uint8_t addr);
     int cdc_usb_open_dev(struct cdc_ctx *cdc, struct libusb_device *dev);
     int cdc_usb_open_string(struct cdc_ctx *cdc, char const *description);
+    int cdc_tty_open(struct cdc_ctx *cdc, char const *path);
     
     int cdc_usb_close(struct cdc_ctx *cdc);
     
@@ -188,11 +543,78 @@ extern "C"
                             enum cdc_parity_type parity);
     
     int cdc_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size);
+    int cdc_read_message(struct cdc_ctx *cdc, unsigned char *buf, int size);
+    int cdc_read_messages(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                          struct cdc_message *msgs, int count);
+    int cdc_read_stamped(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                         struct cdc_message *blocks, int count);
     int cdc_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size);
+    int cdc_transact(struct cdc_ctx *cdc, unsigned char const *req, int req_len,
+                     unsigned char *resp, int resp_max, int terminator, int timeout);
     
     int cdc_setdtr_rts(struct cdc_ctx *cdc, int dtr, int rts);
+
+    int cdc_cancel_io(struct cdc_ctx *cdc);
+    int cdc_set_nonblocking(struct cdc_ctx *cdc, int nonblocking);
+    int cdc_set_read_min(struct cdc_ctx *cdc, int min_bytes, int inter_byte_timeout);
+    int cdc_set_read_coalesce(struct cdc_ctx *cdc, int bytes, int usecs);
+    int cdc_set_read_frame_gap(struct cdc_ctx *cdc, int chars, int usecs);
+    int cdc_set_write_pacing(struct cdc_ctx *cdc, int burst);
     
     char *cdc_get_error_string(struct cdc_ctx *cdc, char *buf, int size);
+    int cdc_get_thread_error(char const **str);
+    char *cdc_get_thread_error_string(char *buf, int size);
+
+    int cdc_async_start(struct cdc_ctx *cdc, int depth, int size);
+    void cdc_async_stop(struct cdc_ctx *cdc);
+    int cdc_handle_events(struct cdc_ctx *cdc, int timeout);
+    int cdc_get_pollfds(struct cdc_ctx *cdc, struct pollfd *fds, int count);
+    int cdc_rx_peek(struct cdc_ctx *cdc, unsigned char **buf);
+    int cdc_rx_consume(struct cdc_ctx *cdc, int size);
+    int cdc_tx_reserve(struct cdc_ctx *cdc, unsigned char **buf);
+    int cdc_tx_commit(struct cdc_ctx *cdc, int size);
+    int cdc_get_stats(struct cdc_ctx *cdc, struct cdc_stats *stats);
+    int cdc_async_autotune(struct cdc_ctx *cdc, int min_depth, int min_size);
+    int cdc_async_set_idle(struct cdc_ctx *cdc, int idle_ms, int keep);
+    int cdc_rx_set_watermarks(struct cdc_ctx *cdc, int high, int low,
+                              enum cdc_overflow_policy policy);
+    int cdc_rx_set_watermark_callback(struct cdc_ctx *cdc, cdc_watermark_cb callback,
+                                      void *user_data);
+    int cdc_write_at(struct cdc_ctx *cdc, unsigned char const *buf, int size, uint64_t when);
+    int cdc_set_write_at_callback(struct cdc_ctx *cdc, cdc_write_at_cb callback, void *user_data);
+
+    int cdc_rt_start(struct cdc_ctx *cdc, struct cdc_rt_config const *config);
+    int cdc_rt_stop(struct cdc_ctx *cdc);
+
+    int cdc_write_queue_start(struct cdc_ctx *cdc, int size, int batch_size);
+    int cdc_write_queue_stop(struct cdc_ctx *cdc);
+    int cdc_write_queue_submit(struct cdc_ctx *cdc, unsigned char const *buf, int size);
+    int cdc_write_queue_submit_urgent(struct cdc_ctx *cdc, unsigned char const *buf, int size);
+    int cdc_write_queue_flush(struct cdc_ctx *cdc, int timeout);
+
+    int cdc_broadcast_start(struct cdc_ctx *cdc, int depth, int size);
+    int cdc_broadcast_stop(struct cdc_ctx *cdc);
+    struct cdc_subscriber *cdc_broadcast_subscribe(struct cdc_ctx *cdc,
+                                                   enum cdc_broadcast_policy policy);
+    void cdc_broadcast_unsubscribe(struct cdc_subscriber *sub);
+    int cdc_broadcast_peek(struct cdc_subscriber *sub, unsigned char **buf, int timeout);
+    int cdc_broadcast_release(struct cdc_subscriber *sub);
+    int cdc_broadcast_get_stats(struct cdc_subscriber *sub, struct cdc_subscriber_stats *stats);
+
+    struct cdc_tap *cdc_tap_attach(struct cdc_ctx *cdc, int directions, int size);
+    void cdc_tap_detach(struct cdc_tap *tap);
+    int cdc_tap_read(struct cdc_tap *tap, unsigned char *buf, int size,
+                     struct cdc_tap_record *record, int timeout);
+    int cdc_tap_get_stats(struct cdc_tap *tap, struct cdc_tap_stats *stats);
+
+    struct cdc_uring *cdc_uring_new(int max_ports, int buffer_size);
+    void cdc_uring_free(struct cdc_uring *ring);
+    int cdc_uring_add(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                      cdc_uring_rx_cb callback, void *user_data);
+    int cdc_uring_write(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                        unsigned char const *buf, int size);
+    int cdc_uring_run(struct cdc_uring *ring, int timeout);
+    int cdc_uring_get_stats(struct cdc_uring *ring, struct cdc_uring_stats *stats);
 
 #ifdef __cplusplus
 }
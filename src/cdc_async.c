@@ -0,0 +1,2088 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/** maximum number of slots filled by one tty readv() */
+#define CDC_TTY_IOV_MAX 16
+
+/** completions the autotuning looks at before adjusting anything */
+#define CDC_TUNE_WINDOW 16
+
+/** silence in milliseconds after which autotuning starts over at the minimum */
+#define CDC_TUNE_IDLE 250
+
+/**
+    Internal function to convert a libusb transfer status to a CDC_ERROR code.
+    \internal
+
+    \param status libusb_transfer_status
+
+    \return CDC_SUCCESS or the matching CDC_ERROR code
+*/
+int cdc_transfer_status_internal(int status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return CDC_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return CDC_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return CDC_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL:
+        return CDC_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return CDC_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return CDC_ERROR_OVERFLOW;
+    default:
+        return CDC_ERROR_IO;
+    }
+}
+
+/**
+    Internal function returning the milliseconds left until a deadline.
+    \internal
+
+    \param deadline CLOCK_MONOTONIC deadline in milliseconds, 0 for none
+
+    \return milliseconds left, at least 1, or 0 once the deadline passed,
+            or -1 without a deadline
+*/
+int cdc_remaining_internal(uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    if (deadline == 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return now >= deadline ? 0 : (int)(deadline - now);
+}
+
+/**
+    Internal function to compute a deadline timeout milliseconds from now.
+    \internal
+
+    \param timeout timeout in milliseconds, 0 for none
+
+    \return CLOCK_MONOTONIC deadline in milliseconds, 0 for none
+*/
+uint64_t cdc_deadline_internal(int timeout)
+{
+    struct timespec ts;
+
+    if (timeout == 0) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout;
+}
+
+/**
+    Internal function returning the CLOCK_MONOTONIC time in nanoseconds.
+    \internal
+*/
+uint64_t cdc_now_ns_internal(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+    Internal function to get the number of slots to keep armed: that
+    chosen by autotuning, limited by the reader's demand with
+    demand-driven read-ahead.  Called with rx_lock held.
+    \internal
+
+    \param async asynchronous engine
+*/
+static int cdc_rx_depth_internal(struct cdc_async *async)
+{
+    if (async->rx_idle_ms && async->rx_demand < async->rx_active_depth) {
+        return async->rx_demand;
+    }
+    return async->rx_active_depth;
+}
+
+/**
+    Internal function telling whether a reader needing want bytes should
+    take the received data: once that much is buffered, on an error, or
+    when the ring is full or paused and cannot take more.  Called with
+    rx_lock held.
+    \internal
+
+    \param async asynchronous engine
+    \param want bytes the reader waits for
+*/
+static int cdc_rx_ready_internal(struct cdc_async *async, int want)
+{
+    /* slots complete in order, so the newest one tells whether all are filled */
+    return async->rx_avail >= want || async->rx_error != CDC_SUCCESS || async->rx_paused ||
+           (async->rx_tail != async->rx_head &&
+            async->rx_tail - async->rx_head >= (unsigned int)cdc_rx_depth_internal(async) &&
+            async->rx[(async->rx_tail - 1) & async->rx_mask].state == CDC_SLOT_DONE);
+}
+
+/**
+    Internal function to round a receive transfer size to the limits of
+    the port: a multiple of the packet size on libusb ports.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param size size in bytes
+
+    \return the rounded size
+*/
+static int cdc_rx_round_internal(struct cdc_ctx *cdc, int size)
+{
+    /* reads must be a multiple of the packet size to avoid overflows */
+    if (cdc->backend == CDC_BACKEND_LIBUSB && cdc->max_packet_size) {
+        size = (size + cdc->max_packet_size - 1) / cdc->max_packet_size * cdc->max_packet_size;
+    }
+    return size;
+}
+
+static int cdc_rx_arm_internal(struct cdc_ctx *cdc);
+static void cdc_rx_consume_internal(struct cdc_ctx *cdc, struct cdc_rx_slot *slot, int size);
+static void LIBUSB_CALL cdc_rx_callback(struct libusb_transfer *transfer);
+
+/**
+    Internal function to set the number of armed slots and their size,
+    arming more slots if allowed.  Slots armed already keep their size.
+    Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param depth number of slots to keep armed
+    \param size bytes to arm each slot for
+*/
+static void cdc_rx_retune_internal(struct cdc_ctx *cdc, int depth, int size)
+{
+    struct cdc_async *async = cdc->async;
+
+    if (depth != async->rx_active_depth || size != async->rx_active_size) {
+        async->rx_active_depth = depth;
+        async->rx_active_size = size;
+        async->stats.rx_depth = depth;
+        async->stats.rx_size = size;
+        async->stats.rx_retunes ++;
+        if (async->rx_error == CDC_SUCCESS) {
+            cdc_rx_arm_internal(cdc);
+        }
+    }
+}
+
+/**
+    Internal function adapting the receive queue to the traffic, from the
+    completion of a slot.  Streams of full transfers get larger transfers
+    and more of them; a reader that lets all slots fill gets more slots;
+    short transfers a reader takes at once, and silence, shrink the queue
+    back towards the minimum.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param slot the slot just filled
+*/
+static void cdc_rx_autotune_internal(struct cdc_ctx *cdc, struct cdc_rx_slot *slot)
+{
+    struct cdc_async *async = cdc->async;
+    uint64_t now = cdc_now_ns_internal();
+    int depth = async->rx_active_depth, size = async->rx_active_size, lag = 0;
+    unsigned int i;
+
+    if (async->tune_last && now - async->tune_last > (uint64_t)CDC_TUNE_IDLE * 1000000) {
+        async->tune_completions = async->tune_full = async->tune_lag = 0;
+        depth = async->tune_min_depth;
+        size = async->tune_min_size;
+    }
+    async->tune_last = now;
+
+    for (i = async->rx_head; i != async->rx_tail && async->rx[i & async->rx_mask].state == CDC_SLOT_DONE; i ++) {
+        lag ++;
+    }
+    async->tune_completions ++;
+    async->tune_full += slot->len >= slot->size;
+    async->tune_lag = lag > async->tune_lag ? lag : async->tune_lag;
+
+    if (async->tune_completions == CDC_TUNE_WINDOW) {
+        if (async->tune_full * 4 >= CDC_TUNE_WINDOW * 3) {
+            size = size * 2 < async->rx_size ? cdc_rx_round_internal(cdc, size * 2) : async->rx_size;
+            depth += depth < async->rx_depth;
+        } else if (async->tune_full == 0 && async->tune_lag <= 1) {
+            size = size / 2 > async->tune_min_size ? cdc_rx_round_internal(cdc, size / 2) : async->tune_min_size;
+            depth -= depth > async->tune_min_depth;
+        }
+        if (async->tune_lag >= async->rx_active_depth) {
+            /* the reader falls behind: let more data wait for it */
+            depth = depth * 2 < async->rx_depth ? depth * 2 : async->rx_depth;
+        }
+        async->tune_completions = async->tune_full = async->tune_lag = 0;
+    }
+    cdc_rx_retune_internal(cdc, depth, size);
+}
+
+/**
+    Internal function to shrink the receive queue of a port nobody reads
+    from to rx_idle_keep armed slots.  The newest armed transfers are
+    cancelled, and leave the queue in their callback; the buffers of the
+    slots out of use go back to the pool.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_shrink_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+    unsigned int i, armed = 0;
+
+    async->rx_idle = 1;
+    async->rx_demand = async->rx_idle_keep;
+    async->stats.rx_idles ++;
+
+    /* armed slots follow the filled ones, so the newest are cancelled */
+    for (i = async->rx_tail; i != async->rx_head && async->rx[(i - 1) & async->rx_mask].state == CDC_SLOT_ARMED; i --) {
+        armed ++;
+    }
+    for (i = async->rx_tail; armed > (unsigned int)async->rx_idle_keep; i --, armed --) {
+        struct cdc_rx_slot *slot = &async->rx[(i - 1) & async->rx_mask];
+        if (cdc->backend == CDC_BACKEND_LIBUSB) {
+            libusb_cancel_transfer(slot->transfer);
+        } else {
+            slot->state = CDC_SLOT_IDLE;
+            async->rx_tail --;
+        }
+    }
+    for (i = 0; i < (unsigned int)async->rx_depth; i ++) {
+        if (async->rx[i].state == CDC_SLOT_IDLE) {
+            cdc_pool_buffer_put_internal(async->rx[i].buf);
+            async->rx[i].buf = NULL;
+        }
+    }
+}
+
+/**
+    Internal function to note that the reader wants data, with
+    demand-driven read-ahead: a shrunk queue is armed again, starting
+    from one slot.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_demand_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    if (async->rx_idle_ms == 0) {
+        return;
+    }
+    async->rx_demand_last = cdc_now_ns_internal();
+    if (async->rx_idle) {
+        async->rx_idle = 0;
+        if (async->rx_demand < 1) {
+            async->rx_demand = 1;
+        }
+        if (async->rx_error == CDC_SUCCESS) {
+            cdc_rx_arm_internal(cdc);
+        }
+    }
+}
+
+/**
+    Internal function to shrink the receive queue once the reader has
+    been away for rx_idle_ms, from cdc_handle_events().
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param timeout milliseconds the caller is going to wait, -1 forever
+
+    \return timeout, shortened to the moment the queue is due to shrink
+*/
+static int cdc_rx_idle_internal(struct cdc_ctx *cdc, int timeout)
+{
+    struct cdc_async *async = cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    if (async->rx_idle_ms && !async->rx_idle) {
+        uint64_t idle_at = async->rx_demand_last + (uint64_t)async->rx_idle_ms * 1000000;
+        uint64_t now = cdc_now_ns_internal();
+
+        if (now >= idle_at) {
+            cdc_rx_shrink_internal(cdc);
+        } else if (timeout < 0 || (idle_at - now + 999999) / 1000000 < (uint64_t)timeout) {
+            timeout = (int)((idle_at - now + 999999) / 1000000);
+        }
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+    return timeout;
+}
+
+/**
+    Internal function to update the watermark state after rx_avail
+    changed, pausing or resuming the arming of slots under
+    CDC_OVERFLOW_BLOCK.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_mark_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    if (!async->rx_above && async->rx_high && async->rx_avail >= async->rx_high) {
+        __atomic_store_n(&async->rx_above, 1, __ATOMIC_RELAXED);
+        if (async->rx_policy == CDC_OVERFLOW_BLOCK) {
+            async->rx_paused = 1;
+            async->stats.rx_pauses ++;
+        }
+    } else if (async->rx_above && async->rx_avail <= async->rx_low) {
+        __atomic_store_n(&async->rx_above, 0, __ATOMIC_RELAXED);
+        if (async->rx_paused) {
+            async->rx_paused = 0;
+            if (async->rx_error == CDC_SUCCESS) {
+                cdc_rx_arm_internal(cdc);
+            }
+        }
+    }
+}
+
+/**
+    Internal function to apply the overflow policy once slots were
+    filled: under CDC_OVERFLOW_DROP_OLDEST, discards the oldest filled
+    slots down to the high watermark, except the newest one and one a
+    reader holds.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_overflow_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    if (async->rx_high == 0) {
+        return;
+    }
+    /* note the crossing before dropping back below the high watermark */
+    cdc_rx_mark_internal(cdc);
+    while (async->rx_policy == CDC_OVERFLOW_DROP_OLDEST && async->rx_avail > async->rx_high &&
+           !async->rx_held && async->rx_tail - async->rx_head > 1) {
+        struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+
+        if (slot->state != CDC_SLOT_DONE ||
+            async->rx[(async->rx_head + 1) & async->rx_mask].state != CDC_SLOT_DONE) {
+            break;
+        }
+        async->stats.rx_overruns ++;
+        async->stats.rx_overrun_bytes += slot->len - slot->offset;
+        cdc_rx_consume_internal(cdc, slot, slot->len - slot->offset);
+    }
+    cdc_rx_mark_internal(cdc);
+}
+
+/**
+    Internal function to tell the watermark callback about a crossing of
+    a watermark since it was last called.  Called without locks held, by
+    the thread handling events or the one consuming data.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_notify_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+    cdc_watermark_cb callback;
+    void *user_data;
+    int above, buffered;
+
+    if (__atomic_load_n(&async->rx_above, __ATOMIC_RELAXED) ==
+        __atomic_load_n(&async->rx_above_told, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&async->rx_lock);
+    callback = async->rx_mark_callback;
+    user_data = async->rx_mark_user_data;
+    above = async->rx_above;
+    buffered = async->rx_avail;
+    __atomic_store_n(&async->rx_above_told, above, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&async->rx_lock);
+    if (callback) {
+        callback(cdc, above, buffered, user_data);
+    }
+}
+
+/**
+    Internal function to move a libusb slot behind the other armed ones,
+    updating the transfers of those it passes.  Only called from transfer
+    callbacks, so no other callback holds a stale slot meanwhile.  Called
+    with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param slot the slot just completed
+
+    \return the slot at its new place, the newest one
+*/
+static struct cdc_rx_slot *cdc_rx_rotate_internal(struct cdc_ctx *cdc, struct cdc_rx_slot *slot)
+{
+    struct cdc_async *async = cdc->async;
+    struct cdc_rx_slot moved = *slot;
+    unsigned int pos = async->rx_head;
+
+    while (&async->rx[pos & async->rx_mask] != slot) {
+        pos ++;
+    }
+    for (; pos != async->rx_tail - 1; pos ++) {
+        struct cdc_rx_slot *to = &async->rx[pos & async->rx_mask];
+        *to = async->rx[(pos + 1) & async->rx_mask];
+        to->transfer->user_data = to;
+    }
+    slot = &async->rx[pos & async->rx_mask];
+    *slot = moved;
+    slot->transfer->user_data = slot;
+    return slot;
+}
+
+/**
+    Internal function to arm a libusb slot again right after it completed,
+    its data discarded under CDC_OVERFLOW_DROP_NEWEST.  Slots are consumed
+    in the order they are armed, so the slot is first moved behind the
+    other armed ones.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param slot the slot just completed
+*/
+static void cdc_rx_requeue_internal(struct cdc_ctx *cdc, struct cdc_rx_slot *slot)
+{
+    struct cdc_async *async = cdc->async;
+    int result;
+
+    slot = cdc_rx_rotate_internal(cdc, slot);
+    slot->len = slot->offset = 0;
+    slot->time = 0;
+    libusb_fill_bulk_transfer(slot->transfer, cdc->usb_dev, cdc->out_ep,
+                              slot->buf, slot->size, cdc_rx_callback, slot, 0);
+    result = libusb_submit_transfer(slot->transfer);
+    if (result < 0) {
+        /* left empty, to be recycled once the reader gets to it */
+        async->rx_error = result;
+        slot->state = CDC_SLOT_DONE;
+    }
+}
+
+static void LIBUSB_CALL cdc_rx_callback(struct libusb_transfer *transfer)
+{
+    struct cdc_rx_slot *slot = (struct cdc_rx_slot *)transfer->user_data;
+    struct cdc_async *async = slot->cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    slot->len = transfer->actual_length;
+    slot->offset = 0;
+    slot->stamp = cdc_now_ns_internal();
+    cdc_tap_feed_internal(slot->cdc, CDC_TAP_RX, slot->buf, slot->len, slot->stamp);
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && async->rx_high &&
+        async->rx_policy == CDC_OVERFLOW_DROP_NEWEST && async->rx_avail >= async->rx_high) {
+        async->stats.rx_transfers ++;
+        async->stats.rx_bytes += slot->len;
+        async->stats.rx_overruns ++;
+        async->stats.rx_overrun_bytes += slot->len;
+        cdc_rx_requeue_internal(slot->cdc, slot);
+        pthread_mutex_unlock(&async->rx_lock);
+        return;
+    }
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+        (transfer->status == LIBUSB_TRANSFER_CANCELLED && slot->len > 0)) {
+        slot->state = CDC_SLOT_DONE;
+        async->stats.rx_transfers ++;
+        async->stats.rx_bytes += slot->len;
+        async->rx_avail += slot->len;
+        if (async->tune_min_depth) {
+            cdc_rx_autotune_internal(slot->cdc, slot);
+        }
+        cdc_rx_overflow_internal(slot->cdc);
+    } else {
+        slot->state = CDC_SLOT_IDLE;
+        if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+            async->rx_error = cdc_transfer_status_internal(transfer->status);
+        } else {
+            /* cancelled while idle or stopping: leave the queue */
+            slot = cdc_rx_rotate_internal(slot->cdc, slot);
+            async->rx_tail --;
+            if (async->rx_idle) {
+                cdc_pool_buffer_put_internal(slot->buf);
+                slot->buf = NULL;
+            } else if (async->rx_idle_ms && async->rx_error == CDC_SUCCESS) {
+                /* a reader came back meanwhile */
+                cdc_rx_arm_internal(slot->cdc);
+            }
+        }
+    }
+    if (async->rt) {
+        slot->time = slot->stamp;
+        if (cdc_rx_ready_internal(async, async->rx_want)) {
+            pthread_cond_broadcast(&async->rx_cond);
+        }
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+}
+
+/**
+    Internal function to wake up a thread waiting in cdc_handle_events() on
+    a tty backed port, which does not wait for data while there is no slot
+    to read into, nor for the tty to drain while no write is in flight.
+    \internal
+
+    \param async asynchronous engine
+*/
+static void cdc_async_wake_internal(struct cdc_async *async)
+{
+    uint64_t one = 1;
+
+    if (async->wake_fd >= 0 && write(async->wake_fd, &one, sizeof(one)) < 0) {
+        /* already woken */
+    }
+}
+
+/**
+    Internal function to arm idle slots after the last armed one, up to
+    rx_active_depth slots or the reader's demand, unless paused at the
+    high watermark.  Slots whose buffer went back to the pool while idle
+    get a new one.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+static int cdc_rx_arm_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    if (cdc->backend == CDC_BACKEND_TTY && !async->rx_paused &&
+        (async->rx_tail == async->rx_head ||
+         async->rx[(async->rx_tail - 1) & async->rx_mask].state != CDC_SLOT_ARMED) &&
+        async->rx_tail - async->rx_head < (unsigned int)cdc_rx_depth_internal(async)) {
+        /* the event thread may be waiting without POLLIN */
+        cdc_async_wake_internal(async);
+    }
+
+    while (!async->rx_paused && async->rx_tail - async->rx_head < (unsigned int)cdc_rx_depth_internal(async)) {
+        struct cdc_rx_slot *slot = &async->rx[async->rx_tail & async->rx_mask];
+
+        if (slot->buf == NULL) {
+            slot->buf = cdc_pool_buffer_get_internal(async->rx_size);
+            if (slot->buf == NULL) {
+                if (async->rx_tail == async->rx_head) {
+                    /* nothing left to receive into */
+                    async->rx_error = CDC_ERROR_NO_MEM;
+                }
+                return CDC_ERROR_NO_MEM;
+            }
+        }
+        slot->len = slot->offset = 0;
+        slot->time = 0;
+        slot->size = async->rx_active_size;
+        if (cdc->backend == CDC_BACKEND_LIBUSB) {
+            int result;
+            libusb_fill_bulk_transfer(slot->transfer, cdc->usb_dev, cdc->out_ep,
+                                      slot->buf, slot->size, cdc_rx_callback, slot, 0);
+            result = libusb_submit_transfer(slot->transfer);
+            if (result < 0) {
+                async->rx_error = result;
+                return result;
+            }
+        }
+        slot->state = CDC_SLOT_ARMED;
+        async->rx_tail ++;
+    }
+    return CDC_SUCCESS;
+}
+
+static void LIBUSB_CALL cdc_tx_callback(struct libusb_transfer *transfer);
+
+/**
+    Internal function to write the in flight transmit buffer to a tty,
+    until the tty is full.  Called with tx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_tx_flush_tty_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    while (async->tx_busy) {
+        int i = async->tx_fill ^ 1;
+        ssize_t result = write(cdc->tty_fd, async->tx_buf[i] + async->tx_off[i],
+                               async->tx_len[i] - async->tx_off[i]);
+        if (result < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            async->tx_error = cdc_errno_internal(errno);
+            async->tx_len[i] = async->tx_off[i] = 0;
+            async->tx_busy = 0;
+            return;
+        }
+        cdc_tap_feed_internal(cdc, CDC_TAP_TX, async->tx_buf[i] + async->tx_off[i], result, 0);
+        async->stats.tx_transfers ++;
+        async->stats.tx_bytes += result;
+        async->tx_off[i] += result;
+        if (async->tx_off[i] < async->tx_len[i]) {
+            continue;
+        }
+
+        /* buffer done: swap in the one filled meanwhile */
+        async->tx_len[i] = async->tx_off[i] = 0;
+        async->tx_busy = 0;
+        if (async->tx_len[async->tx_fill] && !async->tx_reserved) {
+            async->tx_fill = i;
+            async->tx_busy = 1;
+        }
+    }
+}
+
+/**
+    Internal function to start writing the filled transmit buffer unless
+    a write is already in flight.  Called with tx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_tx_submit_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+    int i = async->tx_fill, result;
+
+    /* a reserved buffer is being filled by another thread: only resume short writes */
+    if (async->tx_busy || async->tx_len[i] == 0 || (async->tx_reserved && async->tx_off[i] == 0)) {
+        return;
+    }
+    async->tx_busy = 1;
+    async->tx_fill = i ^ 1;
+
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        cdc_tx_flush_tty_internal(cdc);
+        if (async->tx_busy) {
+            /* the event thread may be waiting without POLLOUT */
+            cdc_async_wake_internal(async);
+        }
+        return;
+    }
+
+    libusb_fill_bulk_transfer(async->tx_transfer, cdc->usb_dev, cdc->in_ep,
+                              async->tx_buf[i] + async->tx_off[i],
+                              async->tx_len[i] - async->tx_off[i],
+                              cdc_tx_callback, cdc, 0);
+    result = libusb_submit_transfer(async->tx_transfer);
+    if (result < 0) {
+        async->tx_error = result;
+        async->tx_len[i] = async->tx_off[i] = 0;
+        async->tx_busy = 0;
+    }
+}
+
+static void LIBUSB_CALL cdc_tx_callback(struct libusb_transfer *transfer)
+{
+    struct cdc_ctx *cdc = (struct cdc_ctx *)transfer->user_data;
+    struct cdc_async *async = cdc->async;
+    int i;
+
+    pthread_mutex_lock(&async->tx_lock);
+    i = async->tx_fill ^ 1;
+    cdc_tap_feed_internal(cdc, CDC_TAP_TX, transfer->buffer, transfer->actual_length, 0);
+    async->stats.tx_transfers ++;
+    async->stats.tx_bytes += transfer->actual_length;
+    async->tx_off[i] += transfer->actual_length;
+    async->tx_busy = 0;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+            async->tx_error = cdc_transfer_status_internal(transfer->status);
+        }
+        async->tx_len[i] = async->tx_off[i] = 0;
+    } else if (async->tx_off[i] < async->tx_len[i]) {
+        /* short write: finish this buffer first */
+        async->tx_fill = i;
+        cdc_tx_submit_internal(cdc);
+    } else {
+        async->tx_len[i] = async->tx_off[i] = 0;
+        cdc_tx_submit_internal(cdc);
+    }
+    if (async->rt) {
+        pthread_cond_broadcast(&async->tx_cond);
+    }
+    pthread_mutex_unlock(&async->tx_lock);
+}
+
+/**
+    Starts the asynchronous engine of an opened port.
+
+    The engine keeps depth reads of size bytes queued at all times, so
+    data is received while the application is busy, and double buffers
+    writes so data queued while a write is in flight goes out in the next
+    one.  Once started, cdc_read_data() and cdc_write_data() go through
+    the engine, and the zero-copy functions cdc_rx_peek(), cdc_rx_consume(),
+    cdc_tx_reserve() and cdc_tx_commit() become available.
+
+    Events are processed by cdc_handle_events(), which the blocking calls
+    do themselves.  A single thread can drive many ports by waiting on
+    their cdc_get_pollfds() descriptors.
+
+    \param cdc pointer to cdc_ctx
+    \param depth number of receive transfers kept queued, 0 for 4; rounded
+                 up to a power of two, at most 65536
+    \param size size of each receive transfer and of each of the two
+                transmit buffers, 0 for a default
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_async_start(struct cdc_ctx *cdc, int depth, int size)
+{
+    struct cdc_async *async;
+    pthread_condattr_t attr;
+    int result;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->backend != CDC_BACKEND_NONE ? CDC_SUCCESS : CDC_ERROR_NO_DEVICE, "not opened");
+    cdc_check(cdc->async == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "already started");
+    cdc_check(cdc->write_queue == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "write queue running");
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "broadcast running");
+    cdc_check(depth >= 0 && size >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "depth or size");
+
+    if (depth == 0) {
+        depth = 4;
+    }
+    cdc_check(depth <= 65536 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "depth");
+    /* slot counters wrap around 2^32: a power of two keeps indexing them continuous */
+    while (depth & (depth - 1)) {
+        depth += depth & -depth;
+    }
+    if (size == 0) {
+        size = 16384;
+    }
+    size = cdc_rx_round_internal(cdc, size);
+
+    async = (struct cdc_async *)cdc_calloc_internal(1, sizeof(struct cdc_async));
+    cdc_check(async ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    pthread_mutex_init(&async->rx_lock, NULL);
+    pthread_mutex_init(&async->tx_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&async->rx_cond, &attr);
+    pthread_cond_init(&async->tx_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    cdc->async = async;
+    async->rx_depth = depth;
+    async->rx_mask = depth - 1;
+    async->rx_want = 1;
+    async->rx_size = size;
+    async->rx_active_depth = depth;
+    async->rx_active_size = size;
+    async->tx_size = size;
+    async->wake_fd = -1;
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        async->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        cdc_check(async->wake_fd >= 0 ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "eventfd", cdc_async_stop(cdc));
+    }
+
+    async->rx = (struct cdc_rx_slot *)cdc_calloc_internal(depth, sizeof(struct cdc_rx_slot));
+    async->tx_buf[0] = cdc_pool_buffer_get_internal(size);
+    async->tx_buf[1] = cdc_pool_buffer_get_internal(size);
+    async->sched = (struct cdc_sched *)cdc_calloc_internal(1, sizeof(struct cdc_sched));
+    if (async->sched) {
+        pthread_mutex_init(&async->sched->lock, NULL);
+    }
+    if (cdc->backend == CDC_BACKEND_LIBUSB) {
+        async->tx_transfer = cdc_pool_transfer_get_internal();
+    }
+    if (!async->rx || !async->tx_buf[0] || !async->tx_buf[1] || !async->sched ||
+        (cdc->backend == CDC_BACKEND_LIBUSB && !async->tx_transfer)) {
+        cdc_return(CDC_ERROR_NO_MEM, "out of memory", cdc_async_stop(cdc));
+    }
+    /* touch the buffers now, so that no transfer ever waits for a page fault */
+    memset(async->tx_buf[0], 0, size);
+    memset(async->tx_buf[1], 0, size);
+
+    for (int i = 0; i < depth; i ++) {
+        struct cdc_rx_slot *slot = &async->rx[i];
+        slot->cdc = cdc;
+        slot->buf = cdc_pool_buffer_get_internal(size);
+        if (cdc->backend == CDC_BACKEND_LIBUSB) {
+            slot->transfer = cdc_pool_transfer_get_internal();
+        }
+        if (!slot->buf || (cdc->backend == CDC_BACKEND_LIBUSB && !slot->transfer)) {
+            cdc_return(CDC_ERROR_NO_MEM, "out of memory", cdc_async_stop(cdc));
+        }
+        memset(slot->buf, 0, size);
+    }
+
+    result = cdc_rx_arm_internal(cdc);
+    cdc_check(result, "libusb_submit_transfer", cdc_async_stop(cdc));
+    async->stats.rx_depth = depth;
+    async->stats.rx_size = size;
+
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to cancel the armed receive transfers and the
+    transmit transfer in flight of a libusb backed port.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_async_cancel_all_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+
+    /* newest first: cancelled slots move behind the others as they complete */
+    for (unsigned int i = async->rx_tail; i != async->rx_head && async->rx; i --) {
+        if (async->rx[(i - 1) & async->rx_mask].state == CDC_SLOT_ARMED) {
+            libusb_cancel_transfer(async->rx[(i - 1) & async->rx_mask].transfer);
+        }
+    }
+    if (async->tx_busy) {
+        libusb_cancel_transfer(async->tx_transfer);
+    }
+}
+
+/**
+    Stops the asynchronous engine, cancelling queued transfers and
+    discarding buffered data.  Returns once every cancelled transfer has
+    completed, so no transfer or buffer goes back to the shared pool while
+    the device may still use it.  Called by cdc_usb_close().
+
+    \param cdc pointer to cdc_ctx
+*/
+void cdc_async_stop(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async;
+    int pending;
+
+    if (cdc == NULL || cdc->async == NULL) {
+        return;
+    }
+    cdc_rt_stop(cdc);
+    async = cdc->async;
+
+    if (cdc->backend == CDC_BACKEND_LIBUSB) {
+        /* cancel everything, then wait for the cancellations to complete */
+        pthread_mutex_lock(&async->rx_lock);
+        async->rx_idle = 1;
+        pthread_mutex_unlock(&async->rx_lock);
+        for (int tries = 0; ; tries ++) {
+            struct timeval tv = { 0, 10000 };
+
+            if (tries % 100 == 0) {
+                /* again now and then, for transfers resubmitted meanwhile */
+                cdc_async_cancel_all_internal(cdc);
+            }
+            pending = async->tx_busy;
+            for (int i = 0; i < async->rx_depth && async->rx; i ++) {
+                pending |= async->rx[i].state == CDC_SLOT_ARMED;
+            }
+            if (!pending) {
+                break;
+            }
+            /* a transfer is never freed in flight: the host controller may still write its buffer */
+            libusb_handle_events_timeout_completed(cdc->usb_ctx, &tv, NULL);
+        }
+    }
+
+    for (int i = 0; i < async->rx_depth && async->rx; i ++) {
+        cdc_pool_transfer_put_internal(async->rx[i].transfer);
+        cdc_pool_buffer_put_internal(async->rx[i].buf);
+    }
+    cdc_pool_transfer_put_internal(async->tx_transfer);
+    cdc_pool_buffer_put_internal(async->tx_buf[0]);
+    cdc_pool_buffer_put_internal(async->tx_buf[1]);
+    cdc_free_internal(async->rx);
+    cdc_sched_free_internal(async);
+    if (async->wake_fd >= 0) {
+        close(async->wake_fd);
+    }
+    pthread_cond_destroy(&async->tx_cond);
+    pthread_cond_destroy(&async->rx_cond);
+    pthread_mutex_destroy(&async->tx_lock);
+    pthread_mutex_destroy(&async->rx_lock);
+    cdc_free_internal(async);
+    cdc->async = NULL;
+}
+
+/**
+    Internal function to read from a tty into the armed receive slots.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_rx_fill_tty_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+    struct cdc_rx_slot *slots[CDC_TTY_IOV_MAX];
+    struct iovec iov[CDC_TTY_IOV_MAX];
+    unsigned int i;
+    int count = 0;
+    ssize_t result;
+    uint64_t stamp;
+
+    pthread_mutex_lock(&async->rx_lock);
+    /* armed slots follow the filled ones in consumption order */
+    for (i = async->rx_head; i != async->rx_head + async->rx_depth && count < CDC_TTY_IOV_MAX; i ++) {
+        struct cdc_rx_slot *slot = &async->rx[i & async->rx_mask];
+        if (slot->state == CDC_SLOT_ARMED) {
+            slots[count] = slot;
+            iov[count].iov_base = slot->buf;
+            iov[count].iov_len = slot->size;
+            count ++;
+        } else if (count) {
+            break;
+        }
+    }
+    if (count == 0) {
+        pthread_mutex_unlock(&async->rx_lock);
+        return;
+    }
+
+    do {
+        result = readv(cdc->tty_fd, iov, count);
+    } while (result < 0 && errno == EINTR);
+
+    if (result <= 0) {
+        if (result == 0 || errno != EAGAIN) {
+            async->rx_error = result == 0 || errno == EIO ? CDC_ERROR_NO_DEVICE : cdc_errno_internal(errno);
+        }
+        pthread_mutex_unlock(&async->rx_lock);
+        return;
+    }
+
+    stamp = cdc_now_ns_internal();
+    async->stats.rx_transfers ++;
+    async->stats.rx_bytes += result;
+    for (i = 0; i < (unsigned int)count && result > 0; i ++) {
+        int len = result < slots[i]->size ? result : slots[i]->size;
+
+        result -= len;
+        cdc_tap_feed_internal(cdc, CDC_TAP_RX, slots[i]->buf, len, stamp);
+        if (async->rx_high && async->rx_policy == CDC_OVERFLOW_DROP_NEWEST &&
+            async->rx_avail >= async->rx_high) {
+            /* discarded: the slot stays armed for the next read */
+            async->stats.rx_overruns ++;
+            async->stats.rx_overrun_bytes += len;
+            continue;
+        }
+        slots[i]->len = len;
+        slots[i]->stamp = stamp;
+        slots[i]->state = CDC_SLOT_DONE;
+        async->rx_avail += len;
+        if (async->tune_min_depth) {
+            cdc_rx_autotune_internal(cdc, slots[i]);
+        }
+        if (async->rt) {
+            slots[i]->time = stamp;
+        }
+    }
+    cdc_rx_overflow_internal(cdc);
+    if (async->rt && cdc_rx_ready_internal(async, async->rx_want)) {
+        pthread_cond_broadcast(&async->rx_cond);
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+}
+
+/**
+    Processes pending events of a port's asynchronous engine: completes
+    receive and transmit transfers and, for tty backed ports, performs the
+    pending reads and writes.  Sends the writes of cdc_write_at() that are
+    due, and waits no longer than until the next one.
+
+    \param cdc pointer to cdc_ctx
+    \param timeout maximum time to wait for an event in milliseconds,
+                   0 to not wait, or -1 to wait forever
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_handle_events(struct cdc_ctx *cdc, int timeout)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+
+    /* send the scheduled writes that are due, and wake up for the next one */
+    cdc_sched_run_internal(cdc);
+    timeout = cdc_sched_timeout_internal(cdc, timeout);
+    timeout = cdc_rx_idle_internal(cdc, timeout);
+
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        struct cdc_async *async = cdc->async;
+        struct pollfd pfd[3] = { { cdc->tty_fd, 0, 0 }, { cdc->cancel_fd, POLLIN, 0 },
+                                 { async->wake_fd, POLLIN, 0 } };
+        int result;
+
+        pthread_mutex_lock(&async->rx_lock);
+        if (async->rx_tail != async->rx_head &&
+            async->rx[(async->rx_tail - 1) & async->rx_mask].state == CDC_SLOT_ARMED) {
+            /* data stays with the tty while there is no slot to read it into */
+            pfd[0].events |= POLLIN;
+        }
+        pthread_mutex_unlock(&async->rx_lock);
+        pthread_mutex_lock(&async->tx_lock);
+        if (async->tx_busy) {
+            pfd[0].events |= POLLOUT;
+        }
+        pthread_mutex_unlock(&async->tx_lock);
+        result = poll(pfd, 3, timeout);
+        if (result < 0 && errno != EINTR) {
+            cdc_return(cdc_errno_internal(errno), "poll");
+        }
+        if (result > 0 && pfd[1].revents) {
+            /* woken by cdc_cancel_io(), whose callers look at cancel_seq */
+            cdc_cancel_drain_internal(cdc);
+        }
+        if (result > 0 && pfd[2].revents) {
+            uint64_t count;
+
+            /* a slot was armed or a write started: poll again with the new events */
+            if (read(async->wake_fd, &count, sizeof(count)) < 0) {
+                /* drained by another thread */
+            }
+        }
+        if (result > 0 && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            cdc_rx_fill_tty_internal(cdc);
+        }
+        if (result > 0 && (pfd[0].revents & POLLOUT)) {
+            pthread_mutex_lock(&async->tx_lock);
+            cdc_tx_flush_tty_internal(cdc);
+            if (async->rt) {
+                pthread_cond_broadcast(&async->tx_cond);
+            }
+            pthread_mutex_unlock(&async->tx_lock);
+        }
+        cdc_rx_notify_internal(cdc);
+        return CDC_SUCCESS;
+    }
+
+    if (timeout < 0) {
+        cdc_check(libusb_handle_events_completed(cdc->usb_ctx, NULL), "libusb_handle_events");
+    } else {
+        struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+        cdc_check(libusb_handle_events_timeout_completed(cdc->usb_ctx, &tv, NULL), "libusb_handle_events");
+    }
+    cdc_rx_notify_internal(cdc);
+    return CDC_SUCCESS;
+}
+
+/**
+    Get the file descriptors to wait on before calling cdc_handle_events().
+    This allows a single thread to serve many ports with poll() or epoll.
+
+    \param cdc pointer to cdc_ctx
+    \param fds storage for the descriptors and the events to wait for
+    \param count number of entries in fds
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of descriptors, which may exceed count
+*/
+int cdc_get_pollfds(struct cdc_ctx *cdc, struct pollfd *fds, int count)
+{
+    const struct libusb_pollfd **usb_fds;
+    int total = 0;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        if (count > 0) {
+            pthread_mutex_lock(&cdc->async->tx_lock);
+            fds[0].fd = cdc->tty_fd;
+            fds[0].events = POLLIN | (cdc->async->tx_busy ? POLLOUT : 0);
+            fds[0].revents = 0;
+            pthread_mutex_unlock(&cdc->async->tx_lock);
+        }
+        if (count > 1) {
+            /* readable when another thread changes the events above */
+            fds[1].fd = cdc->async->wake_fd;
+            fds[1].events = POLLIN;
+            fds[1].revents = 0;
+        }
+        return 2;
+    }
+
+    usb_fds = libusb_get_pollfds(cdc->usb_ctx);
+    cdc_check(usb_fds ? CDC_SUCCESS : CDC_ERROR_NOT_SUPPORTED, "libusb_get_pollfds");
+    for (; usb_fds[total]; total ++) {
+        if (total < count) {
+            fds[total].fd = usb_fds[total]->fd;
+            fds[total].events = usb_fds[total]->events;
+            fds[total].revents = 0;
+        }
+    }
+    libusb_free_pollfds(usb_fds);
+    return total;
+}
+
+/**
+    Internal function to release data of the oldest filled receive slot,
+    re-arming the slot once it is empty.  Called with rx_lock held.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param slot the oldest receive slot, which must be filled
+    \param size number of bytes to release
+*/
+static void cdc_rx_consume_internal(struct cdc_ctx *cdc, struct cdc_rx_slot *slot, int size)
+{
+    struct cdc_async *async = cdc->async;
+
+    slot->offset += size;
+    async->rx_avail -= size;
+    if (slot->offset == slot->len) {
+        slot->state = CDC_SLOT_IDLE;
+        async->rx_head ++;
+        if (async->rx_idle_ms && async->rx_demand < async->rx_depth) {
+            /* sustained reading ramps the queue up */
+            async->rx_demand ++;
+        }
+        if (async->rx_error == CDC_SUCCESS) {
+            cdc_rx_arm_internal(cdc);
+        }
+    }
+    if (async->rx_high) {
+        cdc_rx_mark_internal(cdc);
+    }
+}
+
+/**
+    Internal function to account the delivery latency of a slot filled
+    while the real-time event thread runs.  Called with rx_lock held.
+    \internal
+
+    \param async asynchronous engine
+    \param slot filled slot, peeked for the first time
+*/
+static void cdc_rt_latency_internal(struct cdc_async *async, struct cdc_rx_slot *slot)
+{
+    uint64_t latency = cdc_now_ns_internal() - slot->time;
+
+    slot->time = 0;
+    if (async->rt_samples == 0 || latency < async->stats.rt_latency_min) {
+        async->stats.rt_latency_min = latency;
+    }
+    if (latency > async->stats.rt_latency_max) {
+        async->stats.rt_latency_max = latency;
+    }
+    async->rt_latency_sum += latency;
+    async->rt_samples ++;
+}
+
+/**
+    Internal function to wait for the real-time event thread to fill a
+    receive slot or free transmit space, instead of handling events.
+    Returns early once the thread stops or cdc_cancel_io() is called.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param tx 0 to wait for received data, 1 for transmit space
+    \param want with tx 0, bytes of received data to wait for, or -1
+                for the next completed transfer
+    \param timeout milliseconds to wait, -1 forever
+    \param seq cdc->cancel_seq when the caller started
+*/
+static void cdc_rt_wait_internal(struct cdc_ctx *cdc, int tx, int want, int timeout, unsigned int seq)
+{
+    struct cdc_async *async = cdc->async;
+    pthread_mutex_t *lock = tx ? &async->tx_lock : &async->rx_lock;
+    pthread_cond_t *cond = tx ? &async->tx_cond : &async->rx_cond;
+    uint64_t transfers;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(lock);
+    if (!tx) {
+        /* the event thread wakes us only once this much arrived, or on every completion */
+        async->rx_want = want < 0 ? 0 : want;
+    }
+    transfers = async->stats.rx_transfers;
+    while (async->rt && __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq) {
+        if (tx ? async->tx_len[async->tx_fill] < async->tx_size || async->tx_error :
+            want < 0 ? async->stats.rx_transfers != transfers || async->rx_error :
+                       cdc_rx_ready_internal(async, want)) {
+            break;
+        }
+        if (timeout < 0) {
+            pthread_cond_wait(cond, lock);
+        } else if (pthread_cond_timedwait(cond, lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (!tx) {
+        async->rx_want = 1;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/**
+    Internal function to get a pointer to received data and the time its
+    transfer completed, see cdc_rx_peek().
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf storage for a pointer to the data
+    \param stamp storage for the CLOCK_MONOTONIC nanoseconds at which the
+                 transfer holding the data completed, or NULL
+*/
+static int cdc_rx_peek_internal(struct cdc_ctx *cdc, unsigned char **buf, uint64_t *stamp)
+{
+    struct cdc_async *async = cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    cdc_rx_demand_internal(cdc);
+    for (;;) {
+        struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+        int len;
+
+        switch (slot->state) {
+        case CDC_SLOT_DONE:
+            if (slot->time) {
+                cdc_rt_latency_internal(async, slot);
+            }
+            if (slot->offset < slot->len) {
+                *buf = slot->buf + slot->offset;
+                if (stamp) {
+                    *stamp = slot->stamp;
+                }
+                len = slot->len - slot->offset;
+                async->rx_held = 1;
+                pthread_mutex_unlock(&async->rx_lock);
+                return len;
+            }
+            /* zero length packet: recycle and look at the next slot */
+            cdc_rx_consume_internal(cdc, slot, 0);
+            if (slot->state == CDC_SLOT_IDLE) {
+                cdc_check(async->rx_error, "receive", pthread_mutex_unlock(&async->rx_lock));
+            }
+            break;
+        case CDC_SLOT_ARMED:
+            cdc_check(async->rx_error, "receive", pthread_mutex_unlock(&async->rx_lock));
+            pthread_mutex_unlock(&async->rx_lock);
+            return 0;
+        case CDC_SLOT_IDLE:
+            cdc_check(async->rx_error, "receive", pthread_mutex_unlock(&async->rx_lock));
+            cdc_check(cdc_rx_arm_internal(cdc), "libusb_submit_transfer",
+                      pthread_mutex_unlock(&async->rx_lock));
+            pthread_mutex_unlock(&async->rx_lock);
+            return 0;
+        }
+    }
+}
+
+/**
+    Get a pointer to received data without copying it.  The data stays
+    valid until it is released with cdc_rx_consume().  Does not wait.
+
+    \param cdc pointer to cdc_ctx
+    \param buf storage for a pointer to the data
+
+    \retval <0: CDC_ERROR code, once all data received before the error was consumed
+    \retval >=0: number of contiguous bytes available at *buf
+*/
+int cdc_rx_peek(struct cdc_ctx *cdc, unsigned char **buf)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+
+    return cdc_rx_peek_internal(cdc, buf, NULL);
+}
+
+/**
+    Releases data obtained with cdc_rx_peek().  Emptied receive buffers
+    are queued for reading again.
+
+    \param cdc pointer to cdc_ctx
+    \param size number of bytes to release, at most what cdc_rx_peek() returned
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_rx_consume(struct cdc_ctx *cdc, int size)
+{
+    struct cdc_async *async;
+    struct cdc_rx_slot *slot;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    async = cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    slot = &async->rx[async->rx_head & async->rx_mask];
+    cdc_check(slot->state == CDC_SLOT_DONE && size >= 0 && size <= slot->len - slot->offset ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "size", pthread_mutex_unlock(&async->rx_lock));
+
+    async->rx_held = 0;
+    cdc_rx_consume_internal(cdc, slot, size);
+    pthread_mutex_unlock(&async->rx_lock);
+    cdc_rx_notify_internal(cdc);
+    return CDC_SUCCESS;
+}
+
+/**
+    Get a pointer to free transmit buffer space to fill in place.  The
+    data is sent once it is committed with cdc_tx_commit(); until then the
+    buffer is not handed to the device, so commit (possibly 0 bytes) soon.
+    Does not wait.
+
+    \param cdc pointer to cdc_ctx
+    \param buf storage for a pointer to the free space
+
+    \retval <0: CDC_ERROR code of a failed earlier write, reported once
+    \retval >=0: number of contiguous bytes available at *buf
+*/
+int cdc_tx_reserve(struct cdc_ctx *cdc, unsigned char **buf)
+{
+    struct cdc_async *async;
+    int i, error, size;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    async = cdc->async;
+
+    pthread_mutex_lock(&async->tx_lock);
+    if (async->tx_error) {
+        error = async->tx_error;
+        async->tx_error = CDC_SUCCESS;
+        cdc_return(error, "transmit", pthread_mutex_unlock(&async->tx_lock));
+    }
+
+    i = async->tx_fill;
+    *buf = async->tx_buf[i] + async->tx_len[i];
+    size = async->tx_size - async->tx_len[i];
+    async->tx_reserved = size > 0;
+    pthread_mutex_unlock(&async->tx_lock);
+    return size;
+}
+
+/**
+    Queues data written into space obtained with cdc_tx_reserve().
+
+    \param cdc pointer to cdc_ctx
+    \param size number of bytes to send, at most what cdc_tx_reserve() returned
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tx_commit(struct cdc_ctx *cdc, int size)
+{
+    struct cdc_async *async;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    async = cdc->async;
+
+    pthread_mutex_lock(&async->tx_lock);
+    cdc_check(size >= 0 && size <= async->tx_size - async->tx_len[async->tx_fill] ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "size", pthread_mutex_unlock(&async->tx_lock));
+
+    async->tx_len[async->tx_fill] += size;
+    async->tx_reserved = 0;
+    cdc_tx_submit_internal(cdc);
+    pthread_mutex_unlock(&async->tx_lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to queue data in the transmit buffers as far as
+    they have room, without waiting and without touching tx_error, for
+    the thread handling events.  Takes no space while another thread
+    fills space it reserved.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf data
+    \param size number of bytes
+
+    \return number of bytes queued
+*/
+int cdc_tx_append_internal(struct cdc_ctx *cdc, unsigned char const *buf, int size)
+{
+    struct cdc_async *async = cdc->async;
+    int i, avail;
+
+    pthread_mutex_lock(&async->tx_lock);
+    i = async->tx_fill;
+    avail = async->tx_reserved ? 0 : async->tx_size - async->tx_len[i];
+    if (avail > size) {
+        avail = size;
+    }
+    if (avail > 0) {
+        memcpy(async->tx_buf[i] + async->tx_len[i], buf, avail);
+        async->tx_len[i] += avail;
+        cdc_tx_submit_internal(cdc);
+    }
+    pthread_mutex_unlock(&async->tx_lock);
+    return avail;
+}
+
+/**
+    Reads data through the asynchronous engine.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param want bytes to wait for before taking any, so that a coalescing
+                reader is not woken for every transfer; less is returned
+                on timeout
+    \param timeout milliseconds to wait for data, 0 to take only what the
+                   engine already received, -1 to wait forever
+    \param blocks storage for the position and completion time of the data
+                  of each transfer read, or NULL
+    \param count with blocks, the number of entries in it, set to the
+                 number of entries filled
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read, 0 if none arrived in time
+*/
+int cdc_async_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size, int want, int timeout,
+                        struct cdc_message *blocks, int *count)
+{
+    struct cdc_async *async = cdc->async;
+    uint64_t deadline = cdc_deadline_internal(timeout > 0 ? timeout : 0);
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    int actual_size = 0, polled = 0, ready, capacity = 0;
+
+    if (blocks) {
+        capacity = *count;
+        *count = 0;
+    }
+    want = want < 1 ? 1 : want > size ? size : want;
+    pthread_mutex_lock(&async->rx_lock);
+    cdc_rx_demand_internal(cdc);
+    pthread_mutex_unlock(&async->rx_lock);
+    for (;;) {
+        unsigned char *data;
+        uint64_t stamp;
+        int avail = 0;
+        int remaining = timeout == 0 ? 0 : cdc_remaining_internal(deadline);
+
+        pthread_mutex_lock(&async->rx_lock);
+        ready = remaining == 0 || cdc_rx_ready_internal(async, want);
+        pthread_mutex_unlock(&async->rx_lock);
+        if (ready) {
+            avail = cdc_rx_peek_internal(cdc, &data, &stamp);
+        }
+        if (avail > 0) {
+            if (avail > size - actual_size) {
+                avail = size - actual_size;
+            }
+            memcpy(buf + actual_size, data, avail);
+            cdc_rx_consume(cdc, avail);
+            if (blocks) {
+                blocks[*count].offset = actual_size;
+                blocks[*count].len = avail;
+                blocks[*count].time = stamp;
+                (*count) ++;
+            }
+            actual_size += avail;
+            if (actual_size < size && (blocks == NULL || *count < capacity)) {
+                continue;
+            }
+        }
+        if (actual_size > 0) {
+            return actual_size;
+        }
+        if (avail < 0) {
+            return avail;
+        }
+
+        if (remaining == 0) {
+            /* pick up transfers completed but not handled yet, then give up */
+            if (polled) {
+                return 0;
+            }
+            polled = 1;
+        }
+        cdc_check(__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq ?
+                  CDC_SUCCESS : CDC_ERROR_INTERRUPTED, "cdc_cancel_io");
+        if (async->rt) {
+            cdc_rt_wait_internal(cdc, 0, want, remaining, seq);
+        } else {
+            cdc_check(cdc_handle_events(cdc, remaining), NULL);
+        }
+    }
+}
+
+/**
+    Internal function to find the oldest complete message: the filled
+    slots from the oldest one up to one ending with a short packet.  With
+    a frame gap, see cdc_set_read_frame_gap(), such a slot only ends the
+    message once the next one started more than the gap after it
+    completed, or nothing arrived for that long.  Called with rx_lock
+    held.
+    \internal
+
+    \param async asynchronous engine
+    \param gap nanoseconds of silence ending a frame, 0 for messages
+    \param char_ns nanoseconds a character takes on the line
+    \param slots storage for the number of slots of the message
+
+    \retval -2: no end in sight, as the ring is full or paused
+    \retval -1: the message is not complete yet
+    \retval >=0: length of the message
+*/
+static int cdc_rx_message_internal(struct cdc_async *async, uint64_t gap, uint64_t char_ns, int *slots)
+{
+    unsigned int i;
+    int len = 0;
+
+    for (i = async->rx_head; i != async->rx_tail; i ++) {
+        struct cdc_rx_slot *slot = &async->rx[i & async->rx_mask];
+        struct cdc_rx_slot *next = &async->rx[(i + 1) & async->rx_mask];
+        int followed = i + 1 != async->rx_tail && next->state == CDC_SLOT_DONE;
+
+        if (slot->state != CDC_SLOT_DONE) {
+            return -1;
+        }
+        len += slot->len - slot->offset;
+        if (slot->len < slot->size) {
+            if (gap && followed && next->stamp - next->len * char_ns <= slot->stamp + gap) {
+                /* the next transfer started without a pause */
+                continue;
+            }
+            if (gap && !followed && cdc_now_ns_internal() < slot->stamp + gap) {
+                return -1;
+            }
+            *slots = i - async->rx_head + 1;
+            return len;
+        }
+    }
+    return i - async->rx_head >= (unsigned int)cdc_rx_depth_internal(async) || async->rx_paused ? -2 : -1;
+}
+
+/**
+    Reads whole messages through the asynchronous engine, see
+    cdc_read_messages().
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param msgs storage for the positions of the messages
+    \param count number of entries in msgs
+    \param timeout milliseconds to wait for a message, 0 to take only
+                   what the engine already received, -1 to wait forever
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of messages read, 0 if none arrived in time
+*/
+int cdc_async_read_messages(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                            struct cdc_message *msgs, int count, int timeout)
+{
+    struct cdc_async *async = cdc->async;
+    uint64_t deadline = cdc_deadline_internal(timeout > 0 ? timeout : 0);
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    int polled = 0;
+
+    for (;;) {
+        int n = 0, used = 0, error = CDC_SUCCESS, remaining;
+
+        pthread_mutex_lock(&async->rx_lock);
+        cdc_rx_demand_internal(cdc);
+        while (async->rx_skip && async->rx[async->rx_head & async->rx_mask].state == CDC_SLOT_DONE) {
+            struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+            async->rx_skip = slot->len == slot->size;
+            cdc_rx_consume_internal(cdc, slot, slot->len - slot->offset);
+        }
+        while (!async->rx_skip && n < count) {
+            int slots = 0, len = cdc_rx_message_internal(async, 0, 0, &slots);
+
+            if (len == -2 && n == 0) {
+                /* larger than the ring: drop it up to its end */
+                len = async->rx_avail;
+                while (async->rx_head != async->rx_tail &&
+                       async->rx[async->rx_head & async->rx_mask].state == CDC_SLOT_DONE) {
+                    struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+                    cdc_rx_consume_internal(cdc, slot, slot->len - slot->offset);
+                }
+                async->rx_skip = 1;
+                error = CDC_ERROR_OVERFLOW;
+                break;
+            }
+            if (len < 0 || (len > size - used && n > 0)) {
+                break;
+            }
+            if (len > size - used) {
+                error = CDC_ERROR_OVERFLOW;
+            } else if (len > 0) {
+                msgs[n].offset = used;
+                msgs[n].len = len;
+                msgs[n].time = async->rx[async->rx_head & async->rx_mask].stamp;
+                n ++;
+            }
+            while (slots --) {
+                struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+                if (error == CDC_SUCCESS) {
+                    memcpy(buf + used, slot->buf + slot->offset, slot->len - slot->offset);
+                    used += slot->len - slot->offset;
+                }
+                cdc_rx_consume_internal(cdc, slot, slot->len - slot->offset);
+            }
+            if (error) {
+                break;
+            }
+        }
+        if (n == 0 && error == CDC_SUCCESS && async->rx_error &&
+            async->rx[async->rx_head & async->rx_mask].state != CDC_SLOT_DONE) {
+            error = async->rx_error;
+        }
+        pthread_mutex_unlock(&async->rx_lock);
+        cdc_rx_notify_internal(cdc);
+        if (n > 0) {
+            return n;
+        }
+        cdc_check(error, error == CDC_ERROR_OVERFLOW ? "message larger than the buffer" : "receive");
+
+        remaining = timeout == 0 ? 0 : cdc_remaining_internal(deadline);
+        if (remaining == 0) {
+            /* pick up transfers completed but not handled yet, then give up */
+            if (polled) {
+                return 0;
+            }
+            polled = 1;
+        }
+        cdc_check(__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq ?
+                  CDC_SUCCESS : CDC_ERROR_INTERRUPTED, "cdc_cancel_io");
+        if (async->rt) {
+            cdc_rt_wait_internal(cdc, 0, -1, remaining, seq);
+        } else {
+            cdc_check(cdc_handle_events(cdc, remaining), NULL);
+        }
+    }
+}
+
+/**
+    Reads whole frames through the asynchronous engine, see
+    cdc_set_read_frame_gap().  The first frame is copied out transfer by
+    transfer as they complete, so it may span more transfers than the
+    receive queue holds; those after it are added if already complete and
+    fitting into buf.  Once a frame started, waits for its end regardless
+    of the timeout.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param msgs storage for the positions of the frames
+    \param count number of entries in msgs
+    \param timeout milliseconds to wait for a frame to start, 0 to take
+                   only what the engine already received, -1 to wait
+                   forever
+
+    \retval <0: CDC_ERROR code, CDC_ERROR_OVERFLOW if the frame was
+                larger than the buffer and has been discarded
+    \retval >=0: number of frames read, 0 if none arrived in time
+*/
+int cdc_async_read_frames(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                          struct cdc_message *msgs, int count, int timeout)
+{
+    struct cdc_async *async = cdc->async;
+    uint64_t deadline = cdc_deadline_internal(timeout > 0 ? timeout : 0);
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    uint64_t gap = cdc_frame_gap_ns_internal(cdc);
+    uint64_t char_ns = __atomic_load_n(&cdc->write_pacing_char_ns, __ATOMIC_RELAXED);
+    uint64_t last = 0;
+    int got = 0, started = 0, ended = 0, full = 0, overflow = 0, polled = 0;
+
+    for (;;) {
+        int n = 0, error = CDC_SUCCESS, remaining;
+        uint64_t due = 0;
+
+        pthread_mutex_lock(&async->rx_lock);
+        cdc_rx_demand_internal(cdc);
+        for (;;) {
+            struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+            int done = async->rx_head != async->rx_tail && slot->state == CDC_SLOT_DONE;
+            int len = slot->len - slot->offset;
+
+            if (started && !full) {
+                /** a short transfer ends the frame if the line then paused */
+                if (done ? slot->stamp - slot->len * char_ns > last + gap :
+                           cdc_now_ns_internal() >= last + gap) {
+                    ended = 1;
+                } else if (!done) {
+                    due = last + gap;
+                }
+            }
+            if (ended && got == 0 && !overflow) {
+                /* zero length packets only */
+                started = ended = 0;
+                continue;
+            }
+            if (ended || !done) {
+                break;
+            }
+            if (!started) {
+                started = 1;
+                msgs[0].offset = 0;
+                msgs[0].time = slot->stamp;
+            }
+            if (len > size - got) {
+                overflow = 1;
+            }
+            if (!overflow) {
+                memcpy(buf + got, slot->buf + slot->offset, len);
+                got += len;
+            }
+            last = slot->stamp;
+            full = slot->len == slot->size;
+            cdc_rx_consume_internal(cdc, slot, len);
+        }
+        if (ended && !overflow) {
+            msgs[0].len = got;
+            n = 1;
+            while (n < count) {
+                int slots = 0, len = cdc_rx_message_internal(async, gap, char_ns, &slots);
+
+                if (len < 0 || len > size - got) {
+                    break;
+                }
+                if (len > 0) {
+                    msgs[n].offset = got;
+                    msgs[n].len = len;
+                    msgs[n].time = async->rx[async->rx_head & async->rx_mask].stamp;
+                    n ++;
+                }
+                while (slots --) {
+                    struct cdc_rx_slot *slot = &async->rx[async->rx_head & async->rx_mask];
+                    memcpy(buf + got, slot->buf + slot->offset, slot->len - slot->offset);
+                    got += slot->len - slot->offset;
+                    cdc_rx_consume_internal(cdc, slot, slot->len - slot->offset);
+                }
+            }
+        }
+        if (!started && async->rx_error &&
+            async->rx[async->rx_head & async->rx_mask].state != CDC_SLOT_DONE) {
+            error = async->rx_error;
+        }
+        pthread_mutex_unlock(&async->rx_lock);
+        cdc_rx_notify_internal(cdc);
+        if (ended) {
+            cdc_check(overflow ? CDC_ERROR_OVERFLOW : CDC_SUCCESS, "frame larger than the buffer");
+            return n;
+        }
+        cdc_check(error, "receive");
+
+        if (started) {
+            /* wake up once the line was quiet for the gap */
+            uint64_t now = cdc_now_ns_internal();
+            remaining = due == 0 ? -1 : due > now ? (int)((due - now + 999999) / 1000000) : 0;
+        } else {
+            remaining = timeout == 0 ? 0 : cdc_remaining_internal(deadline);
+            if (remaining == 0) {
+                /* pick up transfers completed but not handled yet, then give up */
+                if (polled) {
+                    return 0;
+                }
+                polled = 1;
+            }
+        }
+        cdc_check(__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq ?
+                  CDC_SUCCESS : CDC_ERROR_INTERRUPTED, "cdc_cancel_io");
+        if (async->rt) {
+            cdc_rt_wait_internal(cdc, 0, -1, remaining, seq);
+        } else {
+            cdc_check(cdc_handle_events(cdc, remaining), NULL);
+        }
+    }
+}
+
+/**
+    Writes data through the asynchronous engine.  Returns once the data is
+    queued, waiting up to usb_write_timeout for buffer space.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes queued
+*/
+int cdc_async_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    uint64_t deadline = cdc_deadline_internal(cdc->usb_write_timeout);
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    int actual_size = 0;
+
+    while (actual_size < size) {
+        unsigned char *space;
+        int avail = cdc_tx_reserve(cdc, &space);
+
+        if (avail < 0) {
+            return avail;
+        }
+        if (avail > 0) {
+            if (avail > size - actual_size) {
+                avail = size - actual_size;
+            }
+            memcpy(space, buf + actual_size, avail);
+            cdc_tx_commit(cdc, avail);
+            actual_size += avail;
+            continue;
+        }
+
+        int remaining = cdc_remaining_internal(deadline);
+        int cancelled = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq;
+        if ((remaining == 0 || cancelled) && actual_size) {
+            break;
+        }
+        cdc_check(remaining ? CDC_SUCCESS : CDC_ERROR_TIMEOUT, "write timeout");
+        cdc_check(cancelled ? CDC_ERROR_INTERRUPTED : CDC_SUCCESS, "cdc_cancel_io");
+        if (cdc->async->rt) {
+            cdc_rt_wait_internal(cdc, 1, 0, remaining, seq);
+        } else {
+            cdc_check(cdc_handle_events(cdc, remaining), NULL);
+        }
+    }
+    return actual_size;
+}
+
+/**
+    Lets the asynchronous engine adapt its receive queue to the traffic,
+    between the given minimum and the depth and size passed to
+    cdc_async_start().  It watches how full the completed transfers are,
+    how many filled ones wait for the reader, and pauses in the traffic:
+    streams get more and larger transfers, requests and replies fewer and
+    smaller ones.  cdc_get_stats() reports the current choice.
+
+    \param cdc pointer to cdc_ctx
+    \param min_depth fewest receive transfers to keep queued, or 0 to turn
+                     autotuning off and queue them all again
+    \param min_size smallest transfer size, rounded up to a multiple of
+                    the packet size
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_async_autotune(struct cdc_ctx *cdc, int min_depth, int min_size)
+{
+    struct cdc_async *async;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    async = cdc->async;
+    cdc_check(min_depth >= 0 && min_depth <= async->rx_depth ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM,
+              "min_depth");
+    cdc_check(min_depth == 0 || (min_size > 0 && min_size <= async->rx_size) ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM,
+              "min_size");
+
+    pthread_mutex_lock(&async->rx_lock);
+    async->tune_completions = async->tune_full = async->tune_lag = 0;
+    async->tune_last = 0;
+    async->tune_min_depth = min_depth;
+    async->tune_min_size = min_depth ? cdc_rx_round_internal(cdc, min_size) : 0;
+    if (min_depth) {
+        cdc_rx_retune_internal(cdc, min_depth, async->tune_min_size);
+    } else {
+        cdc_rx_retune_internal(cdc, async->rx_depth, async->rx_size);
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Makes the read-ahead of the asynchronous engine follow the demand of
+    the reader, for ports that are mostly idle.  Once nobody read or
+    peeked for idle_ms, the engine cancels its queued receive transfers
+    down to keep and returns the buffers of the others to the shared pool,
+    see cdc_pool_get_stats().  The next read or peek queues one transfer
+    again, and each transfer the reader consumes allows one more, up to
+    the depth of cdc_async_start() or the one chosen by
+    cdc_async_autotune().  The port starts out idle.
+
+    Data arriving while no transfer is queued waits in the device, or in
+    the tty for tty backed ports.  Event loops that only read once
+    cdc_get_pollfds() reports data should keep one transfer queued.
+
+    \param cdc pointer to cdc_ctx
+    \param idle_ms milliseconds without a reader before the queue shrinks,
+                   0 to keep it queued all the time, the default
+    \param keep receive transfers left queued while idle, 0 or 1
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_async_set_idle(struct cdc_ctx *cdc, int idle_ms, int keep)
+{
+    struct cdc_async *async;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    cdc_check(idle_ms >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "idle_ms");
+    cdc_check(keep == 0 || keep == 1 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "keep");
+    async = cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    async->rx_idle_keep = keep;
+    if (idle_ms) {
+        async->rx_idle_ms = idle_ms;
+        if (!async->rx_idle) {
+            cdc_rx_shrink_internal(cdc);
+        }
+    } else {
+        async->rx_idle_ms = 0;
+        async->rx_idle = 0;
+        if (async->rx_error == CDC_SUCCESS) {
+            cdc_rx_arm_internal(cdc);
+        }
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+    cdc_check(async->rx_error, "receive");
+    return CDC_SUCCESS;
+}
+
+/**
+    Bounds the received data waiting for the reader.  Once it reaches high
+    bytes, the engine applies the overflow policy until the reader drained
+    it to low bytes: CDC_OVERFLOW_BLOCK stops queueing receive transfers,
+    so that the device is NAKed and holds back, while the drop policies
+    keep receiving and discard data, counted in the rx_overruns and
+    rx_overrun_bytes of cdc_get_stats().  Transfers already queued still
+    complete, so under CDC_OVERFLOW_BLOCK up to the queued transfers'
+    worth of data more may arrive.  Data a reader holds between
+    cdc_rx_peek() and cdc_rx_consume() is never discarded, nor is the
+    newest transfer by CDC_OVERFLOW_DROP_OLDEST.
+
+    \param cdc pointer to cdc_ctx
+    \param high high watermark in bytes, or 0 to turn the watermarks off;
+                without them the engine blocks once all transfers are full
+    \param low low watermark in bytes, at most high
+    \param policy what to do at the high watermark
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_rx_set_watermarks(struct cdc_ctx *cdc, int high, int low, enum cdc_overflow_policy policy)
+{
+    struct cdc_async *async;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    cdc_check(high >= 0 && low >= 0 && low <= high ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "high or low");
+    cdc_check(policy >= CDC_OVERFLOW_BLOCK && policy <= CDC_OVERFLOW_DROP_NEWEST ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "policy");
+    async = cdc->async;
+
+    pthread_mutex_lock(&async->rx_lock);
+    async->rx_high = high;
+    async->rx_low = low;
+    async->rx_policy = policy;
+    __atomic_store_n(&async->rx_above, 0, __ATOMIC_RELAXED);
+    async->rx_paused = 0;
+    cdc_rx_overflow_internal(cdc);
+    if (async->rx_error == CDC_SUCCESS) {
+        cdc_rx_arm_internal(cdc);
+    }
+    pthread_mutex_unlock(&async->rx_lock);
+    cdc_rx_notify_internal(cdc);
+    return CDC_SUCCESS;
+}
+
+/**
+    Sets the function told when the received data waiting for the reader
+    reaches the high watermark of cdc_rx_set_watermarks() and when it
+    falls to the low one again.  It is called without locks held, by the
+    thread handling events or the one consuming data, and may call any
+    libcdc function of that thread.
+
+    \param cdc pointer to cdc_ctx
+    \param callback function to call, NULL for none
+    \param user_data passed to callback
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_rx_set_watermark_callback(struct cdc_ctx *cdc, cdc_watermark_cb callback, void *user_data)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+
+    pthread_mutex_lock(&cdc->async->rx_lock);
+    cdc->async->rx_mark_callback = callback;
+    cdc->async->rx_mark_user_data = user_data;
+    pthread_mutex_unlock(&cdc->async->rx_lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Get the counters of a port's asynchronous engine, or of its write
+    queue for the transmit side while one is running.
+
+    \param cdc pointer to cdc_ctx
+    \param stats storage for the counters, zeroed if neither is running
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_get_stats(struct cdc_ctx *cdc, struct cdc_stats *stats)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(stats ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_stats *stats");
+
+    if (cdc->async) {
+        pthread_mutex_lock(&cdc->async->rx_lock);
+        pthread_mutex_lock(&cdc->async->tx_lock);
+        *stats = cdc->async->stats;
+        if (cdc->async->rt_samples) {
+            stats->rt_latency_mean = cdc->async->rt_latency_sum / cdc->async->rt_samples;
+            stats->rt_jitter = stats->rt_latency_max - stats->rt_latency_min;
+        }
+        if (stats->tx_scheduled) {
+            stats->tx_lateness_mean = cdc->async->tx_lateness_sum / stats->tx_scheduled;
+        }
+        pthread_mutex_unlock(&cdc->async->tx_lock);
+        pthread_mutex_unlock(&cdc->async->rx_lock);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    if (cdc->write_queue) {
+        struct cdc_write_queue *queue = cdc->write_queue;
+        stats->tx_bytes = __atomic_load_n(&queue->tx_bytes, __ATOMIC_RELAXED);
+        stats->tx_transfers = __atomic_load_n(&queue->tx_transfers, __ATOMIC_RELAXED);
+        stats->tx_messages = __atomic_load_n(&queue->tx_messages, __ATOMIC_RELAXED);
+        stats->tx_urgent = __atomic_load_n(&queue->tx_urgent, __ATOMIC_RELAXED);
+    }
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
@@ -0,0 +1,502 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/** longest time in milliseconds the reader thread takes to notice cdc_broadcast_stop() */
+#define CDC_BROADCAST_POLL 100
+
+/**
+    Internal function to receive one transfer from the reader thread.
+    Leaves cdc->error_code and cdc->error_str alone, as other threads may
+    be using them.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read, 0 if nothing arrived for a while
+*/
+static int cdc_broadcast_port_read_internal(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    int result;
+
+    if (cdc->backend == CDC_BACKEND_TTY) {
+        for (;;) {
+            ssize_t n = read(cdc->tty_fd, buf, size);
+            if (n > 0) {
+                return n;
+            }
+            if (n == 0 || errno == EIO) {
+                return CDC_ERROR_NO_DEVICE;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return cdc_errno_internal(errno);
+            }
+            result = cdc_tty_wait_internal(cdc, POLLIN, CDC_BROADCAST_POLL);
+            if (result == CDC_ERROR_TIMEOUT) {
+                return 0;
+            }
+            if (result < 0) {
+                return result;
+            }
+        }
+    } else {
+        int transferred = 0;
+        result = libusb_bulk_transfer(cdc->usb_dev, cdc->out_ep, buf, size, &transferred,
+                                      CDC_BROADCAST_POLL);
+        if (transferred > 0 || result == LIBUSB_ERROR_TIMEOUT) {
+            return transferred;
+        }
+        return result;
+    }
+}
+
+/**
+    Internal function to check whether the slot of transfer head may be
+    overwritten: it still holds transfer head - depth, which no blocking
+    subscriber may still need.  Dropping subscribers never hold it back,
+    so only they can find their transfer overtaken; a blocking subscriber
+    may be at head - depth between publishing and this check.
+    \internal
+
+    \param broadcast receive broadcast, locked
+
+    \return 1 if the slot is free, 0 otherwise
+*/
+static int cdc_broadcast_slot_free_internal(struct cdc_broadcast *broadcast)
+{
+    struct cdc_subscriber *sub;
+
+    for (sub = broadcast->subscribers; sub; sub = sub->next) {
+        if (sub->cursor + broadcast->depth > broadcast->head) {
+            continue;
+        }
+        if (sub->policy == CDC_BROADCAST_BLOCK) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+    Reader thread of the receive broadcast: receives into the slot of
+    transfer head and publishes it, until stopped or the port fails.
+    \internal
+
+    \param arg pointer to cdc_broadcast
+*/
+static void *cdc_broadcast_thread(void *arg)
+{
+    struct cdc_broadcast *broadcast = (struct cdc_broadcast *)arg;
+
+    pthread_mutex_lock(&broadcast->lock);
+    while (!broadcast->stopping) {
+        int slot = broadcast->head % broadcast->depth, result;
+
+        if (!cdc_broadcast_slot_free_internal(broadcast)) {
+            pthread_cond_wait(&broadcast->space, &broadcast->lock);
+            continue;
+        }
+
+        /* subscribers cannot see this slot until head moves past it */
+        pthread_mutex_unlock(&broadcast->lock);
+        result = cdc_broadcast_port_read_internal(broadcast->cdc, broadcast->buf[slot], broadcast->size);
+        cdc_tap_feed_internal(broadcast->cdc, CDC_TAP_RX, broadcast->buf[slot], result, 0);
+        pthread_mutex_lock(&broadcast->lock);
+
+        if (result < 0) {
+            broadcast->error = result;
+            pthread_cond_broadcast(&broadcast->data);
+            break;
+        }
+        if (result == 0) {
+            continue;
+        }
+        broadcast->len[slot] = result;
+        broadcast->start[slot] = broadcast->position;
+        broadcast->position += result;
+        broadcast->head ++;
+        if (broadcast->sleepers) {
+            pthread_cond_broadcast(&broadcast->data);
+        }
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+    return NULL;
+}
+
+/**
+    Internal function to free a receive broadcast.
+    \internal
+
+    \param broadcast receive broadcast, its thread not running
+*/
+static void cdc_broadcast_free_internal(struct cdc_broadcast *broadcast)
+{
+    while (broadcast->subscribers) {
+        struct cdc_subscriber *sub = broadcast->subscribers;
+        broadcast->subscribers = sub->next;
+        cdc_free_internal(sub);
+    }
+    for (int i = 0; i < broadcast->depth && broadcast->buf; i ++) {
+        cdc_pool_buffer_put_internal(broadcast->buf[i]);
+    }
+    cdc_free_internal(broadcast->buf);
+    cdc_free_internal(broadcast->len);
+    cdc_free_internal(broadcast->start);
+    pthread_cond_destroy(&broadcast->space);
+    pthread_cond_destroy(&broadcast->data);
+    pthread_mutex_destroy(&broadcast->lock);
+    cdc_free_internal(broadcast);
+}
+
+/**
+    Starts broadcasting a port's received data to any number of threads.
+
+    A reader thread receives into a ring of depth transfers of size bytes.
+    Every transfer is published once and each subscriber, see
+    cdc_broadcast_subscribe(), reads it in place at its own pace with
+    cdc_broadcast_peek() and cdc_broadcast_release().  While the broadcast
+    runs, cdc_read_data() and the asynchronous engine are not available;
+    writing, also through the write queue, is.
+
+    \param cdc pointer to cdc_ctx
+    \param depth number of transfers in the ring, at least 2, 0 for 16
+    \param size size of each transfer, 0 for a default
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_broadcast_start(struct cdc_ctx *cdc, int depth, int size)
+{
+    struct cdc_broadcast *broadcast;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->backend != CDC_BACKEND_NONE ? CDC_SUCCESS : CDC_ERROR_NO_DEVICE, "not opened");
+    cdc_check(cdc->broadcast == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "already started");
+    cdc_check(cdc->async == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "asynchronous engine running");
+    cdc_check(depth == 0 || depth >= 2 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "depth");
+    cdc_check(size >= 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "size");
+
+    if (depth == 0) {
+        depth = 16;
+    }
+    if (size == 0) {
+        size = 16384;
+    }
+    /* reads must be a multiple of the packet size to avoid overflows */
+    if (cdc->backend == CDC_BACKEND_LIBUSB && cdc->max_packet_size) {
+        size = (size + cdc->max_packet_size - 1) / cdc->max_packet_size * cdc->max_packet_size;
+    }
+
+    broadcast = (struct cdc_broadcast *)cdc_calloc_internal(1, sizeof(struct cdc_broadcast));
+    cdc_check(broadcast ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    broadcast->cdc = cdc;
+    broadcast->depth = depth;
+    broadcast->size = size;
+    pthread_mutex_init(&broadcast->lock, NULL);
+    pthread_cond_init(&broadcast->data, NULL);
+    pthread_cond_init(&broadcast->space, NULL);
+
+    broadcast->buf = (unsigned char **)cdc_calloc_internal(depth, sizeof(unsigned char *));
+    broadcast->len = (int *)cdc_calloc_internal(depth, sizeof(int));
+    broadcast->start = (uint64_t *)cdc_calloc_internal(depth, sizeof(uint64_t));
+    if (!broadcast->buf || !broadcast->len || !broadcast->start) {
+        cdc_return(CDC_ERROR_NO_MEM, "out of memory", cdc_broadcast_free_internal(broadcast));
+    }
+    for (int i = 0; i < depth; i ++) {
+        broadcast->buf[i] = cdc_pool_buffer_get_internal(size);
+        if (!broadcast->buf[i]) {
+            cdc_return(CDC_ERROR_NO_MEM, "out of memory", cdc_broadcast_free_internal(broadcast));
+        }
+    }
+
+    if (pthread_create(&broadcast->thread, NULL, cdc_broadcast_thread, broadcast) != 0) {
+        cdc_return(CDC_ERROR_NO_MEM, "pthread_create", cdc_broadcast_free_internal(broadcast));
+    }
+    cdc->broadcast = broadcast;
+    return CDC_SUCCESS;
+}
+
+/**
+    Stops the receive broadcast and frees all its subscribers.  Threads
+    sleeping in cdc_broadcast_peek() return CDC_ERROR_INTERRUPTED; no
+    subscriber may be used afterwards.  Called by cdc_usb_close().
+
+    \param cdc pointer to cdc_ctx
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_broadcast_stop(struct cdc_ctx *cdc)
+{
+    struct cdc_broadcast *broadcast;
+
+    if (cdc == NULL || cdc->broadcast == NULL) {
+        return CDC_SUCCESS;
+    }
+    broadcast = cdc->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    broadcast->stopping = 1;
+    pthread_cond_broadcast(&broadcast->data);
+    pthread_cond_broadcast(&broadcast->space);
+    pthread_mutex_unlock(&broadcast->lock);
+    pthread_join(broadcast->thread, NULL);
+
+    /* let sleeping subscribers leave before their state goes away */
+    pthread_mutex_lock(&broadcast->lock);
+    while (broadcast->sleepers) {
+        pthread_cond_wait(&broadcast->space, &broadcast->lock);
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    cdc->broadcast = NULL;
+    cdc_broadcast_free_internal(broadcast);
+    return CDC_SUCCESS;
+}
+
+/**
+    Adds a subscriber to a port's receive broadcast.  It sees every
+    transfer received from now on, in order.  Thread safe.
+
+    \param cdc pointer to cdc_ctx
+    \param policy what happens when the subscriber falls behind by the
+                  whole ring: CDC_BROADCAST_BLOCK stops receiving for
+                  everybody until it catches up, CDC_BROADCAST_DROP lets
+                  it skip ahead and counts the loss
+
+    \return subscriber, or NULL if the broadcast is not running or out of memory
+*/
+struct cdc_subscriber *cdc_broadcast_subscribe(struct cdc_ctx *cdc,
+                                               enum cdc_broadcast_policy policy)
+{
+    struct cdc_broadcast *broadcast;
+    struct cdc_subscriber *sub;
+
+    if (cdc == NULL || cdc->broadcast == NULL) {
+        return NULL;
+    }
+    broadcast = cdc->broadcast;
+    sub = (struct cdc_subscriber *)cdc_calloc_internal(1, sizeof(struct cdc_subscriber));
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->broadcast = broadcast;
+    sub->policy = policy;
+
+    pthread_mutex_lock(&broadcast->lock);
+    sub->cursor = broadcast->head;
+    sub->position = broadcast->position;
+    sub->next = broadcast->subscribers;
+    broadcast->subscribers = sub;
+    pthread_mutex_unlock(&broadcast->lock);
+    return sub;
+}
+
+/**
+    Removes and frees a subscriber.  Thread safe, but not while the
+    subscriber itself is in use by another thread.
+
+    \param sub subscriber
+*/
+void cdc_broadcast_unsubscribe(struct cdc_subscriber *sub)
+{
+    struct cdc_broadcast *broadcast;
+    struct cdc_subscriber **link;
+
+    if (sub == NULL) {
+        return;
+    }
+    broadcast = sub->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    for (link = &broadcast->subscribers; *link; link = &(*link)->next) {
+        if (*link == sub) {
+            *link = sub->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&broadcast->space);
+    pthread_mutex_unlock(&broadcast->lock);
+    cdc_free_internal(sub);
+}
+
+/**
+    Get a pointer to the subscriber's next received transfer without
+    copying it, to be released with cdc_broadcast_release().  For a
+    blocking subscriber the data stays valid until then; for a dropping
+    one it may be overwritten meanwhile, which cdc_broadcast_release()
+    reports.  A subscriber is used by one thread at a time; different
+    subscribers by as many threads as wanted.
+
+    \param sub subscriber
+    \param buf storage for a pointer to the data
+    \param timeout maximum time to wait for data in milliseconds, 0 to not
+                   wait, or -1 to wait forever
+
+    \retval <0: CDC_ERROR code: the receive error once all data received
+                before it was read, or CDC_ERROR_INTERRUPTED once stopped or
+                woken by cdc_cancel_io()
+    \retval 0: no data arrived within timeout
+    \retval >0: number of bytes at *buf
+*/
+int cdc_broadcast_peek(struct cdc_subscriber *sub, unsigned char **buf, int timeout)
+{
+    struct cdc_broadcast *broadcast;
+    struct timespec deadline;
+    unsigned int seq;
+    int result;
+
+    if (sub == NULL || buf == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    broadcast = sub->broadcast;
+    seq = __atomic_load_n(&broadcast->cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec ++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&broadcast->lock);
+    for (;;) {
+        if (sub->policy == CDC_BROADCAST_DROP && sub->cursor + broadcast->depth <= broadcast->head) {
+            /* overtaken: skip to the oldest transfer still in the ring */
+            uint64_t oldest = broadcast->head - broadcast->depth + 1;
+            uint64_t start = broadcast->start[oldest % broadcast->depth];
+            sub->stats.dropped_transfers += oldest - sub->cursor;
+            sub->stats.dropped_bytes += start - sub->position;
+            sub->cursor = oldest;
+            sub->position = start;
+        }
+        if (sub->cursor < broadcast->head) {
+            int slot = sub->cursor % broadcast->depth;
+            if (broadcast->head - sub->cursor > sub->stats.max_lag) {
+                sub->stats.max_lag = broadcast->head - sub->cursor;
+            }
+            sub->held = 1;
+            *buf = broadcast->buf[slot];
+            result = broadcast->len[slot];
+            break;
+        }
+        if (broadcast->stopping || broadcast->error) {
+            result = broadcast->stopping ? CDC_ERROR_INTERRUPTED : broadcast->error;
+            break;
+        }
+        if (timeout == 0) {
+            result = 0;
+            break;
+        }
+        if (__atomic_load_n(&broadcast->cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+            result = CDC_ERROR_INTERRUPTED;
+            break;
+        }
+        broadcast->sleepers ++;
+        if (timeout < 0) {
+            result = pthread_cond_wait(&broadcast->data, &broadcast->lock);
+        } else {
+            result = pthread_cond_timedwait(&broadcast->data, &broadcast->lock, &deadline);
+        }
+        broadcast->sleepers --;
+        if (broadcast->stopping && broadcast->sleepers == 0) {
+            pthread_cond_broadcast(&broadcast->space);
+        }
+        if (result == ETIMEDOUT) {
+            timeout = 0;
+        }
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+    return result;
+}
+
+/**
+    Releases the transfer obtained with cdc_broadcast_peek() and moves the
+    subscriber on to the next one.
+
+    \param sub subscriber
+
+    \return CDC_SUCCESS on success, CDC_ERROR_OVERFLOW if the subscriber
+            drops data and the transfer was overwritten while it was held,
+            so what was read of it is not reliable, or another CDC_ERROR code
+*/
+int cdc_broadcast_release(struct cdc_subscriber *sub)
+{
+    struct cdc_broadcast *broadcast;
+
+    if (sub == NULL || !sub->held) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    broadcast = sub->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    sub->held = 0;
+    if (sub->policy == CDC_BROADCAST_DROP && sub->cursor + broadcast->depth <= broadcast->head) {
+        /* overtaken while held: the next peek counts it as dropped */
+        pthread_mutex_unlock(&broadcast->lock);
+        return CDC_ERROR_OVERFLOW;
+    }
+    sub->stats.rx_bytes += broadcast->len[sub->cursor % broadcast->depth];
+    sub->position += broadcast->len[sub->cursor % broadcast->depth];
+    sub->cursor ++;
+    pthread_cond_broadcast(&broadcast->space);
+    pthread_mutex_unlock(&broadcast->lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Get the counters of a subscriber, including how far it is behind.
+
+    \param sub subscriber
+    \param stats storage for the counters
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_broadcast_get_stats(struct cdc_subscriber *sub, struct cdc_subscriber_stats *stats)
+{
+    struct cdc_broadcast *broadcast;
+
+    if (sub == NULL || stats == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    broadcast = sub->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    *stats = sub->stats;
+    stats->lag_bytes = broadcast->position - sub->position;
+    pthread_mutex_unlock(&broadcast->lock);
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
@@ -0,0 +1,503 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Internal declarations shared between the libcdc translation units. */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "cdc.h"
+
+/*
+    Errors are recorded both in the context and, for cdc_get_thread_error(),
+    in the calling thread, so threads sharing a context can tell which
+    failure was theirs.
+*/
+#define cdc_return(code, str, ...)                 \
+    {                                              \
+        int __ret = (code);                        \
+        cdc_set_error_internal(cdc, __ret, (str)); \
+        if (cdc) {                                 \
+            __VA_ARGS__;                           \
+        }                                          \
+        return __ret;                              \
+    }
+
+#define cdc_check(code, str, ...)    \
+    do {                             \
+        int __code = (code);         \
+        if (__code < 0) {            \
+            cdc_return(__code, str,  \
+                       __VA_ARGS__); \
+        }                            \
+    } while(0);
+
+/** State of a receive slot of the asynchronous engine */
+enum cdc_slot_state
+{
+    /** not queued, free to be armed */
+    CDC_SLOT_IDLE = 0,
+    /** armed: a transfer or tty read is pending on it */
+    CDC_SLOT_ARMED = 1,
+    /** holds received data not yet consumed */
+    CDC_SLOT_DONE = 2
+};
+
+/**
+    Internal receive slot: one transfer worth of read-ahead.
+    \internal
+*/
+struct cdc_rx_slot
+{
+    struct libusb_transfer *transfer;
+    unsigned char *buf;
+    /** number of bytes the slot was armed for */
+    int size;
+    /** number of received bytes in buf */
+    int len;
+    /** number of bytes already consumed */
+    int offset;
+    enum cdc_slot_state state;
+    struct cdc_ctx *cdc;
+    /** CLOCK_MONOTONIC nanoseconds of completion, with the real-time
+        event thread only, until its data is first peeked */
+    uint64_t time;
+    /** CLOCK_MONOTONIC nanoseconds of completion */
+    uint64_t stamp;
+};
+
+/**
+    Internal state of the asynchronous engine, see cdc_async_start().
+    Received data is kept in a ring of slots that are consumed in order and
+    re-armed once empty.  Transmit data is double buffered: one buffer is
+    filled while the other is being written.  The receive and transmit
+    sides have their own lock, so a reading and a writing thread do not
+    wait for each other; neither is held while handling events.
+    \internal
+*/
+struct cdc_async
+{
+    /** protects the rx_ fields and the receive counters */
+    pthread_mutex_t rx_lock;
+    /** protects the tx_ fields and the transmit counters */
+    pthread_mutex_t tx_lock;
+
+    struct cdc_rx_slot *rx;
+    /** allocated number of slots and size of their buffers */
+    int rx_depth;
+    int rx_size;
+    /** rx_depth - 1: rx_depth is a power of two, so that the slot
+        counters below index the slots as counter & rx_mask even once
+        they wrap around */
+    unsigned int rx_mask;
+    /** number of slots kept armed and bytes each is armed for, at most
+        rx_depth and rx_size, see cdc_async_autotune() */
+    int rx_active_depth;
+    int rx_active_size;
+    /** slot counter of the oldest slot, consumed first */
+    unsigned int rx_head;
+    /** slot counter of the next slot to arm; slots rx_head to rx_tail - 1
+        are armed or filled */
+    unsigned int rx_tail;
+    /** received bytes not consumed yet, in all filled slots */
+    int rx_avail;
+    /** bytes the reader waiting on rx_cond needs, see cdc_set_read_coalesce() */
+    int rx_want;
+    /** sticky receive error, reported once buffered data is consumed */
+    int rx_error;
+    /** watermarks of rx_avail, rx_high 0 when off, and what happens at
+        the high one, see cdc_rx_set_watermarks() */
+    int rx_high;
+    int rx_low;
+    enum cdc_overflow_policy rx_policy;
+    /** rx_avail reached rx_high and has not fallen to rx_low since */
+    int rx_above;
+    /** rx_above as last reported to rx_mark_callback */
+    int rx_above_told;
+    /** no slots are armed while set: rx_above under CDC_OVERFLOW_BLOCK */
+    int rx_paused;
+    /** the oldest slot is between cdc_rx_peek() and cdc_rx_consume() */
+    int rx_held;
+    /** slots up to the next short one belong to a message that was too
+        large and are discarded, see cdc_read_messages() */
+    int rx_skip;
+    cdc_watermark_cb rx_mark_callback;
+    void *rx_mark_user_data;
+    /** demand-driven read-ahead, see cdc_async_set_idle(): milliseconds
+        without a reader after which the queue shrinks to rx_idle_keep
+        armed slots, 0 when off */
+    int rx_idle_ms;
+    int rx_idle_keep;
+    /** the queue shrank and waits for a reader */
+    int rx_idle;
+    /** slots the reader's demand allows to arm, growing as it consumes */
+    int rx_demand;
+    /** CLOCK_MONOTONIC nanoseconds of the last read or peek */
+    uint64_t rx_demand_last;
+
+    struct libusb_transfer *tx_transfer;
+    unsigned char *tx_buf[2];
+    int tx_size;
+    /** bytes queued in each buffer, and bytes of it already written */
+    int tx_len[2];
+    int tx_off[2];
+    /** buffer being filled; the other one is in flight if tx_busy */
+    int tx_fill;
+    int tx_busy;
+    /** space handed out by cdc_tx_reserve() is not committed yet */
+    int tx_reserved;
+    /** sticky transmit error, reported by the next cdc_tx_reserve() */
+    int tx_error;
+
+    /** eventfd of tty backed ports, signalled when a slot is armed again
+        or a write starts waiting for the tty, so that a thread asleep in
+        cdc_handle_events() looks again at what to wait for; -1 otherwise */
+    int wake_fd;
+
+    /** real-time event thread, NULL unless started by cdc_rt_start() */
+    struct cdc_rt *rt;
+    /** with rt, broadcast when a slot is filled or rx_error is set */
+    pthread_cond_t rx_cond;
+    /** with rt, broadcast when transmit space is freed or tx_error is set */
+    pthread_cond_t tx_cond;
+    /** autotuning bounds, 0 when off, see cdc_async_autotune() */
+    int tune_min_depth;
+    int tune_min_size;
+    /** completions in the current window, the full ones among them, and
+        the most filled slots waiting for the reader during it */
+    int tune_completions;
+    int tune_full;
+    int tune_lag;
+    /** CLOCK_MONOTONIC nanoseconds of the last completion */
+    uint64_t tune_last;
+
+    /** sum and number of latencies measured for rt_latency_mean */
+    uint64_t rt_latency_sum;
+    uint64_t rt_samples;
+
+    /** writes held until their deadline, see cdc_write_at() */
+    struct cdc_sched *sched;
+    /** sum of the lateness of scheduled writes, for tx_lateness_mean */
+    uint64_t tx_lateness_sum;
+
+    struct cdc_stats stats;
+};
+
+/** smallest block of the memory arena, see cdc_set_arena(), in bytes */
+#define CDC_MEM_MIN_BLOCK 64
+
+/** number of block sizes of the memory arena, doubling from the smallest */
+#define CDC_MEM_CLASSES 26
+
+/** alignment of pooled transfer buffers, a cache line */
+#define CDC_POOL_ALIGN 64
+
+/** smallest pooled transfer buffer, in bytes */
+#define CDC_POOL_MIN_BUFFER 512
+
+/** number of pooled buffer sizes, doubling from the smallest */
+#define CDC_POOL_CLASSES 20
+
+#ifdef CDC_STATIC_PORTS
+#ifndef CDC_STATIC_PORT_BYTES
+/** memory of the static arena per port, see the STATIC_PORTS option */
+#define CDC_STATIC_PORT_BYTES (256 * 1024)
+#endif
+#endif
+
+/** bytes read at once from a tty while collecting a frame without an
+    engine, see cdc_set_read_frame_gap() */
+#define CDC_FRAME_TTY_CHUNK 256
+
+/** number of slots of the scheduler's timer wheel, a power of two */
+#define CDC_SCHED_SLOTS 256
+
+/** time covered by one slot of the timer wheel, in nanoseconds */
+#define CDC_SCHED_TICK 1000000
+
+/**
+    Write held by the scheduler until its deadline, see cdc_write_at().
+    \internal
+*/
+struct cdc_sched_write
+{
+    struct cdc_sched_write *next;
+    /** CLOCK_MONOTONIC deadline in nanoseconds */
+    uint64_t when;
+    int size;
+    /** bytes already handed to the transmit buffers */
+    int offset;
+    /** nanoseconds from when until the last byte was handed over */
+    uint64_t lateness;
+    unsigned char data[];
+};
+
+/**
+    Internal state of the write scheduler: a hashed timer wheel.  A write
+    due at tick when / CDC_SCHED_TICK is kept in slot tick % CDC_SCHED_SLOTS,
+    whose list is sorted by deadline; writes more than a turn of the wheel
+    ahead share the slot and are skipped until their turn comes.  lock
+    protects everything but is only tried by the thread handling events.
+    \internal
+*/
+struct cdc_sched
+{
+    pthread_mutex_t lock;
+    struct cdc_sched_write *slot[CDC_SCHED_SLOTS];
+    /** tick of the oldest slot that may hold due writes */
+    uint64_t tick;
+    /** earliest deadline of all held writes */
+    uint64_t next;
+    int count;
+    /** due write partly handed to the transmit buffers, which were full */
+    struct cdc_sched_write *current;
+    cdc_write_at_cb callback;
+    void *user_data;
+};
+
+/**
+    Internal state of the real-time event thread, see cdc_rt_start().
+    \internal
+*/
+struct cdc_rt
+{
+    pthread_t thread;
+    int busy_poll;
+    int stopping;
+    /** error that ended the event thread */
+    int error;
+};
+
+/** lanes of the write queue, in the order the drain thread serves them */
+enum cdc_queue_lane_index
+{
+    CDC_LANE_URGENT = 0,
+    CDC_LANE_BULK = 1,
+    CDC_LANES = 2
+};
+
+/**
+    Lane of the write submission queue.  Messages are records in a ring:
+    an 8 byte header whose first word is the message length, then the
+    message padded to 8 bytes.  Producers reserve a record by advancing
+    tail, copy the message and publish it by storing its length; the
+    drain thread batches published records in order, zeroes them and
+    advances head.  A record that would wrap is preceded by a
+    CDC_QUEUE_PAD record filling the end of the ring.
+    \internal
+*/
+struct cdc_queue_lane
+{
+    unsigned char *ring;
+    uint32_t size;
+    /** reservation position of the producers */
+    uint64_t tail;
+    /** position of the oldest record not yet taken by the drain thread */
+    uint64_t head;
+    /** position up to which records were written to the port */
+    uint64_t done;
+    /** bytes of the record at head already copied into the batch */
+    uint32_t part;
+};
+
+/**
+    Internal state of the write submission queue, see cdc_write_queue_start().
+    Every batch starts with the published urgent records, then takes bulk
+    records up to the batch size.
+    \internal
+*/
+struct cdc_write_queue
+{
+    struct cdc_queue_lane lane[CDC_LANES];
+
+    unsigned char *batch;
+    int batch_size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /** signalled to wake the drain thread */
+    pthread_cond_t wake;
+    /** broadcast after every batch, for producers waiting on space and flushes */
+    pthread_cond_t space;
+    /** set while the drain thread sleeps on wake */
+    int waiting;
+    /** number of threads sleeping on space */
+    int space_waiters;
+    int stopping;
+    /** sticky error of the drain thread */
+    int error;
+
+    uint64_t tx_bytes;
+    uint64_t tx_transfers;
+    uint64_t tx_messages;
+    uint64_t tx_urgent;
+};
+
+/**
+    Subscriber of a receive broadcast.
+    \internal
+*/
+struct cdc_subscriber
+{
+    struct cdc_broadcast *broadcast;
+    struct cdc_subscriber *next;
+    enum cdc_broadcast_policy policy;
+    /** sequence number of the next transfer to read */
+    uint64_t cursor;
+    /** byte position of the next transfer to read */
+    uint64_t position;
+    /** set between cdc_broadcast_peek() and cdc_broadcast_release() */
+    int held;
+    struct cdc_subscriber_stats stats;
+};
+
+/**
+    Internal state of the receive broadcast, see cdc_broadcast_start().
+    A reader thread receives into a ring of depth slots, one transfer
+    each.  Transfer number seq lives in slot seq % depth; while transfer
+    head is being received, transfers head - depth + 1 to head - 1 are
+    readable.  Protected by lock.
+    \internal
+*/
+struct cdc_broadcast
+{
+    struct cdc_ctx *cdc;
+    unsigned char **buf;
+    int *len;
+    /** byte position of the first byte of each slot */
+    uint64_t *start;
+    int depth;
+    int size;
+    /** sequence number of the transfer being received */
+    uint64_t head;
+    /** byte position of the end of the received data */
+    uint64_t position;
+
+    struct cdc_subscriber *subscribers;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /** broadcast when a transfer is published, for subscribers */
+    pthread_cond_t data;
+    /** broadcast when a subscriber moves on, for the reader thread */
+    pthread_cond_t space;
+    /** subscribers sleeping in cdc_broadcast_peek() */
+    int sleepers;
+    int stopping;
+    /** sticky receive error, reported once published data is read */
+    int error;
+};
+
+/**
+    Tap mirroring a port's traffic, see cdc_tap_attach().  Chunks are
+    records in a ring: a 16 byte header holding the length, direction and
+    time, then the data padded to 16 bytes.  The I/O paths append records
+    and advance tail with the context's taps locked; the reader takes them
+    without the lock and advances head.  A record that would wrap is
+    preceded by a CDC_TAP_PAD record filling the end of the ring.
+    \internal
+*/
+struct cdc_tap
+{
+    struct cdc_taps *taps;
+    struct cdc_tap *next;
+    /** CDC_TAP_RX and/or CDC_TAP_TX */
+    int directions;
+    unsigned char *ring;
+    uint32_t size;
+    /** position after the newest record */
+    uint64_t tail;
+    /** position of the oldest record not yet read */
+    uint64_t head;
+    /** set while the reader sleeps in cdc_tap_read() */
+    int sleeping;
+    /** signalled when a record is added while the reader sleeps */
+    pthread_cond_t data;
+    struct cdc_tap_stats stats;
+};
+
+/**
+    Taps of a context, allocated with the first one and kept until the
+    context is freed.
+    \internal
+*/
+struct cdc_taps
+{
+    pthread_mutex_t lock;
+    struct cdc_tap *list;
+};
+
+/* cdc.c */
+void cdc_set_error_internal(struct cdc_ctx *cdc, int code, char const *str);
+void cdc_cancel_drain_internal(struct cdc_ctx *cdc);
+int cdc_pace_internal(struct cdc_ctx *cdc, int size, unsigned int seq);
+uint64_t cdc_frame_gap_ns_internal(struct cdc_ctx *cdc);
+
+/* cdc_mem.c */
+void *cdc_malloc_internal(size_t size);
+int cdc_mem_port_get_internal(void);
+void cdc_mem_port_put_internal(void);
+void *cdc_calloc_internal(size_t count, size_t size);
+void cdc_free_internal(void *ptr);
+
+/* cdc_pool.c */
+unsigned char *cdc_pool_buffer_get_internal(int size);
+void cdc_pool_buffer_put_internal(unsigned char *buf);
+struct libusb_transfer *cdc_pool_transfer_get_internal(void);
+void cdc_pool_transfer_put_internal(struct libusb_transfer *transfer);
+
+/* cdc_tap.c */
+void cdc_tap_feed_internal(struct cdc_ctx *cdc, int direction, unsigned char const *data, int size,
+                           uint64_t time);
+void cdc_tap_release_internal(struct cdc_ctx *cdc);
+
+/* cdc_async.c */
+int cdc_transfer_status_internal(int status);
+int cdc_remaining_internal(uint64_t deadline);
+uint64_t cdc_deadline_internal(int timeout);
+int cdc_async_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size, int want, int timeout,
+                        struct cdc_message *blocks, int *count);
+int cdc_async_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size);
+int cdc_async_read_messages(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                            struct cdc_message *msgs, int count, int timeout);
+int cdc_async_read_frames(struct cdc_ctx *cdc, unsigned char *buf, int size,
+                          struct cdc_message *msgs, int count, int timeout);
+uint64_t cdc_now_ns_internal(void);
+int cdc_tx_append_internal(struct cdc_ctx *cdc, unsigned char const *buf, int size);
+
+/* cdc_sched.c */
+int cdc_sched_timeout_internal(struct cdc_ctx *cdc, int timeout);
+void cdc_sched_run_internal(struct cdc_ctx *cdc);
+void cdc_sched_free_internal(struct cdc_async *async);
+
+/* cdc_queue.c */
+int cdc_queue_write_data(struct cdc_ctx *cdc, unsigned char const *buf, int size);
+
+/* cdc_tty.c */
+int cdc_errno_internal(int err);
+int cdc_tty_find_internal(struct cdc_ctx *cdc, struct libusb_device *dev,
+                          int config_num, char *path, int path_len);
+void cdc_tty_close_internal(struct cdc_ctx *cdc);
+int cdc_tty_wait_internal(struct cdc_ctx *cdc, short events, int timeout);
+int cdc_tty_wait_cancel_internal(struct cdc_ctx *cdc, short events, int timeout, unsigned int seq);
+int cdc_tty_set_line_coding(struct cdc_ctx *cdc, int baudrate,
+                            enum cdc_bits_type bits, enum cdc_stopbits_type sbit,
+                            enum cdc_parity_type parity);
+int cdc_tty_set_speed_internal(struct cdc_ctx *cdc, int baudrate);
+int cdc_tty_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size, int timeout);
+int cdc_tty_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size);
+int cdc_tty_setdtr_rts(struct cdc_ctx *cdc, int dtr, int rts);
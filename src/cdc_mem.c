@@ -0,0 +1,357 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdc_i.h"
+
+/**
+    Header in front of every block handed out, keeping the payload
+    aligned like malloc() does
+*/
+union cdc_mem_header
+{
+    /** size of the block including the header */
+    size_t size;
+    /** with the arena, next free block of the same class */
+    union cdc_mem_header *next;
+    max_align_t align;
+};
+
+#ifdef CDC_STATIC_PORTS
+/** memory of the static profile, for CDC_STATIC_PORTS ports */
+static max_align_t cdc_static_arena[(CDC_STATIC_PORTS * CDC_STATIC_PORT_BYTES + sizeof(max_align_t) - 1) /
+                                    sizeof(max_align_t)];
+#endif
+
+/**
+    State of the allocator.  Blocks come from the caller's hooks, from
+    malloc() by default, or from an arena: the arena is carved into blocks
+    of power of two sizes, and freed blocks are kept on a list per size
+    for the next request of that size, so it never fragments beyond the
+    rounding.
+*/
+static struct
+{
+    pthread_mutex_t lock;
+    cdc_malloc_fn malloc_fn;
+    cdc_free_fn free_fn;
+    void *user_data;
+
+    /** arena, NULL unless set by cdc_set_arena() */
+    unsigned char *arena;
+    size_t arena_size;
+    /** bytes of the arena carved into blocks so far */
+    size_t arena_used;
+    union cdc_mem_header *arena_free[CDC_MEM_CLASSES];
+
+    /** blocks handed out, and their bytes now and at most */
+    size_t blocks;
+    size_t used;
+    size_t peak;
+
+    /** contexts initialised and not deinitialised yet */
+    int ports;
+} cdc_mem = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#ifdef CDC_STATIC_PORTS
+    .arena = (unsigned char *)cdc_static_arena,
+    .arena_size = sizeof(cdc_static_arena),
+#endif
+};
+
+/**
+    Internal function to find the size class of an arena block.
+    \internal
+
+    \param size bytes needed including the header
+
+    \return index of the smallest class holding size
+*/
+static int cdc_mem_class_internal(size_t size)
+{
+    int index = 0;
+
+    while (((size_t)CDC_MEM_MIN_BLOCK << index) < size) {
+        index ++;
+    }
+    return index;
+}
+
+/**
+    Internal function to take a block of the arena.  Called with the
+    allocator locked.
+    \internal
+
+    \param size bytes needed including the header
+
+    \return the block, or NULL if the arena is exhausted
+*/
+static union cdc_mem_header *cdc_mem_arena_take_internal(size_t size)
+{
+    int index = cdc_mem_class_internal(size);
+    union cdc_mem_header *block;
+
+    if (index >= CDC_MEM_CLASSES) {
+        return NULL;
+    }
+    size = (size_t)CDC_MEM_MIN_BLOCK << index;
+    block = cdc_mem.arena_free[index];
+    if (block) {
+        cdc_mem.arena_free[index] = block->next;
+    } else {
+        if (cdc_mem.arena_size - cdc_mem.arena_used < size) {
+            return NULL;
+        }
+        block = (union cdc_mem_header *)(cdc_mem.arena + cdc_mem.arena_used);
+        cdc_mem.arena_used += size;
+    }
+    block->size = size;
+    return block;
+}
+
+/**
+    Internal function to allocate memory through the hooks, the arena or
+    malloc().
+    \internal
+
+    \param size bytes to allocate
+
+    \return the memory, or NULL on failure
+*/
+void *cdc_malloc_internal(size_t size)
+{
+    union cdc_mem_header *block;
+
+    if (size > (size_t)-1 / 2) {
+        return NULL;
+    }
+    size += sizeof(union cdc_mem_header);
+
+    pthread_mutex_lock(&cdc_mem.lock);
+    if (cdc_mem.arena) {
+        block = cdc_mem_arena_take_internal(size);
+    } else {
+        block = (union cdc_mem_header *)(cdc_mem.malloc_fn ? cdc_mem.malloc_fn(size, cdc_mem.user_data) :
+                                                             malloc(size));
+        if (block) {
+            block->size = size;
+        }
+    }
+    if (block) {
+        cdc_mem.blocks ++;
+        cdc_mem.used += block->size;
+        if (cdc_mem.used > cdc_mem.peak) {
+            cdc_mem.peak = cdc_mem.used;
+        }
+    }
+    pthread_mutex_unlock(&cdc_mem.lock);
+    return block ? block + 1 : NULL;
+}
+
+/**
+    Internal function to allocate zeroed memory, see cdc_malloc_internal().
+    \internal
+
+    \param count number of elements
+    \param size size of an element
+
+    \return the memory, or NULL on failure
+*/
+void *cdc_calloc_internal(size_t count, size_t size)
+{
+    void *ptr;
+
+    if (size && count > (size_t)-1 / 2 / size) {
+        return NULL;
+    }
+    ptr = cdc_malloc_internal(count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/**
+    Internal function to free memory of cdc_malloc_internal().
+    \internal
+
+    \param ptr the memory, or NULL
+*/
+void cdc_free_internal(void *ptr)
+{
+    union cdc_mem_header *block = (union cdc_mem_header *)ptr;
+
+    if (block == NULL) {
+        return;
+    }
+    block --;
+
+    pthread_mutex_lock(&cdc_mem.lock);
+    cdc_mem.blocks --;
+    cdc_mem.used -= block->size;
+    if (cdc_mem.arena) {
+        int index = cdc_mem_class_internal(block->size);
+        block->next = cdc_mem.arena_free[index];
+        cdc_mem.arena_free[index] = block;
+    } else if (cdc_mem.free_fn) {
+        cdc_mem.free_fn(block, cdc_mem.user_data);
+    } else {
+        free(block);
+    }
+    pthread_mutex_unlock(&cdc_mem.lock);
+}
+
+/**
+    Internal function to count a context being initialised.  While the
+    static arena of the STATIC_PORTS option is in use, at most that many
+    contexts exist at a time.
+    \internal
+
+    \return CDC_SUCCESS, or CDC_ERROR_NO_MEM if all static ports are in use
+*/
+int cdc_mem_port_get_internal(void)
+{
+    int result = CDC_SUCCESS;
+
+    pthread_mutex_lock(&cdc_mem.lock);
+#ifdef CDC_STATIC_PORTS
+    if (cdc_mem.arena == (unsigned char *)cdc_static_arena && cdc_mem.ports >= CDC_STATIC_PORTS) {
+        result = CDC_ERROR_NO_MEM;
+    }
+#endif
+    if (result == CDC_SUCCESS) {
+        cdc_mem.ports ++;
+    }
+    pthread_mutex_unlock(&cdc_mem.lock);
+    return result;
+}
+
+/**
+    Internal function to count a context being deinitialised.
+    \internal
+*/
+void cdc_mem_port_put_internal(void)
+{
+    pthread_mutex_lock(&cdc_mem.lock);
+    cdc_mem.ports --;
+    pthread_mutex_unlock(&cdc_mem.lock);
+}
+
+/**
+    Makes libcdc allocate its memory through the given functions instead
+    of malloc() and free(): contexts, read buffers, device lists and the
+    buffers of the asynchronous engine, the write queue, broadcasts and the
+    write scheduler.  libusb allocates its own transfers and contexts, and
+    the io_uring engine maps its rings from the kernel.
+
+    Only possible while no memory of libcdc is allocated, that is before
+    the first context is created or after all were freed.
+
+    \param malloc_fn function allocating size bytes aligned like malloc(),
+                     returning NULL on failure; NULL to use malloc() again
+    \param free_fn function releasing memory of malloc_fn
+    \param user_data passed to both
+
+    \retval CDC_SUCCESS: the functions are used from now on
+    \retval CDC_ERROR_INVALID_PARAM: only one of the functions given
+    \retval CDC_ERROR_BUSY: memory of libcdc is in use
+*/
+int cdc_set_allocator(cdc_malloc_fn malloc_fn, cdc_free_fn free_fn, void *user_data)
+{
+    if ((malloc_fn == NULL) != (free_fn == NULL)) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+
+    /* buffers only kept for reuse do not count as in use */
+    cdc_pool_trim();
+    pthread_mutex_lock(&cdc_mem.lock);
+    if (cdc_mem.blocks) {
+        pthread_mutex_unlock(&cdc_mem.lock);
+        return CDC_ERROR_BUSY;
+    }
+    cdc_mem.malloc_fn = malloc_fn;
+    cdc_mem.free_fn = free_fn;
+    cdc_mem.user_data = user_data;
+    cdc_mem.arena = NULL;
+    cdc_mem.arena_size = cdc_mem.arena_used = 0;
+    memset(cdc_mem.arena_free, 0, sizeof(cdc_mem.arena_free));
+    pthread_mutex_unlock(&cdc_mem.lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Makes libcdc allocate its memory, see cdc_set_allocator(), from a
+    fixed region instead of the heap.  Blocks are carved from it in power
+    of two sizes and reused for requests of the same size once freed, so
+    the total memory of libcdc is bounded by the region and does not
+    fragment; allocations fail with CDC_ERROR_NO_MEM once it is exhausted.
+    cdc_get_memory_usage() shows how much of it a configuration needs.
+
+    Builds with the STATIC_PORTS option start out with a static arena of
+    STATIC_PORT_BYTES per port, and allow at most STATIC_PORTS contexts
+    at a time while it is in use; cdc_init() fails with CDC_ERROR_NO_MEM
+    beyond that.  Setting another arena or allocator, or returning to
+    malloc(), leaves the static arena for good.
+
+    Only possible while no memory of libcdc is allocated.
+
+    \param mem the region, aligned like malloc(), or NULL to return to
+               malloc(), also from the static arena
+    \param size size of the region in bytes
+
+    \retval CDC_SUCCESS: the arena is used from now on
+    \retval CDC_ERROR_BUSY: memory of libcdc is in use
+*/
+int cdc_set_arena(void *mem, size_t size)
+{
+    int result = cdc_set_allocator(NULL, NULL, NULL);
+
+    if (result == CDC_SUCCESS && mem) {
+        pthread_mutex_lock(&cdc_mem.lock);
+        cdc_mem.arena = (unsigned char *)mem;
+        cdc_mem.arena_size = size;
+        pthread_mutex_unlock(&cdc_mem.lock);
+    }
+    return result;
+}
+
+/**
+    Get the memory libcdc allocated, including block headers and, with an
+    arena, the rounding to its block sizes.
+
+    \param used storage for the bytes allocated now, or NULL
+    \param peak storage for the most bytes allocated at any time, or NULL
+*/
+void cdc_get_memory_usage(size_t *used, size_t *peak)
+{
+    pthread_mutex_lock(&cdc_mem.lock);
+    if (used) {
+        *used = cdc_mem.used;
+    }
+    if (peak) {
+        *peak = cdc_mem.peak;
+    }
+    pthread_mutex_unlock(&cdc_mem.lock);
+}
+
+/* @} end of doxygen libcdc group */
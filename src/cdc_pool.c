@@ -0,0 +1,268 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cdc_i.h"
+
+/**
+    Header kept in the cache line in front of a pooled buffer
+*/
+struct cdc_pool_buffer
+{
+    /** memory as allocated, for cdc_free_internal() */
+    void *base;
+    /** next free buffer of the same class */
+    struct cdc_pool_buffer *next;
+    int index;
+};
+
+/**
+    Pool of transfer buffers and libusb transfers shared by all contexts.
+    Buffers come in power of two size classes, cache line aligned; freed
+    buffers and transfers are kept for the next engine started, by any
+    context, instead of going back to the allocator.
+*/
+static struct
+{
+    pthread_mutex_t lock;
+    struct cdc_pool_buffer *free[CDC_POOL_CLASSES];
+    /** free transfers, linked through user_data */
+    struct libusb_transfer *transfers;
+    struct cdc_pool_stats stats;
+} cdc_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+    Internal function to release the cached buffers.  Called with the
+    pool locked.
+    \internal
+*/
+static void cdc_pool_trim_internal(void)
+{
+    for (int i = 0; i < CDC_POOL_CLASSES; i ++) {
+        while (cdc_pool.free[i]) {
+            struct cdc_pool_buffer *buffer = cdc_pool.free[i];
+            cdc_pool.free[i] = buffer->next;
+            cdc_free_internal(buffer->base);
+        }
+    }
+    cdc_pool.stats.cached = 0;
+}
+
+/**
+    Internal function to take a transfer buffer from the pool.
+    \internal
+
+    \param size bytes needed
+
+    \return the buffer, aligned to CDC_POOL_ALIGN, or NULL if out of
+            memory or over the budget
+*/
+unsigned char *cdc_pool_buffer_get_internal(int size)
+{
+    struct cdc_pool_buffer *buffer;
+    unsigned char *base;
+    size_t class_size;
+    int index = 0;
+
+    while (((size_t)CDC_POOL_MIN_BUFFER << index) < (size_t)size) {
+        index ++;
+    }
+    if (index >= CDC_POOL_CLASSES) {
+        return NULL;
+    }
+    class_size = (size_t)CDC_POOL_MIN_BUFFER << index;
+
+    pthread_mutex_lock(&cdc_pool.lock);
+    buffer = cdc_pool.free[index];
+    if (buffer) {
+        cdc_pool.free[index] = buffer->next;
+        cdc_pool.stats.cached -= class_size;
+        cdc_pool.stats.hits ++;
+    } else {
+        if (cdc_pool.stats.budget &&
+            cdc_pool.stats.used + cdc_pool.stats.cached + class_size > cdc_pool.stats.budget) {
+            /* make room with the buffers cached for other sizes */
+            cdc_pool_trim_internal();
+        }
+        if (cdc_pool.stats.budget && cdc_pool.stats.used + class_size > cdc_pool.stats.budget) {
+            cdc_pool.stats.failures ++;
+            pthread_mutex_unlock(&cdc_pool.lock);
+            return NULL;
+        }
+        base = (unsigned char *)cdc_malloc_internal(class_size + 2 * CDC_POOL_ALIGN);
+        if (base == NULL) {
+            cdc_pool.stats.failures ++;
+            pthread_mutex_unlock(&cdc_pool.lock);
+            return NULL;
+        }
+        buffer = (struct cdc_pool_buffer *)(((uintptr_t)base + CDC_POOL_ALIGN - 1) & ~(uintptr_t)(CDC_POOL_ALIGN - 1));
+        buffer->base = base;
+        buffer->index = index;
+        cdc_pool.stats.misses ++;
+    }
+    cdc_pool.stats.used += class_size;
+    if (cdc_pool.stats.used + cdc_pool.stats.cached > cdc_pool.stats.high_water) {
+        cdc_pool.stats.high_water = cdc_pool.stats.used + cdc_pool.stats.cached;
+    }
+    pthread_mutex_unlock(&cdc_pool.lock);
+    return (unsigned char *)buffer + CDC_POOL_ALIGN;
+}
+
+/**
+    Internal function to return a transfer buffer to the pool.
+    \internal
+
+    \param buf buffer of cdc_pool_buffer_get_internal(), or NULL
+*/
+void cdc_pool_buffer_put_internal(unsigned char *buf)
+{
+    struct cdc_pool_buffer *buffer;
+    size_t class_size;
+
+    if (buf == NULL) {
+        return;
+    }
+    buffer = (struct cdc_pool_buffer *)(buf - CDC_POOL_ALIGN);
+    class_size = (size_t)CDC_POOL_MIN_BUFFER << buffer->index;
+
+    pthread_mutex_lock(&cdc_pool.lock);
+    buffer->next = cdc_pool.free[buffer->index];
+    cdc_pool.free[buffer->index] = buffer;
+    cdc_pool.stats.used -= class_size;
+    cdc_pool.stats.cached += class_size;
+    pthread_mutex_unlock(&cdc_pool.lock);
+}
+
+/**
+    Internal function to take a libusb transfer from the pool.
+    \internal
+
+    \return the transfer, or NULL if out of memory
+*/
+struct libusb_transfer *cdc_pool_transfer_get_internal(void)
+{
+    struct libusb_transfer *transfer;
+
+    pthread_mutex_lock(&cdc_pool.lock);
+    transfer = cdc_pool.transfers;
+    if (transfer) {
+        cdc_pool.transfers = (struct libusb_transfer *)transfer->user_data;
+        cdc_pool.stats.transfers_cached --;
+    } else {
+        transfer = libusb_alloc_transfer(0);
+    }
+    if (transfer) {
+        cdc_pool.stats.transfers_used ++;
+        if (cdc_pool.stats.transfers_used + cdc_pool.stats.transfers_cached > cdc_pool.stats.transfers_high_water) {
+            cdc_pool.stats.transfers_high_water = cdc_pool.stats.transfers_used + cdc_pool.stats.transfers_cached;
+        }
+    }
+    pthread_mutex_unlock(&cdc_pool.lock);
+    return transfer;
+}
+
+/**
+    Internal function to return a libusb transfer to the pool.  It must
+    not be pending.
+    \internal
+
+    \param transfer transfer of cdc_pool_transfer_get_internal(), or NULL
+*/
+void cdc_pool_transfer_put_internal(struct libusb_transfer *transfer)
+{
+    if (transfer == NULL) {
+        return;
+    }
+    transfer->flags = 0;
+    transfer->buffer = NULL;
+
+    pthread_mutex_lock(&cdc_pool.lock);
+    transfer->user_data = cdc_pool.transfers;
+    cdc_pool.transfers = transfer;
+    cdc_pool.stats.transfers_used --;
+    cdc_pool.stats.transfers_cached ++;
+    pthread_mutex_unlock(&cdc_pool.lock);
+}
+
+/**
+    Limits the memory of the transfer buffers of all contexts: those of
+    the asynchronous engines, see cdc_async_start(), and of receive
+    broadcasts, see cdc_broadcast_start().  Buffers are shared through a
+    pool, in power of two sizes, and kept for reuse once an engine stops;
+    starting an engine fails with CDC_ERROR_NO_MEM when its buffers would
+    exceed the budget even after releasing the kept ones.
+
+    \param bytes budget in bytes, 0 for no limit, the default
+
+    \return CDC_SUCCESS
+*/
+int cdc_pool_set_budget(size_t bytes)
+{
+    pthread_mutex_lock(&cdc_pool.lock);
+    cdc_pool.stats.budget = bytes;
+    if (bytes && cdc_pool.stats.used + cdc_pool.stats.cached > bytes) {
+        cdc_pool_trim_internal();
+    }
+    pthread_mutex_unlock(&cdc_pool.lock);
+    return CDC_SUCCESS;
+}
+
+/**
+    Releases the buffers and transfers the pool keeps for reuse.  Those
+    in use stay allocated.
+*/
+void cdc_pool_trim(void)
+{
+    pthread_mutex_lock(&cdc_pool.lock);
+    cdc_pool_trim_internal();
+    while (cdc_pool.transfers) {
+        struct libusb_transfer *transfer = cdc_pool.transfers;
+        cdc_pool.transfers = (struct libusb_transfer *)transfer->user_data;
+        libusb_free_transfer(transfer);
+    }
+    cdc_pool.stats.transfers_cached = 0;
+    pthread_mutex_unlock(&cdc_pool.lock);
+}
+
+/**
+    Get the usage of the shared pool of transfer buffers and transfers.
+
+    \param stats storage for the statistics
+
+    \return CDC_SUCCESS on success or CDC_ERROR_INVALID_PARAM
+*/
+int cdc_pool_get_stats(struct cdc_pool_stats *stats)
+{
+    if (stats == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+
+    pthread_mutex_lock(&cdc_pool.lock);
+    *stats = cdc_pool.stats;
+    pthread_mutex_unlock(&cdc_pool.lock);
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
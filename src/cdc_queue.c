@@ -0,0 +1,618 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/** record header flag: padding up to the end of the ring */
+#define CDC_QUEUE_PAD 0x80000000u
+
+/** size of a record holding len message bytes */
+#define CDC_QUEUE_RECORD(len) (8 + (((len) + 7) & ~7u))
+
+/** largest ring of the urgent lane */
+#define CDC_QUEUE_URGENT_SIZE 4096
+
+/**
+    Internal function to write a batch to the port from the drain thread.
+    Unlike cdc_write_data(), it leaves cdc->error_code and cdc->error_str
+    alone, as other threads may be using them.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf data to write
+    \param size number of bytes
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+static int cdc_queue_port_write_internal(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    int actual_size = 0, paced = 0;
+
+    while (actual_size < size) {
+        if (actual_size == paced) {
+            /* cdc_cancel_io() wakes the pacing wait but does not stop the drain thread */
+            int chunk = cdc_pace_internal(cdc, size - actual_size,
+                                          __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST));
+            if (chunk > 0) {
+                paced += chunk;
+            }
+            continue;
+        }
+        if (cdc->backend == CDC_BACKEND_TTY) {
+            ssize_t result = write(cdc->tty_fd, buf + actual_size, paced - actual_size);
+            if (result >= 0) {
+                cdc_tap_feed_internal(cdc, CDC_TAP_TX, buf + actual_size, result, 0);
+                actual_size += result;
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return errno == EIO ? CDC_ERROR_NO_DEVICE : cdc_errno_internal(errno);
+            }
+            result = cdc_tty_wait_internal(cdc, POLLOUT, cdc->usb_write_timeout);
+            if (result < 0) {
+                return result;
+            }
+        } else {
+            int transferred = 0;
+            int result = libusb_bulk_transfer(cdc->usb_dev, cdc->in_ep, buf + actual_size,
+                                              paced - actual_size, &transferred,
+                                              cdc->usb_write_timeout);
+            cdc_tap_feed_internal(cdc, CDC_TAP_TX, buf + actual_size, transferred, 0);
+            actual_size += transferred;
+            if (result < 0) {
+                return result;
+            }
+        }
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to take published records of a lane into the batch
+    buffer.  A message that does not fit waits for the next batch, unless
+    it is larger than a batch: that one is cut into batch sized chunks.
+    Records are zeroed once taken, so that a record reserved over them
+    later reads as unpublished until its length is stored.
+    \internal
+
+    \param queue write queue
+    \param lane lane to take records from
+    \param len number of bytes already in the batch
+
+    \return number of bytes in the batch
+*/
+static int cdc_queue_collect_internal(struct cdc_write_queue *queue, struct cdc_queue_lane *lane, int len)
+{
+    while (len < queue->batch_size) {
+        uint32_t *hdr = (uint32_t *)(lane->ring + (lane->head & (lane->size - 1)));
+        uint32_t msg = __atomic_load_n(hdr, __ATOMIC_ACQUIRE), n;
+
+        if (msg == 0) {
+            break;
+        }
+        if (msg & CDC_QUEUE_PAD) {
+            msg &= ~CDC_QUEUE_PAD;
+            memset(hdr, 0, 8 + msg);
+            __atomic_store_n(&lane->head, lane->head + 8 + msg, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        n = msg - lane->part;
+        if (n > (uint32_t)(queue->batch_size - len)) {
+            if (len > 0 && lane->part == 0 && msg <= (uint32_t)queue->batch_size) {
+                break;
+            }
+            n = queue->batch_size - len;
+        }
+        memcpy(queue->batch + len, (unsigned char *)(hdr + 2) + lane->part, n);
+        len += n;
+        lane->part += n;
+        if (lane->part < msg) {
+            break;
+        }
+        lane->part = 0;
+        memset(hdr, 0, CDC_QUEUE_RECORD(msg));
+        __atomic_store_n(&lane->head, lane->head + CDC_QUEUE_RECORD(msg), __ATOMIC_SEQ_CST);
+    }
+    return len;
+}
+
+/**
+    Internal function telling whether a lane has a published record.
+    \internal
+
+    \param lane lane of the write queue
+*/
+static int cdc_queue_pending_internal(struct cdc_queue_lane *lane)
+{
+    uint32_t *hdr = (uint32_t *)(lane->ring + (lane->head & (lane->size - 1)));
+
+    return __atomic_load_n(hdr, __ATOMIC_SEQ_CST) != 0;
+}
+
+/**
+    Internal function to wake threads waiting for ring space or a flush.
+    \internal
+
+    \param queue write queue
+*/
+static void cdc_queue_notify_internal(struct cdc_write_queue *queue)
+{
+    if (__atomic_load_n(&queue->space_waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->space);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+    Drain thread of the write queue: writes published records to the port
+    in batches until the queue is stopped and empty.  Urgent records go
+    first, so they wait at most for the batch being written.  After an error,
+    records are discarded so producers and cdc_write_queue_stop() never
+    wait for a port that is gone.
+    \internal
+
+    \param arg pointer to cdc_ctx
+*/
+static void *cdc_queue_thread(void *arg)
+{
+    struct cdc_ctx *cdc = (struct cdc_ctx *)arg;
+    struct cdc_write_queue *queue = cdc->write_queue;
+
+    for (;;) {
+        int len = 0, i;
+
+        for (i = 0; i < CDC_LANES; i ++) {
+            len = cdc_queue_collect_internal(queue, &queue->lane[i], len);
+        }
+        if (len == 0) {
+            pthread_mutex_lock(&queue->lock);
+            __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+            if (!cdc_queue_pending_internal(&queue->lane[CDC_LANE_URGENT]) &&
+                !cdc_queue_pending_internal(&queue->lane[CDC_LANE_BULK])) {
+                if (queue->stopping) {
+                    pthread_mutex_unlock(&queue->lock);
+                    break;
+                }
+                pthread_cond_wait(&queue->wake, &queue->lock);
+            }
+            __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+        /* the collected records' space is free already, the write may take long */
+        cdc_queue_notify_internal(queue);
+
+        if (__atomic_load_n(&queue->error, __ATOMIC_RELAXED) == CDC_SUCCESS) {
+            int result = cdc_queue_port_write_internal(cdc, queue->batch, len);
+            if (result < 0) {
+                __atomic_store_n(&queue->error, result, __ATOMIC_RELEASE);
+            } else {
+                __atomic_add_fetch(&queue->tx_bytes, len, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&queue->tx_transfers, 1, __ATOMIC_RELAXED);
+            }
+        }
+        /* a message cut by the batch size is done once its last part is written */
+        for (i = 0; i < CDC_LANES; i ++) {
+            if (queue->lane[i].part == 0) {
+                __atomic_store_n(&queue->lane[i].done, queue->lane[i].head, __ATOMIC_SEQ_CST);
+            }
+        }
+        cdc_queue_notify_internal(queue);
+    }
+    return NULL;
+}
+
+/**
+    Internal function to reserve and publish a record without locking.
+    \internal
+
+    \param lane lane of the write queue
+    \param buf message
+    \param size message size, at most half the ring minus the header
+
+    \return 1 if the message was queued, 0 if the ring is full
+*/
+static int cdc_queue_try_internal(struct cdc_queue_lane *lane, unsigned char const *buf, int size)
+{
+    uint64_t tail, head, off, total, need = CDC_QUEUE_RECORD((uint32_t)size);
+    uint32_t *hdr;
+
+    tail = __atomic_load_n(&lane->tail, __ATOMIC_RELAXED);
+    do {
+        head = __atomic_load_n(&lane->head, __ATOMIC_SEQ_CST);
+        off = tail & (lane->size - 1);
+        /* records never wrap: pad to the end of the ring first */
+        total = off + need > lane->size ? lane->size - off + need : need;
+        if (tail + total - head > lane->size) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&lane->tail, &tail, tail + total, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (total != need) {
+        hdr = (uint32_t *)(lane->ring + off);
+        __atomic_store_n(hdr, CDC_QUEUE_PAD | (uint32_t)(lane->size - off - 8), __ATOMIC_RELEASE);
+        off = 0;
+    }
+    hdr = (uint32_t *)(lane->ring + off);
+    memcpy(hdr + 2, buf, size);
+    __atomic_store_n(hdr, (uint32_t)size, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/**
+    Internal function to wake the drain thread after publishing a record,
+    if it sleeps.  Must be called without holding the queue lock.
+    \internal
+
+    \param queue write queue
+*/
+static void cdc_queue_wake_internal(struct cdc_write_queue *queue)
+{
+    if (__atomic_exchange_n(&queue->waiting, 0, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+    Internal function to compute an absolute CLOCK_MONOTONIC time.
+    \internal
+
+    \param ts storage for the time
+    \param timeout milliseconds from now
+*/
+static void cdc_queue_abstime_internal(struct timespec *ts, int timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout / 1000;
+    ts->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec ++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+    Internal function to free the memory of a write queue.
+    \internal
+
+    \param queue write queue
+*/
+static void cdc_queue_free_internal(struct cdc_write_queue *queue)
+{
+    for (int i = 0; i < CDC_LANES; i ++) {
+        cdc_free_internal(queue->lane[i].ring);
+    }
+    cdc_free_internal(queue->batch);
+    cdc_free_internal(queue);
+}
+
+/**
+    Starts the write submission queue of an opened port.
+
+    Any number of threads may then call cdc_write_queue_submit() at the
+    same time.  Each message is copied into a bounded ring without taking
+    a lock and written to the port, in order and batched with the messages
+    queued behind it, by a drain thread.  cdc_write_data() submits to the
+    queue as well.  Reading from another thread meanwhile is fine; the
+    asynchronous engine cannot be used together with the queue.
+
+    Messages from cdc_write_queue_submit_urgent() have a ring of their
+    own and overtake everything not yet handed to the port, so they wait
+    for one batch at most: batch_size bounds their latency.  Messages are
+    never interleaved with each other, except that urgent messages may go
+    between the batch sized chunks of a message larger than a batch.
+
+    \param cdc pointer to cdc_ctx
+    \param size ring size in bytes, a power of two, 0 for 64 KiB.  The
+                largest message is half the ring minus 8 bytes.  The ring
+                of urgent messages has the same size, up to 4 KiB.
+    \param batch_size largest single write to the port, 0 for 16 KiB
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_write_queue_start(struct cdc_ctx *cdc, int size, int batch_size)
+{
+    struct cdc_write_queue *queue;
+    pthread_condattr_t attr;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->backend != CDC_BACKEND_NONE ? CDC_SUCCESS : CDC_ERROR_NO_DEVICE, "not opened");
+    cdc_check(cdc->write_queue == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "already started");
+    cdc_check(cdc->async == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "asynchronous engine running");
+
+    if (size == 0) {
+        size = 65536;
+    }
+    if (batch_size == 0) {
+        batch_size = 16384;
+    }
+    cdc_check(size >= 64 && (size & (size - 1)) == 0 && batch_size > 0 ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "size or batch_size");
+
+    queue = (struct cdc_write_queue *)cdc_calloc_internal(1, sizeof(struct cdc_write_queue));
+    cdc_check(queue ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    queue->lane[CDC_LANE_BULK].size = size;
+    queue->lane[CDC_LANE_URGENT].size = size < CDC_QUEUE_URGENT_SIZE ? size : CDC_QUEUE_URGENT_SIZE;
+    queue->lane[CDC_LANE_BULK].ring = (unsigned char *)cdc_calloc_internal(1, size);
+    queue->lane[CDC_LANE_URGENT].ring = (unsigned char *)cdc_calloc_internal(1, queue->lane[CDC_LANE_URGENT].size);
+    queue->batch_size = batch_size;
+    queue->batch = (unsigned char *)cdc_malloc_internal(batch_size);
+    if (!queue->lane[CDC_LANE_BULK].ring || !queue->lane[CDC_LANE_URGENT].ring || !queue->batch) {
+        cdc_queue_free_internal(queue);
+        cdc_return(CDC_ERROR_NO_MEM, "out of memory");
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->space, &attr);
+    pthread_condattr_destroy(&attr);
+
+    cdc->write_queue = queue;
+    if (pthread_create(&queue->thread, NULL, cdc_queue_thread, cdc) != 0) {
+        cdc->write_queue = NULL;
+        pthread_cond_destroy(&queue->space);
+        pthread_cond_destroy(&queue->wake);
+        pthread_mutex_destroy(&queue->lock);
+        cdc_queue_free_internal(queue);
+        cdc_return(CDC_ERROR_NO_MEM, "pthread_create");
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Stops the write submission queue after writing everything queued.
+    No thread may submit meanwhile.  Called by cdc_usb_close().
+
+    \param cdc pointer to cdc_ctx
+
+    \return CDC_SUCCESS, or the CDC_ERROR code of a failed write whose
+            data was discarded
+*/
+int cdc_write_queue_stop(struct cdc_ctx *cdc)
+{
+    struct cdc_write_queue *queue;
+    int error;
+
+    if (cdc == NULL || cdc->write_queue == NULL) {
+        return CDC_SUCCESS;
+    }
+    queue = cdc->write_queue;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+
+    error = queue->error;
+    pthread_cond_destroy(&queue->space);
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->lock);
+    cdc_queue_free_internal(queue);
+    cdc->write_queue = NULL;
+    cdc_check(error, "write queue");
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to queue a message in a lane of the write queue.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param index CDC_LANE_URGENT or CDC_LANE_BULK
+    \param buf message
+    \param size message size
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: size
+*/
+static int cdc_queue_submit_internal(struct cdc_ctx *cdc, int index, unsigned char const *buf, int size)
+{
+    struct cdc_write_queue *queue;
+    struct cdc_queue_lane *lane;
+    struct timespec deadline;
+    unsigned int seq;
+    int queued, error;
+
+    if (cdc == NULL || cdc->write_queue == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    queue = cdc->write_queue;
+    lane = &queue->lane[index];
+    seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    if (size <= 0 || CDC_QUEUE_RECORD((uint32_t)size) > lane->size / 2) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    error = __atomic_load_n(&queue->error, __ATOMIC_ACQUIRE);
+    if (error) {
+        return error;
+    }
+
+    queued = cdc_queue_try_internal(lane, buf, size);
+    if (!queued) {
+        /* full: sleep until the drain thread frees space */
+        cdc_queue_abstime_internal(&deadline, cdc->usb_write_timeout);
+        pthread_mutex_lock(&queue->lock);
+        __atomic_add_fetch(&queue->space_waiters, 1, __ATOMIC_SEQ_CST);
+        while (!(queued = cdc_queue_try_internal(lane, buf, size))) {
+            if ((error = __atomic_load_n(&queue->error, __ATOMIC_ACQUIRE)) != CDC_SUCCESS) {
+                break;
+            }
+            if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+                error = CDC_ERROR_INTERRUPTED;
+                break;
+            }
+            if (cdc->usb_write_timeout == 0) {
+                pthread_cond_wait(&queue->space, &queue->lock);
+            } else if (pthread_cond_timedwait(&queue->space, &queue->lock, &deadline) == ETIMEDOUT) {
+                error = CDC_ERROR_TIMEOUT;
+                break;
+            }
+        }
+        __atomic_sub_fetch(&queue->space_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->lock);
+        if (!queued) {
+            return error;
+        }
+    }
+    cdc_queue_wake_internal(queue);
+    __atomic_add_fetch(&queue->tx_messages, 1, __ATOMIC_RELAXED);
+    if (index == CDC_LANE_URGENT) {
+        __atomic_add_fetch(&queue->tx_urgent, 1, __ATOMIC_RELAXED);
+    }
+    return size;
+}
+
+/**
+    Queues a message for writing.  Thread safe: may be called from any
+    number of threads at once.  Returns as soon as the message is in the
+    ring, which takes no lock unless the ring is full, in which case it
+    waits up to usb_write_timeout for space.
+
+    Being callable concurrently, it reports failures only through its
+    return value and does not set the error string of cdc.
+
+    \param cdc pointer to cdc_ctx
+    \param buf message
+    \param size message size, at most half the ring size minus 8
+
+    \retval <0: CDC_ERROR code; CDC_ERROR_TIMEOUT if the ring stayed full,
+                CDC_ERROR_INTERRUPTED if woken by cdc_cancel_io(),
+                or the sticky error of an earlier failed write
+    \retval >=0: size
+*/
+int cdc_write_queue_submit(struct cdc_ctx *cdc, unsigned char const *buf, int size)
+{
+    return cdc_queue_submit_internal(cdc, CDC_LANE_BULK, buf, size);
+}
+
+/**
+    Queues a message ahead of all messages queued with
+    cdc_write_queue_submit() and not yet handed to the port, for control
+    messages such as heartbeats or emergency stops.  Urgent messages are
+    written in the order they are submitted.  Otherwise the same as
+    cdc_write_queue_submit().
+
+    \param cdc pointer to cdc_ctx
+    \param buf message
+    \param size message size, at most half the urgent ring size minus 8,
+                2040 bytes with the default ring
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: size
+*/
+int cdc_write_queue_submit_urgent(struct cdc_ctx *cdc, unsigned char const *buf, int size)
+{
+    return cdc_queue_submit_internal(cdc, CDC_LANE_URGENT, buf, size);
+}
+
+/**
+    Waits until every message submitted before the call was written.
+
+    \param cdc pointer to cdc_ctx
+    \param timeout maximum time to wait in milliseconds, 0 to wait forever
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_write_queue_flush(struct cdc_ctx *cdc, int timeout)
+{
+    struct cdc_write_queue *queue;
+    struct timespec deadline;
+    uint64_t target[CDC_LANES];
+    int error = CDC_SUCCESS, i;
+
+    if (cdc == NULL || cdc->write_queue == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    queue = cdc->write_queue;
+    for (i = 0; i < CDC_LANES; i ++) {
+        target[i] = __atomic_load_n(&queue->lane[i].tail, __ATOMIC_SEQ_CST);
+    }
+    cdc_queue_abstime_internal(&deadline, timeout);
+
+    pthread_mutex_lock(&queue->lock);
+    __atomic_add_fetch(&queue->space_waiters, 1, __ATOMIC_SEQ_CST);
+    while ((int64_t)(__atomic_load_n(&queue->lane[CDC_LANE_URGENT].done, __ATOMIC_SEQ_CST) -
+                     target[CDC_LANE_URGENT]) < 0 ||
+           (int64_t)(__atomic_load_n(&queue->lane[CDC_LANE_BULK].done, __ATOMIC_SEQ_CST) -
+                     target[CDC_LANE_BULK]) < 0) {
+        if ((error = __atomic_load_n(&queue->error, __ATOMIC_ACQUIRE)) != CDC_SUCCESS) {
+            break;
+        }
+        if (timeout == 0) {
+            pthread_cond_wait(&queue->space, &queue->lock);
+        } else if (pthread_cond_timedwait(&queue->space, &queue->lock, &deadline) == ETIMEDOUT) {
+            error = CDC_ERROR_TIMEOUT;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&queue->space_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+    return error ? error : __atomic_load_n(&queue->error, __ATOMIC_ACQUIRE);
+}
+
+/**
+    Writes data through the write queue, as messages of at most the
+    largest size the ring takes.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes queued
+*/
+int cdc_queue_write_data(struct cdc_ctx *cdc, unsigned char const *buf, int size)
+{
+    int max = cdc->write_queue->lane[CDC_LANE_BULK].size / 2 - 8, actual_size = 0;
+
+    while (actual_size < size) {
+        int n = size - actual_size < max ? size - actual_size : max;
+        int result = cdc_write_queue_submit(cdc, buf + actual_size, n);
+        if (result < 0) {
+            if (actual_size) {
+                break;
+            }
+            cdc_return(result, "write queue");
+        }
+        actual_size += n;
+    }
+    return actual_size;
+}
+
+/* @} end of doxygen libcdc group */
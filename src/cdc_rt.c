@@ -0,0 +1,208 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+/* pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <libusb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/** longest time in milliseconds the sleeping event thread takes to notice cdc_rt_stop() */
+#define CDC_RT_POLL 100
+
+/** stack the event thread touches when it starts, so it never page faults later */
+#define CDC_RT_STACK_PREFAULT (64 * 1024)
+
+/**
+    Internal function to fault in the stack of the calling thread.
+    \internal
+*/
+static void cdc_rt_prefault_stack_internal(void)
+{
+    volatile unsigned char stack[CDC_RT_STACK_PREFAULT];
+
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+    Real-time event thread: handles the events of the port, in a loop
+    without sleeping if busy polling, until stopped or the events fail.
+    \internal
+
+    \param arg pointer to cdc_ctx
+*/
+static void *cdc_rt_thread(void *arg)
+{
+    struct cdc_ctx *cdc = (struct cdc_ctx *)arg;
+    struct cdc_async *async = cdc->async;
+    struct cdc_rt *rt = async->rt;
+    int timeout = rt->busy_poll ? 0 : CDC_RT_POLL, result;
+
+    cdc_rt_prefault_stack_internal();
+    while (!__atomic_load_n(&rt->stopping, __ATOMIC_ACQUIRE)) {
+        result = cdc_handle_events(cdc, timeout);
+        if (result < 0) {
+            /* nobody else handles events: fail the waiting readers and writers */
+            rt->error = result;
+            pthread_mutex_lock(&async->rx_lock);
+            if (async->rx_error == CDC_SUCCESS) {
+                async->rx_error = result;
+            }
+            pthread_cond_broadcast(&async->rx_cond);
+            pthread_mutex_unlock(&async->rx_lock);
+            pthread_mutex_lock(&async->tx_lock);
+            if (async->tx_error == CDC_SUCCESS) {
+                async->tx_error = result;
+            }
+            pthread_cond_broadcast(&async->tx_cond);
+            pthread_mutex_unlock(&async->tx_lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+    Starts a real-time event thread for a port's asynchronous engine, for
+    replies within a bounded time rather than on average.
+
+    The thread handles all events of the port, optionally at SCHED_FIFO
+    priority, pinned to one CPU and without ever sleeping; cdc_read_data()
+    and cdc_write_data() then only wait for it, and cdc_handle_events()
+    must not be called elsewhere.  The engine's buffers and transfers are
+    allocated and touched by cdc_async_start() already; with lock_memory
+    all memory of the process is locked as well, and stays locked after
+    the thread stops.  cdc_get_stats() reports the delivery latency and
+    its jitter.  A busy polling thread at SCHED_FIFO priority never gives
+    up its CPU, so pin it to a CPU no other thread of the process needs.
+
+    \param cdc pointer to cdc_ctx
+    \param config settings of the thread
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure:
+            CDC_ERROR_ACCESS if real-time scheduling is not permitted,
+            CDC_ERROR_NO_MEM if the memory could not be locked
+*/
+int cdc_rt_start(struct cdc_ctx *cdc, struct cdc_rt_config const *config)
+{
+    struct cdc_async *async;
+    struct cdc_rt *rt;
+    pthread_attr_t attr;
+    int result;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(config ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_rt_config *config");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    async = cdc->async;
+    cdc_check(async->rt == NULL ? CDC_SUCCESS : CDC_ERROR_BUSY, "already started");
+    cdc_check(config->priority >= 0 && config->priority <= sched_get_priority_max(SCHED_FIFO) ?
+              CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "priority");
+    cdc_check(config->cpu >= -1 && config->cpu < CPU_SETSIZE ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cpu");
+
+    if (config->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        cdc_return(cdc_errno_internal(errno), "mlockall");
+    }
+
+    rt = (struct cdc_rt *)cdc_calloc_internal(1, sizeof(struct cdc_rt));
+    cdc_check(rt ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    rt->busy_poll = config->busy_poll;
+
+    pthread_attr_init(&attr);
+    if (config->priority > 0) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    if (config->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    async->rt = rt;
+    result = pthread_create(&rt->thread, &attr, cdc_rt_thread, cdc);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        async->rt = NULL;
+        cdc_free_internal(rt);
+        cdc_return(cdc_errno_internal(result), "pthread_create");
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Stops the real-time event thread; blocking calls handle events
+    themselves again.  Called by cdc_async_stop().
+
+    \param cdc pointer to cdc_ctx
+
+    \return CDC_SUCCESS, or the CDC_ERROR code that ended the thread early
+*/
+int cdc_rt_stop(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async;
+    struct cdc_rt *rt;
+    uint64_t one = 1;
+    int error;
+
+    if (cdc == NULL || cdc->async == NULL || cdc->async->rt == NULL) {
+        return CDC_SUCCESS;
+    }
+    async = cdc->async;
+    rt = async->rt;
+
+    __atomic_store_n(&rt->stopping, 1, __ATOMIC_RELEASE);
+    if (cdc->backend == CDC_BACKEND_LIBUSB) {
+        libusb_interrupt_event_handler(cdc->usb_ctx);
+    } else if (write(cdc->cancel_fd, &one, sizeof(one)) < 0) {
+        /* already woken */
+    }
+    pthread_join(rt->thread, NULL);
+
+    /* let waiting callers go back to handling events themselves */
+    pthread_mutex_lock(&async->rx_lock);
+    pthread_mutex_lock(&async->tx_lock);
+    async->rt = NULL;
+    pthread_cond_broadcast(&async->rx_cond);
+    pthread_cond_broadcast(&async->tx_cond);
+    pthread_mutex_unlock(&async->tx_lock);
+    pthread_mutex_unlock(&async->rx_lock);
+
+    error = rt->error;
+    cdc_free_internal(rt);
+    return error;
+}
+
+/* @} end of doxygen libcdc group */
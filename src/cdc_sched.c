@@ -0,0 +1,347 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/**
+    Internal function to find the earliest deadline of the held writes.
+    Called with the scheduler locked.
+    \internal
+
+    \param sched write scheduler
+
+    \return CLOCK_MONOTONIC deadline in nanoseconds, 0 if none is held
+*/
+static uint64_t cdc_sched_next_internal(struct cdc_sched *sched)
+{
+    uint64_t next = 0;
+
+    if (sched->count == 0) {
+        return 0;
+    }
+    /* the lists are sorted: their heads hold the earliest deadlines */
+    for (int i = 0; i < CDC_SCHED_SLOTS; i ++) {
+        if (sched->slot[i] && (next == 0 || sched->slot[i]->when < next)) {
+            next = sched->slot[i]->when;
+        }
+    }
+    return next;
+}
+
+/**
+    Internal function to take the earliest write due within a tick out of
+    the timer wheel.  Called with the scheduler locked.
+    \internal
+
+    \param sched write scheduler
+    \param now CLOCK_MONOTONIC time in nanoseconds
+
+    \return the write, or NULL if none is due
+*/
+static struct cdc_sched_write *cdc_sched_take_internal(struct cdc_sched *sched, uint64_t now)
+{
+    uint64_t horizon = now + CDC_SCHED_TICK;
+    uint64_t tick = sched->tick;
+
+    if (horizon / CDC_SCHED_TICK - tick >= CDC_SCHED_SLOTS) {
+        /* events were not handled for a whole turn: start at the earliest write */
+        uint64_t next = cdc_sched_next_internal(sched);
+        if (next && next / CDC_SCHED_TICK > tick) {
+            tick = next / CDC_SCHED_TICK;
+        }
+    }
+    for (int i = 0; i < CDC_SCHED_SLOTS && tick <= horizon / CDC_SCHED_TICK; i ++, tick ++) {
+        struct cdc_sched_write **head = &sched->slot[tick % CDC_SCHED_SLOTS];
+        struct cdc_sched_write *write = *head;
+
+        /* writes of later turns of the wheel are further down the list */
+        if (write && write->when <= horizon) {
+            *head = write->next;
+            sched->count --;
+            sched->tick = tick;
+            return write;
+        }
+    }
+    sched->tick = now / CDC_SCHED_TICK;
+    return NULL;
+}
+
+/**
+    Internal function to wake the thread waiting for events of the port,
+    so that it waits for an earlier deadline.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+static void cdc_sched_wake_internal(struct cdc_ctx *cdc)
+{
+    uint64_t one = 1;
+
+    if (cdc->backend == CDC_BACKEND_LIBUSB) {
+        libusb_interrupt_event_handler(cdc->usb_ctx);
+    } else if (write(cdc->cancel_fd, &one, sizeof(one)) < 0) {
+        /* already woken */
+    }
+}
+
+/**
+    Internal function to shorten a wait for events so that it ends when
+    the next scheduled write is due.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param timeout milliseconds the caller wants to wait, -1 forever
+
+    \return milliseconds to wait, -1 forever
+*/
+int cdc_sched_timeout_internal(struct cdc_ctx *cdc, int timeout)
+{
+    struct cdc_sched *sched = cdc->async->sched;
+    uint64_t next = __atomic_load_n(&sched->next, __ATOMIC_ACQUIRE);
+    uint64_t now;
+    int wait;
+
+    if (__atomic_load_n(&sched->current, __ATOMIC_ACQUIRE)) {
+        /* the transmit buffers were full: try again soon */
+        return timeout < 0 || timeout > 1 ? 1 : timeout;
+    }
+    if (next == 0 || timeout == 0) {
+        return timeout;
+    }
+    now = cdc_now_ns_internal();
+    if (next <= now + CDC_SCHED_TICK) {
+        return 0;
+    }
+    /* wake up within the last tick; cdc_sched_run_internal() sleeps the rest */
+    wait = (int)((next - CDC_SCHED_TICK - now + 999999) / 1000000);
+    return timeout < 0 || timeout > wait ? wait : timeout;
+}
+
+/**
+    Internal function to send the scheduled writes that are due: each
+    waits in the wheel until its deadline is less than a tick away, then
+    for the deadline itself, and is handed to the transmit buffers.
+    Called by cdc_handle_events(); does nothing while another thread
+    runs the scheduler.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+void cdc_sched_run_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_async *async = cdc->async;
+    struct cdc_sched *sched = async->sched;
+    struct cdc_sched_write *done = NULL, **tail = &done, *write;
+    cdc_write_at_cb callback;
+    void *user_data;
+
+    if (__atomic_load_n(&sched->next, __ATOMIC_ACQUIRE) == 0 &&
+        __atomic_load_n(&sched->current, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    if (pthread_mutex_trylock(&sched->lock) != 0) {
+        return;
+    }
+
+    for (;;) {
+        uint64_t now = cdc_now_ns_internal();
+
+        write = sched->current;
+        if (write == NULL) {
+            write = cdc_sched_take_internal(sched, now);
+            if (write == NULL) {
+                break;
+            }
+            if (write->when > now) {
+                struct timespec ts = { (time_t)(write->when / 1000000000),
+                                       (long)(write->when % 1000000000) };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+                }
+            }
+            __atomic_store_n(&sched->current, write, __ATOMIC_RELEASE);
+        }
+
+        write->offset += cdc_tx_append_internal(cdc, write->data + write->offset,
+                                                write->size - write->offset);
+        if (write->offset < write->size) {
+            /* continued once a transmit buffer is free */
+            break;
+        }
+        write->lateness = cdc_now_ns_internal() - write->when;
+        __atomic_store_n(&sched->current, NULL, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&async->tx_lock);
+        async->stats.tx_scheduled ++;
+        async->tx_lateness_sum += write->lateness;
+        if (write->lateness > async->stats.tx_lateness_max) {
+            async->stats.tx_lateness_max = write->lateness;
+        }
+        pthread_mutex_unlock(&async->tx_lock);
+
+        write->next = NULL;
+        *tail = write;
+        tail = &write->next;
+    }
+    __atomic_store_n(&sched->next, cdc_sched_next_internal(sched), __ATOMIC_RELEASE);
+    callback = sched->callback;
+    user_data = sched->user_data;
+    pthread_mutex_unlock(&sched->lock);
+
+    /* unlocked, so that callbacks can schedule the next write */
+    while (done) {
+        write = done;
+        done = write->next;
+        if (callback) {
+            callback(cdc, write->when, write->lateness, user_data);
+        }
+        cdc_free_internal(write);
+    }
+}
+
+/**
+    Internal function to free the write scheduler with the writes it
+    still holds.  Called by cdc_async_stop().
+    \internal
+
+    \param async asynchronous engine
+*/
+void cdc_sched_free_internal(struct cdc_async *async)
+{
+    struct cdc_sched *sched = async->sched;
+
+    if (sched == NULL) {
+        return;
+    }
+    for (int i = 0; i < CDC_SCHED_SLOTS; i ++) {
+        while (sched->slot[i]) {
+            struct cdc_sched_write *write = sched->slot[i];
+            sched->slot[i] = write->next;
+            cdc_free_internal(write);
+        }
+    }
+    cdc_free_internal(sched->current);
+    pthread_mutex_destroy(&sched->lock);
+    cdc_free_internal(sched);
+    async->sched = NULL;
+}
+
+/**
+    Writes data at a given time instead of as soon as possible, for time
+    slotted protocols.  The data is copied and held in a timer wheel by
+    the asynchronous engine; the thread handling its events, the real-time
+    event thread of cdc_rt_start() if one runs, hands it to the port at
+    the deadline.  Writes go out in the order of their deadlines, those
+    with the same deadline in the order they were scheduled.  How late
+    each one went out is passed to the callback of
+    cdc_set_write_at_callback() and summed up by cdc_get_stats().
+
+    Without the real-time event thread, the writes are sent from
+    cdc_handle_events(), which waits no longer than until the next one
+    is due; applications waiting on cdc_get_pollfds() themselves must
+    call it in time.  Writes still held are discarded by cdc_async_stop().
+
+    \param cdc pointer to cdc_ctx
+    \param buf data
+    \param size number of bytes
+    \param when CLOCK_MONOTONIC time in nanoseconds to send the data at;
+                a time in the past sends it at once
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: size
+*/
+int cdc_write_at(struct cdc_ctx *cdc, unsigned char const *buf, int size, uint64_t when)
+{
+    struct cdc_sched *sched;
+    struct cdc_sched_write *write, **link;
+    uint64_t tick, next;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    cdc_check(buf && size > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "buf or size");
+    sched = cdc->async->sched;
+
+    write = (struct cdc_sched_write *)cdc_malloc_internal(sizeof(struct cdc_sched_write) + size);
+    cdc_check(write ? CDC_SUCCESS : CDC_ERROR_NO_MEM, "out of memory");
+    write->when = when;
+    write->size = size;
+    write->offset = 0;
+    write->lateness = 0;
+    memcpy(write->data, buf, size);
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->count == 0 && sched->current == NULL) {
+        sched->tick = cdc_now_ns_internal() / CDC_SCHED_TICK;
+    }
+    /* overdue writes go to the oldest slot still to be looked at */
+    tick = when / CDC_SCHED_TICK;
+    if (tick < sched->tick) {
+        tick = sched->tick;
+    }
+    link = &sched->slot[tick % CDC_SCHED_SLOTS];
+    while (*link && (*link)->when <= when) {
+        link = &(*link)->next;
+    }
+    write->next = *link;
+    *link = write;
+    sched->count ++;
+    next = sched->next;
+    if (next == 0 || when < next) {
+        __atomic_store_n(&sched->next, when ? when : 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    if (next == 0 || when < next) {
+        cdc_sched_wake_internal(cdc);
+    }
+    return size;
+}
+
+/**
+    Sets the function told about every write of cdc_write_at() once it
+    was handed to the port, with its deadline and lateness.
+
+    \param cdc pointer to cdc_ctx
+    \param callback function to call, NULL for none
+    \param user_data passed to callback
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_set_write_at_callback(struct cdc_ctx *cdc, cdc_write_at_cb callback, void *user_data)
+{
+    struct cdc_sched *sched;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(cdc->async ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_async_start not called");
+    sched = cdc->async->sched;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->callback = callback;
+    sched->user_data = user_data;
+    pthread_mutex_unlock(&sched->lock);
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
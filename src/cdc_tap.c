@@ -0,0 +1,349 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "cdc_i.h"
+
+/** record header flag: padding up to the end of the ring */
+#define CDC_TAP_PAD 0x80000000u
+
+/** bytes of the ring taken by a record of len bytes */
+#define CDC_TAP_RECORD(len) (16 + (((len) + 15) & ~15u))
+
+/** smallest ring of a tap, in bytes */
+#define CDC_TAP_MIN_SIZE 256
+
+/**
+    Header of a record in the ring of a tap
+*/
+struct cdc_tap_header
+{
+    /** length of the data, or CDC_TAP_PAD and the bytes to skip */
+    uint32_t len;
+    uint32_t direction;
+    uint64_t time;
+};
+
+/**
+    Internal function to append a record to a tap, or count it as dropped
+    if the ring has no room.  Called with the taps of the context locked.
+    \internal
+
+    \param tap tap
+    \param direction CDC_TAP_RX or CDC_TAP_TX
+    \param data the data
+    \param len its length, at most a quarter of the ring
+    \param time CLOCK_MONOTONIC nanoseconds of the transfer
+*/
+static void cdc_tap_put_internal(struct cdc_tap *tap, int direction, unsigned char const *data,
+                                 uint32_t len, uint64_t time)
+{
+    uint64_t head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+    uint64_t off = tap->tail % tap->size;
+    uint32_t need = CDC_TAP_RECORD(len);
+    uint32_t pad = off + need > tap->size ? (uint32_t)(tap->size - off) : 0;
+    struct cdc_tap_header *hdr;
+
+    if (tap->tail + pad + need - head > tap->size) {
+        /* the reader is behind: lose the data rather than wait */
+        tap->stats.dropped_records ++;
+        tap->stats.dropped_bytes += len;
+        return;
+    }
+    if (pad) {
+        /* records never wrap: pad to the end of the ring first */
+        hdr = (struct cdc_tap_header *)(tap->ring + off);
+        hdr->len = CDC_TAP_PAD | pad;
+        off = 0;
+    }
+    hdr = (struct cdc_tap_header *)(tap->ring + off);
+    hdr->len = len;
+    hdr->direction = direction;
+    hdr->time = time;
+    memcpy(hdr + 1, data, len);
+    __atomic_store_n(&tap->tail, tap->tail + pad + need, __ATOMIC_RELEASE);
+    tap->stats.records ++;
+    tap->stats.bytes += len;
+    if (tap->sleeping) {
+        pthread_cond_signal(&tap->data);
+    }
+}
+
+/**
+    Internal function to mirror traffic into the taps of a context.  Costs
+    a single load while no tap is attached.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param direction CDC_TAP_RX or CDC_TAP_TX
+    \param data the data transferred
+    \param size its length
+    \param time CLOCK_MONOTONIC nanoseconds of the transfer, 0 for now
+*/
+void cdc_tap_feed_internal(struct cdc_ctx *cdc, int direction, unsigned char const *data, int size,
+                           uint64_t time)
+{
+    struct cdc_taps *taps = __atomic_load_n(&cdc->taps, __ATOMIC_ACQUIRE);
+    struct cdc_tap *tap;
+
+    if (taps == NULL || size <= 0 || __atomic_load_n(&taps->list, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    if (time == 0) {
+        time = cdc_now_ns_internal();
+    }
+
+    pthread_mutex_lock(&taps->lock);
+    for (tap = taps->list; tap; tap = tap->next) {
+        uint32_t chunk = tap->size / 4 - 16;
+        int off;
+
+        if (!(tap->directions & direction)) {
+            continue;
+        }
+        /* transfers larger than a quarter of the ring are split */
+        for (off = 0; off < size; off += chunk) {
+            cdc_tap_put_internal(tap, direction, data + off,
+                                 (uint32_t)(size - off) < chunk ? (uint32_t)(size - off) : chunk, time);
+        }
+    }
+    pthread_mutex_unlock(&taps->lock);
+}
+
+/**
+    Internal function to free the taps of a context being freed.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+void cdc_tap_release_internal(struct cdc_ctx *cdc)
+{
+    struct cdc_taps *taps = cdc->taps;
+
+    if (taps == NULL) {
+        return;
+    }
+    while (taps->list) {
+        cdc_tap_detach(taps->list);
+    }
+    pthread_mutex_destroy(&taps->lock);
+    cdc_free_internal(taps);
+    cdc->taps = NULL;
+}
+
+/**
+    Attaches a tap to a port, mirroring its traffic for monitoring,
+    logging or analysis without getting in the way of its readers and
+    writers.  Every chunk received or sent from now on is copied into the
+    tap's ring as it completes, with its direction and time: transfers of
+    the asynchronous engine, the io_uring engine, the receive broadcast,
+    the write queue, and blocking reads and writes.  A tap never holds the
+    port back: when its ring is full the chunk is dropped and counted, see
+    cdc_tap_get_stats().  Taps can be attached and detached while the port
+    is in use, from any thread.
+
+    \param cdc pointer to cdc_ctx
+    \param directions CDC_TAP_RX, CDC_TAP_TX or both
+    \param size bytes of the ring, at least 256; every chunk takes 16
+                bytes more, and chunks larger than a quarter of the ring
+                are split
+
+    \return tap, or NULL if out of memory or a parameter is invalid
+*/
+struct cdc_tap *cdc_tap_attach(struct cdc_ctx *cdc, int directions, int size)
+{
+    struct cdc_taps *taps;
+    struct cdc_tap *tap;
+
+    if (cdc == NULL || !(directions & (CDC_TAP_RX | CDC_TAP_TX)) || (directions & ~(CDC_TAP_RX | CDC_TAP_TX)) ||
+        size < CDC_TAP_MIN_SIZE) {
+        return NULL;
+    }
+
+    taps = __atomic_load_n(&cdc->taps, __ATOMIC_ACQUIRE);
+    if (taps == NULL) {
+        struct cdc_taps *expected = NULL;
+
+        taps = (struct cdc_taps *)cdc_calloc_internal(1, sizeof(struct cdc_taps));
+        if (taps == NULL) {
+            return NULL;
+        }
+        pthread_mutex_init(&taps->lock, NULL);
+        if (!__atomic_compare_exchange_n(&cdc->taps, &expected, taps, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* attached concurrently by another thread */
+            pthread_mutex_destroy(&taps->lock);
+            cdc_free_internal(taps);
+            taps = expected;
+        }
+    }
+
+    tap = (struct cdc_tap *)cdc_calloc_internal(1, sizeof(struct cdc_tap));
+    if (tap == NULL) {
+        return NULL;
+    }
+    tap->size = (uint32_t)size & ~15u;
+    tap->ring = (unsigned char *)cdc_malloc_internal(tap->size);
+    if (tap->ring == NULL) {
+        cdc_free_internal(tap);
+        return NULL;
+    }
+    tap->taps = taps;
+    tap->directions = directions;
+    pthread_cond_init(&tap->data, NULL);
+
+    pthread_mutex_lock(&taps->lock);
+    tap->next = taps->list;
+    __atomic_store_n(&taps->list, tap, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&taps->lock);
+    return tap;
+}
+
+/**
+    Detaches and frees a tap.  Thread safe, but not while the tap itself
+    is in use by another thread.  Taps still attached are freed with their
+    context.
+
+    \param tap tap
+*/
+void cdc_tap_detach(struct cdc_tap *tap)
+{
+    struct cdc_taps *taps;
+    struct cdc_tap **link;
+
+    if (tap == NULL) {
+        return;
+    }
+    taps = tap->taps;
+
+    pthread_mutex_lock(&taps->lock);
+    for (link = &taps->list; *link; link = &(*link)->next) {
+        if (*link == tap) {
+            __atomic_store_n(link, tap->next, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&taps->lock);
+    pthread_cond_destroy(&tap->data);
+    cdc_free_internal(tap->ring);
+    cdc_free_internal(tap);
+}
+
+/**
+    Reads the oldest chunk of traffic from a tap.  A tap is read by one
+    thread at a time.
+
+    \param tap tap
+    \param buf Buffer to fill
+    \param size Size of the buffer; the rest of a larger chunk is skipped
+    \param record storage for the direction, length and time of the chunk
+    \param timeout maximum time to wait for a chunk in milliseconds, 0 to
+                   not wait, or -1 to wait forever
+
+    \retval <0: CDC_ERROR code
+    \retval 0: no chunk arrived within timeout
+    \retval >0: number of bytes copied to buf
+*/
+int cdc_tap_read(struct cdc_tap *tap, unsigned char *buf, int size,
+                 struct cdc_tap_record *record, int timeout)
+{
+    struct timespec deadline;
+
+    if (tap == NULL || buf == NULL || size <= 0 || record == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec ++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;) {
+        uint64_t head = tap->head;
+
+        if (head != __atomic_load_n(&tap->tail, __ATOMIC_ACQUIRE)) {
+            struct cdc_tap_header *hdr = (struct cdc_tap_header *)(tap->ring + head % tap->size);
+            int len;
+
+            if (hdr->len & CDC_TAP_PAD) {
+                __atomic_store_n(&tap->head, head + (hdr->len & ~CDC_TAP_PAD), __ATOMIC_RELEASE);
+                continue;
+            }
+            len = hdr->len < (uint32_t)size ? (int)hdr->len : size;
+            memcpy(buf, hdr + 1, len);
+            record->direction = (enum cdc_tap_direction)hdr->direction;
+            record->len = (int)hdr->len;
+            record->time = hdr->time;
+            __atomic_store_n(&tap->head, head + CDC_TAP_RECORD(hdr->len), __ATOMIC_RELEASE);
+            return len;
+        }
+        if (timeout == 0) {
+            return 0;
+        }
+
+        pthread_mutex_lock(&tap->taps->lock);
+        if (head == __atomic_load_n(&tap->tail, __ATOMIC_ACQUIRE)) {
+            int result;
+
+            tap->sleeping = 1;
+            if (timeout < 0) {
+                result = pthread_cond_wait(&tap->data, &tap->taps->lock);
+            } else {
+                result = pthread_cond_timedwait(&tap->data, &tap->taps->lock, &deadline);
+            }
+            tap->sleeping = 0;
+            if (result == ETIMEDOUT) {
+                timeout = 0;
+            }
+        }
+        pthread_mutex_unlock(&tap->taps->lock);
+    }
+}
+
+/**
+    Get the counters of a tap, including how much of it is waiting to be
+    read.
+
+    \param tap tap
+    \param stats storage for the counters
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tap_get_stats(struct cdc_tap *tap, struct cdc_tap_stats *stats)
+{
+    if (tap == NULL || stats == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+
+    pthread_mutex_lock(&tap->taps->lock);
+    *stats = tap->stats;
+    stats->lag_bytes = tap->tail - __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&tap->taps->lock);
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
@@ -0,0 +1,484 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "cdc_i.h"
+
+/**
+    Internal table mapping baud rates to termios speed constants.
+    \internal
+*/
+static struct {
+    int baudrate;
+    speed_t speed;
+} const cdc_tty_speeds[] = {
+    { 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+    { 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+    { 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+    { 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 },
+    { 921600, B921600 }, { 1000000, B1000000 }, { 1152000, B1152000 },
+    { 1500000, B1500000 }, { 2000000, B2000000 }, { 2500000, B2500000 },
+    { 3000000, B3000000 }, { 3500000, B3500000 }, { 4000000, B4000000 },
+#endif
+};
+
+/**
+    Internal function to convert an errno value to a CDC_ERROR code.
+    \internal
+
+    \param err errno value
+
+    \return the matching CDC_ERROR code
+*/
+int cdc_errno_internal(int err)
+{
+    switch (err) {
+    case EACCES:
+    case EPERM:
+        return CDC_ERROR_ACCESS;
+    case ENODEV:
+    case ENXIO:
+        return CDC_ERROR_NO_DEVICE;
+    case ENOENT:
+        return CDC_ERROR_NOT_FOUND;
+    case EBUSY:
+        return CDC_ERROR_BUSY;
+    case EAGAIN:
+    case ETIMEDOUT:
+        return CDC_ERROR_TIMEOUT;
+    case EINTR:
+        return CDC_ERROR_INTERRUPTED;
+    case ENOMEM:
+        return CDC_ERROR_NO_MEM;
+    case EINVAL:
+        return CDC_ERROR_INVALID_PARAM;
+    case ENOTTY:
+    case EOPNOTSUPP:
+        return CDC_ERROR_NOT_SUPPORTED;
+    default:
+        return CDC_ERROR_IO;
+    }
+}
+
+/**
+    Internal function to find the kernel tty device bound to a usb device.
+    Looks for a tty below any of the device's interfaces in sysfs.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param dev usb device to look up
+    \param config_num active configuration value
+    \param path storage for the /dev path of the tty
+    \param path_len size of path storage
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tty_find_internal(struct cdc_ctx *cdc, struct libusb_device *dev,
+                          int config_num, char *path, int path_len)
+{
+    uint8_t ports[8];
+    char sysfs[256];
+    int len, nports;
+
+    nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    if (nports <= 0) {
+        cdc_return(CDC_ERROR_NOT_FOUND, "libusb_get_port_numbers");
+    }
+
+    len = snprintf(sysfs, sizeof(sysfs), "/sys/bus/usb/devices/%d-%d",
+                   libusb_get_bus_number(dev), ports[0]);
+    for (int p = 1; p < nports; p ++) {
+        len += snprintf(sysfs + len, sizeof(sysfs) - len, ".%d", ports[p]);
+    }
+
+    for (int ifnum = 0; ifnum <= cdc->data_if; ifnum ++) {
+        struct dirent *entry;
+        DIR *dir;
+
+        snprintf(sysfs + len, sizeof(sysfs) - len, ":%d.%d/tty", config_num, ifnum);
+        dir = opendir(sysfs);
+        if (dir == NULL) {
+            continue;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, path_len, "/dev/%s", entry->d_name);
+                closedir(dir);
+                return CDC_SUCCESS;
+            }
+        }
+        closedir(dir);
+    }
+
+    cdc_return(CDC_ERROR_NOT_FOUND, "kernel tty");
+}
+
+/**
+    Internal function to close the tty of the kernel tty backend.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+*/
+void cdc_tty_close_internal(struct cdc_ctx *cdc)
+{
+    if (cdc && cdc->tty_fd >= 0)
+    {
+        close(cdc->tty_fd);
+        cdc->tty_fd = -1;
+    }
+    if (cdc && cdc->backend == CDC_BACKEND_TTY)
+    {
+        cdc->backend = CDC_BACKEND_NONE;
+    }
+}
+
+/**
+    Opens a tty device, such as a /dev/ttyACM* node bound by the kernel
+    cdc_acm driver, and drives it through the kernel tty backend.
+    cdc_read_data(), cdc_write_data(), cdc_set_line_coding() and
+    cdc_setdtr_rts() then behave as they do for a libusb opened device.
+
+    Any tty works, so the slave side of an openpty() pair can be used to
+    exercise an application without hardware.  A port already open on
+    cdc is closed first.
+
+    \param cdc pointer to cdc_ctx
+    \param path path of the tty device
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tty_open(struct cdc_ctx *cdc, char const *path)
+{
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(path ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "char const *path");
+
+    if (cdc->backend != CDC_BACKEND_NONE) {
+        cdc_usb_close(cdc);
+    }
+
+    cdc->tty_fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (cdc->tty_fd < 0) {
+        cdc_return(cdc_errno_internal(errno), "open tty");
+    }
+    cdc->backend = CDC_BACKEND_TTY;
+
+    /* Set line state to 9600 8N1 */
+    cdc_check(
+        cdc_set_line_coding(cdc, 9600, BITS_8, STOP_BIT_1, NONE),
+        NULL,
+        cdc_tty_close_internal(cdc)
+    );
+
+    return CDC_SUCCESS;
+}
+
+/**
+    Set line characteristics through termios.  Any baud rate can be set;
+    the cdc_acm driver has no way to ask for 1.5 stop bits or 16 data
+    bits, so STOP_BIT_15 and BITS_16 fail with CDC_ERROR_NOT_SUPPORTED,
+    as do MARK and SPACE parity where termios lacks CMSPAR.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param baudrate baud rate to set
+    \param bits Number of bits
+    \param sbit Number of stop bits
+    \param parity Parity mode
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tty_set_line_coding(struct cdc_ctx *cdc, int baudrate,
+                            enum cdc_bits_type bits, enum cdc_stopbits_type sbit,
+                            enum cdc_parity_type parity)
+{
+    struct termios tio;
+    speed_t speed = 0;
+    unsigned int i;
+
+    cdc_check(baudrate > 0 ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "baudrate");
+    for (i = 0; i < sizeof(cdc_tty_speeds) / sizeof(cdc_tty_speeds[0]); i ++) {
+        if (cdc_tty_speeds[i].baudrate == baudrate) {
+            speed = cdc_tty_speeds[i].speed;
+            break;
+        }
+    }
+    if (speed == 0) {
+        /* replaced by the exact rate below */
+        speed = B38400;
+    }
+
+    if (tcgetattr(cdc->tty_fd, &tio) < 0) {
+        cdc_return(cdc_errno_internal(errno), "tcgetattr");
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    /* with O_NONBLOCK this makes an empty read fail with EAGAIN, not return 0 */
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    tio.c_cflag &= ~CSIZE;
+    switch (bits) {
+    case BITS_5: tio.c_cflag |= CS5; break;
+    case BITS_6: tio.c_cflag |= CS6; break;
+    case BITS_7: tio.c_cflag |= CS7; break;
+    case BITS_8: tio.c_cflag |= CS8; break;
+    default: cdc_return(CDC_ERROR_NOT_SUPPORTED, "bits");
+    }
+
+    /* the kernel driver maps CSTOPB to 2 stop bits, 1.5 is not expressible */
+    tio.c_cflag &= ~CSTOPB;
+    switch (sbit) {
+    case STOP_BIT_1: break;
+    case STOP_BIT_2: tio.c_cflag |= CSTOPB; break;
+    default: cdc_return(CDC_ERROR_NOT_SUPPORTED, "stop bits");
+    }
+
+    tio.c_cflag &= ~(PARENB | PARODD);
+#ifdef CMSPAR
+    tio.c_cflag &= ~CMSPAR;
+#endif
+    switch (parity) {
+    case NONE: break;
+    case ODD: tio.c_cflag |= PARENB | PARODD; break;
+    case EVEN: tio.c_cflag |= PARENB; break;
+#ifdef CMSPAR
+    case MARK: tio.c_cflag |= PARENB | PARODD | CMSPAR; break;
+    case SPACE: tio.c_cflag |= PARENB | CMSPAR; break;
+#endif
+    default: cdc_return(CDC_ERROR_NOT_SUPPORTED, "parity");
+    }
+
+    if (tcsetattr(cdc->tty_fd, TCSANOW, &tio) < 0) {
+        cdc_return(cdc_errno_internal(errno), "tcsetattr");
+    }
+    if (i == sizeof(cdc_tty_speeds) / sizeof(cdc_tty_speeds[0])) {
+        cdc_check(cdc_tty_set_speed_internal(cdc, baudrate), NULL);
+    }
+
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function to wait until the tty is ready.
+    A timeout of 0 waits forever, like a libusb transfer timeout.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param events poll events to wait for
+    \param timeout timeout in milliseconds
+
+    \return CDC_SUCCESS when ready or CDC_ERROR code on failure
+*/
+int cdc_tty_wait_internal(struct cdc_ctx *cdc, short events, int timeout)
+{
+    struct pollfd pfd = { cdc->tty_fd, events, 0 };
+    int result;
+
+    do {
+        result = poll(&pfd, 1, timeout ? timeout : -1);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+        return cdc_errno_internal(errno);
+    }
+    if (result == 0) {
+        return CDC_ERROR_TIMEOUT;
+    }
+    if (pfd.revents & POLLNVAL) {
+        return CDC_ERROR_NO_DEVICE;
+    }
+    return CDC_SUCCESS;
+}
+
+/**
+    Internal function like cdc_tty_wait_internal(), which also returns
+    once cdc_cancel_io() is called.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param events poll events to wait for
+    \param timeout timeout in milliseconds
+    \param seq cdc->cancel_seq when the calling function started
+
+    \return CDC_SUCCESS when ready or CDC_ERROR code on failure,
+            CDC_ERROR_INTERRUPTED if cancelled
+*/
+int cdc_tty_wait_cancel_internal(struct cdc_ctx *cdc, short events, int timeout, unsigned int seq)
+{
+    struct pollfd pfd[2] = { { cdc->tty_fd, events, 0 }, { cdc->cancel_fd, POLLIN, 0 } };
+    int result;
+
+    for (;;) {
+        if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) != seq) {
+            return CDC_ERROR_INTERRUPTED;
+        }
+        result = poll(pfd, 2, timeout ? timeout : -1);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            return cdc_errno_internal(errno);
+        }
+        if (result == 0) {
+            return CDC_ERROR_TIMEOUT;
+        }
+        if (pfd[0].revents & POLLNVAL) {
+            return CDC_ERROR_NO_DEVICE;
+        }
+        if (pfd[0].revents) {
+            return CDC_SUCCESS;
+        }
+        /* a cancellation of an earlier call is left over: consume it */
+        if (__atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST) == seq) {
+            cdc_cancel_drain_internal(cdc);
+        }
+    }
+}
+
+/**
+    Reads data from the tty, waiting up to timeout for it to arrive.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer to fill
+    \param size Size of the buffer
+    \param timeout milliseconds to wait for data, 0 to take only what the
+                   tty already received, -1 to wait forever
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes read, 0 if none arrived in time
+*/
+int cdc_tty_read_data(struct cdc_ctx *cdc, unsigned char *buf, int size, int timeout)
+{
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    ssize_t result;
+
+    for (;;) {
+        result = read(cdc->tty_fd, buf, size);
+        if (result > 0) {
+            cdc_tap_feed_internal(cdc, CDC_TAP_RX, buf, result, 0);
+            return result;
+        }
+        if (result == 0) {
+            /* hangup of a pty master or a removed device */
+            cdc_return(CDC_ERROR_NO_DEVICE, "read");
+        }
+        if (errno == EIO) {
+            cdc_return(CDC_ERROR_NO_DEVICE, "read");
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            cdc_return(cdc_errno_internal(errno), "read");
+        }
+        if (timeout == 0) {
+            return 0;
+        }
+        result = cdc_tty_wait_cancel_internal(cdc, POLLIN, timeout < 0 ? 0 : timeout, seq);
+        if (result == CDC_ERROR_TIMEOUT) {
+            return 0;
+        }
+        cdc_check(result, "poll");
+    }
+}
+
+/**
+    Writes data to the tty, waiting up to usb_write_timeout for room.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes written
+*/
+int cdc_tty_write_data(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    unsigned int seq = __atomic_load_n(&cdc->cancel_seq, __ATOMIC_SEQ_CST);
+    int actual_size = 0;
+
+    while (actual_size < size) {
+        ssize_t result = write(cdc->tty_fd, buf + actual_size, size - actual_size);
+        if (result >= 0) {
+            cdc_tap_feed_internal(cdc, CDC_TAP_TX, buf + actual_size, result, 0);
+            actual_size += result;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            cdc_return(cdc_errno_internal(errno), "write");
+        }
+        result = cdc_tty_wait_cancel_internal(cdc, POLLOUT, cdc->usb_write_timeout, seq);
+        if ((result == CDC_ERROR_TIMEOUT || result == CDC_ERROR_INTERRUPTED) && actual_size != 0) {
+            break;
+        }
+        cdc_check(result, "poll");
+    }
+    return actual_size;
+}
+
+/**
+    Set dtr and rts lines through the modem control ioctls.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param dtr DTR state to set line to (1 or 0)
+    \param rts RTS state to set line to (1 or 0)
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tty_setdtr_rts(struct cdc_ctx *cdc, int dtr, int rts)
+{
+    int set = 0, clear = 0;
+
+    if (dtr) {
+        set |= TIOCM_DTR;
+    } else {
+        clear |= TIOCM_DTR;
+    }
+    if (rts) {
+        set |= TIOCM_RTS;
+    } else {
+        clear |= TIOCM_RTS;
+    }
+
+    if (set && ioctl(cdc->tty_fd, TIOCMBIS, &set) < 0) {
+        cdc_return(cdc_errno_internal(errno), "TIOCMBIS");
+    }
+    if (clear && ioctl(cdc->tty_fd, TIOCMBIC, &clear) < 0) {
+        cdc_return(cdc_errno_internal(errno), "TIOCMBIC");
+    }
+
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
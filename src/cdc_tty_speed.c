@@ -0,0 +1,60 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+/*
+    The kernel's termios2 definitions clash with those of <termios.h>, so
+    the baud rates without a B* constant are set in a file of their own.
+*/
+#include <asm/termbits.h>
+#include <errno.h>
+#include <libusb.h>
+#include <sys/ioctl.h>
+
+#include "cdc_i.h"
+
+/**
+    Internal function to set any baud rate of a tty, including rates
+    without a B* constant, through termios2 and BOTHER.  The other line
+    settings are left as they are.
+    \internal
+
+    \param cdc pointer to cdc_ctx
+    \param baudrate baud rate to set
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_tty_set_speed_internal(struct cdc_ctx *cdc, int baudrate)
+{
+    struct termios2 tio;
+
+    if (ioctl(cdc->tty_fd, TCGETS2, &tio) < 0) {
+        cdc_return(cdc_errno_internal(errno), "TCGETS2");
+    }
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baudrate;
+    tio.c_ospeed = baudrate;
+    if (ioctl(cdc->tty_fd, TCSETS2, &tio) < 0) {
+        cdc_return(cdc_errno_internal(errno), "TCSETS2");
+    }
+
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
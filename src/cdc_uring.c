@@ -0,0 +1,513 @@
+/*
+    Copyright 2021.  This file is part of libcdc.
+
+    libcdc is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libcdc is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with libcdc.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \addtogroup libcdc */
+/* @{ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdc_i.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* user_data of a submission: port index and operation */
+#define CDC_URING_OP_RX_POLL 0
+#define CDC_URING_OP_RX      1
+#define CDC_URING_OP_TX_POLL 2
+#define CDC_URING_OP_TX      3
+#define CDC_URING_OPS        4
+
+/**
+    Internal per port state of an io_uring engine.
+    \internal
+*/
+struct cdc_uring_port
+{
+    struct cdc_ctx *cdc;
+    cdc_uring_rx_cb callback;
+    void *user_data;
+
+    /** registered buffers of the port */
+    unsigned char *rx_buf;
+    unsigned char *tx_buf;
+    /** bytes queued in tx_buf, of which tx_busy are being written */
+    int tx_len;
+    int tx_busy;
+    /** sticky write error, reported by the next cdc_uring_write() */
+    int tx_error;
+};
+
+struct cdc_uring
+{
+    int fd;
+
+    /** submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_pending;
+
+    /** completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /** buffer arena registered with the kernel, two buffers per port */
+    unsigned char *arena;
+    size_t arena_size;
+    int buffer_size;
+
+    struct cdc_uring_port *ports;
+    int port_count;
+    int max_ports;
+
+    struct cdc_uring_stats stats;
+};
+
+/**
+    Internal function to queue a poll linked to a fixed buffer read or write.
+    The pair is only handed to the kernel by the next cdc_uring_run().
+    \internal
+
+    \param ring io_uring engine
+    \param index port index
+    \param op CDC_URING_OP_RX or CDC_URING_OP_TX
+    \param buf registered buffer to use
+    \param len length of the transfer
+*/
+static void cdc_uring_queue_internal(struct cdc_uring *ring, int index, int op,
+                                     unsigned char *buf, int len)
+{
+    struct cdc_uring_port *port = &ring->ports[index];
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    struct io_uring_sqe *sqe;
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = port->cdc->tty_fd;
+    sqe->poll32_events = op == CDC_URING_OP_RX ? POLLIN : POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)index * CDC_URING_OPS + op - 1;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    tail ++;
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == CDC_URING_OP_RX ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    sqe->fd = port->cdc->tty_fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = 0;
+    sqe->user_data = (uint64_t)index * CDC_URING_OPS + op;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+
+    ring->sq_pending += 2;
+}
+
+/**
+    Creates an io_uring engine batching reads and writes of tty backed ports.
+
+    Every port gets two registered buffers of buffer_size bytes.  Reads are
+    kept armed as a poll linked to a fixed buffer read, so a single
+    io_uring_enter() per cdc_uring_run() submits and reaps the operations
+    of all ports.
+
+    \param max_ports maximum number of ports added with cdc_uring_add()
+    \param buffer_size size of the receive and transmit buffer of each port
+
+    \return a pointer to a new engine, or NULL on failure
+*/
+struct cdc_uring *cdc_uring_new(int max_ports, int buffer_size)
+{
+    struct io_uring_params params;
+    struct cdc_uring *ring;
+    struct iovec iov;
+
+    if (max_ports <= 0 || buffer_size <= 0) {
+        return NULL;
+    }
+
+    ring = (struct cdc_uring *)cdc_calloc_internal(1, sizeof(struct cdc_uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->max_ports = max_ports;
+    ring->buffer_size = buffer_size;
+
+    ring->ports = (struct cdc_uring_port *)cdc_calloc_internal(max_ports, sizeof(struct cdc_uring_port));
+    if (ring->ports == NULL) {
+        goto fail;
+    }
+
+    /* room for a poll and a transfer in each direction of every port */
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, max_ports * CDC_URING_OPS, &params);
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+        goto fail;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+        ring->cq_ring = NULL;
+        goto fail;
+    }
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    /* one registered region holding every buffer */
+    ring->arena_size = (size_t)max_ports * 2 * buffer_size;
+    ring->arena = mmap(NULL, ring->arena_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring->arena == MAP_FAILED) {
+        ring->arena = NULL;
+        goto fail;
+    }
+    iov.iov_base = ring->arena;
+    iov.iov_len = ring->arena_size;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    cdc_uring_free(ring);
+    return NULL;
+}
+
+/**
+    Frees an io_uring engine.  Pending operations are dropped, the ports
+    themselves are left open.
+
+    \param ring io_uring engine
+*/
+void cdc_uring_free(struct cdc_uring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->arena) {
+        munmap(ring->arena, ring->arena_size);
+    }
+    if (ring->cq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    cdc_free_internal(ring->ports);
+    cdc_free_internal(ring);
+}
+
+/**
+    Adds a port opened through the kernel tty backend to an io_uring engine.
+    From then on received data is passed to callback from cdc_uring_run(),
+    and cdc_read_data() must not be used on the port.
+
+    \param ring io_uring engine
+    \param cdc pointer to cdc_ctx
+    \param callback called with received data, or with a negative
+                    CDC_ERROR code once the port fails
+    \param user_data passed to callback
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_uring_add(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                  cdc_uring_rx_cb callback, void *user_data)
+{
+    struct cdc_uring_port *port;
+    int index;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(ring && callback ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "cdc_uring_add");
+    cdc_check(cdc->backend == CDC_BACKEND_TTY ? CDC_SUCCESS : CDC_ERROR_NOT_SUPPORTED, "not a tty backed port");
+    cdc_check(ring->port_count < ring->max_ports ? CDC_SUCCESS : CDC_ERROR_OVERFLOW, "too many ports");
+
+    index = ring->port_count ++;
+    port = &ring->ports[index];
+    port->cdc = cdc;
+    port->callback = callback;
+    port->user_data = user_data;
+    port->rx_buf = ring->arena + (size_t)index * 2 * ring->buffer_size;
+    port->tx_buf = port->rx_buf + ring->buffer_size;
+    port->tx_len = port->tx_busy = port->tx_error = 0;
+
+    cdc_uring_queue_internal(ring, index, CDC_URING_OP_RX, port->rx_buf, ring->buffer_size);
+
+    return CDC_SUCCESS;
+}
+
+/**
+    Queues data to be written to a port of an io_uring engine.  The data is
+    copied to the port's registered buffer and written by the following
+    cdc_uring_run() calls; data queued while a write is in flight is
+    batched into the next one.
+
+    \param ring io_uring engine
+    \param cdc pointer to cdc_ctx added with cdc_uring_add()
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of bytes queued, less than size if the buffer is full
+*/
+int cdc_uring_write(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                    unsigned char const *buf, int size)
+{
+    struct cdc_uring_port *port = NULL;
+    int index, error;
+
+    cdc_check(cdc ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_ctx *cdc");
+    cdc_check(ring ? CDC_SUCCESS : CDC_ERROR_INVALID_PARAM, "struct cdc_uring *ring");
+
+    for (index = 0; index < ring->port_count; index ++) {
+        if (ring->ports[index].cdc == cdc) {
+            port = &ring->ports[index];
+            break;
+        }
+    }
+    cdc_check(port ? CDC_SUCCESS : CDC_ERROR_NOT_FOUND, "port not added");
+
+    if (port->tx_error) {
+        error = port->tx_error;
+        port->tx_error = 0;
+        cdc_return(error, "io_uring write");
+    }
+
+    if (size > ring->buffer_size - port->tx_len) {
+        size = ring->buffer_size - port->tx_len;
+    }
+    memcpy(port->tx_buf + port->tx_len, buf, size);
+    port->tx_len += size;
+
+    if (!port->tx_busy && port->tx_len) {
+        port->tx_busy = port->tx_len;
+        cdc_uring_queue_internal(ring, index, CDC_URING_OP_TX, port->tx_buf, port->tx_busy);
+    }
+
+    return size;
+}
+
+/**
+    Internal function to handle one completion.
+    \internal
+
+    \param ring io_uring engine
+    \param cqe completion to handle
+*/
+static void cdc_uring_complete_internal(struct cdc_uring *ring, struct io_uring_cqe *cqe)
+{
+    int index = cqe->user_data / CDC_URING_OPS;
+    struct cdc_uring_port *port = &ring->ports[index];
+
+    switch (cqe->user_data % CDC_URING_OPS) {
+    case CDC_URING_OP_RX:
+        if (cqe->res > 0) {
+            ring->stats.rx_bytes += cqe->res;
+            cdc_tap_feed_internal(port->cdc, CDC_TAP_RX, port->rx_buf, cqe->res, 0);
+            port->callback(port->cdc, port->rx_buf, cqe->res, port->user_data);
+        } else if (cqe->res != -EAGAIN) {
+            /* hangup or error: report it and stop reading */
+            port->callback(port->cdc, port->rx_buf,
+                           cqe->res == 0 || cqe->res == -EIO ? CDC_ERROR_NO_DEVICE : cdc_errno_internal(-cqe->res),
+                           port->user_data);
+            break;
+        }
+        cdc_uring_queue_internal(ring, index, CDC_URING_OP_RX, port->rx_buf, ring->buffer_size);
+        break;
+
+    case CDC_URING_OP_TX:
+        if (cqe->res > 0) {
+            ring->stats.tx_bytes += cqe->res;
+            cdc_tap_feed_internal(port->cdc, CDC_TAP_TX, port->tx_buf, cqe->res, 0);
+            port->tx_len -= cqe->res;
+            memmove(port->tx_buf, port->tx_buf + cqe->res, port->tx_len);
+        } else if (cqe->res != -EAGAIN) {
+            port->tx_error = cdc_errno_internal(-cqe->res);
+            port->tx_len = 0;
+        }
+        port->tx_busy = port->tx_len;
+        if (port->tx_busy) {
+            cdc_uring_queue_internal(ring, index, CDC_URING_OP_TX, port->tx_buf, port->tx_busy);
+        }
+        break;
+
+    default:
+        /* completion of a poll linked to a transfer */
+        break;
+    }
+}
+
+/**
+    Runs one iteration of an io_uring engine: submits everything queued
+    since the last call and waits for and handles completions, all within
+    a single io_uring_enter() system call.
+
+    \param ring io_uring engine
+    \param timeout maximum time to wait for a completion in milliseconds,
+                   0 to not wait, or -1 to wait forever
+
+    \retval <0: CDC_ERROR code
+    \retval >=0: number of completions handled
+*/
+int cdc_uring_run(struct cdc_uring *ring, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, to_submit;
+    int result, count = 0;
+
+    if (ring == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE);
+    ring->stats.submissions += ring->sq_pending;
+    ring->sq_pending = 0;
+
+    /* includes entries left over by an interrupted call */
+    to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    ring->stats.syscalls ++;
+    result = syscall(__NR_io_uring_enter, ring->fd, to_submit, timeout ? 1 : 0,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (result < 0 && errno != ETIME && errno != EINTR) {
+        return cdc_errno_internal(errno);
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cdc_uring_complete_internal(ring, &ring->cqes[head & *ring->cq_mask]);
+        head ++;
+        count ++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    ring->stats.completions += count;
+
+    return count;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct cdc_uring
+{
+    struct cdc_uring_stats stats;
+};
+
+struct cdc_uring *cdc_uring_new(int max_ports, int buffer_size)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void cdc_uring_free(struct cdc_uring *ring)
+{
+}
+
+int cdc_uring_add(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                  cdc_uring_rx_cb callback, void *user_data)
+{
+    cdc_return(CDC_ERROR_NOT_SUPPORTED, "io_uring");
+}
+
+int cdc_uring_write(struct cdc_uring *ring, struct cdc_ctx *cdc,
+                    unsigned char const *buf, int size)
+{
+    cdc_return(CDC_ERROR_NOT_SUPPORTED, "io_uring");
+}
+
+int cdc_uring_run(struct cdc_uring *ring, int timeout)
+{
+    return CDC_ERROR_NOT_SUPPORTED;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+    Get the counters of an io_uring engine.
+
+    \param ring io_uring engine
+    \param stats storage for the counters
+
+    \return CDC_SUCCESS on success or CDC_ERROR code on failure
+*/
+int cdc_uring_get_stats(struct cdc_uring *ring, struct cdc_uring_stats *stats)
+{
+    if (ring == NULL || stats == NULL) {
+        return CDC_ERROR_INVALID_PARAM;
+    }
+    *stats = ring->stats;
+    return CDC_SUCCESS;
+}
+
+/* @} end of doxygen libcdc group */
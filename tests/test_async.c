@@ -0,0 +1,139 @@
+/* test_async.c
+
+   The asynchronous engine on a tty backed port: blocking reads and
+   writes, zero-copy access driven from poll(), the rounded queue depth
+   and a receive ring whose counters wrap.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+#include "cdc_i.h"
+
+#define STREAM 200000
+
+static int master;
+
+/* the device streams a counter, pausing now and then */
+static void *feeder(void *arg)
+{
+    unsigned char buf[100];
+    unsigned int n = 0;
+    int i, k;
+
+    for (i = 0; i < STREAM / 100; i ++)
+    {
+        for (k = 0; k < 100; k ++)
+            buf[k] = n ++;
+        test_fd_write(master, buf, sizeof(buf));
+        if (i % 50 == 0)
+            test_sleep_ms(1);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    unsigned char out[3000], in[3000], *data;
+    struct pollfd fds[4];
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    struct cdc_async *async;
+    int n, nfds, done, i, bad;
+    unsigned int expect;
+    pthread_t thread;
+    double end;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_rx_peek(cdc, &data) == CDC_ERROR_INVALID_PARAM);
+    CHECK(cdc_async_start(cdc, 65537, 256) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 5, 256) == CDC_SUCCESS);
+    CHECK(cdc_async_start(cdc, 5, 256) == CDC_ERROR_BUSY);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_depth == 8);
+    CHECK(stats.rx_size == 256);
+
+    /* blocking calls go through the engine */
+    test_pattern(out, sizeof(out), 1);
+    test_fd_write(master, out, sizeof(out));
+    for (done = 0; done < (int)sizeof(in); done += n)
+        REQUIRE((n = cdc_read_data(cdc, in + done, 700)) > 0);
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+    CHECK(cdc_write_data(cdc, out, sizeof(out)) == sizeof(out));
+    CHECK(test_fd_read(master, in, sizeof(in), 2000) == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    /* one thread waiting on the port's descriptors, without copies */
+    nfds = cdc_get_pollfds(cdc, fds, 4);
+    CHECK(nfds >= 1 && nfds <= 4);
+    test_pattern(out, sizeof(out), 2);
+    test_fd_write(master, out, sizeof(out));
+    end = test_now() + 5;
+    for (done = 0; done < (int)sizeof(in) && test_now() < end; )
+    {
+        REQUIRE(poll(fds, nfds, 100) >= 0);
+        REQUIRE(cdc_handle_events(cdc, 0) == CDC_SUCCESS);
+        while ((n = cdc_rx_peek(cdc, &data)) > 0)
+        {
+            CHECK(done + n <= (int)sizeof(in));
+            memcpy(in + done, data, n);
+            done += n;
+            REQUIRE(cdc_rx_consume(cdc, n) == CDC_SUCCESS);
+        }
+        REQUIRE(n == 0);
+        nfds = cdc_get_pollfds(cdc, fds, 4);
+    }
+    CHECK(done == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    for (done = 0; done < (int)sizeof(out); done += n)
+    {
+        REQUIRE((n = cdc_tx_reserve(cdc, &data)) >= 0);
+        if (n > (int)sizeof(out) - done)
+            n = sizeof(out) - done;
+        memcpy(data, out + done, n);
+        REQUIRE(cdc_tx_commit(cdc, n) == CDC_SUCCESS);
+        REQUIRE(cdc_handle_events(cdc, 10) == CDC_SUCCESS);
+    }
+    end = test_now() + 2;
+    for (done = 0; done < (int)sizeof(in) && test_now() < end; )
+    {
+        REQUIRE(cdc_handle_events(cdc, 10) == CDC_SUCCESS);
+        done += test_fd_read(master, in + done, sizeof(in) - done, 10);
+    }
+    CHECK(done == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == 2 * sizeof(out));
+    CHECK(stats.tx_bytes == 2 * sizeof(out));
+
+    /* the slot counters wrap at 2^32 in the middle of a stream */
+    async = cdc->async;
+    pthread_mutex_lock(&async->rx_lock);
+    async->rx_head += 0xfffffff8u;
+    async->rx_tail += 0xfffffff8u;
+    pthread_mutex_unlock(&async->rx_lock);
+    REQUIRE(pthread_create(&thread, NULL, feeder, NULL) == 0);
+    for (done = bad = 0, expect = 0; done < STREAM; done += n)
+    {
+        REQUIRE((n = cdc_read_data(cdc, in, sizeof(in))) > 0);
+        for (i = 0; i < n; i ++)
+            bad += in[i] != (unsigned char)expect ++;
+    }
+    pthread_join(thread, NULL);
+    CHECK(bad == 0);
+    CHECK(async->rx_head < 0x10000);
+
+    /* the engine can be restarted, and reports a hangup */
+    cdc_async_stop(cdc);
+    CHECK(cdc->async == NULL);
+    REQUIRE(cdc_async_start(cdc, 4, 0) == CDC_SUCCESS);
+    close(master);
+    cdc->usb_read_timeout = 1000;
+    CHECK(cdc_read_data(cdc, in, sizeof(in)) < 0);
+    cdc_free(cdc);
+    return test_result();
+}
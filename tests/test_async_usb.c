@@ -0,0 +1,64 @@
+/* test_async_usb.c
+
+   The asynchronous engine on the libusb backend: receive transfers stay
+   queued, data split over several transfers arrives in order, writes
+   reach the device and stopping collects every transfer.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+int main(void)
+{
+    static int const sizes[] = { 100, 300, 256, 10, 1000 };
+    unsigned char out[2000], in[2000];
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    int i, n, done, total;
+    double end;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    CHECK(usb_fake_baudrate() == 9600);
+    CHECK(cdc->line_baudrate == 9600);
+    REQUIRE(cdc_async_start(cdc, 4, 256) == CDC_SUCCESS);
+
+    /* the queue is armed before any data arrives */
+    end = test_now() + 1;
+    while (usb_fake_pending_reads() < 4 && test_now() < end)
+        cdc_handle_events(cdc, 10);
+    CHECK(usb_fake_pending_reads() == 4);
+
+    test_pattern(out, sizeof(out), 3);
+    for (i = total = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); total += sizes[i ++])
+        usb_fake_send(out + total, sizes[i], 1000);
+    for (done = 0; done < total; done += n)
+        REQUIRE((n = cdc_read_data(cdc, in + done, total - done)) > 0);
+    CHECK(memcmp(in, out, total) == 0);
+
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == (uint64_t)total);
+    /* 300 and 1000 bytes take two and four transfers of 256 */
+    CHECK(stats.rx_transfers >= 9);
+
+    test_pattern(out, sizeof(out), 4);
+    CHECK(cdc_write_data(cdc, out, sizeof(out)) == sizeof(out));
+    end = test_now() + 2;
+    for (done = 0; done < (int)sizeof(in) && test_now() < end; )
+    {
+        cdc_handle_events(cdc, 10);
+        done += usb_fake_received(in + done, sizeof(in) - done);
+    }
+    CHECK(done == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    /* nothing is left with the device */
+    cdc_async_stop(cdc);
+    CHECK(usb_fake_pending_reads() == 0);
+
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+    return test_result();
+}
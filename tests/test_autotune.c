@@ -0,0 +1,95 @@
+/* test_autotune.c
+
+   Autotuning of the receive queue on a tty backed port: it starts at
+   the minimum, grows in depth and transfer size while a stream arrives,
+   shrinks back for requests and replies after a pause, and reports its
+   choices in the stats.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define STREAM (2 << 20)
+
+static int master;
+
+static void *feeder(void *arg)
+{
+    static unsigned char buf[4096];
+    int i;
+
+    (void)arg;
+    for (i = 0; i < STREAM / (int)sizeof(buf); i ++)
+    {
+        test_pattern(buf, sizeof(buf), i);
+        test_fd_write(master, buf, sizeof(buf));
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    static unsigned char buf[65536];
+    unsigned int max_depth = 0, max_size = 0;
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    long total;
+    int i, n, got;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_async_autotune(cdc, 1, 256) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 16, 16384) == CDC_SUCCESS);
+    CHECK(cdc_async_autotune(cdc, 17, 256) == CDC_ERROR_INVALID_PARAM);
+    CHECK(cdc_async_autotune(cdc, 1, 0) == CDC_ERROR_INVALID_PARAM);
+    CHECK(cdc_async_autotune(cdc, 1, 32768) == CDC_ERROR_INVALID_PARAM);
+
+    REQUIRE(cdc_async_autotune(cdc, 1, 256) == CDC_SUCCESS);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_depth == 1 && stats.rx_size == 256);
+    CHECK(stats.rx_retunes >= 1);
+
+    /* a stream gets more and larger transfers */
+    REQUIRE(pthread_create(&thread, NULL, feeder, NULL) == 0);
+    for (total = 0; total < STREAM; total += n)
+    {
+        if ((n = cdc_read_data(cdc, buf, sizeof(buf))) < 0)
+            break;
+        REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+        max_depth = stats.rx_depth > max_depth ? stats.rx_depth : max_depth;
+        max_size = stats.rx_size > max_size ? stats.rx_size : max_size;
+    }
+    pthread_join(thread, NULL);
+    CHECK(total == STREAM);
+    CHECK(max_depth > 1);
+    CHECK(max_size >= 4 * 256);
+
+    /* after a pause, short replies taken at once keep it small */
+    test_sleep_ms(300);
+    for (i = 0; i < 40; i ++)
+    {
+        test_fd_write(master, "ping\n", 5);
+        for (got = 0; got < 5; got += n)
+            if ((n = cdc_read_data(cdc, buf, sizeof(buf))) < 0)
+                break;
+        test_sleep_ms(2);
+    }
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_depth <= 2);
+    CHECK(stats.rx_size <= 512);
+
+    /* off: the whole queue of cdc_async_start() */
+    REQUIRE(cdc_async_autotune(cdc, 0, 0) == CDC_SUCCESS);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_depth == 16 && stats.rx_size == 16384);
+    test_fd_write(master, "ok", 2);
+    CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 2);
+
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,117 @@
+/* test_broadcast.c
+
+   The receive broadcast on a tty backed port: blocking subscribers all
+   get every byte in order, while a slow dropping subscriber skips data
+   without holding them back, and accounts for all it skipped.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define TOTAL (2 << 20)
+#define SUBSCRIBERS 3
+
+struct consumer
+{
+    struct cdc_subscriber *sub;
+    int slow;
+    long got;
+    int bad;
+};
+
+static void *consume(void *arg)
+{
+    struct consumer *c = (struct consumer *)arg;
+    unsigned char *buf;
+    uint32_t expect = 0;
+    int i, n;
+
+    while ((c->slow || c->got < TOTAL) && (n = cdc_broadcast_peek(c->sub, &buf, 500)) > 0)
+    {
+        if (c->slow)
+        {
+            /* several transfers arrive meanwhile */
+            test_sleep_ms(2);
+            if (cdc_broadcast_release(c->sub) == CDC_SUCCESS)
+                c->got += n;
+            continue;
+        }
+        for (i = 0; i < n; i ++)
+            c->bad += buf[i] != (unsigned char)(expect ++ * 7);
+        c->got += n;
+        CHECK(cdc_broadcast_release(c->sub) == CDC_SUCCESS);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    static unsigned char data[TOTAL];
+    struct consumer consumers[SUBSCRIBERS];
+    pthread_t threads[SUBSCRIBERS];
+    struct cdc_subscriber_stats stats;
+    struct cdc_subscriber *late;
+    struct cdc_ctx *cdc;
+    unsigned char *buf;
+    int master, i;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_broadcast_subscribe(cdc, CDC_BROADCAST_BLOCK) == NULL);
+    REQUIRE(cdc_broadcast_start(cdc, 8, 4096) == CDC_SUCCESS);
+    CHECK(cdc_broadcast_start(cdc, 8, 4096) == CDC_ERROR_BUSY);
+    CHECK(cdc_read_data(cdc, data, 4) == CDC_ERROR_BUSY);
+
+    memset(consumers, 0, sizeof(consumers));
+    for (i = 0; i < SUBSCRIBERS; i ++)
+    {
+        consumers[i].slow = i == SUBSCRIBERS - 1;
+        consumers[i].sub = cdc_broadcast_subscribe(cdc, consumers[i].slow ? CDC_BROADCAST_DROP : CDC_BROADCAST_BLOCK);
+        REQUIRE(consumers[i].sub != NULL);
+        REQUIRE(pthread_create(&threads[i], NULL, consume, &consumers[i]) == 0);
+    }
+    for (i = 0; i < TOTAL; i ++)
+        data[i] = (unsigned char)(i * 7);
+    test_fd_write(master, data, TOTAL);
+    for (i = 0; i < SUBSCRIBERS; i ++)
+        pthread_join(threads[i], NULL);
+
+    /* the blocking subscribers got everything */
+    for (i = 0; i < SUBSCRIBERS - 1; i ++)
+    {
+        CHECK(consumers[i].got == TOTAL);
+        CHECK(consumers[i].bad == 0);
+        REQUIRE(cdc_broadcast_get_stats(consumers[i].sub, &stats) == CDC_SUCCESS);
+        CHECK(stats.rx_bytes == TOTAL);
+        CHECK(stats.dropped_bytes == 0 && stats.lag_bytes == 0);
+    }
+
+    /* the dropping one skipped most, and knows how much */
+    REQUIRE(cdc_broadcast_get_stats(consumers[i].sub, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == (uint64_t)consumers[i].got);
+    CHECK(stats.dropped_bytes > 0 && stats.dropped_transfers > 0);
+    CHECK(stats.rx_bytes + stats.dropped_bytes == TOTAL);
+    /* it fell behind by as much of the ring as it could see */
+    CHECK(stats.max_lag == 8 - 1);
+
+    /* a subscriber sees only what arrives after it joined */
+    late = cdc_broadcast_subscribe(cdc, CDC_BROADCAST_BLOCK);
+    REQUIRE(late != NULL);
+    CHECK(cdc_broadcast_peek(late, &buf, 0) == 0);
+    test_fd_write(master, data, 100);
+    CHECK(cdc_broadcast_peek(late, &buf, 2000) > 0);
+    CHECK(buf[0] == data[0]);
+    CHECK(cdc_broadcast_release(late) == CDC_SUCCESS);
+    CHECK(cdc_broadcast_release(late) == CDC_ERROR_INVALID_PARAM);
+    cdc_broadcast_unsubscribe(late);
+
+    for (i = 0; i < SUBSCRIBERS; i ++)
+        cdc_broadcast_unsubscribe(consumers[i].sub);
+    CHECK(cdc_broadcast_stop(cdc) == CDC_SUCCESS);
+    CHECK(cdc->broadcast == NULL);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
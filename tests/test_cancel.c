@@ -0,0 +1,134 @@
+/* test_cancel.c
+
+   cdc_cancel_io() wakes blocking reads, writes, write queue submissions
+   and broadcast peeks long before their timeout, on a tty backed port
+   and on the libusb backend, and does not affect later calls.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+#include <termios.h>
+#include "usb_fake.h"
+
+#define BIG (1 << 20)
+
+static struct cdc_ctx *cdc;
+static struct cdc_subscriber *sub;
+static unsigned char big[BIG];
+
+static void *canceller(void *arg)
+{
+    (void)arg;
+    test_sleep_ms(100);
+    CHECK(cdc_cancel_io(cdc) == CDC_SUCCESS);
+    return NULL;
+}
+
+/* run call with a cancellation coming, returning how long it took */
+static double cancelled(int (*call)(void), int *result)
+{
+    pthread_t thread;
+    double start = test_now();
+
+    REQUIRE(pthread_create(&thread, NULL, canceller, NULL) == 0);
+    *result = call();
+    start = test_now() - start;
+    pthread_join(thread, NULL);
+    return start;
+}
+
+static int read_call(void)
+{
+    unsigned char buf[100];
+    return cdc_read_data(cdc, buf, sizeof(buf));
+}
+
+static int write_call(void)
+{
+    return cdc_write_data(cdc, big, BIG);
+}
+
+static int submit_call(void)
+{
+    int result;
+    while ((result = cdc_write_queue_submit(cdc, big, 1000)) > 0)
+        ;
+    return result;
+}
+
+static int peek_call(void)
+{
+    unsigned char *buf;
+    return cdc_broadcast_peek(sub, &buf, -1);
+}
+
+int main(void)
+{
+    unsigned char buf[100];
+    int master, result;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    cdc->usb_read_timeout = cdc->usb_write_timeout = 5000;
+
+    /* a cancellation with nothing blocked is forgotten */
+    CHECK(cdc_cancel_io(cdc) == CDC_SUCCESS);
+    test_fd_write(master, "x", 1);
+    CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 1);
+
+    CHECK(cancelled(read_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    /* the device reads nothing: what fitted is reported */
+    CHECK(cancelled(write_call, &result) < 1);
+    CHECK(result > 0 && result < BIG);
+    tcflush(master, TCIFLUSH);
+
+    REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+    CHECK(cancelled(read_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    CHECK(cancelled(write_call, &result) < 1);
+    CHECK(result > 0 && result < BIG);
+    cdc_async_stop(cdc);
+    tcflush(master, TCIFLUSH);
+
+    REQUIRE(cdc_write_queue_start(cdc, 4096, 0) == CDC_SUCCESS);
+    CHECK(cancelled(submit_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    /* the device discards what was queued */
+    do
+        tcflush(master, TCIFLUSH);
+    while (cdc_write_queue_flush(cdc, 10) == CDC_ERROR_TIMEOUT);
+    CHECK(cdc_write_queue_stop(cdc) == CDC_SUCCESS);
+
+    REQUIRE(cdc_broadcast_start(cdc, 0, 0) == CDC_SUCCESS);
+    REQUIRE((sub = cdc_broadcast_subscribe(cdc, CDC_BROADCAST_BLOCK)) != NULL);
+    CHECK(cancelled(peek_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    cdc_broadcast_unsubscribe(sub);
+    CHECK(cdc_broadcast_stop(cdc) == CDC_SUCCESS);
+
+    close(master);
+    cdc_free(cdc);
+
+    /* pending transfers of the libusb backend are cancelled */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    cdc->usb_read_timeout = 5000;
+    CHECK(cancelled(read_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    usb_fake_send((unsigned char const *)"y", 1, 0);
+    CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 1);
+
+    REQUIRE(cdc_async_start(cdc, 4, 256) == CDC_SUCCESS);
+    CHECK(cancelled(read_call, &result) < 1);
+    CHECK(result == CDC_ERROR_INTERRUPTED);
+    usb_fake_send((unsigned char const *)"z", 1, 0);
+    CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 1 && buf[0] == 'z');
+    cdc_async_stop(cdc);
+
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+    return test_result();
+}
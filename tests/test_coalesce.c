@@ -0,0 +1,95 @@
+/* test_coalesce.c
+
+   The latency timer of cdc_set_read_coalesce() on a tty backed port,
+   without the asynchronous engine, with it and with its real-time event
+   thread: a trickle of small chunks is delivered in reads of the byte
+   threshold while that comes first, and of what arrived within the timer
+   otherwise.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+/* the device sends CHUNKS chunks of 8 bytes, one every 5 ms */
+#define CHUNKS 40
+#define TOTAL (CHUNKS * 8)
+
+static int master;
+
+static void *feeder(void *arg)
+{
+    int i;
+
+    (void)arg;
+    for (i = 0; i < CHUNKS; i ++)
+    {
+        test_sleep_ms(5);
+        test_fd_write(master, "01234567", 8);
+    }
+    return NULL;
+}
+
+/* read the trickle, counting the reads and the largest one */
+static int trickle(struct cdc_ctx *cdc, int bytes, int usecs, int *largest)
+{
+    unsigned char buf[256];
+    pthread_t thread;
+    int reads, total, n;
+
+    REQUIRE(cdc_set_read_coalesce(cdc, bytes, usecs) == CDC_SUCCESS);
+    REQUIRE(pthread_create(&thread, NULL, feeder, NULL) == 0);
+    for (reads = total = *largest = 0; total < TOTAL; reads ++, total += n)
+    {
+        if ((n = cdc_read_data(cdc, buf, sizeof(buf))) <= 0)
+            break;
+        if (n > *largest)
+            *largest = n;
+    }
+    pthread_join(thread, NULL);
+    CHECK(total == TOTAL);
+    return reads;
+}
+
+int main(void)
+{
+    struct cdc_rt_config config;
+    struct cdc_ctx *cdc;
+    int mode, reads, largest;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_set_read_coalesce(cdc, -1, 0) == CDC_ERROR_INVALID_PARAM);
+    cdc->usb_read_timeout = 1000;
+    memset(&config, 0, sizeof(config));
+    config.cpu = -1;
+
+    for (mode = 0; mode < 3; mode ++)
+    {
+        if (mode == 1)
+            REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+        if (mode == 2)
+            REQUIRE(cdc_rt_start(cdc, &config) == CDC_SUCCESS);
+
+        /* off: a read per chunk, give or take */
+        reads = trickle(cdc, 0, 0, &largest);
+        CHECK(reads >= CHUNKS / 2);
+        CHECK(largest < 64);
+
+        /* 64 bytes arrive within 100 ms */
+        reads = trickle(cdc, 64, 100000, &largest);
+        CHECK(reads <= TOTAL / 64 + 1);
+        CHECK(largest >= 64);
+
+        /* 12 ms pass before 64 bytes arrive */
+        reads = trickle(cdc, 64, 12000, &largest);
+        CHECK(reads >= TOTAL / 64 + 2 && reads < CHUNKS);
+        CHECK(largest < 64);
+    }
+
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,106 @@
+/* test_duplex.c
+
+   Full duplex use of one context on a tty backed port: a thread writes
+   while another reads what the device echoes, and each thread sees its
+   own errors only.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define SIZE (1 << 20)
+
+static struct cdc_ctx *cdc;
+static int master;
+
+struct writer
+{
+    int sent;
+    int error;
+    char const *error_str;
+};
+
+static void *writer(void *arg)
+{
+    struct writer *w = (struct writer *)arg;
+    unsigned char buf[1000];
+    int n;
+
+    while (w->sent < SIZE)
+    {
+        n = SIZE - w->sent < (int)sizeof(buf) ? SIZE - w->sent : (int)sizeof(buf);
+        test_pattern(buf, n, w->sent);
+        if ((n = cdc_write_data(cdc, buf, n)) < 0)
+            break;
+        w->sent += n;
+    }
+    w->error = cdc_get_thread_error(&w->error_str);
+    return NULL;
+}
+
+/* the device sends back what it receives */
+static void *echo(void *arg)
+{
+    unsigned char buf[4096];
+    long done = 0;
+    int n;
+
+    (void)arg;
+    while (done < SIZE && (n = test_fd_read(master, buf, sizeof(buf), 2000)) > 0)
+    {
+        test_fd_write(master, buf, n);
+        done += n;
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    static unsigned char in[SIZE], expect[1000];
+    pthread_t writer_thread, echo_thread;
+    struct writer w;
+    char const *str;
+    int done, n, i, bad;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_get_thread_error(&str) == CDC_SUCCESS);
+
+    /* this thread's timeout is its own */
+    cdc->usb_read_timeout = 50;
+    CHECK(cdc_read_data(cdc, in, 10) == CDC_ERROR_TIMEOUT);
+    CHECK(cdc_get_thread_error(&str) == CDC_ERROR_TIMEOUT);
+    CHECK(str != NULL);
+    cdc->usb_read_timeout = 5000;
+
+    memset(&w, 0, sizeof(w));
+    REQUIRE(pthread_create(&echo_thread, NULL, echo, NULL) == 0);
+    REQUIRE(pthread_create(&writer_thread, NULL, writer, &w) == 0);
+    for (done = bad = 0; done < SIZE; done += n)
+    {
+        if ((n = cdc_read_data(cdc, in + done, SIZE - done)) < 0)
+            break;
+    }
+    pthread_join(writer_thread, NULL);
+    pthread_join(echo_thread, NULL);
+
+    CHECK(w.sent == SIZE);
+    CHECK(done == SIZE);
+    for (i = 0; i < done; i += n)
+    {
+        n = done - i < (int)sizeof(expect) ? done - i : (int)sizeof(expect);
+        test_pattern(expect, n, i);
+        bad += memcmp(in + i, expect, n) != 0;
+    }
+    CHECK(bad == 0);
+    /* the writer never saw the reader's failure */
+    CHECK(w.error == CDC_SUCCESS);
+    CHECK(strcmp(w.error_str, "no error") == 0);
+    CHECK(cdc_get_thread_error(NULL) == CDC_ERROR_TIMEOUT);
+
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,147 @@
+/* test_frames.c
+
+   Frames ending at a pause of the line, cdc_set_read_frame_gap(), on a
+   tty backed port and on the libusb backend, with and without the
+   asynchronous engine: a frame trickling in ends at the first pause
+   longer than the gap, frames seen while nobody read come in one call,
+   and a frame larger than the buffer is reported without losing the next.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+#include "usb_fake.h"
+
+/* frame lengths; each frame is filled with a letter of its own */
+static int const lengths[] = { 6, 3, 10, 1, 4 };
+#define FRAMES ((int)(sizeof(lengths) / sizeof(lengths[0])))
+
+static int master;
+
+/* the device sends each frame a byte per millisecond, 40 ms apart */
+static void *feeder(void *arg)
+{
+    int f, i;
+
+    (void)arg;
+    for (f = 0; f < FRAMES; f ++)
+    {
+        test_sleep_ms(40);
+        for (i = 0; i < lengths[f]; i ++)
+        {
+            test_fd_write(master, "abcde" + f, 1);
+            test_sleep_ms(1);
+        }
+    }
+    return NULL;
+}
+
+/* whether buf holds frame f */
+static int is_frame(unsigned char const *buf, int len, int f)
+{
+    int i;
+
+    for (i = 0; i < len; i ++)
+        if (buf[i] != 'a' + f)
+            return 0;
+    return len == lengths[f];
+}
+
+static void tty_frames(int mode)
+{
+    unsigned char buf[64];
+    struct cdc_message msgs[8];
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    int f, n, k;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    cdc->usb_read_timeout = 300;
+    if (mode)
+        REQUIRE(cdc_async_start(cdc, mode == 2 ? 32 : 0, 0) == CDC_SUCCESS);
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_NOT_SUPPORTED);
+    CHECK(cdc_set_read_frame_gap(cdc, -1, 0) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_set_read_frame_gap(cdc, 0, 10000) == CDC_SUCCESS);
+    REQUIRE(pthread_create(&thread, NULL, feeder, NULL) == 0);
+
+    f = 0;
+    if (mode == 2)
+    {
+        /* nobody reads while the frames arrive */
+        double end = test_now() + FRAMES * 0.06 + 0.05;
+        while (test_now() < end)
+            CHECK(cdc_handle_events(cdc, 5) == CDC_SUCCESS);
+        n = cdc_read_messages(cdc, buf, sizeof(buf), msgs, 8);
+        CHECK(n == FRAMES);
+        for (k = 0; k < n && k < FRAMES; k ++, f ++)
+            CHECK(is_frame(buf + msgs[k].offset, msgs[k].len, f));
+    }
+    for (; f < FRAMES; f ++)
+    {
+        n = cdc_read_message(cdc, buf, sizeof(buf));
+        CHECK(is_frame(buf, n, f));
+    }
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_TIMEOUT);
+    pthread_join(thread, NULL);
+
+    if (mode)
+        cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+}
+
+/* frames of the given sizes at 1200 baud, in transfers of 2 bytes as they come off the line */
+static void usb_send(int const *sizes, int count)
+{
+    unsigned char chunk[2];
+    int f, i, n;
+
+    for (f = 0; f < count; f ++)
+        for (i = 0; i < sizes[f]; i += n)
+        {
+            n = sizes[f] - i < 2 ? sizes[f] - i : 2;
+            memset(chunk, 'a' + f, n);
+            usb_fake_send(chunk, n, i ? n * 8333 : 100000);
+        }
+}
+
+static void usb_frames(int async)
+{
+    static int const sizes[] = { 6, 3, 30, 10 };
+    unsigned char buf[20];
+    struct cdc_ctx *cdc;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    cdc->usb_read_timeout = 300;
+    REQUIRE(cdc_set_line_coding(cdc, 1200, BITS_8, STOP_BIT_1, NONE) == CDC_SUCCESS);
+    if (async)
+        REQUIRE(cdc_async_start(cdc, 8, 512) == CDC_SUCCESS);
+    /* 3 character times are 25 ms */
+    REQUIRE(cdc_set_read_frame_gap(cdc, 3, 0) == CDC_SUCCESS);
+    usb_send(sizes, 4);
+
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == 6 && buf[0] == 'a' && buf[5] == 'a');
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == 3 && buf[0] == 'b' && buf[2] == 'b');
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_OVERFLOW);
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == 10 && buf[0] == 'd' && buf[9] == 'd');
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_TIMEOUT);
+
+    if (async)
+        cdc_async_stop(cdc);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+}
+
+int main(void)
+{
+    int mode;
+
+    for (mode = 0; mode < 3; mode ++)
+        tty_frames(mode);
+    usb_frames(0);
+    usb_frames(1);
+    return test_result();
+}
@@ -0,0 +1,130 @@
+/* test_idle.c
+
+   Read-ahead following the reader, cdc_async_set_idle(), on the libusb
+   backend and on a tty backed port: an idle port keeps at most one
+   receive transfer queued and its buffers in the pool, data waits in the
+   device meanwhile, reading ramps the queue up again, and nothing is lost
+   or reordered on the way.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+/* messages of SIZE bytes, ending in a short packet of transfers of BUFFER bytes */
+#define MESSAGES 30
+#define SIZE 500
+#define BUFFER 512
+#define TOTAL (MESSAGES * SIZE)
+
+static void pump(struct cdc_ctx *cdc, int ms)
+{
+    double end = test_now() + ms / 1e3;
+
+    while (test_now() < end)
+        CHECK(cdc_handle_events(cdc, 5) == CDC_SUCCESS);
+}
+
+static void usb_idle(int keep)
+{
+    static unsigned char sent[TOTAL], buf[TOTAL];
+    struct cdc_pool_stats pool;
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    size_t busy;
+    int i, n, got, most;
+    uint64_t idles;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    cdc->usb_read_timeout = 1000;
+    CHECK(cdc_async_set_idle(cdc, 50, 0) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 8, BUFFER) == CDC_SUCCESS);
+    CHECK(usb_fake_pending_reads() == 8);
+    REQUIRE(cdc_pool_get_stats(&pool) == CDC_SUCCESS);
+    busy = pool.used;
+    CHECK(cdc_async_set_idle(cdc, 50, 2) == CDC_ERROR_INVALID_PARAM);
+
+    /* the port starts out idle */
+    REQUIRE(cdc_async_set_idle(cdc, 50, keep) == CDC_SUCCESS);
+    pump(cdc, 20);
+    CHECK(usb_fake_pending_reads() == keep);
+    REQUIRE(cdc_pool_get_stats(&pool) == CDC_SUCCESS);
+    CHECK(pool.used == busy - (8 - keep) * BUFFER);
+
+    /* without a reader the data stays with the device */
+    test_pattern(sent, TOTAL, keep);
+    for (i = 0; i < MESSAGES; i ++)
+        usb_fake_send(sent + i * SIZE, SIZE, 0);
+    pump(cdc, 20);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == (uint64_t)keep * SIZE);
+
+    /* a reader gets the queue back, a transfer at a time */
+    for (got = most = 0, i = 0; i < 12; i ++, got += n)
+    {
+        if ((n = cdc_read_data(cdc, buf + got, SIZE)) <= 0)
+            break;
+        pump(cdc, 1);
+        REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+        if ((int)stats.rx_bytes - got - n > most)
+            most = stats.rx_bytes - got - n;
+    }
+    CHECK(most > 2 * SIZE && most <= 8 * SIZE);
+    while (got < TOTAL && (n = cdc_read_data(cdc, buf + got, TOTAL - got)) > 0)
+        got += n;
+    CHECK(got == TOTAL && memcmp(buf, sent, TOTAL) == 0);
+
+    /* and loses it when it stops reading */
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    idles = stats.rx_idles;
+    CHECK(usb_fake_pending_reads() > 2);
+    pump(cdc, 100);
+    CHECK(usb_fake_pending_reads() == keep);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_idles == idles + 1);
+    REQUIRE(cdc_pool_get_stats(&pool) == CDC_SUCCESS);
+    CHECK(pool.used == busy - (8 - keep) * BUFFER);
+
+    /* off: the whole queue again */
+    REQUIRE(cdc_async_set_idle(cdc, 0, 0) == CDC_SUCCESS);
+    pump(cdc, 5);
+    CHECK(usb_fake_pending_reads() == 8);
+
+    cdc_async_stop(cdc);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+}
+
+int main(void)
+{
+    static unsigned char sent[4096], buf[4096];
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    int master, got, n;
+
+    usb_idle(0);
+    usb_idle(1);
+
+    /* an idle tty backed port leaves the data with the tty */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    cdc->usb_read_timeout = 1000;
+    REQUIRE(cdc_async_start(cdc, 8, 1024) == CDC_SUCCESS);
+    REQUIRE(cdc_async_set_idle(cdc, 50, 0) == CDC_SUCCESS);
+    test_pattern(sent, sizeof(sent), 3);
+    test_fd_write(master, sent, sizeof(sent));
+    pump(cdc, 20);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == 0);
+    for (got = 0; got < (int)sizeof(sent); got += n)
+        if ((n = cdc_read_data(cdc, buf + got, sizeof(buf) - got)) <= 0)
+            break;
+    CHECK(got == sizeof(sent) && memcmp(buf, sent, sizeof(sent)) == 0);
+
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
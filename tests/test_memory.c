@@ -0,0 +1,109 @@
+/* test_memory.c
+
+   The memory of libcdc: it comes from the functions of
+   cdc_set_allocator() or the region of cdc_set_arena(), all of it is
+   given back, cdc_get_memory_usage() accounts for it, an exhausted arena
+   fails cleanly and the allocator can only change while nothing is
+   allocated.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+
+static int mallocs, frees;
+
+static void *counting_malloc(size_t size, void *user_data)
+{
+    *(int *)user_data += 1;
+    mallocs ++;
+    return malloc(size);
+}
+
+static void counting_free(void *ptr, void *user_data)
+{
+    (void)user_data;
+    frees ++;
+    free(ptr);
+}
+
+/* open two ports with buffers of all kinds, returning the bytes in use meanwhile */
+static size_t workload(void)
+{
+    unsigned char buf[16];
+    struct cdc_ctx *cdc[2];
+    size_t used;
+    int master[2], i;
+
+    for (i = 0; i < 2; i ++)
+    {
+        REQUIRE((cdc[i] = cdc_new()) != NULL);
+        master[i] = test_pty_open(cdc[i]);
+    }
+    REQUIRE(cdc_async_start(cdc[0], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_write_queue_start(cdc[1], 4096, 0) == CDC_SUCCESS);
+    test_fd_write(master[1], "hello\nworld", 11);
+    CHECK(cdc_transact(cdc[1], (unsigned char const *)"?", 1, buf, sizeof(buf), '\n', 500) == 6);
+
+    cdc_get_memory_usage(&used, NULL);
+    CHECK(cdc_set_allocator(NULL, NULL, NULL) == CDC_ERROR_BUSY);
+    CHECK(cdc_set_arena(NULL, 0) == CDC_ERROR_BUSY);
+
+    CHECK(cdc_write_queue_stop(cdc[1]) == CDC_SUCCESS);
+    cdc_async_stop(cdc[0]);
+    for (i = 0; i < 2; i ++)
+    {
+        close(master[i]);
+        cdc_free(cdc[i]);
+    }
+    /* the transfer buffers stay in the pool until trimmed */
+    cdc_pool_trim();
+    return used;
+}
+
+int main(void)
+{
+    static max_align_t small[4096 / sizeof(max_align_t)];
+    static max_align_t large[(1 << 20) / sizeof(max_align_t)];
+    struct cdc_ctx *cdc[64];
+    size_t used, peak, heap;
+    int calls = 0, i;
+
+    /* the heap */
+    REQUIRE(cdc_set_arena(NULL, 0) == CDC_SUCCESS);
+    heap = workload();
+    cdc_get_memory_usage(&used, &peak);
+    CHECK(heap > 0 && used == 0 && peak >= heap);
+
+    /* functions of the application, called for all of it */
+    CHECK(cdc_set_allocator(counting_malloc, NULL, NULL) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_set_allocator(counting_malloc, counting_free, &calls) == CDC_SUCCESS);
+    CHECK(workload() == heap);
+    CHECK(calls > 0 && mallocs == calls && frees == mallocs);
+
+    /* an arena holds all of it and does not fragment */
+    REQUIRE(cdc_set_arena(large, sizeof(large)) == CDC_SUCCESS);
+    mallocs = 0;
+    used = workload();
+    CHECK(used >= heap && used <= sizeof(large));
+    CHECK(workload() == used);
+    cdc_get_memory_usage(&used, &peak);
+    CHECK(used == 0 && peak <= sizeof(large));
+    CHECK(mallocs == 0);
+    REQUIRE((cdc[0] = cdc_new()) != NULL);
+    CHECK((void *)cdc[0] > (void *)large && (void *)cdc[0] < (void *)(large + sizeof(large) / sizeof(large[0])));
+    cdc_free(cdc[0]);
+
+    /* an exhausted arena fails the allocation, not the program */
+    REQUIRE(cdc_set_arena(small, sizeof(small)) == CDC_SUCCESS);
+    for (i = 0; i < 64 && (cdc[i] = cdc_new()) != NULL; i ++)
+        ;
+    CHECK(i > 0 && i < 64);
+    while (i > 0)
+        cdc_free(cdc[-- i]);
+    cdc_get_memory_usage(&used, NULL);
+    CHECK(used == 0);
+
+    REQUIRE(cdc_set_arena(NULL, 0) == CDC_SUCCESS);
+    return test_result();
+}
@@ -0,0 +1,116 @@
+/* test_messages.c
+
+   cdc_read_message() and cdc_read_messages() on the libusb backend, with
+   and without the asynchronous engine: messages keep the boundaries the
+   device gave them, across transfers and at zero length packets, several
+   arrive in one call, empty ones are skipped and those too large are
+   reported and discarded without losing the next.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+/* message lengths; each message is filled with its number */
+static int const lengths[] = { 10, 64, 0, 200, 128, 5, 1000, 7, 300, 3 };
+#define COUNT ((int)(sizeof(lengths) / sizeof(lengths[0])))
+
+static void send_all(void)
+{
+    static unsigned char msg[1000];
+    int i;
+
+    for (i = 0; i < COUNT; i ++)
+    {
+        memset(msg, i, lengths[i]);
+        usb_fake_send(msg, lengths[i], 0);
+    }
+}
+
+/* whether msg in buf is message number id */
+static int is_message(unsigned char const *buf, struct cdc_message const *msg, int id)
+{
+    int i;
+
+    if (msg->len != lengths[id])
+        return 0;
+    for (i = 0; i < msg->len; i ++)
+        if (buf[msg->offset + i] != id)
+            return 0;
+    return 1;
+}
+
+int main(void)
+{
+    unsigned char buf[600];
+    struct cdc_message msgs[8];
+    struct cdc_ctx *cdc;
+    int async, id, n, k;
+
+    /* a tty merges the transfers */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    close(test_pty_open(cdc));
+    CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_NOT_SUPPORTED);
+    cdc_free(cdc);
+
+    for (async = 0; async < 2; async ++)
+    {
+        REQUIRE((cdc = cdc_new()) != NULL);
+        REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+        cdc->usb_read_timeout = 1000;
+        CHECK(cdc_read_messages(cdc, buf, sizeof(buf), NULL, 1) == CDC_ERROR_INVALID_PARAM);
+        if (async)
+            REQUIRE(cdc_async_start(cdc, 4, 128) == CDC_SUCCESS);
+        send_all();
+
+        for (id = 0; id < COUNT; )
+        {
+            if (lengths[id] == 0)
+            {
+                id ++;
+                continue;
+            }
+            if (lengths[id] > (int)sizeof(buf))
+            {
+                CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == CDC_ERROR_OVERFLOW);
+                id ++;
+                continue;
+            }
+            if ((n = cdc_read_messages(cdc, buf, sizeof(buf), msgs, 8)) <= 0)
+                break;
+            CHECK(async || n == 1);
+            for (k = 0; k < n; k ++, id ++)
+            {
+                while (lengths[id] == 0)
+                    id ++;
+                CHECK(id < COUNT && is_message(buf, &msgs[k], id));
+            }
+        }
+        CHECK(id == COUNT);
+
+        /* messages complete in the receive queue come in one call */
+        if (async)
+        {
+            test_sleep_ms(10);
+            send_all();
+            test_sleep_ms(20);
+            for (k = 0; k < 20; k ++)
+                cdc_handle_events(cdc, 0);
+            n = cdc_read_messages(cdc, buf, sizeof(buf), msgs, 8);
+            CHECK(n == 2 && is_message(buf, &msgs[0], 0) && is_message(buf, &msgs[1], 1));
+            CHECK(msgs[0].offset == 0 && msgs[1].offset == 10);
+            for (k = 0; k < COUNT && cdc_read_message(cdc, buf, sizeof(buf)) != 3; k ++)
+                ;
+            CHECK(k < COUNT);
+        }
+
+        REQUIRE(cdc_set_nonblocking(cdc, 1) == CDC_SUCCESS);
+        CHECK(cdc_read_message(cdc, buf, sizeof(buf)) == 0);
+        if (async)
+            cdc_async_stop(cdc);
+        cdc_usb_close(cdc);
+        cdc_free(cdc);
+    }
+    return test_result();
+}
@@ -0,0 +1,210 @@
+/* test_muxd.c
+
+   cdc-muxd, run on a pty standing in for the device: readers at their
+   own positions all get the received data, a reader left behind is told
+   what it lost, a reader racing the daemon at the full lag never gets
+   data being overwritten, records written by two processes reach the
+   device whole, and a client corrupting the transmit ring makes the
+   daemon close the port instead of crashing, which clients see.
+
+   usage: test_muxd <path of cdc-muxd>
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "cdc_mux.h"
+
+#define RING 4096
+#define RECORD 20
+#define RECORDS 100
+#define RACE (64 * RING)
+
+/* get port 0 from the daemon */
+static struct cdc_mux_shm *connect_port(char const *path, int *efd)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct cdc_mux_port msg;
+    struct iovec iov = { &msg, sizeof(msg) };
+    struct sockaddr_un addr;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    int fd, fds[2];
+    double end = test_now() + 5;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    for (;;)
+    {
+        REQUIRE((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(fd);
+        REQUIRE(test_now() < end);
+        test_sleep_ms(10);
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    REQUIRE(recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) == sizeof(msg));
+    close(fd);
+    CHECK(msg.index == 0);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    REQUIRE(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)));
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *efd = fds[1];
+    return cdc_mux_map(fds[0]);
+}
+
+/* read len bytes at *pos */
+static int read_all(struct cdc_mux_shm *shm, uint64_t *pos, unsigned char *buf, int len, uint64_t *lost)
+{
+    int done = 0;
+    while (done < len && cdc_mux_wait(shm, *pos, 2000) > 0)
+        done += cdc_mux_read(shm, pos, buf + done, len - done, lost);
+    return done;
+}
+
+/* queue RECORDS records of one letter */
+static void write_records(struct cdc_mux_shm *shm, int efd, unsigned char letter)
+{
+    unsigned char record[RECORD];
+    int i, ret;
+
+    memset(record, letter, sizeof(record));
+    for (i = 0; i < RECORDS; i ++)
+    {
+        while ((ret = cdc_mux_write(shm, efd, record, sizeof(record))) == 0)
+            test_sleep_ms(1);
+        REQUIRE(ret == sizeof(record));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char out[3 * RING], a[3 * RING], b[3 * RING], race[RACE];
+    char dir[] = "/tmp/cdc-muxd-XXXXXX", path[64], device[64], ring[16];
+    struct cdc_mux_shm *shm;
+    uint64_t pos_a, pos_b, lost_a = 0, lost_b = 0, start, head, tail, one = 1;
+    int master, efd, status, done, i, n, reads, bad, counts[2] = { 0, 0 };
+    pid_t pid, child;
+    double end;
+
+    REQUIRE(argc == 2);
+    REQUIRE(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/mux.sock", dir);
+    snprintf(ring, sizeof(ring), "%d", RING);
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    REQUIRE(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    REQUIRE(ptsname_r(master, device, sizeof(device)) == 0);
+
+    pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0)
+    {
+        /* do not outlive a failed test */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execl(argv[1], argv[1], "-t", device, "-S", path, "-r", ring, "-w", ring, (char *)NULL);
+        _exit(127);
+    }
+    REQUIRE((shm = connect_port(path, &efd)) != NULL);
+    CHECK(shm->rx_size == RING);
+
+    /* two readers, one of them starting late, get the same data */
+    pos_a = pos_b = cdc_mux_rx_position(shm);
+    test_pattern(out, RING, 9);
+    test_fd_write(master, out, RING);
+    CHECK(read_all(shm, &pos_a, a, RING, &lost_a) == RING);
+    CHECK(read_all(shm, &pos_b, b, RING, &lost_b) == RING);
+    CHECK(memcmp(a, out, RING) == 0);
+    CHECK(memcmp(b, out, RING) == 0);
+    CHECK(lost_a == 0 && lost_b == 0);
+
+    /* a reader three rings behind keeps the newest ring and counts the rest */
+    test_pattern(out, sizeof(out), 10);
+    test_fd_write(master, out, sizeof(out));
+    end = test_now() + 5;
+    while (cdc_mux_rx_position(shm) - pos_b < sizeof(out) && test_now() < end)
+        test_sleep_ms(1);
+    CHECK(read_all(shm, &pos_b, b, RING, &lost_b) == RING);
+    CHECK(lost_b == sizeof(out) - RING);
+    CHECK(memcmp(b, out + sizeof(out) - RING, RING) == 0);
+
+    /* a reader at the oldest byte left races the daemon overwriting it */
+    start = cdc_mux_rx_position(shm);
+    test_pattern(race, RACE, 11);
+    child = fork();
+    REQUIRE(child >= 0);
+    if (child == 0)
+    {
+        /* a ring at a time, leaving the reader time to run on one CPU */
+        for (i = 0; i < RACE; i += RING)
+        {
+            test_fd_write(master, race + i, RING);
+            test_sleep_ms(1);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    end = test_now() + 10;
+    for (reads = bad = 0; (head = cdc_mux_rx_position(shm)) - start < RACE && test_now() < end; )
+    {
+        pos_b = head - start > RING ? head - RING : start;
+        if ((n = cdc_mux_read(shm, &pos_b, b, 256, &lost_b)) > 0)
+        {
+            bad += memcmp(b, race + (pos_b - n - start), n) != 0;
+            reads ++;
+        }
+    }
+    REQUIRE(waitpid(child, &status, 0) == child);
+    CHECK(head - start == RACE);
+    CHECK(reads > 0 && bad == 0);
+
+    /* records from two processes arrive whole */
+    child = fork();
+    REQUIRE(child >= 0);
+    if (child == 0)
+    {
+        int child_efd;
+        struct cdc_mux_shm *child_shm = connect_port(path, &child_efd);
+        REQUIRE(child_shm != NULL);
+        write_records(child_shm, child_efd, 'C');
+        _exit(test_result());
+    }
+    write_records(shm, efd, 'P');
+    REQUIRE(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    done = test_fd_read(master, a, 2 * RECORD * RECORDS, 5000);
+    CHECK(done == 2 * RECORD * RECORDS);
+    for (i = 0; i < done; i += RECORD)
+    {
+        CHECK(memchr(a + i, a[i] == 'P' ? 'C' : 'P', RECORD) == NULL);
+        counts[a[i] == 'C'] ++;
+    }
+    CHECK(counts[0] == RECORDS && counts[1] == RECORDS);
+
+    /* a record running past the ring closes the port, and readers learn it is gone */
+    tail = __atomic_fetch_add(&shm->tx_tail, 8, __ATOMIC_ACQ_REL);
+    __atomic_store_n((uint32_t *)(cdc_mux_tx_data(shm) + (tail & (RING - 1))), 0x7ffffff0u,
+                     __ATOMIC_RELEASE);
+    REQUIRE(write(efd, &one, sizeof(one)) == sizeof(one));
+    pos_a = cdc_mux_rx_position(shm);
+    CHECK(cdc_mux_wait(shm, pos_a, 2000) == -1);
+    CHECK(cdc_mux_write(shm, efd, "x", 1) == -1);
+    CHECK(waitpid(pid, &status, WNOHANG) == 0);
+    kill(pid, SIGTERM);
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    close(master);
+    rmdir(dir);
+    return test_result();
+}
@@ -0,0 +1,153 @@
+/* test_netd.c
+
+   cdc-netd, run on a pty standing in for the device: a telnet client
+   sets the baud rate with the RFC 2217 COM-PORT-OPTION, a setting the
+   port refuses is answered with the one kept, and data with IAC bytes
+   passes both ways escaped on the network side only.
+
+   usage: test_netd <path of cdc-netd>
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+
+#define IAC 255
+#define SIZE 4000
+
+/* escape IAC bytes of buf into esc, returning the escaped length */
+static int escape(unsigned char const *buf, int size, unsigned char *esc)
+{
+    int i, n = 0;
+    for (i = 0; i < size; i ++)
+    {
+        esc[n ++] = buf[i];
+        if (buf[i] == IAC)
+            esc[n ++] = IAC;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char const set_baudrate[] = {
+        IAC, 250, 44, 1, 0x00, 0x00, 0xe1, 0x00, IAC, 240
+    };
+    static unsigned char const baudrate_reply[] = {
+        IAC, 250, 44, 101, 0x00, 0x00, 0xe1, 0x00, IAC, 240
+    };
+    /* 1.5 stop bits, which a tty cannot do, then 9600 baud */
+    static unsigned char const set_stopsize[] = { IAC, 250, 44, 4, 3, IAC, 240 };
+    static unsigned char const stopsize_reply[] = { IAC, 250, 44, 104, 1, IAC, 240 };
+    static unsigned char const set_9600[] = {
+        IAC, 250, 44, 1, 0x00, 0x00, 0x25, 0x80, IAC, 240
+    };
+    static unsigned char const reply_9600[] = {
+        IAC, 250, 44, 101, 0x00, 0x00, 0x25, 0x80, IAC, 240
+    };
+    static unsigned char out[SIZE], in[2 * SIZE], esc[2 * SIZE];
+    unsigned char greeting[15], reply[sizeof(baudrate_reply)];
+    struct sockaddr_in addr;
+    struct termios tio;
+    char device[64], port[16];
+    int master, slave, sock, status, esc_len, sent, done, n;
+    pid_t pid;
+    double end;
+
+    REQUIRE(argc == 2);
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    REQUIRE(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    REQUIRE(ptsname_r(master, device, sizeof(device)) == 0);
+    REQUIRE((slave = open(device, O_RDWR | O_NOCTTY | O_CLOEXEC)) >= 0);
+
+    /* a port away from the default 2000, different for concurrent runs */
+    snprintf(port, sizeof(port), "%d", 20000 + getpid() % 20000);
+    pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0)
+    {
+        /* do not outlive a failed test */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execl(argv[1], argv[1], "-t", device, "-P", port, "-b", "115200", (char *)NULL);
+        _exit(127);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    end = test_now() + 5;
+    do
+    {
+        REQUIRE((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(sock);
+        sock = -1;
+        test_sleep_ms(10);
+    }
+    while (test_now() < end);
+    REQUIRE(sock >= 0);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    /* the server offers the COM-PORT-OPTION and agrees to 57600 baud */
+    CHECK(test_fd_read(sock, greeting, sizeof(greeting), 2000) == sizeof(greeting));
+    CHECK(greeting[0] == IAC && greeting[sizeof(greeting) - 1] == 44);
+    test_fd_write(sock, set_baudrate, sizeof(set_baudrate));
+    CHECK(test_fd_read(sock, reply, sizeof(reply), 2000) == sizeof(reply));
+    CHECK(memcmp(reply, baudrate_reply, sizeof(reply)) == 0);
+    REQUIRE(tcgetattr(slave, &tio) == 0);
+    CHECK(cfgetospeed(&tio) == B57600);
+
+    /* a refused setting is not kept, so later ones still apply */
+    test_fd_write(sock, set_stopsize, sizeof(set_stopsize));
+    CHECK(test_fd_read(sock, reply, sizeof(stopsize_reply), 2000) == sizeof(stopsize_reply));
+    CHECK(memcmp(reply, stopsize_reply, sizeof(stopsize_reply)) == 0);
+    test_fd_write(sock, set_9600, sizeof(set_9600));
+    CHECK(test_fd_read(sock, reply, sizeof(reply), 2000) == sizeof(reply));
+    CHECK(memcmp(reply, reply_9600, sizeof(reply)) == 0);
+    REQUIRE(tcgetattr(slave, &tio) == 0);
+    CHECK(cfgetospeed(&tio) == B9600 && !(tio.c_cflag & CSTOPB));
+
+    /* client to device: escaped IACs arrive single */
+    test_pattern(out, SIZE, 7);
+    esc_len = escape(out, SIZE, esc);
+    CHECK(esc_len > SIZE);
+    end = test_now() + 10;
+    for (sent = done = 0; done < SIZE && test_now() < end; )
+    {
+        if (sent < esc_len && (n = write(sock, esc + sent, esc_len - sent)) > 0)
+            sent += n;
+        done += test_fd_read(master, in + done, SIZE - done, 10);
+    }
+    CHECK(done == SIZE);
+    CHECK(memcmp(in, out, SIZE) == 0);
+
+    /* device to client: IACs arrive doubled */
+    test_pattern(out, SIZE, 8);
+    esc_len = escape(out, SIZE, esc);
+    end = test_now() + 10;
+    for (sent = done = 0; done < esc_len && test_now() < end; )
+    {
+        if (sent < SIZE && (n = write(master, out + sent, SIZE - sent)) > 0)
+            sent += n;
+        done += test_fd_read(sock, in + done, esc_len - done, 10);
+    }
+    CHECK(done == esc_len);
+    CHECK(memcmp(in, esc, esc_len) == 0);
+
+    close(sock);
+    kill(pid, SIGTERM);
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    close(slave);
+    close(master);
+    return test_result();
+}
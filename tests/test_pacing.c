@@ -0,0 +1,118 @@
+/* test_pacing.c
+
+   Write pacing on a tty backed port, without the asynchronous engine,
+   with it and with the write queue: writes leave at the character rate
+   of the line coding after a burst, follow changes of it, go out at once
+   with pacing off and can be cancelled while waiting for the bucket.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define TOTAL 6144
+
+static int master;
+static volatile int stop;
+static volatile long got;
+
+/* the device takes everything at once */
+static void *sink(void *arg)
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    unsigned char buf[4096];
+    int n;
+
+    (void)arg;
+    pfd.fd = master;
+    while (!stop)
+        if (poll(&pfd, 1, 10) > 0 && (n = read(master, buf, sizeof(buf))) > 0)
+            got += n;
+    return NULL;
+}
+
+static void *canceller(void *arg)
+{
+    test_sleep_ms(200);
+    cdc_cancel_io(arg);
+    return NULL;
+}
+
+/* the seconds TOTAL bytes take to go out */
+static double paced(int mode, int burst, int baudrate)
+{
+    static unsigned char buf[1024];
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    double start;
+    int i;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    if (mode == 1)
+        REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+    if (mode == 2)
+        REQUIRE(cdc_write_queue_start(cdc, 0, 0) == CDC_SUCCESS);
+    REQUIRE(cdc_set_write_pacing(cdc, burst) == CDC_SUCCESS);
+    REQUIRE(cdc_set_line_coding(cdc, baudrate, BITS_8, STOP_BIT_1, NONE) == CDC_SUCCESS);
+    got = stop = 0;
+    REQUIRE(pthread_create(&thread, NULL, sink, NULL) == 0);
+
+    start = test_now();
+    for (i = 0; i < TOTAL / (int)sizeof(buf); i ++)
+        CHECK(cdc_write_data(cdc, buf, sizeof(buf)) == sizeof(buf));
+    if (mode == 2)
+        CHECK(cdc_write_queue_flush(cdc, 5000) == CDC_SUCCESS);
+    start = test_now() - start;
+
+    test_sleep_ms(50);
+    stop = 1;
+    pthread_join(thread, NULL);
+    CHECK(got == TOTAL);
+    if (mode == 1)
+        cdc_async_stop(cdc);
+    if (mode == 2)
+        CHECK(cdc_write_queue_stop(cdc) == CDC_SUCCESS);
+    close(master);
+    cdc_free(cdc);
+    return start;
+}
+
+int main(void)
+{
+    static unsigned char buf[1024];
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    double t;
+    int mode, n;
+
+    /* 115200 baud 8N1 carries 11520 bytes a second */
+    for (mode = 0; mode < 3; mode ++)
+    {
+        t = paced(mode, 64, 115200);
+        CHECK(t >= (TOTAL - 64) / 11520.0 - 0.01 && t < TOTAL / 11520.0 + 0.15);
+        CHECK(paced(mode, 0, 115200) < 0.1);
+    }
+    t = paced(0, 64, 57600);
+    CHECK(t >= (TOTAL - 64) / 5760.0 - 0.01 && t < TOTAL / 5760.0 + 0.15);
+
+    /* a paced write is cancelled with part of it sent */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_set_write_pacing(cdc, -1) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_set_write_pacing(cdc, 16) == CDC_SUCCESS);
+    REQUIRE(cdc_set_line_coding(cdc, 300, BITS_8, STOP_BIT_1, NONE) == CDC_SUCCESS);
+    REQUIRE(pthread_create(&thread, NULL, canceller, cdc) == 0);
+    t = test_now();
+    n = cdc_write_data(cdc, buf, sizeof(buf));
+    t = test_now() - t;
+    pthread_join(thread, NULL);
+    CHECK(n > 0 && n < 64);
+    CHECK(t >= 0.19 && t < 0.5);
+    CHECK(test_fd_read(master, buf, sizeof(buf), 50) == n);
+
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,107 @@
+/* test_pool.c
+
+   The pool of transfer buffers and transfers shared by all contexts:
+   engines stopped leave their buffers for the next ones started, the
+   budget refuses engines beyond it after releasing the buffers kept for
+   other sizes, the stats add up, and stopping an engine on the libusb
+   backend waits for its transfers instead of pooling them in flight.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+#define PORTS 4
+
+int main(void)
+{
+    struct cdc_ctx *cdc[PORTS];
+    struct cdc_pool_stats stats;
+    int master[PORTS], i;
+    size_t per;
+    uint64_t misses;
+
+    CHECK(cdc_pool_get_stats(NULL) == CDC_ERROR_INVALID_PARAM);
+    for (i = 0; i < PORTS; i ++)
+    {
+        REQUIRE((cdc[i] = cdc_new()) != NULL);
+        master[i] = test_pty_open(cdc[i]);
+    }
+
+    /* stopped engines leave their buffers to the next ones */
+    REQUIRE(cdc_async_start(cdc[0], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    per = stats.used;
+    CHECK(per >= 4 * 4096 && stats.cached == 0 && stats.budget == 0);
+    for (i = 1; i < PORTS; i ++)
+        REQUIRE(cdc_async_start(cdc[i], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.used == PORTS * per && stats.high_water == PORTS * per);
+    misses = stats.misses;
+    for (i = 0; i < PORTS; i ++)
+        cdc_async_stop(cdc[i]);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.used == 0 && stats.cached == PORTS * per);
+    for (i = 0; i < PORTS; i ++)
+        REQUIRE(cdc_async_start(cdc[i], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.misses == misses && stats.hits == misses);
+    CHECK(stats.high_water == PORTS * per);
+    for (i = 0; i < PORTS; i ++)
+        cdc_async_stop(cdc[i]);
+
+    /* the budget admits two engines */
+    cdc_pool_trim();
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.used == 0 && stats.cached == 0);
+    REQUIRE(cdc_pool_set_budget(2 * per + per / 2) == CDC_SUCCESS);
+    CHECK(cdc_async_start(cdc[0], 4, 4096) == CDC_SUCCESS);
+    CHECK(cdc_async_start(cdc[1], 4, 4096) == CDC_SUCCESS);
+    CHECK(cdc_async_start(cdc[2], 4, 4096) == CDC_ERROR_NO_MEM);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.used == 2 * per && stats.failures > 0);
+    cdc_async_stop(cdc[0]);
+    cdc_async_stop(cdc[1]);
+
+    /* buffers kept for another size make room */
+    REQUIRE(cdc_pool_set_budget(per) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.cached <= per);
+    REQUIRE(cdc_async_start(cdc[0], 2, 1024) == CDC_SUCCESS);
+    cdc_async_stop(cdc[0]);
+    CHECK(cdc_async_start(cdc[1], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.used == per && stats.cached == 0);
+    cdc_async_stop(cdc[1]);
+    REQUIRE(cdc_pool_set_budget(0) == CDC_SUCCESS);
+
+    for (i = 0; i < PORTS; i ++)
+    {
+        close(master[i]);
+        cdc_free(cdc[i]);
+    }
+
+    /* the libusb backend: transfers are pooled once the device let go of them */
+    REQUIRE((cdc[0] = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc[0]) == CDC_SUCCESS);
+    REQUIRE(cdc_async_start(cdc[0], 4, 4096) == CDC_SUCCESS);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    /* the receive transfers and the one transmitting */
+    CHECK(stats.transfers_used == 4 + 1 && stats.transfers_cached == 0);
+    CHECK(usb_fake_pending_reads() == 4);
+    cdc_async_stop(cdc[0]);
+    CHECK(usb_fake_pending_reads() == 0);
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.transfers_used == 0 && stats.transfers_cached == 4 + 1);
+    REQUIRE(cdc_async_start(cdc[0], 4, 4096) == CDC_SUCCESS);
+    cdc_async_stop(cdc[0]);
+    cdc_pool_trim();
+    REQUIRE(cdc_pool_get_stats(&stats) == CDC_SUCCESS);
+    CHECK(stats.transfers_cached == 0 && stats.cached == 0);
+    CHECK(stats.transfers_high_water == 4 + 1);
+
+    cdc_usb_close(cdc[0]);
+    cdc_free(cdc[0]);
+    return test_result();
+}
@@ -0,0 +1,107 @@
+/* test_ptyd.c
+
+   cdc-ptyd, run on a pty standing in for the device: data passes both
+   ways between the device and the pty the daemon links, and a speed set
+   on that pty is applied to the port.
+
+   usage: test_ptyd <path of cdc-ptyd>
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+
+#define SIZE 20000
+
+int main(int argc, char **argv)
+{
+    static unsigned char out[SIZE], in[SIZE];
+    char dir[] = "/tmp/cdc-ptyd-XXXXXX", prefix[64], link[64], device[64];
+    struct termios tio;
+    struct stat st;
+    int master, client, slave, status, sent, done, n;
+    pid_t pid;
+    double end;
+
+    REQUIRE(argc == 2);
+    REQUIRE(mkdtemp(dir) != NULL);
+    snprintf(prefix, sizeof(prefix), "%s/tty", dir);
+    snprintf(link, sizeof(link), "%s/tty0", dir);
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    REQUIRE(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    REQUIRE(ptsname_r(master, device, sizeof(device)) == 0);
+    /* our own handle on the device's termios */
+    REQUIRE((slave = open(device, O_RDWR | O_NOCTTY | O_CLOEXEC)) >= 0);
+
+    pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0)
+    {
+        /* do not outlive a failed test */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execl(argv[1], argv[1], "-t", device, "-l", prefix, "-b", "115200", (char *)NULL);
+        _exit(127);
+    }
+
+    end = test_now() + 5;
+    while (lstat(link, &st) < 0 && test_now() < end)
+        test_sleep_ms(10);
+    REQUIRE((client = open(link, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) >= 0);
+    REQUIRE(tcgetattr(slave, &tio) == 0);
+    CHECK(cfgetospeed(&tio) == B115200);
+
+    /* device to client and back, at the same time */
+    test_pattern(out, SIZE, 5);
+    end = test_now() + 10;
+    for (sent = done = 0; done < SIZE && test_now() < end; )
+    {
+        if (sent < SIZE && (n = write(master, out + sent, SIZE - sent)) > 0)
+            sent += n;
+        done += test_fd_read(client, in + done, SIZE - done, 10);
+    }
+    CHECK(done == SIZE);
+    CHECK(memcmp(in, out, SIZE) == 0);
+
+    test_pattern(out, SIZE, 6);
+    end = test_now() + 10;
+    for (sent = done = 0; done < SIZE && test_now() < end; )
+    {
+        if (sent < SIZE && (n = write(client, out + sent, SIZE - sent)) > 0)
+            sent += n;
+        done += test_fd_read(master, in + done, SIZE - done, 10);
+    }
+    CHECK(done == SIZE);
+    CHECK(memcmp(in, out, SIZE) == 0);
+
+    /* line settings follow the client's */
+    REQUIRE(tcgetattr(client, &tio) == 0);
+    cfsetispeed(&tio, B57600);
+    cfsetospeed(&tio, B57600);
+    REQUIRE(tcsetattr(client, TCSANOW, &tio) == 0);
+    end = test_now() + 2;
+    do
+    {
+        test_sleep_ms(10);
+        REQUIRE(tcgetattr(slave, &tio) == 0);
+    }
+    while (cfgetospeed(&tio) != B57600 && test_now() < end);
+    CHECK(cfgetospeed(&tio) == B57600);
+
+    /* a clean shutdown removes the link */
+    close(client);
+    kill(pid, SIGTERM);
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    CHECK(lstat(link, &st) < 0);
+
+    close(slave);
+    close(master);
+    rmdir(dir);
+    return test_result();
+}
@@ -0,0 +1,104 @@
+/* test_queue.c
+
+   The write submission queue on a tty backed port: messages from many
+   threads at once reach the device whole and each thread's in order,
+   batched into fewer writes, and flushing and stopping wait for them.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define THREADS 8
+#define MESSAGES 10000
+
+static struct cdc_ctx *cdc;
+
+/* one producer: "<thread:sequence:padding>" */
+static void *producer(void *arg)
+{
+    static char const padding[] = "xxxxxxxxxxxxxxxxxxxxxx";
+    long id = (long)arg;
+    char msg[64];
+    int i, n;
+
+    for (i = 0; i < MESSAGES; i ++)
+    {
+        n = snprintf(msg, sizeof(msg), "<%ld:%d:%.*s>", id, i, i % 23, padding);
+        if (cdc_write_queue_submit(cdc, (unsigned char *)msg, n) != n)
+            break;
+    }
+    CHECK(i == MESSAGES);
+    return NULL;
+}
+
+int main(void)
+{
+    static char buf[1 << 16];
+    unsigned char data[1 << 12], hello[5];
+    int master, next[THREADS], messages, corrupt, len, n;
+    pthread_t threads[THREADS];
+    struct cdc_stats stats;
+    char *p, *end;
+    long id, i;
+    int seq;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_write_queue_submit(cdc, data, 10) == CDC_ERROR_INVALID_PARAM);
+    CHECK(cdc_write_queue_start(cdc, 1000, 0) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_write_queue_start(cdc, 4096, 512) == CDC_SUCCESS);
+    CHECK(cdc_write_queue_start(cdc, 4096, 512) == CDC_ERROR_BUSY);
+    CHECK(cdc_async_start(cdc, 4, 0) == CDC_ERROR_BUSY);
+    /* at most half the ring minus the record header */
+    CHECK(cdc_write_queue_submit(cdc, data, 2048) == CDC_ERROR_INVALID_PARAM);
+
+    for (i = 0; i < THREADS; i ++)
+    {
+        next[i] = 0;
+        REQUIRE(pthread_create(&threads[i], NULL, producer, (void *)i) == 0);
+    }
+
+    /* every message arrives whole, each thread's in order */
+    for (messages = corrupt = len = 0; messages < THREADS * MESSAGES && !corrupt; )
+    {
+        n = test_fd_read(master, buf + len, sizeof(buf) - len, 2000);
+        if (n == 0)
+            break;
+        len += n;
+        for (p = buf; (end = memchr(p, '>', buf + len - p)) != NULL; p = end + 1, messages ++)
+        {
+            if (*p != '<' || sscanf(p, "<%ld:%d:", &id, &seq) != 2 ||
+                id < 0 || id >= THREADS || seq != next[id])
+            {
+                corrupt = 1;
+                break;
+            }
+            next[id] ++;
+        }
+        memmove(buf, p, buf + len - p);
+        len = buf + len - p;
+    }
+    for (i = 0; i < THREADS; i ++)
+        pthread_join(threads[i], NULL);
+    CHECK(!corrupt);
+    CHECK(messages == THREADS * MESSAGES);
+    CHECK(cdc_write_queue_flush(cdc, 1000) == CDC_SUCCESS);
+
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.tx_messages == THREADS * MESSAGES);
+    CHECK(stats.tx_transfers < stats.tx_messages);
+
+    /* plain writes go through the queue, and stopping drains it */
+    test_pattern(data, sizeof(data), 11);
+    CHECK(cdc_write_data(cdc, data, 5) == 5);
+    CHECK(cdc_write_queue_stop(cdc) == CDC_SUCCESS);
+    CHECK(cdc->write_queue == NULL);
+    CHECK(test_fd_read(master, hello, sizeof(hello), 1000) == sizeof(hello));
+    CHECK(memcmp(hello, data, sizeof(hello)) == 0);
+
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
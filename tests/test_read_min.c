@@ -0,0 +1,127 @@
+/* test_read_min.c
+
+   Non-blocking reads and VMIN/VTIME style reads on a tty backed port,
+   with and without the asynchronous engine: a read collects min_bytes,
+   returns early after inter-byte silence and never waits for the first
+   byte longer than usb_read_timeout.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+/* chunks the device sends: bytes, and delay before them in ms */
+struct chunk
+{
+    int size;
+    int delay;
+};
+
+static struct chunk const *plan;
+static int master;
+
+static void *feeder(void *arg)
+{
+    struct chunk const *c;
+
+    (void)arg;
+    for (c = plan; c->size; c ++)
+    {
+        test_sleep_ms(c->delay);
+        test_fd_write(master, "abcdefghijklmnopqrstuvwxyz", c->size);
+    }
+    return NULL;
+}
+
+/* read size bytes while the device follows chunks, returning the time taken */
+static double timed_read(struct cdc_ctx *cdc, struct chunk const *chunks, int size, int *result)
+{
+    unsigned char buf[64];
+    pthread_t thread;
+    double start;
+
+    plan = chunks;
+    REQUIRE(pthread_create(&thread, NULL, feeder, NULL) == 0);
+    start = test_now();
+    *result = cdc_read_data(cdc, buf, size);
+    start = test_now() - start;
+    pthread_join(thread, NULL);
+
+    /* leave nothing for the next case */
+    test_sleep_ms(20);
+    cdc_set_nonblocking(cdc, 1);
+    while (cdc_read_data(cdc, buf, sizeof(buf)) > 0)
+        ;
+    cdc_set_nonblocking(cdc, 0);
+    return start;
+}
+
+int main(void)
+{
+    static struct chunk const none[] = { { 0, 0 } };
+    static struct chunk const split[] = { { 3, 0 }, { 4, 30 }, { 0, 0 } };
+    static struct chunk const slow[] = { { 5, 0 }, { 5, 100 }, { 0, 0 } };
+    static struct chunk const burst[] = { { 12, 0 }, { 0, 0 } };
+    static struct chunk const late[] = { { 3, 200 }, { 0, 0 } };
+    struct cdc_ctx *cdc;
+    unsigned char buf[8];
+    int result, async;
+    double t;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_set_read_min(cdc, -1, 0) == CDC_ERROR_INVALID_PARAM);
+    cdc->usb_read_timeout = 1000;
+
+    for (async = 0; async < 2; async ++)
+    {
+        if (async)
+            REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+
+        /* non-blocking: only what is there */
+        REQUIRE(cdc_set_nonblocking(cdc, 1) == CDC_SUCCESS);
+        t = test_now();
+        CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 0);
+        CHECK(test_now() - t < 0.1);
+        test_fd_write(master, "xyz", 3);
+        test_sleep_ms(20);
+        CHECK(cdc_read_data(cdc, buf, sizeof(buf)) == 3);
+        REQUIRE(cdc_set_nonblocking(cdc, 0) == CDC_SUCCESS);
+
+        /* 3 and 4 bytes 30 ms apart, then 50 ms of silence */
+        REQUIRE(cdc_set_read_min(cdc, 10, 50) == CDC_SUCCESS);
+        t = timed_read(cdc, split, 64, &result);
+        CHECK(result == 7);
+        CHECK(t >= 0.07 && t < 0.5);
+
+        /* without inter-byte timeout it waits for all 10 */
+        REQUIRE(cdc_set_read_min(cdc, 10, 0) == CDC_SUCCESS);
+        t = timed_read(cdc, slow, 64, &result);
+        CHECK(result == 10);
+        CHECK(t >= 0.09);
+
+        /* more than min_bytes at once */
+        REQUIRE(cdc_set_read_min(cdc, 10, 50) == CDC_SUCCESS);
+        t = timed_read(cdc, burst, 64, &result);
+        CHECK(result >= 10 && result <= 12);
+
+        /* the first byte may take up to usb_read_timeout */
+        t = timed_read(cdc, late, 64, &result);
+        CHECK(result == 3);
+        CHECK(t >= 0.2 && t < 0.9);
+        t = timed_read(cdc, none, 64, &result);
+        CHECK(result == CDC_ERROR_TIMEOUT);
+        CHECK(t >= 0.9);
+
+        /* never more than asked for */
+        REQUIRE(cdc_set_read_min(cdc, 10, 0) == CDC_SUCCESS);
+        timed_read(cdc, burst, 4, &result);
+        CHECK(result == 4);
+        REQUIRE(cdc_set_read_min(cdc, 0, 0) == CDC_SUCCESS);
+    }
+
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
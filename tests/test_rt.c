@@ -0,0 +1,131 @@
+/* test_rt.c
+
+   The real-time event thread on a tty backed port: replies arrive while
+   it handles all events, sleeping or busy polling, it reports delivery
+   latency and jitter, and a write from another thread is sent as soon
+   as the port takes data rather than after its next poll timeout.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define ROUNDS 500
+
+static int master;
+
+/* the device answers everything */
+static void *echo(void *arg)
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    unsigned char buf[256];
+    int n;
+
+    (void)arg;
+    pfd.fd = master;
+    while (poll(&pfd, 1, 500) > 0)
+        if ((n = read(master, buf, sizeof(buf))) > 0)
+            test_fd_write(master, buf, n);
+    return NULL;
+}
+
+/* round trips of a 16 byte command, returning how many succeeded */
+static int round_trips(struct cdc_ctx *cdc, int rounds)
+{
+    unsigned char cmd[16] = "0123456789abcdef", reply[16];
+    int i, got, n;
+
+    for (i = 0; i < rounds; i ++)
+    {
+        if (cdc_write_data(cdc, cmd, sizeof(cmd)) != sizeof(cmd))
+            break;
+        for (got = 0; got < (int)sizeof(reply); got += n)
+            if ((n = cdc_read_data(cdc, reply + got, sizeof(reply) - got)) < 0)
+                return i;
+        if (memcmp(reply, cmd, sizeof(cmd)) != 0)
+            break;
+    }
+    return i;
+}
+
+int main(void)
+{
+    static unsigned char buf[1 << 16];
+    struct cdc_rt_config config;
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    char name[64];
+    double start, worst;
+    int slave, fill, got, n, i, result;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    memset(&config, 0, sizeof(config));
+    config.cpu = -1;
+    CHECK(cdc_rt_start(cdc, &config) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 0, 4096) == CDC_SUCCESS);
+    config.cpu = -2;
+    CHECK(cdc_rt_start(cdc, &config) == CDC_ERROR_INVALID_PARAM);
+    config.cpu = -1;
+
+    /* a sleeping thread, at real-time priority where permitted */
+    config.priority = 1;
+    result = cdc_rt_start(cdc, &config);
+    CHECK(result == CDC_SUCCESS || result == CDC_ERROR_ACCESS);
+    config.priority = 0;
+    if (result != CDC_SUCCESS)
+        REQUIRE(cdc_rt_start(cdc, &config) == CDC_SUCCESS);
+    CHECK(cdc_rt_start(cdc, &config) == CDC_ERROR_BUSY);
+    REQUIRE(pthread_create(&thread, NULL, echo, NULL) == 0);
+    CHECK(round_trips(cdc, ROUNDS) == ROUNDS);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rt_latency_max > 0);
+    CHECK(stats.rt_latency_min <= stats.rt_latency_mean);
+    CHECK(stats.rt_latency_mean <= stats.rt_latency_max);
+    CHECK(stats.rt_jitter == stats.rt_latency_max - stats.rt_latency_min);
+    CHECK(cdc_rt_stop(cdc) == CDC_SUCCESS);
+
+    /* events are handled by the callers again */
+    CHECK(round_trips(cdc, 10) == 10);
+
+    /* a busy polling thread; at real-time priority it would need a CPU
+       of its own */
+    config.busy_poll = 1;
+    REQUIRE(cdc_rt_start(cdc, &config) == CDC_SUCCESS);
+    CHECK(round_trips(cdc, ROUNDS) == ROUNDS);
+    CHECK(cdc_rt_stop(cdc) == CDC_SUCCESS);
+    pthread_join(thread, NULL);
+
+    /* with the tty full and nothing in flight, a write waits for space,
+       not for the sleeping thread's next timeout */
+    config.busy_poll = 0;
+    REQUIRE(cdc_rt_start(cdc, &config) == CDC_SUCCESS);
+    REQUIRE(ptsname_r(master, name, sizeof(name)) == 0);
+    REQUIRE((slave = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) >= 0);
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0, worst = 0; i < 10; i ++)
+    {
+        test_sleep_ms(20);
+        for (fill = 0; (n = write(slave, buf, 4096)) > 0; fill += n)
+            ;
+        CHECK(cdc_write_data(cdc, buf, 100) == 100);
+        test_sleep_ms(5);
+        start = test_now();
+        for (got = 0; got < fill + 100 && test_now() - start < 1; )
+            if ((n = read(master, buf, sizeof(buf))) > 0)
+                got += n;
+        CHECK(got == fill + 100);
+        if (test_now() - start > worst)
+            worst = test_now() - start;
+    }
+    CHECK(worst < 0.05);
+    close(slave);
+
+    CHECK(cdc_rt_stop(cdc) == CDC_SUCCESS);
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,121 @@
+/* test_stamped.c
+
+   cdc_read_stamped() on the libusb backend with and without the
+   asynchronous engine, and on a tty backed port: each block comes from
+   one transfer and carries the time that transfer completed, not the
+   time of the read, and data left over by a read keeps its time.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+/* CLOCK_MONOTONIC in nanoseconds, as the blocks carry it */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* five messages of 10 to 50 bytes, 10 ms apart, each filled with its number */
+static void send_all(void)
+{
+    unsigned char msg[50];
+    int i;
+
+    for (i = 0; i < 5; i ++)
+    {
+        memset(msg, i, sizeof(msg));
+        usb_fake_send(msg, 10 * (i + 1), i ? 10000 : 0);
+    }
+}
+
+int main(void)
+{
+    unsigned char buf[256];
+    struct cdc_message blocks[8];
+    struct cdc_ctx *cdc;
+    uint64_t start, t;
+    int master, i, n, offset;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    cdc->usb_read_timeout = 1000;
+    CHECK(cdc_read_stamped(cdc, buf, sizeof(buf), NULL, 1) == CDC_ERROR_INVALID_PARAM);
+
+    /* without the engine: stamped on return, the rest keeps the stamp */
+    send_all();
+    n = cdc_read_stamped(cdc, buf, 5, blocks, 8);
+    t = now_ns();
+    CHECK(n == 1 && blocks[0].len == 5 && blocks[0].offset == 0);
+    CHECK(blocks[0].time <= t && t - blocks[0].time < 5000000);
+    start = blocks[0].time;
+    test_sleep_ms(10);
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8);
+    CHECK(n == 1 && blocks[0].len == 5);
+    CHECK(blocks[0].time - start + 1000000 < 2000000);
+    while (cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8) == 1 && buf[0] != 4)
+        ;
+
+    /* the engine stamps each transfer as it completes */
+    REQUIRE(cdc_async_start(cdc, 8, 64) == CDC_SUCCESS);
+    start = now_ns();
+    send_all();
+    while (now_ns() - start < 60000000)
+        CHECK(cdc_handle_events(cdc, 1) == CDC_SUCCESS);
+    test_sleep_ms(30);
+    t = now_ns();
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8);
+    CHECK(n == 5);
+    for (i = offset = 0; i < n; offset += blocks[i ++].len)
+    {
+        CHECK(blocks[i].offset == offset && blocks[i].len == 10 * (i + 1));
+        CHECK(buf[offset] == i && buf[offset + blocks[i].len - 1] == i);
+        CHECK(blocks[i].time + 1000000 >= start + i * 10000000ull &&
+              blocks[i].time < start + i * 10000000ull + 8000000);
+    }
+    CHECK(t - blocks[4].time >= 30000000);
+
+    /* at most count blocks, and no more than fits */
+    start = now_ns();
+    send_all();
+    while (now_ns() - start < 60000000)
+        CHECK(cdc_handle_events(cdc, 1) == CDC_SUCCESS);
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 2);
+    CHECK(n == 2 && blocks[1].len == 20);
+    n = cdc_read_stamped(cdc, buf, 40, blocks, 8);
+    CHECK(n == 2 && blocks[0].len == 30 && blocks[1].len == 10);
+    t = blocks[1].time;
+    REQUIRE(cdc_set_nonblocking(cdc, 1) == CDC_SUCCESS);
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8);
+    CHECK(n == 2 && blocks[0].len == 30 && blocks[1].len == 50);
+    CHECK(blocks[0].time == t && blocks[1].time > t);
+    CHECK(cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8) == 0);
+
+    cdc_async_stop(cdc);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+
+    /* a tty is stamped when read, by the engine if one runs */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    test_fd_write(master, "hello", 5);
+    test_sleep_ms(20);
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8);
+    CHECK(n == 1 && blocks[0].len == 5 && now_ns() - blocks[0].time < 5000000);
+    REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+    test_fd_write(master, "world", 5);
+    for (i = 0; i < 10; i ++)
+        CHECK(cdc_handle_events(cdc, 1) == CDC_SUCCESS);
+    test_sleep_ms(30);
+    n = cdc_read_stamped(cdc, buf, sizeof(buf), blocks, 8);
+    CHECK(n == 1 && blocks[0].len == 5 && now_ns() - blocks[0].time >= 30000000);
+    CHECK(memcmp(buf, "world", 5) == 0);
+
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
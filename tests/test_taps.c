@@ -0,0 +1,208 @@
+/* test_taps.c
+
+   Traffic taps on a tty backed port and on the libusb backend, with and
+   without the asynchronous engine: a tap sees what was sent and received
+   in its directions, in order and stamped, drops and counts what does not
+   fit instead of holding the port back, and taps come and go while the
+   port is busy.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+#include "usb_fake.h"
+
+static int master;
+static volatile int stop;
+
+/* totals of a tap's records, checking their bytes and stamps */
+struct seen
+{
+    int rx, tx, records, bad;
+    /* directions of the records in order, run lengths merged */
+    char order[16];
+};
+
+static void drain_tap(struct cdc_tap *tap, struct seen *seen)
+{
+    unsigned char buf[2048];
+    struct cdc_tap_record record;
+    uint64_t last = 0;
+    int n, i, len;
+
+    memset(seen, 0, sizeof(*seen));
+    while ((n = cdc_tap_read(tap, buf, sizeof(buf), &record, 0)) > 0)
+    {
+        char c = record.direction == CDC_TAP_RX ? 'r' : 't';
+        seen->records ++;
+        if (record.direction == CDC_TAP_RX)
+            seen->rx += n;
+        else
+            seen->tx += n;
+        for (i = 0; i < n; i ++)
+            seen->bad += buf[i] != (record.direction == CDC_TAP_RX ? 'h' : 'a');
+        seen->bad += record.len != n || record.time < last;
+        last = record.time;
+        len = strlen(seen->order);
+        if ((len == 0 || seen->order[len - 1] != c) && len < (int)sizeof(seen->order) - 1)
+            seen->order[len] = c;
+    }
+}
+
+/* a reader draining a tap while the port is busy */
+static void *tap_reader(void *arg)
+{
+    struct cdc_tap_record record;
+    unsigned char buf[64];
+    long got = 0;
+    int n;
+
+    while (!stop)
+        if ((n = cdc_tap_read(arg, buf, sizeof(buf), &record, 10)) > 0)
+            got += record.len;
+    while ((n = cdc_tap_read(arg, buf, sizeof(buf), &record, 0)) > 0)
+        got += record.len;
+    return (void *)got;
+}
+
+/* take the len bytes written off the line */
+static void settle(struct cdc_ctx *cdc, int async, int len)
+{
+    unsigned char buf[1024];
+    double end = test_now() + 1;
+    int got = 0;
+
+    while (got < len && test_now() < end)
+    {
+        if (async)
+            cdc_handle_events(cdc, 1);
+        got += test_fd_read(master, buf, len - got, 1);
+    }
+    CHECK(got == len);
+}
+
+static void tty_taps(int async)
+{
+    static unsigned char buf[2048];
+    struct cdc_tap *both, *rx, *small, *extra;
+    struct cdc_tap_stats stats;
+    struct cdc_ctx *cdc;
+    struct seen seen;
+    pthread_t thread;
+    void *got;
+    int i;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    cdc->usb_read_timeout = 200;
+    if (async)
+        REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+    CHECK(cdc_tap_attach(cdc, 0, 4096) == NULL);
+    CHECK(cdc_tap_attach(cdc, CDC_TAP_RX, 100) == NULL);
+    REQUIRE((both = cdc_tap_attach(cdc, CDC_TAP_RX | CDC_TAP_TX, 4096)) != NULL);
+    REQUIRE((rx = cdc_tap_attach(cdc, CDC_TAP_RX, 4096)) != NULL);
+    REQUIRE((small = cdc_tap_attach(cdc, CDC_TAP_TX, 256)) != NULL);
+
+    memset(buf, 'a', sizeof(buf));
+    CHECK(cdc_write_data(cdc, buf, 100) == 100);
+    settle(cdc, async, 100);
+    test_fd_write(master, "hhhhh", 5);
+    CHECK(cdc_read_data(cdc, buf, 64) == 5);
+    memset(buf, 'a', sizeof(buf));
+    CHECK(cdc_write_data(cdc, buf, 1000) == 1000);
+    settle(cdc, async, 1000);
+
+    /* everything, in order */
+    drain_tap(both, &seen);
+    CHECK(seen.tx == 1100 && seen.rx == 5 && seen.bad == 0);
+    CHECK(strcmp(seen.order, "trt") == 0);
+    CHECK(cdc_tap_get_stats(both, &stats) == CDC_SUCCESS);
+    CHECK(stats.records == (uint64_t)seen.records && stats.bytes == 1105);
+    CHECK(stats.dropped_records == 0 && stats.lag_bytes == 0);
+
+    /* one direction */
+    drain_tap(rx, &seen);
+    CHECK(seen.tx == 0 && seen.rx == 5 && seen.bad == 0);
+
+    /* a small ring splits chunks and drops what does not fit */
+    drain_tap(small, &seen);
+    CHECK(cdc_tap_get_stats(small, &stats) == CDC_SUCCESS);
+    CHECK(seen.tx == (int)stats.bytes && seen.bad == 0);
+    CHECK(stats.dropped_records > 0 && stats.bytes + stats.dropped_bytes == 1100);
+    cdc_tap_detach(small);
+
+    /* taps come and go while the port is busy and another is read */
+    stop = 0;
+    REQUIRE(pthread_create(&thread, NULL, tap_reader, both) == 0);
+    for (i = 0; i < 200; i ++)
+    {
+        REQUIRE((extra = cdc_tap_attach(cdc, CDC_TAP_TX, 512)) != NULL);
+        CHECK(cdc_write_data(cdc, buf, 64) == 64);
+        settle(cdc, async, 64);
+        cdc_tap_detach(extra);
+    }
+    stop = 1;
+    pthread_join(thread, &got);
+    CHECK(cdc_tap_get_stats(both, &stats) == CDC_SUCCESS);
+    /* a reader falling behind loses records, never bytes of them */
+    CHECK((long)got == (long)stats.bytes - 1105);
+    CHECK(stats.bytes + stats.dropped_bytes == 1105 + 200 * 64);
+
+    /* the port frees the taps left */
+    if (async)
+        cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+}
+
+static void usb_taps(int async)
+{
+    unsigned char buf[256], msg[50];
+    struct cdc_tap *tap;
+    struct cdc_ctx *cdc;
+    struct seen seen;
+    int i, got, n;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    cdc->usb_read_timeout = 200;
+    REQUIRE((tap = cdc_tap_attach(cdc, CDC_TAP_RX | CDC_TAP_TX, 4096)) != NULL);
+    if (async)
+        REQUIRE(cdc_async_start(cdc, 8, 64) == CDC_SUCCESS);
+    memset(msg, 'h', sizeof(msg));
+    for (i = 1; i <= 5; i ++)
+        usb_fake_send(msg, 10 * i, 0);
+    for (got = i = 0; i < 5; i ++)
+        if ((n = cdc_read_message(cdc, buf, sizeof(buf))) > 0)
+            got += n;
+    CHECK(got == 150);
+    memset(buf, 'a', sizeof(buf));
+    CHECK(cdc_write_data(cdc, buf, 77) == 77);
+    for (i = 0; async && i < 20; i ++)
+        cdc_handle_events(cdc, 1);
+
+    drain_tap(tap, &seen);
+    CHECK(seen.rx == 150 && seen.tx == 77 && seen.bad == 0);
+    /* the engine sends in transfers of its 64 byte buffers */
+    CHECK(seen.records == 5 + (async ? 2 : 1) && strcmp(seen.order, "rt") == 0);
+    CHECK(usb_fake_received(buf, sizeof(buf)) == 77);
+
+    if (async)
+        cdc_async_stop(cdc);
+    cdc_tap_detach(tap);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+}
+
+int main(void)
+{
+    int async;
+
+    for (async = 0; async < 2; async ++)
+    {
+        tty_taps(async);
+        usb_taps(async);
+    }
+    return test_result();
+}
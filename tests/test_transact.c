@@ -0,0 +1,116 @@
+/* test_transact.c
+
+   cdc_transact() against an echoing device, on the libusb backend and on
+   a tty backed port with and without the asynchronous engine: responses
+   end at the terminator or at a fixed length, and bytes after them, or of
+   a response that timed out, are kept for the next read.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+#include "usb_fake.h"
+
+static int master;
+static volatile int stop;
+
+/* the device answers everything */
+static void *echo(void *arg)
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    unsigned char buf[256];
+    int n;
+
+    (void)arg;
+    pfd.fd = master;
+    while (!stop)
+        if (poll(&pfd, 1, 10) > 0 && (n = read(master, buf, sizeof(buf))) > 0)
+            test_fd_write(master, buf, n);
+    return NULL;
+}
+
+/* what arrived but was not taken yet */
+static int leftover(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    int n;
+
+    test_sleep_ms(20);
+    cdc_set_nonblocking(cdc, 1);
+    n = cdc_read_data(cdc, buf, size);
+    cdc_set_nonblocking(cdc, 0);
+    return n;
+}
+
+static void transactions(struct cdc_ctx *cdc)
+{
+    unsigned char resp[256], req[100];
+    double start;
+    int i, n;
+
+    n = cdc_transact(cdc, (unsigned char const *)"hello\nworld", 11, resp, sizeof(resp), '\n', 500);
+    CHECK(n == 6 && memcmp(resp, "hello\n", 6) == 0);
+    n = leftover(cdc, resp, sizeof(resp));
+    CHECK(n == 5 && memcmp(resp, "world", 5) == 0);
+
+    for (i = 0; i < (int)sizeof(req); i ++)
+        req[i] = i;
+    n = cdc_transact(cdc, req, sizeof(req), resp, sizeof(req), CDC_TRANSACT_LENGTH, 500);
+    CHECK(n == sizeof(req) && memcmp(resp, req, sizeof(req)) == 0);
+
+    /* no terminator: the partial response stays */
+    start = test_now();
+    n = cdc_transact(cdc, (unsigned char const *)"abc", 3, resp, sizeof(resp), 'Z', 50);
+    CHECK(n == CDC_ERROR_TIMEOUT);
+    CHECK(test_now() - start >= 0.045 && test_now() - start < 0.5);
+    n = leftover(cdc, resp, sizeof(resp));
+    CHECK(n == 3 && memcmp(resp, "abc", 3) == 0);
+
+    /* a full buffer ends the response, the rest comes next */
+    n = cdc_transact(cdc, (unsigned char const *)"12345", 5, resp, 3, '\n', 500);
+    CHECK(n == 3 && memcmp(resp, "123", 3) == 0);
+    n = cdc_transact(cdc, (unsigned char const *)"x\n", 2, resp, sizeof(resp), '\n', 500);
+    CHECK(n == 4 && memcmp(resp, "45x\n", 4) == 0);
+
+    for (i = 0; i < 200; i ++)
+        if (cdc_transact(cdc, (unsigned char const *)"ping\n", 5, resp, sizeof(resp), '\n', 500) != 5)
+            break;
+    CHECK(i == 200);
+}
+
+int main(void)
+{
+    unsigned char resp[8];
+    struct cdc_ctx *cdc;
+    pthread_t thread;
+    int async;
+
+    /* the libusb backend, the fake device looping writes back */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    CHECK(cdc_transact(cdc, NULL, 0, resp, sizeof(resp), '\n', 10) == CDC_ERROR_NO_DEVICE);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    CHECK(cdc_transact(cdc, NULL, 0, resp, sizeof(resp), 256, 10) == CDC_ERROR_INVALID_PARAM);
+    usb_fake_set_loopback(1);
+    transactions(cdc);
+    /* the read was posted before the request went out */
+    CHECK(usb_fake_reads_at_write() > 0);
+    usb_fake_set_loopback(0);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+
+    for (async = 0; async < 2; async ++)
+    {
+        REQUIRE((cdc = cdc_new()) != NULL);
+        master = test_pty_open(cdc);
+        if (async)
+            REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+        stop = 0;
+        REQUIRE(pthread_create(&thread, NULL, echo, NULL) == 0);
+        transactions(cdc);
+        stop = 1;
+        pthread_join(thread, NULL);
+        close(master);
+        cdc_free(cdc);
+    }
+    return test_result();
+}
@@ -0,0 +1,94 @@
+/* test_tty_backend.c
+
+   The kernel tty backend behind the usual API: data both ways, the line
+   coding, including rates without a B* constant, reopening and hangup.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <dirent.h>
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+static int count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int count = 0;
+    REQUIRE(dir != NULL);
+    while (readdir(dir) != NULL)
+        count ++;
+    closedir(dir);
+    return count;
+}
+
+int main(void)
+{
+    static int const rates[] = { 115200, 250000, 31250, 1234567 };
+    unsigned char out[1000], in[1000];
+    struct termios2 tio;
+    struct cdc_ctx *cdc;
+    int master, done, fds, i;
+    char name[64];
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    /* libusb stays the default, the kernel driver is only used on request */
+    CHECK(cdc->module_detach_mode == AUTO_DETACH_CDC_MODULE);
+
+    master = test_pty_open(cdc);
+    CHECK(cdc->line_baudrate == 9600);
+    CHECK(cdc->line_bits == BITS_8);
+    CHECK(cdc->line_sbit == STOP_BIT_1);
+    CHECK(cdc->line_parity == NONE);
+
+    /* device to host */
+    test_pattern(out, sizeof(out), 1);
+    test_fd_write(master, out, sizeof(out));
+    for (done = 0; done < (int)sizeof(in); done += i)
+    {
+        i = cdc_read_data(cdc, in + done, sizeof(in) - done);
+        REQUIRE(i >= 0);
+    }
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    /* host to device */
+    test_pattern(out, sizeof(out), 2);
+    CHECK(cdc_write_data(cdc, out, sizeof(out)) == sizeof(out));
+    CHECK(test_fd_read(master, in, sizeof(in), 1000) == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    /* nothing to read */
+    cdc->usb_read_timeout = 50;
+    CHECK(cdc_read_data(cdc, in, sizeof(in)) == CDC_ERROR_TIMEOUT);
+
+    /* any baud rate reaches the tty, the settings termios lacks are refused */
+    for (i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])); i ++)
+    {
+        CHECK(cdc_set_line_coding(cdc, rates[i], BITS_7, STOP_BIT_2, EVEN) == CDC_SUCCESS);
+        REQUIRE(ioctl(cdc->tty_fd, TCGETS2, &tio) == 0);
+        CHECK(tio.c_ospeed == (speed_t)rates[i]);
+        CHECK(tio.c_ispeed == (speed_t)rates[i]);
+        /* a pty keeps 8 bits without parity whatever it is told */
+        CHECK(tio.c_cflag & CSTOPB);
+        CHECK(cdc->line_baudrate == rates[i]);
+    }
+    CHECK(cdc_set_line_coding(cdc, 9600, BITS_8, STOP_BIT_15, NONE) == CDC_ERROR_NOT_SUPPORTED);
+    CHECK(cdc_set_line_coding(cdc, 9600, BITS_16, STOP_BIT_1, NONE) == CDC_ERROR_NOT_SUPPORTED);
+    CHECK(cdc_set_line_coding(cdc, 0, BITS_8, STOP_BIT_1, NONE) == CDC_ERROR_INVALID_PARAM);
+
+    /* opening again closes the previous tty */
+    REQUIRE(ptsname_r(master, name, sizeof(name)) == 0);
+    fds = count_fds();
+    CHECK(cdc_tty_open(cdc, name) == CDC_SUCCESS);
+    CHECK(count_fds() == fds);
+    CHECK(cdc->line_baudrate == 9600);
+
+    /* the device goes away */
+    close(master);
+    CHECK(cdc_read_data(cdc, in, sizeof(in)) < 0);
+
+    CHECK(cdc_usb_close(cdc) == CDC_SUCCESS);
+    CHECK(cdc->tty_fd < 0);
+    cdc_free(cdc);
+    return test_result();
+}
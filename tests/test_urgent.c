@@ -0,0 +1,63 @@
+/* test_urgent.c
+
+   The urgent lane of the write submission queue on a tty backed port:
+   urgent messages overtake bulk messages not yet handed to the port, keep
+   their own order and leave the bulk messages whole and in order.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+
+#define MESSAGES 14
+#define MESSAGE 4000
+#define TOTAL (MESSAGES * MESSAGE + 4)
+
+int main(void)
+{
+    static unsigned char buf[TOTAL], bulk[MESSAGES * MESSAGE], msg[MESSAGE];
+    unsigned char *first, *second;
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    int master, i;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_write_queue_submit_urgent(cdc, (unsigned char const *)"!", 1) < 0);
+    REQUIRE(cdc_write_queue_start(cdc, 0, 1024) == CDC_SUCCESS);
+    CHECK(cdc_write_queue_submit_urgent(cdc, msg, 2041) == CDC_ERROR_INVALID_PARAM);
+    CHECK(cdc_write_queue_submit_urgent(cdc, msg, 0) == CDC_ERROR_INVALID_PARAM);
+
+    /* nobody reads, so the bulk messages back up behind the pty */
+    for (i = 0; i < MESSAGES; i ++)
+    {
+        memset(bulk + i * MESSAGE, 'a' + i, MESSAGE);
+        REQUIRE(cdc_write_queue_submit(cdc, bulk + i * MESSAGE, MESSAGE) == MESSAGE);
+    }
+    test_sleep_ms(20);
+    CHECK(cdc_write_queue_submit_urgent(cdc, (unsigned char const *)"!1", 2) == 2);
+    CHECK(cdc_write_queue_submit_urgent(cdc, (unsigned char const *)"!2", 2) == 2);
+
+    CHECK(test_fd_read(master, buf, TOTAL, 5000) == TOTAL);
+    CHECK(cdc_write_queue_flush(cdc, 1000) == CDC_SUCCESS);
+
+    /* ahead of the backlog, in order */
+    REQUIRE((first = memchr(buf, '!', TOTAL)) != NULL);
+    REQUIRE((second = memchr(first + 1, '!', buf + TOTAL - first - 1)) != NULL);
+    CHECK(first[1] == '1' && second[1] == '2');
+    CHECK(second - buf < TOTAL - 2 * MESSAGE);
+
+    /* the bulk messages are intact around them */
+    memmove(second, second + 2, buf + TOTAL - second - 2);
+    memmove(first, first + 2, buf + TOTAL - first - 2);
+    CHECK(memcmp(buf, bulk, sizeof(bulk)) == 0);
+
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.tx_urgent == 2);
+    CHECK(stats.tx_messages == MESSAGES + 2);
+
+    CHECK(cdc_write_queue_stop(cdc) == CDC_SUCCESS);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,149 @@
+/* test_uring.c
+
+   The io_uring engine: the reads and writes of many tty backed ports are
+   batched into one io_uring_enter() per cdc_uring_run(), and every port
+   gets its own data back.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+
+#define PORTS 8
+#define SIZE 20000
+
+struct port
+{
+    struct cdc_ctx *cdc;
+    int master;
+    unsigned char out[SIZE];
+    unsigned char in[SIZE];
+    int received;
+    int failed;
+};
+
+static struct port ports[PORTS];
+
+static void on_rx(struct cdc_ctx *cdc, unsigned char *buf, int len, void *user_data)
+{
+    struct port *port = user_data;
+
+    CHECK(cdc == port->cdc);
+    if (len < 0)
+    {
+        port->failed = len;
+        return;
+    }
+    CHECK(port->received + len <= SIZE);
+    if (port->received + len <= SIZE)
+        memcpy(port->in + port->received, buf, len);
+    port->received += len;
+}
+
+int main(void)
+{
+    struct cdc_uring_stats stats;
+    struct cdc_uring *ring;
+    int i, runs, left, sent[PORTS] = { 0 };
+    double end;
+
+    ring = cdc_uring_new(PORTS, 4096);
+    if (ring == NULL)
+    {
+        fprintf(stderr, "io_uring is not available\n");
+        return TEST_SKIP;
+    }
+
+    for (i = 0; i < PORTS; i ++)
+    {
+        REQUIRE((ports[i].cdc = cdc_new()) != NULL);
+        ports[i].master = test_pty_open(ports[i].cdc);
+        test_pattern(ports[i].out, SIZE, i);
+        CHECK(cdc_uring_add(ring, ports[i].cdc, on_rx, &ports[i]) == CDC_SUCCESS);
+    }
+    /* a port that is not tty backed cannot be added */
+    {
+        struct cdc_ctx *usb = cdc_new();
+        CHECK(cdc_uring_add(ring, usb, on_rx, NULL) < 0);
+        cdc_free(usb);
+    }
+
+    /* device to host on all ports at once */
+    end = test_now() + 5;
+    for (runs = 0; test_now() < end; runs ++)
+    {
+        for (i = left = 0; i < PORTS; i ++)
+        {
+            int n = write(ports[i].master, ports[i].out + sent[i], SIZE - sent[i]);
+            if (n > 0)
+                sent[i] += n;
+            left += ports[i].received < SIZE;
+        }
+        if (!left)
+            break;
+        REQUIRE(cdc_uring_run(ring, 100) >= 0);
+    }
+    for (i = 0; i < PORTS; i ++)
+    {
+        CHECK(ports[i].received == SIZE);
+        CHECK(memcmp(ports[i].in, ports[i].out, SIZE) == 0);
+        CHECK(ports[i].failed == 0);
+    }
+    REQUIRE(cdc_uring_get_stats(ring, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_bytes == (uint64_t)PORTS * SIZE);
+    /* one system call per run, each handling the completions of several ports */
+    CHECK(stats.syscalls <= (uint64_t)runs);
+    CHECK(stats.completions > stats.syscalls);
+
+    /* host to device, in pieces larger than the buffer */
+    for (i = 0; i < PORTS; i ++)
+    {
+        test_pattern(ports[i].out, SIZE, 100 + i);
+        ports[i].received = sent[i] = 0;
+    }
+    end = test_now() + 5;
+    while (test_now() < end)
+    {
+        for (i = left = 0; i < PORTS; i ++)
+        {
+            int n;
+            if (sent[i] < SIZE)
+            {
+                n = cdc_uring_write(ring, ports[i].cdc, ports[i].out + sent[i], SIZE - sent[i]);
+                CHECK(n >= 0);
+                if (n > 0)
+                    sent[i] += n;
+            }
+            n = read(ports[i].master, ports[i].in + ports[i].received, SIZE - ports[i].received);
+            if (n > 0)
+                ports[i].received += n;
+            left += ports[i].received < SIZE;
+        }
+        if (!left)
+            break;
+        REQUIRE(cdc_uring_run(ring, 10) >= 0);
+    }
+    for (i = 0; i < PORTS; i ++)
+    {
+        CHECK(ports[i].received == SIZE);
+        CHECK(memcmp(ports[i].in, ports[i].out, SIZE) == 0);
+    }
+    REQUIRE(cdc_uring_get_stats(ring, &stats) == CDC_SUCCESS);
+    CHECK(stats.tx_bytes == (uint64_t)PORTS * SIZE);
+
+    /* a hangup is reported once */
+    close(ports[0].master);
+    end = test_now() + 2;
+    while (!ports[0].failed && test_now() < end)
+        REQUIRE(cdc_uring_run(ring, 100) >= 0);
+    CHECK(ports[0].failed == CDC_ERROR_NO_DEVICE);
+
+    cdc_uring_free(ring);
+    for (i = 0; i < PORTS; i ++)
+    {
+        if (i)
+            close(ports[i].master);
+        cdc_free(ports[i].cdc);
+    }
+    return test_result();
+}
@@ -0,0 +1,141 @@
+/* test_util.h
+
+   Checks and helpers shared by the tests
+
+   Every test is a program that exits with EXIT_SUCCESS when all of its
+   checks passed, and with TEST_SKIP when the system lacks something it
+   needs.  Tty backed ports are tested against the slave side of a pseudo
+   terminal, whose master plays the device.  <termios.h> is left out, so
+   that tests can use the kernel's termios2 instead.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cdc.h>
+
+/* exit code of a test that cannot run here, see SKIP_RETURN_CODE */
+#define TEST_SKIP 77
+
+static int test_failures;
+
+/* report a failed check and carry on */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures ++; \
+        } \
+    } while (0)
+
+/* report a failed check and give up, for checks later ones depend on */
+#define REQUIRE(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: requirement failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static inline int test_result(void)
+{
+    if (test_failures)
+        fprintf(stderr, "%d checks failed\n", test_failures);
+    return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* CLOCK_MONOTONIC in seconds */
+static inline double test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void test_sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* open cdc on the slave side of a new pty and return its non-blocking master */
+static inline int test_pty_open(struct cdc_ctx *cdc)
+{
+    char errbuf[256], name[64];
+    int master;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    REQUIRE(master >= 0);
+    REQUIRE(grantpt(master) == 0 && unlockpt(master) == 0);
+    REQUIRE(ptsname_r(master, name, sizeof(name)) == 0);
+    if (cdc_tty_open(cdc, name) < 0)
+    {
+        fprintf(stderr, "unable to open %s: %s\n", name, cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+        exit(EXIT_FAILURE);
+    }
+    return master;
+}
+
+/* write all of buf to a non-blocking fd */
+static inline void test_fd_write(int fd, void const *buf, int size)
+{
+    unsigned char const *p = buf;
+    while (size > 0)
+    {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno != EAGAIN)
+            REQUIRE(!"write");
+        if (n > 0)
+        {
+            p += n;
+            size -= n;
+        }
+        else
+            poll(&pfd, 1, 100);
+    }
+}
+
+/* read up to size bytes from a non-blocking fd, waiting at most timeout_ms */
+static inline int test_fd_read(int fd, void *buf, int size, int timeout_ms)
+{
+    double end = test_now() + timeout_ms / 1e3;
+    unsigned char *p = buf;
+    int done = 0;
+    while (done < size)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int left = (end - test_now()) * 1e3;
+        ssize_t n = read(fd, p + done, size - done);
+        if (n > 0)
+        {
+            done += n;
+            continue;
+        }
+        if (left <= 0 || (n < 0 && errno != EAGAIN))
+            break;
+        poll(&pfd, 1, left);
+    }
+    return done;
+}
+
+/* bytes of a pattern that shows misordered or lost data */
+static inline void test_pattern(unsigned char *buf, int size, int seed)
+{
+    int i;
+    for (i = 0; i < size; i ++)
+        buf[i] = (unsigned char)(seed + i * 7 + i / 251);
+}
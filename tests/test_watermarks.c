@@ -0,0 +1,169 @@
+/* test_watermarks.c
+
+   Watermarks of the received data waiting for the reader, on the libusb
+   backend and on a tty backed port: at the high watermark the engine
+   stops receiving, so the device holds back and nothing is lost, or keeps
+   receiving and discards the oldest or the newest data, and the callback
+   hears of the high and the low watermark.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include "usb_fake.h"
+
+/* the device sends MESSAGES short packets of SIZE bytes, each one filled with its number */
+#define MESSAGES 40
+#define SIZE 63
+#define TOTAL (MESSAGES * SIZE)
+
+static int highs, lows, last_buffered;
+
+static void on_mark(struct cdc_ctx *cdc, int above, int buffered, void *user_data)
+{
+    (void)cdc;
+    (void)user_data;
+    if (above)
+        highs ++;
+    else
+        lows ++;
+    last_buffered = buffered;
+}
+
+static void pump(struct cdc_ctx *cdc)
+{
+    int i;
+
+    for (i = 0; i < 4 * MESSAGES; i ++)
+        CHECK(cdc_handle_events(cdc, 0) == CDC_SUCCESS);
+}
+
+/* take all that waits for the reader, without waiting for more */
+static int drain(struct cdc_ctx *cdc, unsigned char *buf, int size)
+{
+    unsigned char *data;
+    int n, got = 0;
+
+    while ((n = cdc_rx_peek(cdc, &data)) > 0 && got + n <= size)
+    {
+        memcpy(buf + got, data, n);
+        got += n;
+        REQUIRE(cdc_rx_consume(cdc, n) == CDC_SUCCESS);
+    }
+    return got;
+}
+
+/* whether buf holds whole messages counting up from first */
+static int in_order(unsigned char const *buf, int size, int first)
+{
+    int i;
+
+    for (i = 0; i < size; i ++)
+        if (buf[i] != first + i / SIZE)
+            return 0;
+    return size % SIZE == 0;
+}
+
+static void usb_policy(enum cdc_overflow_policy policy)
+{
+    static unsigned char buf[TOTAL], msg[SIZE];
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    int i, got, total;
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    REQUIRE(usb_fake_open(cdc) == CDC_SUCCESS);
+    CHECK(cdc_rx_set_watermarks(cdc, 256, 64, policy) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 8, 64) == CDC_SUCCESS);
+    CHECK(cdc_rx_set_watermarks(cdc, 256, 512, policy) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_rx_set_watermarks(cdc, 256, 64, policy) == CDC_SUCCESS);
+    REQUIRE(cdc_rx_set_watermark_callback(cdc, on_mark, NULL) == CDC_SUCCESS);
+    highs = lows = last_buffered = 0;
+
+    for (i = 0; i < MESSAGES; i ++)
+    {
+        memset(msg, i, sizeof(msg));
+        usb_fake_send(msg, sizeof(msg), 0);
+    }
+    pump(cdc);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(highs == 1 && last_buffered >= 256 - SIZE);
+
+    if (policy == CDC_OVERFLOW_BLOCK)
+    {
+        /* the device is left without transfers and keeps the rest */
+        CHECK(usb_fake_pending_reads() == 0);
+        CHECK(stats.rx_overruns == 0 && stats.rx_pauses >= 1);
+        got = drain(cdc, buf, sizeof(buf));
+        CHECK(got >= 256 && got <= 256 + 8 * SIZE);
+        CHECK(lows == 1);
+
+        /* and sends it once the reader caught up */
+        for (total = got, i = 0; total < TOTAL && i < MESSAGES; i ++)
+        {
+            pump(cdc);
+            total += drain(cdc, buf + total, sizeof(buf) - total);
+        }
+        CHECK(total == TOTAL && in_order(buf, TOTAL, 0));
+    }
+    else
+    {
+        got = drain(cdc, buf, sizeof(buf));
+        CHECK(stats.rx_overruns > 0);
+        CHECK(stats.rx_overrun_bytes == stats.rx_overruns * SIZE);
+        CHECK(got + stats.rx_overrun_bytes == TOTAL);
+        CHECK(got < 256 + 8 * SIZE);
+        CHECK(lows == 1);
+        if (policy == CDC_OVERFLOW_DROP_OLDEST)
+            CHECK(in_order(buf, got, MESSAGES - got / SIZE));
+        else
+            CHECK(in_order(buf, got, 0));
+    }
+
+    cdc_async_stop(cdc);
+    cdc_usb_close(cdc);
+    cdc_free(cdc);
+}
+
+int main(void)
+{
+    static unsigned char buf[TOTAL];
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    int master, i, got;
+
+    usb_policy(CDC_OVERFLOW_BLOCK);
+    usb_policy(CDC_OVERFLOW_DROP_OLDEST);
+    usb_policy(CDC_OVERFLOW_DROP_NEWEST);
+
+    /* a tty backed port blocks by leaving the data with the tty */
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    REQUIRE(cdc_async_start(cdc, 8, 64) == CDC_SUCCESS);
+    REQUIRE(cdc_rx_set_watermarks(cdc, 256, 64, CDC_OVERFLOW_BLOCK) == CDC_SUCCESS);
+    for (i = 0; i < MESSAGES; i ++)
+    {
+        memset(buf + i * SIZE, i, SIZE);
+        test_fd_write(master, buf + i * SIZE, SIZE);
+    }
+    test_sleep_ms(20);
+    pump(cdc);
+    got = drain(cdc, buf, sizeof(buf));
+    CHECK(got >= 256 && got < TOTAL);
+    while (got < TOTAL && cdc_handle_events(cdc, 100) == CDC_SUCCESS)
+    {
+        pump(cdc);
+        i = drain(cdc, buf + got, sizeof(buf) - got);
+        if (i == 0)
+            break;
+        got += i;
+    }
+    CHECK(got == TOTAL && in_order(buf, TOTAL, 0));
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.rx_overruns == 0 && stats.rx_pauses >= 1);
+
+    cdc_async_stop(cdc);
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
@@ -0,0 +1,142 @@
+/* test_write_at.c
+
+   Scheduled writes of cdc_write_at() on a tty backed port, sent from
+   cdc_handle_events() and from the real-time event thread: they go out
+   in deadline order, not before their deadline and not much after it,
+   those past due at once, and each is reported to the callback and in
+   the stats.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include "test_util.h"
+#include <pthread.h>
+
+#define WRITES 12
+
+static int master;
+static volatile int stop;
+static unsigned char seen[WRITES + 1];
+static double seen_at[WRITES + 1];
+static int nseen;
+static int calls;
+static uint64_t worst;
+
+/* the device notes when each byte arrives */
+static void *sink(void *arg)
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    unsigned char buf[16];
+    int i, n;
+
+    (void)arg;
+    pfd.fd = master;
+    while (!stop)
+        if (poll(&pfd, 1, 10) > 0 && (n = read(master, buf, sizeof(buf))) > 0)
+            for (i = 0; i < n && nseen <= WRITES; i ++, nseen ++)
+            {
+                seen[nseen] = buf[i];
+                seen_at[nseen] = test_now();
+            }
+    return NULL;
+}
+
+static void on_write(struct cdc_ctx *cdc, uint64_t when, uint64_t lateness, void *user_data)
+{
+    (void)cdc;
+    (void)when;
+    *(int *)user_data += 1;
+    if (lateness > worst)
+        worst = lateness;
+}
+
+/* CLOCK_MONOTONIC in nanoseconds, as cdc_write_at() takes it */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void schedule(struct cdc_ctx *cdc, int rt)
+{
+    static int const order[10] = { 5, 2, 9, 0, 7, 1, 8, 3, 6, 4 };
+    struct cdc_stats stats;
+    pthread_t thread;
+    uint64_t base;
+    double start;
+    unsigned char c;
+    int i;
+
+    nseen = calls = 0;
+    worst = 0;
+    stop = 0;
+    REQUIRE(pthread_create(&thread, NULL, sink, NULL) == 0);
+    start = test_now();
+    base = now_ns() + 50000000ull;
+
+    /* out of order, one long past, one beyond a turn of the wheel */
+    for (i = 0; i < 10; i ++)
+    {
+        c = '0' + order[i];
+        CHECK(cdc_write_at(cdc, &c, 1, base + order[i] * 10000000ull) == 1);
+    }
+    CHECK(cdc_write_at(cdc, (unsigned char const *)"L", 1, base + 400000000ull) == 1);
+    CHECK(cdc_write_at(cdc, (unsigned char const *)"P", 1, 1) == 1);
+
+    while (test_now() - start < 0.6 && nseen < WRITES)
+        if (rt)
+            test_sleep_ms(10);
+        else
+            CHECK(cdc_handle_events(cdc, 100) == CDC_SUCCESS);
+    stop = 1;
+    pthread_join(thread, NULL);
+
+    CHECK(nseen == WRITES && memcmp(seen, "P0123456789L", WRITES) == 0);
+    CHECK(seen_at[0] - start < 0.04);
+    for (i = 1; i <= 10; i ++)
+    {
+        double due = start + 0.05 + (i - 1) * 0.01;
+        CHECK(seen_at[i] >= due - 0.002 && seen_at[i] < due + 0.02);
+    }
+    CHECK(seen_at[11] >= start + 0.448 && seen_at[11] < start + 0.47);
+
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(calls == WRITES);
+    CHECK(stats.tx_lateness_max == worst);
+    CHECK(stats.tx_lateness_mean <= stats.tx_lateness_max);
+}
+
+int main(void)
+{
+    struct cdc_rt_config config;
+    struct cdc_stats stats;
+    struct cdc_ctx *cdc;
+    unsigned char buf[4];
+
+    REQUIRE((cdc = cdc_new()) != NULL);
+    master = test_pty_open(cdc);
+    CHECK(cdc_write_at(cdc, buf, 1, 0) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_async_start(cdc, 0, 0) == CDC_SUCCESS);
+    CHECK(cdc_write_at(cdc, buf, 0, 0) == CDC_ERROR_INVALID_PARAM);
+    REQUIRE(cdc_set_write_at_callback(cdc, on_write, &calls) == CDC_SUCCESS);
+
+    schedule(cdc, 0);
+    memset(&config, 0, sizeof(config));
+    config.cpu = -1;
+    REQUIRE(cdc_rt_start(cdc, &config) == CDC_SUCCESS);
+    schedule(cdc, 1);
+    CHECK(cdc_rt_stop(cdc) == CDC_SUCCESS);
+    REQUIRE(cdc_get_stats(cdc, &stats) == CDC_SUCCESS);
+    CHECK(stats.tx_scheduled == 2 * WRITES);
+
+    /* stopping the engine drops what is still held */
+    CHECK(cdc_write_at(cdc, (unsigned char const *)"X", 1, now_ns() + 50000000ull) == 1);
+    cdc_async_stop(cdc);
+    test_sleep_ms(100);
+    CHECK(read(master, buf, sizeof(buf)) < 0 && errno == EAGAIN);
+
+    close(master);
+    cdc_free(cdc);
+    return test_result();
+}
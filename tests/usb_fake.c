@@ -0,0 +1,640 @@
+/* usb_fake.c
+
+   A scripted CDC device behind the libusb API, see usb_fake.h
+
+   Transfers complete like on a real bus: an IN transfer takes the data of
+   one message at most and ends early at the message's last, short packet,
+   a message filling its last transfer exactly is followed by a zero length
+   packet, and callbacks only run from the event handling functions, one
+   thread at a time.  Timeouts and cancellations are honoured, so the
+   engine's error paths can be driven as well.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libusb.h>
+#include <cdc.h>
+
+#include "usb_fake.h"
+
+#define USB_FAKE_MAX_TRANSFERS 1024
+/* longest sleep of an event handler, so that it notices other threads' completions */
+#define USB_FAKE_MAX_WAIT 0.01
+
+struct libusb_context { int unused; };
+struct libusb_device { int unused; };
+struct libusb_device_handle { int unused; };
+
+struct usb_fake_message
+{
+    struct usb_fake_message *next;
+    double release;
+    int size;
+    int offset;
+    unsigned char data[];
+};
+
+struct usb_fake_pending
+{
+    struct libusb_transfer *transfer;
+    double deadline;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* held by the thread handling events */
+    pthread_mutex_t events;
+
+    /* submitted transfers, in order */
+    struct usb_fake_pending pending[USB_FAKE_MAX_TRANSFERS];
+    int npending;
+    /* transfers whose callback is due, in order */
+    struct libusb_transfer *done[USB_FAKE_MAX_TRANSFERS];
+    int ndone;
+
+    struct usb_fake_message *head, *tail;
+    int zlp;
+
+    unsigned char *sink;
+    int sink_size, sink_alloc;
+    int loopback;
+    int baudrate;
+    /* IN transfers pending when the last OUT transfer was submitted */
+    int reads_at_write;
+} fake = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .events = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct libusb_context usb_fake_context;
+static struct libusb_device usb_fake_device;
+static struct libusb_device_handle usb_fake_handle;
+
+static struct libusb_endpoint_descriptor const usb_fake_endpoints[] = {
+    { .bLength = 7, .bDescriptorType = 5, .bEndpointAddress = 0x02, .bmAttributes = 2,
+      .wMaxPacketSize = USB_FAKE_PACKET },
+    { .bLength = 7, .bDescriptorType = 5, .bEndpointAddress = 0x81, .bmAttributes = 2,
+      .wMaxPacketSize = USB_FAKE_PACKET },
+};
+
+static struct libusb_interface_descriptor const usb_fake_altsettings[] = {
+    /* communications interface, without its notification endpoint */
+    { .bLength = 9, .bDescriptorType = 4, .bInterfaceNumber = 0, .bInterfaceClass = 2,
+      .bInterfaceSubClass = 2, .bInterfaceProtocol = 1 },
+    /* data interface */
+    { .bLength = 9, .bDescriptorType = 4, .bInterfaceNumber = 1, .bNumEndpoints = 2,
+      .bInterfaceClass = 10, .endpoint = usb_fake_endpoints },
+};
+
+static struct libusb_interface const usb_fake_interfaces[] = {
+    { .altsetting = &usb_fake_altsettings[0], .num_altsetting = 1 },
+    { .altsetting = &usb_fake_altsettings[1], .num_altsetting = 1 },
+};
+
+static struct libusb_config_descriptor usb_fake_config = {
+    .bLength = 9, .bDescriptorType = 2, .bNumInterfaces = 2, .bConfigurationValue = 1,
+    .interface = usb_fake_interfaces,
+};
+
+static double usb_fake_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* queue a message, with fake.lock held */
+static void usb_fake_queue(unsigned char const *buf, int size, double delay)
+{
+    struct usb_fake_message *msg = malloc(sizeof(*msg) + size);
+
+    msg->next = NULL;
+    msg->release = (fake.tail ? fake.tail->release : usb_fake_now()) + delay;
+    msg->size = size;
+    msg->offset = 0;
+    memcpy(msg->data, buf, size);
+    if (fake.tail)
+        fake.tail->next = msg;
+    else
+        fake.head = msg;
+    fake.tail = msg;
+    pthread_cond_broadcast(&fake.cond);
+}
+
+/* move a pending transfer to the done queue, with fake.lock held */
+static void usb_fake_complete(int index, enum libusb_transfer_status status)
+{
+    struct libusb_transfer *transfer = fake.pending[index].transfer;
+
+    transfer->status = status;
+    memmove(&fake.pending[index], &fake.pending[index + 1],
+            (fake.npending - index - 1) * sizeof(fake.pending[0]));
+    fake.npending --;
+    fake.done[fake.ndone ++] = transfer;
+}
+
+/* let the device act on its transfers, with fake.lock held; returns when to look again */
+static double usb_fake_progress(void)
+{
+    double now = usb_fake_now(), next = now + USB_FAKE_MAX_WAIT;
+    int i = 0;
+
+    while (i < fake.npending)
+    {
+        struct libusb_transfer *transfer = fake.pending[i].transfer;
+        struct usb_fake_message *msg = fake.head;
+
+        if (!(transfer->endpoint & 0x80))
+        {
+            /* the device takes everything written at once */
+            if (fake.sink_size + transfer->length > fake.sink_alloc)
+            {
+                fake.sink_alloc = (fake.sink_size + transfer->length) * 2;
+                fake.sink = realloc(fake.sink, fake.sink_alloc);
+            }
+            memcpy(fake.sink + fake.sink_size, transfer->buffer, transfer->length);
+            fake.sink_size += transfer->length;
+            if (fake.loopback && transfer->length > 0)
+                usb_fake_queue(transfer->buffer, transfer->length, 0);
+            transfer->actual_length = transfer->length;
+            usb_fake_complete(i, LIBUSB_TRANSFER_COMPLETED);
+        }
+        else if (fake.zlp)
+        {
+            fake.zlp = 0;
+            transfer->actual_length = 0;
+            usb_fake_complete(i, LIBUSB_TRANSFER_COMPLETED);
+        }
+        else if (msg && msg->release <= now)
+        {
+            int size = msg->size - msg->offset;
+            if (size > transfer->length)
+                size = transfer->length;
+            memcpy(transfer->buffer, msg->data + msg->offset, size);
+            msg->offset += size;
+            transfer->actual_length = size;
+            if (msg->offset == msg->size)
+            {
+                /* the last packet was a full one, so the end needs a zero length packet */
+                fake.zlp = size == transfer->length && size % USB_FAKE_PACKET == 0 && size > 0;
+                fake.head = msg->next;
+                if (fake.head == NULL)
+                    fake.tail = NULL;
+                free(msg);
+            }
+            usb_fake_complete(i, LIBUSB_TRANSFER_COMPLETED);
+        }
+        else if (fake.pending[i].deadline && fake.pending[i].deadline <= now)
+        {
+            transfer->actual_length = 0;
+            usb_fake_complete(i, LIBUSB_TRANSFER_TIMED_OUT);
+        }
+        else
+        {
+            if (msg && msg->release < next)
+                next = msg->release;
+            if (fake.pending[i].deadline && fake.pending[i].deadline < next)
+                next = fake.pending[i].deadline;
+            i ++;
+        }
+    }
+    return next;
+}
+
+/* run one callback, or wait up to timeout seconds for one to be due */
+static int usb_fake_handle_events(double timeout)
+{
+    struct libusb_transfer *transfer = NULL;
+    double until = usb_fake_now() + timeout, next;
+    struct timespec ts;
+    int handling;
+
+    pthread_mutex_lock(&fake.lock);
+    handling = pthread_mutex_trylock(&fake.events) == 0;
+    if (handling)
+    {
+        next = usb_fake_progress();
+        if (fake.ndone)
+        {
+            transfer = fake.done[0];
+            memmove(&fake.done[0], &fake.done[1], (-- fake.ndone) * sizeof(fake.done[0]));
+        }
+        else if (until > next)
+            until = next;
+    }
+    else if (until > usb_fake_now() + USB_FAKE_MAX_WAIT)
+    {
+        /* another thread handles events, wait for it to run a callback */
+        until = usb_fake_now() + USB_FAKE_MAX_WAIT;
+    }
+    if (transfer == NULL)
+    {
+        double wait = until - usb_fake_now();
+        if (wait > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += (time_t)wait;
+            ts.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec ++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&fake.cond, &fake.lock, &ts);
+        }
+        if (handling)
+            pthread_mutex_unlock(&fake.events);
+        pthread_mutex_unlock(&fake.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    transfer->callback(transfer);
+    if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+        libusb_free_transfer(transfer);
+
+    pthread_mutex_lock(&fake.lock);
+    pthread_mutex_unlock(&fake.events);
+    pthread_cond_broadcast(&fake.cond);
+    pthread_mutex_unlock(&fake.lock);
+    return 0;
+}
+
+int usb_fake_open(struct cdc_ctx *cdc)
+{
+    return cdc_usb_open_dev(cdc, &usb_fake_device);
+}
+
+void usb_fake_send(unsigned char const *buf, int size, long delay_us)
+{
+    pthread_mutex_lock(&fake.lock);
+    usb_fake_queue(buf, size, delay_us / 1e6);
+    pthread_mutex_unlock(&fake.lock);
+}
+
+int usb_fake_received(unsigned char *buf, int size)
+{
+    pthread_mutex_lock(&fake.lock);
+    if (size > fake.sink_size)
+        size = fake.sink_size;
+    memcpy(buf, fake.sink, size);
+    memmove(fake.sink, fake.sink + size, fake.sink_size - size);
+    fake.sink_size -= size;
+    pthread_mutex_unlock(&fake.lock);
+    return size;
+}
+
+void usb_fake_set_loopback(int loopback)
+{
+    pthread_mutex_lock(&fake.lock);
+    fake.loopback = loopback;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+/* IN transfers pending, with the lock held */
+static int usb_fake_count_reads(void)
+{
+    int i, count = 0;
+    for (i = 0; i < fake.npending; i ++)
+        count += (fake.pending[i].transfer->endpoint & 0x80) != 0;
+    return count;
+}
+
+int usb_fake_pending_reads(void)
+{
+    int count;
+    pthread_mutex_lock(&fake.lock);
+    count = usb_fake_count_reads();
+    pthread_mutex_unlock(&fake.lock);
+    return count;
+}
+
+int usb_fake_reads_at_write(void)
+{
+    int count;
+    pthread_mutex_lock(&fake.lock);
+    count = fake.reads_at_write;
+    pthread_mutex_unlock(&fake.lock);
+    return count;
+}
+
+int usb_fake_baudrate(void)
+{
+    return fake.baudrate;
+}
+
+/* libusb */
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx)
+{
+    if (ctx)
+        *ctx = &usb_fake_context;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    *list = calloc(2, sizeof(**list));
+    if (*list == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    (*list)[0] = &usb_fake_device;
+    return 1;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    free(list);
+}
+
+libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
+{
+    return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev)
+{
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = 18;
+    desc->bDescriptorType = 1;
+    desc->bcdUSB = 0x0200;
+    desc->bDeviceClass = 2;
+    desc->bMaxPacketSize0 = 64;
+    desc->idVendor = USB_FAKE_VENDOR;
+    desc->idProduct = USB_FAKE_PRODUCT;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    desc->bNumConfigurations = 1;
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+                                             struct libusb_config_descriptor **config)
+{
+    if (config_index != 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+    *config = &usb_fake_config;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+    return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+    return 2;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+    if (port_numbers_len < 1)
+        return LIBUSB_ERROR_OVERFLOW;
+    port_numbers[0] = 1;
+    return 1;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    *dev_handle = &usb_fake_handle;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev_handle, int configuration)
+{
+    return configuration == 1 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number)
+{
+    return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle, int enable)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index,
+                                                   unsigned char *data, int length)
+{
+    static char const *strings[] = { NULL, "libcdc", "fake cdc device", "0001" };
+    int size;
+
+    if (desc_index == 0 || desc_index >= sizeof(strings) / sizeof(strings[0]))
+        return LIBUSB_ERROR_INVALID_PARAM;
+    size = strlen(strings[desc_index]);
+    if (size >= length)
+        size = length - 1;
+    memcpy(data, strings[desc_index], size);
+    data[size] = 0;
+    return size;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type,
+                                        uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                                        unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+    /* SET_LINE_CODING */
+    if (bRequest == 0x20 && wLength >= 4)
+        fake.baudrate = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    return wLength;
+}
+
+static void LIBUSB_CALL usb_fake_bulk_callback(struct libusb_transfer *transfer)
+{
+    *(int *)transfer->user_data = 1;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+                                     unsigned char *data, int length, int *actual_length,
+                                     unsigned int timeout)
+{
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    int completed = 0, result;
+
+    if (transfer == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, data, length,
+                              usb_fake_bulk_callback, &completed, timeout);
+    if ((result = libusb_submit_transfer(transfer)) < 0)
+    {
+        libusb_free_transfer(transfer);
+        return result;
+    }
+    while (!completed)
+        libusb_handle_events_completed(&usb_fake_context, &completed);
+    if (actual_length)
+        *actual_length = transfer->actual_length;
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            result = LIBUSB_SUCCESS;
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            result = LIBUSB_ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            result = LIBUSB_ERROR_INTERRUPTED;
+            break;
+        default:
+            result = LIBUSB_ERROR_IO;
+            break;
+    }
+    libusb_free_transfer(transfer);
+    return result;
+}
+
+const char * LIBUSB_CALL libusb_error_name(int errcode)
+{
+    switch (errcode)
+    {
+        case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+        case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+        case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+        case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+        case LIBUSB_ERROR_BUSY: return "LIBUSB_ERROR_BUSY";
+        case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+        case LIBUSB_ERROR_INTERRUPTED: return "LIBUSB_ERROR_INTERRUPTED";
+        case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+        default: return "LIBUSB_ERROR_OTHER";
+    }
+}
+
+const char * LIBUSB_CALL libusb_strerror(int errcode)
+{
+    return libusb_error_name(errcode);
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer) + iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+        free(transfer->buffer);
+    free(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    int i;
+
+    pthread_mutex_lock(&fake.lock);
+    for (i = 0; i < fake.npending; i ++)
+    {
+        if (fake.pending[i].transfer == transfer)
+        {
+            pthread_mutex_unlock(&fake.lock);
+            return LIBUSB_ERROR_BUSY;
+        }
+    }
+    if (fake.npending == USB_FAKE_MAX_TRANSFERS)
+    {
+        pthread_mutex_unlock(&fake.lock);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    transfer->actual_length = 0;
+    if (!(transfer->endpoint & 0x80))
+        fake.reads_at_write = usb_fake_count_reads();
+    fake.pending[fake.npending].transfer = transfer;
+    fake.pending[fake.npending].deadline = transfer->timeout ? usb_fake_now() + transfer->timeout / 1e3 : 0;
+    fake.npending ++;
+    pthread_cond_broadcast(&fake.cond);
+    pthread_mutex_unlock(&fake.lock);
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    int i, result = LIBUSB_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&fake.lock);
+    for (i = 0; i < fake.npending; i ++)
+    {
+        if (fake.pending[i].transfer == transfer)
+        {
+            transfer->actual_length = 0;
+            usb_fake_complete(i, LIBUSB_TRANSFER_CANCELLED);
+            pthread_cond_broadcast(&fake.cond);
+            result = LIBUSB_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return result;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+    if (completed && *completed)
+        return LIBUSB_SUCCESS;
+    return usb_fake_handle_events(tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+    if (completed && *completed)
+        return LIBUSB_SUCCESS;
+    return usb_fake_handle_events(USB_FAKE_MAX_WAIT);
+}
+
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context *ctx)
+{
+    pthread_mutex_lock(&fake.lock);
+    pthread_cond_broadcast(&fake.cond);
+    pthread_mutex_unlock(&fake.lock);
+}
+
+const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(libusb_context *ctx)
+{
+    /* the device has no file descriptors, callers poll with a timeout */
+    return calloc(1, sizeof(struct libusb_pollfd *));
+}
+
+void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+    free(pollfds);
+}
@@ -0,0 +1,42 @@
+/* usb_fake.h
+
+   A scripted CDC device behind the libusb API, for the tests of the
+   libusb backend
+
+   usb_fake.c defines the libusb functions libcdc calls, so a test linked
+   with it and the static library drives one simulated device instead of
+   real hardware.  The device sends the messages queued with
+   usb_fake_send() on its bulk IN endpoint, each one ending with a short or
+   zero length packet, and keeps what is written to its bulk OUT endpoint.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#pragma once
+
+struct cdc_ctx;
+
+#define USB_FAKE_VENDOR 0x1d6b
+#define USB_FAKE_PRODUCT 0x0cdc
+#define USB_FAKE_PACKET 64
+
+/* open the simulated device with cdc_usb_open_dev() */
+int usb_fake_open(struct cdc_ctx *cdc);
+
+/* queue a message released delay_us after the previous one, or after now if none is pending */
+void usb_fake_send(unsigned char const *buf, int size, long delay_us);
+
+/* copy out and forget up to size bytes written to the device */
+int usb_fake_received(unsigned char *buf, int size);
+
+/* send everything written to the device back as one message per transfer */
+void usb_fake_set_loopback(int loopback);
+
+/* IN transfers the device holds, waiting for data */
+int usb_fake_pending_reads(void);
+
+/* IN transfers the device held when the last write was submitted */
+int usb_fake_reads_at_write(void);
+
+/* baud rate of the last SET_LINE_CODING request */
+int usb_fake_baudrate(void);
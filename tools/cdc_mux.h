@@ -0,0 +1,253 @@
+/* cdc_mux.h
+
+   Shared memory layout and client helpers of cdc-muxd
+
+   cdc-muxd owns the devices and publishes every port as one memfd, handed
+   out together with an eventfd over its Unix socket (SCM_RIGHTS, one
+   message of struct cdc_mux_port per port).  The memfd holds:
+
+   - the receive ring, single producer / multiple consumers: the daemon
+     appends everything it receives and advances rx_head; every reader
+     keeps its own position and is never waited for, so a reader more
+     than rx_size bytes behind loses data and is told how much.  Before
+     overwriting old data the daemon announces the end of its copy in
+     rx_write, which readers check after copying, like a seqlock.
+
+   - the transmit ring, multiple producers / single consumer: writers
+     reserve a record by advancing tx_tail, fill it and publish it by
+     storing its length; the daemon forwards records in order and zeroes
+     them.  Writers wake the daemon with the eventfd only when it sleeps.
+
+   Readers block on rx_seq with a futex, so no system call is made while
+   data is flowing.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CDC_MUX_MAGIC 0x4d434443
+#define CDC_MUX_VERSION 2
+#define CDC_MUX_SOCKET "/tmp/cdc-mux.sock"
+
+/* record flag of the transmit ring: skip to the start of the ring */
+#define CDC_MUX_PAD 0x80000000u
+#define CDC_MUX_ALIGN(len) (((len) + 7) & ~7u)
+
+/** message sent for every port, with the memfd and the eventfd attached */
+struct cdc_mux_port
+{
+    uint32_t index;
+    char name[60];
+};
+
+/** header at the start of the memfd, data follows at rx_offset and tx_offset */
+struct cdc_mux_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    /** ring sizes, powers of two */
+    uint32_t rx_size;
+    uint32_t tx_size;
+    uint32_t rx_offset;
+    uint32_t tx_offset;
+    /** set once the port is gone */
+    uint32_t closed;
+    uint32_t reserved;
+
+    /* written by the daemon only */
+    uint64_t rx_head __attribute__((aligned(64)));
+    /** end of the data being copied in, rx_head when idle */
+    uint64_t rx_write;
+    uint32_t rx_seq;
+    uint32_t rx_waiters;
+
+    /* reserved by writers */
+    uint64_t tx_tail __attribute__((aligned(64)));
+
+    /* consumed by the daemon */
+    uint64_t tx_head __attribute__((aligned(64)));
+    /** set while the daemon waits for the eventfd */
+    uint32_t tx_wait;
+};
+
+/** total size of the memfd of a port */
+static inline size_t cdc_mux_shm_size(uint32_t rx_size, uint32_t tx_size)
+{
+    return 4096 + (size_t)rx_size + tx_size;
+}
+
+static inline unsigned char *cdc_mux_rx_data(struct cdc_mux_shm *shm)
+{
+    return (unsigned char *)shm + shm->rx_offset;
+}
+
+static inline unsigned char *cdc_mux_tx_data(struct cdc_mux_shm *shm)
+{
+    return (unsigned char *)shm + shm->tx_offset;
+}
+
+/** map a memfd received from the daemon, NULL if it is not a port */
+static inline struct cdc_mux_shm *cdc_mux_map(int memfd)
+{
+    struct cdc_mux_shm *shm;
+    struct stat st;
+
+    if (fstat(memfd, &st) < 0 || st.st_size < (off_t)sizeof(*shm))
+        return NULL;
+    shm = (struct cdc_mux_shm *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (shm->magic != CDC_MUX_MAGIC || shm->version != CDC_MUX_VERSION)
+    {
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+    return shm;
+}
+
+/** position of the newest received byte, where a live reader starts */
+static inline uint64_t cdc_mux_rx_position(struct cdc_mux_shm *shm)
+{
+    return __atomic_load_n(&shm->rx_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+    Copy received data at *pos into buf, advancing *pos.
+    Returns the number of bytes copied, 0 if none is available.  If the
+    reader was overtaken, *lost is increased by the bytes it missed.
+*/
+static inline int cdc_mux_read(struct cdc_mux_shm *shm, uint64_t *pos, void *buf, int len, uint64_t *lost)
+{
+    unsigned char const *data = cdc_mux_rx_data(shm);
+    uint64_t mask = shm->rx_size - 1;
+
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n(&shm->rx_head, __ATOMIC_ACQUIRE);
+        uint64_t avail, off, first;
+
+        if (head - *pos > shm->rx_size)
+        {
+            *lost += head - shm->rx_size - *pos;
+            *pos = head - shm->rx_size;
+        }
+        avail = head - *pos;
+        if (avail == 0)
+            return 0;
+        if (avail > (uint64_t)len)
+            avail = len;
+        off = *pos & mask;
+        first = shm->rx_size - off < avail ? shm->rx_size - off : avail;
+        memcpy(buf, data + off, first);
+        memcpy((unsigned char *)buf + first, data, avail - first);
+
+        /* the copy is only valid if the daemon did not start overwriting it meanwhile */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->rx_write, __ATOMIC_RELAXED) - *pos <= shm->rx_size)
+        {
+            *pos += avail;
+            return (int)avail;
+        }
+    }
+}
+
+/**
+    Wait until data is available at pos or the port is closed.
+    timeout is in milliseconds, negative waits forever.
+    Returns 1 if data is available, 0 on timeout, -1 once the port is closed.
+*/
+static inline int cdc_mux_wait(struct cdc_mux_shm *shm, uint64_t pos, int timeout)
+{
+    struct timespec ts, *tsp = NULL;
+    uint32_t seq;
+
+    if (timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    for (;;)
+    {
+        seq = __atomic_load_n(&shm->rx_seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shm->rx_head, __ATOMIC_SEQ_CST) != pos)
+            return 1;
+        if (__atomic_load_n(&shm->closed, __ATOMIC_SEQ_CST))
+            return -1;
+        __atomic_add_fetch(&shm->rx_waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shm->rx_head, __ATOMIC_SEQ_CST) != pos)
+        {
+            __atomic_sub_fetch(&shm->rx_waiters, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+        /* shared mapping: not FUTEX_PRIVATE_FLAG */
+        if (syscall(SYS_futex, &shm->rx_seq, FUTEX_WAIT, seq, tsp, NULL, 0) < 0 && errno == ETIMEDOUT)
+        {
+            __atomic_sub_fetch(&shm->rx_waiters, 1, __ATOMIC_SEQ_CST);
+            return __atomic_load_n(&shm->rx_head, __ATOMIC_ACQUIRE) != pos;
+        }
+        __atomic_sub_fetch(&shm->rx_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/** largest record cdc_mux_write() accepts */
+static inline int cdc_mux_max_write(struct cdc_mux_shm *shm)
+{
+    return shm->tx_size / 2 - 8;
+}
+
+/**
+    Queue len bytes for transmission as one record.
+    Returns len, 0 if the ring is full, or -1 if len can never fit or the
+    port is closed.  efd is the eventfd received with the memfd.
+*/
+static inline int cdc_mux_write(struct cdc_mux_shm *shm, int efd, void const *buf, int len)
+{
+    unsigned char *data = cdc_mux_tx_data(shm);
+    uint64_t tail, head, off, total, need = 8 + CDC_MUX_ALIGN((uint32_t)len);
+    uint32_t *hdr;
+
+    if (len <= 0 || need > shm->tx_size / 2 || __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE))
+        return -1;
+    tail = __atomic_load_n(&shm->tx_tail, __ATOMIC_RELAXED);
+    do
+    {
+        head = __atomic_load_n(&shm->tx_head, __ATOMIC_ACQUIRE);
+        off = tail & (shm->tx_size - 1);
+        /* records never wrap: pad to the end of the ring first */
+        total = off + need > shm->tx_size ? shm->tx_size - off + need : need;
+        if (tail + total - head > shm->tx_size)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&shm->tx_tail, &tail, tail + total, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (total != need)
+    {
+        hdr = (uint32_t *)(data + off);
+        __atomic_store_n(hdr, CDC_MUX_PAD | (uint32_t)(shm->tx_size - off - 8), __ATOMIC_RELEASE);
+        off = 0;
+    }
+    hdr = (uint32_t *)(data + off);
+    memcpy(hdr + 2, buf, len);
+    __atomic_store_n(hdr, (uint32_t)len, __ATOMIC_RELEASE);
+
+    if (__atomic_exchange_n(&shm->tx_wait, 0, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        ssize_t r = write(efd, &one, sizeof(one));
+        (void)r;
+    }
+    return len;
+}
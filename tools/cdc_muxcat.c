@@ -0,0 +1,145 @@
+/* cdc_muxcat.c
+
+   cdc-muxcat: connect stdin and stdout to a port shared by cdc-muxd
+
+   Received data of the port is copied to stdout, stdin is queued for
+   transmission; any number of cdc-muxcat instances can use the same
+   port at once.  Data lost because stdout could not keep up is reported
+   on stderr.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cdc_mux.h"
+
+static struct cdc_mux_shm *shm;
+static int efd;
+
+static void *stdin_thread(void *arg)
+{
+    unsigned char buf[4096];
+    int size = cdc_mux_max_write(shm) < (int)sizeof(buf) ? cdc_mux_max_write(shm) : (int)sizeof(buf);
+    ssize_t n;
+
+    while ((n = read(STDIN_FILENO, buf, size)) > 0)
+    {
+        int ret;
+        /* the ring is full: the port is slower than us, wait for it */
+        while ((ret = cdc_mux_write(shm, efd, buf, n)) == 0)
+            usleep(1000);
+        if (ret < 0)
+            break;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct cdc_mux_port msg;
+    char const *path = CDC_MUX_SOCKET;
+    unsigned char buf[65536];
+    uint64_t pos, lost = 0, reported = 0;
+    unsigned int index = 0;
+    int fd, i, oldest = 0, memfd = -1;
+    pthread_t thread;
+
+    while ((i = getopt(argc, argv, "S:n:o")) != -1)
+    {
+        switch (i)
+        {
+            case 'S':
+                path = optarg;
+                break;
+            case 'n':
+                index = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                oldest = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-S socket] [-n port] [-o]\n", *argv);
+                exit(-1);
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    /* the daemon sends one message per port, then hangs up */
+    for (;;)
+    {
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov = { &msg, sizeof(msg) };
+        struct msghdr mh;
+        struct cmsghdr *cmsg;
+        int fds[2];
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) <= 0)
+            break;
+        cmsg = CMSG_FIRSTHDR(&mh);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+            continue;
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        if (msg.index == index && memfd < 0)
+        {
+            memfd = fds[0];
+            efd = fds[1];
+            fprintf(stderr, "port %u: %.*s\n", index, (int)sizeof(msg.name), msg.name);
+        }
+        else
+        {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+    close(fd);
+    if (memfd < 0 || (shm = cdc_mux_map(memfd)) == NULL)
+    {
+        fprintf(stderr, "no port %u\n", index);
+        return EXIT_FAILURE;
+    }
+
+    pos = cdc_mux_rx_position(shm);
+    if (oldest)
+        pos = pos > shm->rx_size ? pos - shm->rx_size : 0;
+    pthread_create(&thread, NULL, stdin_thread, NULL);
+
+    while (cdc_mux_wait(shm, pos, -1) > 0)
+    {
+        int n;
+        while ((n = cdc_mux_read(shm, &pos, buf, sizeof(buf), &lost)) > 0)
+        {
+            if (fwrite(buf, 1, n, stdout) != (size_t)n)
+                return EXIT_FAILURE;
+        }
+        fflush(stdout);
+        if (lost != reported)
+        {
+            fprintf(stderr, "lost %llu bytes\n", (unsigned long long)(lost - reported));
+            reported = lost;
+        }
+    }
+    return EXIT_SUCCESS;
+}
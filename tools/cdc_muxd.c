@@ -0,0 +1,457 @@
+/* cdc_muxd.c
+
+   cdc-muxd: share libcdc ports between processes through shared memory
+
+   The daemon owns the ports and publishes each one as a memfd holding a
+   receive ring every client reads at its own position and a transmit
+   ring every client can append to, see cdc_mux.h.  Clients connect to a
+   Unix socket and receive the memfd and an eventfd of every port with
+   SCM_RIGHTS; after that, no daemon round trip is involved in reading or
+   writing.  One thread pumps all ports with epoll.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <libusb.h>
+#include <cdc.h>
+#include "cdc_mux.h"
+
+#define MAX_PORTS 256
+#define MAX_POLLFDS 16
+#define EV_LISTENER ((uint64_t)1 << 32)
+
+struct port
+{
+    struct cdc_ctx *cdc;
+    char name[60];
+    int memfd;
+    int efd;
+    struct cdc_mux_shm *shm;
+    /* the rings and positions as the daemon set them up: clients can write the header */
+    unsigned char *rx_ring, *tx_ring;
+    uint32_t rx_size, tx_size;
+    uint64_t rx_head, tx_head;
+    /** bytes of the oldest transmit record already forwarded */
+    uint32_t tx_part;
+};
+
+static struct port ports[MAX_PORTS];
+static int nports;
+
+static void port_error(struct port *port, char const *what)
+{
+    char errbuf[256];
+    fprintf(stderr, "%s: %s failed: %s\n", port->name, what,
+            cdc_get_error_string(port->cdc, errbuf, sizeof(errbuf)));
+}
+
+static void wake_readers(struct cdc_mux_shm *shm)
+{
+    __atomic_add_fetch(&shm->rx_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->rx_waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &shm->rx_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* append received data to the receive ring; readers are never waited for */
+static int pump_rx(struct port *port)
+{
+    struct cdc_mux_shm *shm = port->shm;
+    unsigned char *ring = port->rx_ring, *data;
+    uint64_t head = port->rx_head;
+    int avail, moved = 0;
+
+    while ((avail = cdc_rx_peek(port->cdc, &data)) > 0)
+    {
+        uint32_t off = head & (port->rx_size - 1);
+        uint32_t len = avail > (int)port->rx_size ? port->rx_size : (uint32_t)avail;
+        uint32_t first = port->rx_size - off < len ? port->rx_size - off : len;
+
+        /* readers copying what is about to be overwritten find out through rx_write */
+        __atomic_store_n(&shm->rx_write, head + len, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(ring + off, data, first);
+        memcpy(ring, data + first, len - first);
+        head += len;
+        port->rx_head = head;
+        __atomic_store_n(&shm->rx_head, head, __ATOMIC_RELEASE);
+        cdc_rx_consume(port->cdc, len);
+        moved = 1;
+    }
+    if (moved)
+        wake_readers(shm);
+    if (avail < 0)
+    {
+        port_error(port, "receive");
+        return -1;
+    }
+    return 0;
+}
+
+/* forward transmit records in order until the ring is empty or the port is full */
+static int pump_tx(struct port *port)
+{
+    struct cdc_mux_shm *shm = port->shm;
+    unsigned char *ring = port->tx_ring, *data;
+    uint64_t head = port->tx_head;
+    int avail;
+
+    for (;;)
+    {
+        uint32_t off = head & (port->tx_size - 1);
+        uint32_t *hdr = (uint32_t *)(ring + off);
+        uint32_t len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE), n;
+
+        if (len == 0)
+        {
+            /* empty: ask writers for a wakeup, then look again to close the race */
+            __atomic_store_n(&shm->tx_wait, 1, __ATOMIC_SEQ_CST);
+            len = __atomic_load_n(hdr, __ATOMIC_SEQ_CST);
+            if (len == 0)
+                return 0;
+            __atomic_store_n(&shm->tx_wait, 0, __ATOMIC_RELAXED);
+        }
+        /* a pad ends at the end of the ring, a record fits before it, as cdc_mux_write() makes them */
+        if ((len & CDC_MUX_PAD) ? off + 8 + (len & ~CDC_MUX_PAD) != port->tx_size :
+            len > port->tx_size / 2 - 8 || off + 8 + CDC_MUX_ALIGN(len) > port->tx_size || len <= port->tx_part)
+        {
+            fprintf(stderr, "%s: bad transmit record of %#x at %u\n", port->name, len, off);
+            return -1;
+        }
+        if (len & CDC_MUX_PAD)
+        {
+            len &= ~CDC_MUX_PAD;
+            memset(hdr, 0, 8 + len);
+            head += 8 + len;
+            port->tx_head = head;
+            __atomic_store_n(&shm->tx_head, head, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if ((avail = cdc_tx_reserve(port->cdc, &data)) <= 0)
+            break;
+        n = len - port->tx_part < (uint32_t)avail ? len - port->tx_part : (uint32_t)avail;
+        memcpy(data, (unsigned char *)(hdr + 2) + port->tx_part, n);
+        cdc_tx_commit(port->cdc, n);
+        port->tx_part += n;
+        if (port->tx_part < len)
+            continue;
+
+        /* record done: zero it, so a later record starting inside it reads as unpublished */
+        memset(hdr, 0, 8 + CDC_MUX_ALIGN(len));
+        port->tx_part = 0;
+        head += 8 + CDC_MUX_ALIGN(len);
+        port->tx_head = head;
+        __atomic_store_n(&shm->tx_head, head, __ATOMIC_RELEASE);
+    }
+    if (avail < 0)
+    {
+        port_error(port, "transmit");
+        return -1;
+    }
+    return 0;
+}
+
+static int add_port(struct cdc_ctx *cdc, char const *name, uint32_t rx_size, uint32_t tx_size, int baudrate, int bufsize)
+{
+    struct port *port = &ports[nports];
+    size_t size = cdc_mux_shm_size(rx_size, tx_size);
+    char errbuf[256];
+
+    port->cdc = cdc;
+    snprintf(port->name, sizeof(port->name), "%s", name);
+
+    if (cdc_async_start(cdc, 8, bufsize) < 0 ||
+        cdc_set_line_coding(cdc, baudrate, BITS_8, STOP_BIT_1, NONE) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", name, cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+    /* not fatal: ptys used for testing have no modem lines */
+    if (cdc_setdtr_rts(cdc, 1, 1) < 0)
+        port_error(port, "cdc_setdtr_rts");
+
+    port->memfd = memfd_create("cdc-mux", MFD_CLOEXEC);
+    if (port->memfd < 0 || ftruncate(port->memfd, size) < 0)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+    port->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, port->memfd, 0);
+    port->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (port->shm == MAP_FAILED || port->efd < 0)
+    {
+        perror("mmap");
+        return -1;
+    }
+    port->rx_ring = (unsigned char *)port->shm + 4096;
+    port->tx_ring = port->rx_ring + rx_size;
+    port->rx_size = rx_size;
+    port->tx_size = tx_size;
+    port->shm->rx_size = rx_size;
+    port->shm->tx_size = tx_size;
+    port->shm->rx_offset = 4096;
+    port->shm->tx_offset = 4096 + rx_size;
+    port->shm->version = CDC_MUX_VERSION;
+    __atomic_store_n(&port->shm->magic, CDC_MUX_MAGIC, __ATOMIC_RELEASE);
+
+    printf("%s is port %d\n", name, nports);
+    nports++;
+    return 0;
+}
+
+static void remove_port(struct port *port)
+{
+    /* clients keep their mapping and see the port closed */
+    __atomic_store_n(&port->shm->closed, 1, __ATOMIC_SEQ_CST);
+    wake_readers(port->shm);
+    cdc_usb_close(port->cdc);
+    cdc_free(port->cdc);
+    port->cdc = NULL;
+}
+
+/* hand every open port to a new client */
+static void serve_client(int listener)
+{
+    int fd, i;
+
+    while ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        for (i = 0; i < nports; i++)
+        {
+            struct cdc_mux_port msg;
+            char control[CMSG_SPACE(2 * sizeof(int))];
+            struct iovec iov = { &msg, sizeof(msg) };
+            struct msghdr mh;
+            struct cmsghdr *cmsg;
+            int fds[2];
+
+            if (ports[i].cdc == NULL)
+                continue;
+            memset(&msg, 0, sizeof(msg));
+            msg.index = i;
+            snprintf(msg.name, sizeof(msg.name), "%s", ports[i].name);
+
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = &iov;
+            mh.msg_iovlen = 1;
+            mh.msg_control = control;
+            mh.msg_controllen = sizeof(control);
+            cmsg = CMSG_FIRSTHDR(&mh);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            fds[0] = ports[i].memfd;
+            fds[1] = ports[i].efd;
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+            if (sendmsg(fd, &mh, MSG_NOSIGNAL) < 0)
+                break;
+        }
+        close(fd);
+    }
+}
+
+static int is_pow2(unsigned long n)
+{
+    return n >= 4096 && (n & (n - 1)) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event events[64];
+    struct sockaddr_un addr;
+    struct cdc_ctx *cdc;
+    char errbuf[256], name[64];
+    char const *ttys[MAX_PORTS];
+    char const *path = CDC_MUX_SOCKET;
+    unsigned long rx_size = 1 << 20, tx_size = 1 << 18;
+    int nttys = 0, vid = 0, pid = 0, baudrate = 115200, bufsize = 65536;
+    int ep, sfd, listener, i, running = 1;
+    sigset_t mask;
+
+    while ((i = getopt(argc, argv, "v:p:t:S:r:w:b:s:")) != -1)
+    {
+        switch (i)
+        {
+            case 'v':
+                vid = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pid = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                if (nttys < MAX_PORTS)
+                    ttys[nttys++] = optarg;
+                break;
+            case 'S':
+                path = optarg;
+                break;
+            case 'r':
+                rx_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                tx_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                baudrate = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                bufsize = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v vid] [-p pid] [-t tty]... [-S socket] [-r rx ring size] [-w tx ring size] [-b baudrate] [-s buffer size]\n", *argv);
+                exit(-1);
+        }
+    }
+    if (!is_pow2(rx_size) || !is_pow2(tx_size) || rx_size > 1ul << 30 || tx_size > 1ul << 30)
+    {
+        fprintf(stderr, "ring sizes must be powers of two between 4096 and 1 GiB\n");
+        return EXIT_FAILURE;
+    }
+
+    if (nttys)
+    {
+        for (i = 0; i < nttys; i++)
+        {
+            if ((cdc = cdc_new()) == NULL || cdc_tty_open(cdc, ttys[i]) < 0)
+            {
+                fprintf(stderr, "unable to open %s: %s\n", ttys[i], cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                continue;
+            }
+            if (add_port(cdc, ttys[i], rx_size, tx_size, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+    }
+    else
+    {
+        struct cdc_device_list *devlist, *curdev;
+        struct cdc_ctx *finder = cdc_new();
+
+        if (finder == NULL || cdc_usb_find_all(finder, &devlist, vid, pid) < 0)
+        {
+            fprintf(stderr, "unable to list devices\n");
+            return EXIT_FAILURE;
+        }
+        for (curdev = devlist; curdev != NULL && nports < MAX_PORTS; curdev = curdev->next)
+        {
+            uint8_t bus = libusb_get_bus_number(curdev->dev);
+            uint8_t addr = libusb_get_device_address(curdev->dev);
+
+            /* every port gets its own context, so open it again by address */
+            if ((cdc = cdc_new()) == NULL || cdc_usb_open_bus_addr(cdc, bus, addr) < 0)
+            {
+                fprintf(stderr, "unable to open device: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                cdc_free(cdc);
+                continue;
+            }
+            snprintf(name, sizeof(name), "usb %03d:%03d", bus, addr);
+            if (add_port(cdc, name, rx_size, tx_size, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+        cdc_list_free(&devlist);
+        cdc_free(finder);
+    }
+    if (nports == 0)
+    {
+        fprintf(stderr, "no ports\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    /* edge triggered: every port event, including its eventfd, is followed by pumping until EAGAIN */
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    for (i = 0; i < nports; i++)
+    {
+        struct pollfd fds[MAX_POLLFDS];
+        struct epoll_event ev;
+        int n, f;
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = (uint64_t)i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, ports[i].efd, &ev);
+
+        n = cdc_get_pollfds(ports[i].cdc, fds, MAX_POLLFDS);
+        for (f = 0; f < n && f < MAX_POLLFDS; f++)
+        {
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.u64 = (uint64_t)i;
+            epoll_ctl(ep, EPOLL_CTL_ADD, fds[f].fd, &ev);
+        }
+    }
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_LISTENER;
+        epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev);
+        ev.data.u64 = UINT64_MAX;
+        epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+    }
+
+    while (running)
+    {
+        int n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), -1);
+        for (i = 0; i < n; i++)
+        {
+            struct port *port;
+            uint64_t value;
+
+            if (events[i].data.u64 == UINT64_MAX)
+            {
+                running = 0;
+                continue;
+            }
+            if (events[i].data.u64 == EV_LISTENER)
+            {
+                serve_client(listener);
+                continue;
+            }
+            port = &ports[events[i].data.u64];
+            if (port->cdc == NULL)
+                continue;
+            if (read(port->efd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                perror("eventfd");
+            if (cdc_handle_events(port->cdc, 0) < 0)
+                port_error(port, "cdc_handle_events");
+            if (pump_rx(port) < 0 || pump_tx(port) < 0)
+                remove_port(port);
+        }
+    }
+
+    for (i = 0; i < nports; i++)
+        if (ports[i].cdc != NULL)
+            remove_port(&ports[i]);
+    unlink(path);
+    close(listener);
+    close(ep);
+    close(sfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,649 @@
+/* cdc_netd.c
+
+   cdc-netd: share libcdc ports over TCP
+
+   Port <n> is served on TCP port <base>+<n>, one client at a time, either
+   as a raw byte stream or with the telnet COM-PORT-OPTION of RFC 2217, in
+   which case remote baud rate, data size, parity, stop size, DTR and RTS
+   changes are applied with cdc_set_line_coding() and cdc_setdtr_rts().
+   One thread serves all ports with epoll.  Data is sent straight out of
+   and received straight into the asynchronous engine's buffers, so apart
+   from telnet escaping, every byte is copied once.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <libusb.h>
+#include <cdc.h>
+
+#define MAX_PORTS 256
+#define MAX_POLLFDS 16
+
+/* telnet, RFC 854 */
+#define IAC  255
+#define DONT 254
+#define DO   253
+#define WONT 252
+#define WILL 251
+#define SB   250
+#define SE   240
+#define OPT_BINARY   0
+#define OPT_ECHO     1
+#define OPT_SGA      3
+#define OPT_COM_PORT 44
+
+/* COM-PORT-OPTION commands, RFC 2217; server replies add 100 */
+#define CPO_SIGNATURE     0
+#define CPO_SET_BAUDRATE  1
+#define CPO_SET_DATASIZE  2
+#define CPO_SET_PARITY    3
+#define CPO_SET_STOPSIZE  4
+#define CPO_SET_CONTROL   5
+#define CPO_SET_LINESTATE_MASK  10
+#define CPO_SET_MODEMSTATE_MASK 11
+#define CPO_PURGE_DATA    12
+#define CPO_SERVER        100
+
+enum telnet_state { TS_DATA, TS_IAC, TS_OPT, TS_SB, TS_SB_IAC };
+
+struct port
+{
+    struct cdc_ctx *cdc;
+    char name[64];
+    int listener;
+    int client;
+
+    /* telnet parser state of the client */
+    enum telnet_state state;
+    unsigned char verb;
+    unsigned char sb[16];
+    int sb_len;
+    /* an escaped IAC whose second byte is still to be sent */
+    int iac_pending;
+    /* options we already agreed to, so we never answer the same one twice */
+    unsigned int will_sent;
+    unsigned int do_sent;
+
+    /* current line settings */
+    int baudrate;
+    enum cdc_bits_type bits;
+    enum cdc_parity_type parity;
+    enum cdc_stopbits_type sbit;
+    int dtr;
+    int rts;
+};
+
+static struct port ports[MAX_PORTS];
+static int nports;
+static int rfc2217 = 1;
+
+static void port_error(struct port *port, char const *what)
+{
+    char errbuf[256];
+    fprintf(stderr, "%s: %s failed: %s\n", port->name, what,
+            cdc_get_error_string(port->cdc, errbuf, sizeof(errbuf)));
+}
+
+static void send_ctrl(struct port *port, unsigned char const *buf, int len)
+{
+    /* control replies are tiny; if the socket is full the client is not listening anyway */
+    send(port->client, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void negotiate(struct port *port, unsigned char verb, unsigned char opt)
+{
+    unsigned char reply[3] = { IAC, 0, opt };
+    unsigned int bit = opt < 32 ? 1u << opt : 0;
+
+    if (opt == OPT_COM_PORT)
+        bit = 1u << 31;
+    switch (verb)
+    {
+        case WILL:
+            if (opt != OPT_BINARY && opt != OPT_SGA && opt != OPT_COM_PORT)
+                reply[1] = DONT;
+            else if (!(port->do_sent & bit))
+                reply[1] = DO;
+            port->do_sent |= bit;
+            break;
+        case DO:
+            if (opt != OPT_BINARY && opt != OPT_SGA && opt != OPT_ECHO)
+                reply[1] = WONT;
+            else if (!(port->will_sent & bit))
+                reply[1] = WILL;
+            port->will_sent |= bit;
+            break;
+        default:
+            /* WONT and DONT need no answer */
+            break;
+    }
+    if (reply[1])
+        send_ctrl(port, reply, 3);
+}
+
+/* reply with a COM-PORT-OPTION value, escaping IAC bytes */
+static void cpo_reply(struct port *port, unsigned char cmd, unsigned char const *value, int len)
+{
+    unsigned char reply[32];
+    int n = 0, i;
+
+    reply[n++] = IAC;
+    reply[n++] = SB;
+    reply[n++] = OPT_COM_PORT;
+    reply[n++] = cmd + CPO_SERVER;
+    for (i = 0; i < len; i++)
+    {
+        reply[n++] = value[i];
+        if (value[i] == IAC)
+            reply[n++] = IAC;
+    }
+    reply[n++] = IAC;
+    reply[n++] = SE;
+    send_ctrl(port, reply, n);
+}
+
+/* switch to new line settings, keeping the old ones if the port refuses them */
+static void apply_line_coding(struct port *port, int baudrate, enum cdc_bits_type bits,
+                              enum cdc_stopbits_type sbit, enum cdc_parity_type parity)
+{
+    if (cdc_set_line_coding(port->cdc, baudrate, bits, sbit, parity) < 0)
+    {
+        port_error(port, "cdc_set_line_coding");
+        return;
+    }
+    port->baudrate = baudrate;
+    port->bits = bits;
+    port->sbit = sbit;
+    port->parity = parity;
+}
+
+static void com_port_option(struct port *port)
+{
+    unsigned char cmd = port->sb[1], value[4];
+    unsigned char const *arg = port->sb + 2;
+    int arg_len = port->sb_len - 2;
+    static enum cdc_parity_type const parities[] = { NONE, NONE, ODD, EVEN, MARK, SPACE };
+    static enum cdc_stopbits_type const stopsizes[] = { STOP_BIT_1, STOP_BIT_1, STOP_BIT_2, STOP_BIT_15 };
+
+    if (port->sb_len < 2 || port->sb[0] != OPT_COM_PORT)
+        return;
+
+    switch (cmd)
+    {
+        case CPO_SIGNATURE:
+            cpo_reply(port, cmd, (unsigned char const *)"libcdc", 6);
+            break;
+        case CPO_SET_BAUDRATE:
+            if (arg_len == 4)
+            {
+                int baudrate = arg[0] << 24 | arg[1] << 16 | arg[2] << 8 | arg[3];
+                if (baudrate)
+                    apply_line_coding(port, baudrate, port->bits, port->sbit, port->parity);
+            }
+            /* RFC 2217 replies with the setting in effect, which is the old one on failure */
+            value[0] = port->baudrate >> 24;
+            value[1] = port->baudrate >> 16;
+            value[2] = port->baudrate >> 8;
+            value[3] = port->baudrate;
+            cpo_reply(port, cmd, value, 4);
+            break;
+        case CPO_SET_DATASIZE:
+            if (arg_len == 1 && arg[0] >= 5 && arg[0] <= 8)
+                apply_line_coding(port, port->baudrate, (enum cdc_bits_type)arg[0], port->sbit, port->parity);
+            value[0] = port->bits;
+            cpo_reply(port, cmd, value, 1);
+            break;
+        case CPO_SET_PARITY:
+            if (arg_len == 1 && arg[0] >= 1 && arg[0] <= 5)
+                apply_line_coding(port, port->baudrate, port->bits, port->sbit, parities[arg[0]]);
+            value[0] = port->parity + 1;
+            cpo_reply(port, cmd, value, 1);
+            break;
+        case CPO_SET_STOPSIZE:
+            if (arg_len == 1 && arg[0] >= 1 && arg[0] <= 3)
+                apply_line_coding(port, port->baudrate, port->bits, stopsizes[arg[0]], port->parity);
+            value[0] = port->sbit == STOP_BIT_1 ? 1 : port->sbit == STOP_BIT_2 ? 2 : 3;
+            cpo_reply(port, cmd, value, 1);
+            break;
+        case CPO_SET_CONTROL:
+            value[0] = arg_len == 1 ? arg[0] : 0;
+            switch (value[0])
+            {
+                case 8: case 9:
+                    port->dtr = value[0] == 8;
+                    break;
+                case 11: case 12:
+                    port->rts = value[0] == 11;
+                    break;
+                case 7:
+                    value[0] = port->dtr ? 8 : 9;
+                    break;
+                case 13:
+                    value[0] = port->rts ? 11 : 12;
+                    break;
+                default:
+                    /* flow control and break are not available through CDC ACM here */
+                    value[0] = 1;
+                    break;
+            }
+            if (arg_len == 1 && (arg[0] == 8 || arg[0] == 9 || arg[0] == 11 || arg[0] == 12) &&
+                cdc_setdtr_rts(port->cdc, port->dtr, port->rts) < 0)
+                port_error(port, "cdc_setdtr_rts");
+            cpo_reply(port, cmd, value, 1);
+            break;
+        case CPO_SET_LINESTATE_MASK:
+        case CPO_SET_MODEMSTATE_MASK:
+        case CPO_PURGE_DATA:
+            cpo_reply(port, cmd, arg, arg_len > 0 ? 1 : 0);
+            break;
+        default:
+            break;
+    }
+}
+
+/* strip telnet commands from received data in place, returning the data length */
+static int telnet_filter(struct port *port, unsigned char *buf, int len)
+{
+    int in, out = 0;
+
+    for (in = 0; in < len; in++)
+    {
+        unsigned char c = buf[in];
+        switch (port->state)
+        {
+            case TS_DATA:
+                if (c == IAC)
+                    port->state = TS_IAC;
+                else
+                    buf[out++] = c;
+                break;
+            case TS_IAC:
+                port->state = TS_DATA;
+                if (c == IAC)
+                    buf[out++] = c;
+                else if (c == WILL || c == WONT || c == DO || c == DONT)
+                {
+                    port->verb = c;
+                    port->state = TS_OPT;
+                }
+                else if (c == SB)
+                {
+                    port->sb_len = 0;
+                    port->state = TS_SB;
+                }
+                break;
+            case TS_OPT:
+                negotiate(port, port->verb, c);
+                port->state = TS_DATA;
+                break;
+            case TS_SB:
+                if (c == IAC)
+                    port->state = TS_SB_IAC;
+                else if (port->sb_len < (int)sizeof(port->sb))
+                    port->sb[port->sb_len++] = c;
+                break;
+            case TS_SB_IAC:
+                if (c == SE)
+                {
+                    com_port_option(port);
+                    port->state = TS_DATA;
+                }
+                else
+                {
+                    if (port->sb_len < (int)sizeof(port->sb))
+                        port->sb[port->sb_len++] = c;
+                    port->state = TS_SB;
+                }
+                break;
+        }
+    }
+    return out;
+}
+
+static void drop_client(struct port *port)
+{
+    close(port->client);
+    port->client = -1;
+}
+
+/* move data both ways until the port or the client would block */
+static int pump(struct port *port)
+{
+    unsigned char *data;
+    ssize_t n;
+    int avail;
+
+    if (port->client < 0)
+    {
+        /* nobody listening: discard, like a serial line without a receiver */
+        while ((avail = cdc_rx_peek(port->cdc, &data)) > 0)
+            cdc_rx_consume(port->cdc, avail);
+        return avail < 0 ? -1 : 0;
+    }
+
+    /* port to client; in telnet mode a data IAC goes out twice */
+    for (;;)
+    {
+        unsigned char iac = IAC, *esc;
+        int len;
+
+        if (port->iac_pending)
+        {
+            n = send(port->client, &iac, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            port->iac_pending = 0;
+        }
+        if ((avail = cdc_rx_peek(port->cdc, &data)) <= 0)
+            break;
+        len = avail;
+        esc = rfc2217 ? memchr(data, IAC, avail) : NULL;
+        if (esc)
+            len = esc - data + 1;
+        n = send(port->client, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN)
+                drop_client(port);
+            break;
+        }
+        cdc_rx_consume(port->cdc, n);
+        if (esc && n == len)
+            port->iac_pending = 1;
+    }
+    if (avail < 0)
+    {
+        port_error(port, "receive");
+        return -1;
+    }
+    if (port->client < 0)
+        return 0;
+
+    /* client to port, received in place */
+    while ((avail = cdc_tx_reserve(port->cdc, &data)) > 0)
+    {
+        n = recv(port->client, data, avail, MSG_DONTWAIT);
+        if (n <= 0)
+        {
+            int gone = n == 0 || errno != EAGAIN;
+
+            /* release the space, or the data queued before it is held back */
+            cdc_tx_commit(port->cdc, 0);
+            if (gone)
+                drop_client(port);
+            break;
+        }
+        if (rfc2217)
+            n = telnet_filter(port, data, n);
+        cdc_tx_commit(port->cdc, n);
+    }
+    if (avail < 0)
+    {
+        port_error(port, "transmit");
+        return -1;
+    }
+    return 0;
+}
+
+static void accept_client(struct port *port, int ep, int index)
+{
+    static unsigned char const greeting[] = {
+        IAC, WILL, OPT_BINARY, IAC, DO, OPT_BINARY, IAC, WILL, OPT_SGA,
+        IAC, WILL, OPT_ECHO, IAC, DO, OPT_COM_PORT
+    };
+    struct epoll_event ev;
+    int fd, one = 1;
+
+    while ((fd = accept4(port->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (port->client >= 0)
+        {
+            /* one client per port */
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        port->client = fd;
+        port->state = TS_DATA;
+        port->iac_pending = 0;
+        port->will_sent = 1u << OPT_BINARY | 1u << OPT_SGA | 1u << OPT_ECHO;
+        port->do_sent = 1u << OPT_BINARY | 1u << 31;
+        if (rfc2217)
+            send_ctrl(port, greeting, sizeof(greeting));
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = (uint64_t)index;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static int add_port(struct cdc_ctx *cdc, char const *name, int tcp_port, int baudrate, int bufsize)
+{
+    struct port *port = &ports[nports];
+    struct sockaddr_in addr;
+    char errbuf[256];
+    int one = 1;
+
+    port->cdc = cdc;
+    port->client = -1;
+    port->baudrate = baudrate;
+    port->bits = BITS_8;
+    port->parity = NONE;
+    port->sbit = STOP_BIT_1;
+    port->dtr = port->rts = 1;
+    snprintf(port->name, sizeof(port->name), "%s", name);
+
+    if (cdc_async_start(cdc, 8, bufsize) < 0 ||
+        cdc_set_line_coding(cdc, baudrate, BITS_8, STOP_BIT_1, NONE) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", name, cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+    /* not fatal: ptys used for testing have no modem lines */
+    if (cdc_setdtr_rts(cdc, 1, 1) < 0)
+        port_error(port, "cdc_setdtr_rts");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcp_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    port->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    setsockopt(port->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (port->listener < 0 || bind(port->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(port->listener, 4) < 0)
+    {
+        perror("listen");
+        return -1;
+    }
+    printf("%s on tcp port %d (%s)\n", name, tcp_port, rfc2217 ? "rfc2217" : "raw");
+    nports++;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event events[64];
+    struct cdc_ctx *cdc;
+    char errbuf[256], name[64];
+    char const *ttys[MAX_PORTS];
+    int nttys = 0, vid = 0, pid = 0, baudrate = 115200, bufsize = 65536, base = 2000;
+    int ep, sfd, i, running = 1;
+    sigset_t mask;
+
+    while ((i = getopt(argc, argv, "v:p:t:P:rb:s:")) != -1)
+    {
+        switch (i)
+        {
+            case 'v':
+                vid = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pid = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                if (nttys < MAX_PORTS)
+                    ttys[nttys++] = optarg;
+                break;
+            case 'P':
+                base = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rfc2217 = 0;
+                break;
+            case 'b':
+                baudrate = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                bufsize = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v vid] [-p pid] [-t tty]... [-P base tcp port] [-r] [-b baudrate] [-s buffer size]\n", *argv);
+                exit(-1);
+        }
+    }
+
+    if (nttys)
+    {
+        for (i = 0; i < nttys; i++)
+        {
+            if ((cdc = cdc_new()) == NULL || cdc_tty_open(cdc, ttys[i]) < 0)
+            {
+                fprintf(stderr, "unable to open %s: %s\n", ttys[i], cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                continue;
+            }
+            if (add_port(cdc, ttys[i], base + nports, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+    }
+    else
+    {
+        struct cdc_device_list *devlist, *curdev;
+        struct cdc_ctx *finder = cdc_new();
+
+        if (finder == NULL || cdc_usb_find_all(finder, &devlist, vid, pid) < 0)
+        {
+            fprintf(stderr, "unable to list devices\n");
+            return EXIT_FAILURE;
+        }
+        for (curdev = devlist; curdev != NULL && nports < MAX_PORTS; curdev = curdev->next)
+        {
+            uint8_t bus = libusb_get_bus_number(curdev->dev);
+            uint8_t addr = libusb_get_device_address(curdev->dev);
+
+            /* every port gets its own context, so open it again by address */
+            if ((cdc = cdc_new()) == NULL || cdc_usb_open_bus_addr(cdc, bus, addr) < 0)
+            {
+                fprintf(stderr, "unable to open device: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                cdc_free(cdc);
+                continue;
+            }
+            snprintf(name, sizeof(name), "usb %03d:%03d", bus, addr);
+            if (add_port(cdc, name, base + nports, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+        cdc_list_free(&devlist);
+        cdc_free(finder);
+    }
+    if (nports == 0)
+    {
+        fprintf(stderr, "no ports\n");
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    /*
+       epoll data: port index for port and client events, with bit 32 set
+       for the listener; edge triggered, every event is followed by pumping
+       until EAGAIN
+    */
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    for (i = 0; i < nports; i++)
+    {
+        struct pollfd fds[MAX_POLLFDS];
+        struct epoll_event ev;
+        int n, f;
+
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t)1 << 32 | i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, ports[i].listener, &ev);
+
+        n = cdc_get_pollfds(ports[i].cdc, fds, MAX_POLLFDS);
+        for (f = 0; f < n && f < MAX_POLLFDS; f++)
+        {
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.u64 = (uint64_t)i;
+            epoll_ctl(ep, EPOLL_CTL_ADD, fds[f].fd, &ev);
+        }
+    }
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = UINT64_MAX;
+        epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+    }
+
+    while (running)
+    {
+        int n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), -1);
+        for (i = 0; i < n; i++)
+        {
+            struct port *port;
+            uint64_t data = events[i].data.u64;
+
+            if (data == UINT64_MAX)
+            {
+                running = 0;
+                continue;
+            }
+            port = &ports[data & 0xffffffff];
+            if (port->cdc == NULL)
+                continue;
+            if (data >> 32)
+                accept_client(port, ep, data & 0xffffffff);
+            else if (cdc_handle_events(port->cdc, 0) < 0)
+                port_error(port, "cdc_handle_events");
+            if (pump(port) < 0)
+            {
+                /* the device is gone: stop serving it */
+                if (port->client >= 0)
+                    drop_client(port);
+                close(port->listener);
+                cdc_usb_close(port->cdc);
+                cdc_free(port->cdc);
+                port->cdc = NULL;
+            }
+        }
+    }
+
+    for (i = 0; i < nports; i++)
+    {
+        if (ports[i].cdc == NULL)
+            continue;
+        if (ports[i].client >= 0)
+            close(ports[i].client);
+        close(ports[i].listener);
+        cdc_usb_close(ports[i].cdc);
+        cdc_free(ports[i].cdc);
+    }
+    close(ep);
+    close(sfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,448 @@
+/* cdc_ptyd.c
+
+   cdc-ptyd: expose libcdc ports as pseudo terminals
+
+   Every opened port gets a pty whose slave is linked at <prefix><n>, so
+   tools that only talk to tty devices can use it.  One thread pumps all
+   ports with epoll, moving data between the asynchronous engine's buffers
+   and the pty masters without intermediate copies.  Line settings made
+   on the slave are applied to the port: the speed, character size,
+   parity and stop bits with cdc_set_line_coding(), and a speed of B0
+   drops DTR and RTS like a hangup does on a real tty.
+
+   This program is distributed under the GPL, version 3
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+#include <libusb.h>
+#include <cdc.h>
+
+#define MAX_PORTS 256
+#define MAX_POLLFDS 16
+
+struct port
+{
+    struct cdc_ctx *cdc;
+    int master;
+    int slave;
+    char link[256];
+    /** last line settings applied to the port */
+    speed_t speed;
+    tcflag_t cflag;
+    int dtr;
+};
+
+static struct port ports[MAX_PORTS];
+static int nports;
+
+static struct {
+    int baudrate;
+    speed_t speed;
+} const speeds[] = {
+    { 0, B0 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 },
+    { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+    { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+    { 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 },
+    { 2000000, B2000000 }, { 3000000, B3000000 }, { 4000000, B4000000 },
+};
+
+static speed_t baud_to_speed(int baudrate)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+        if (speeds[i].baudrate == baudrate)
+            return speeds[i].speed;
+    return B9600;
+}
+
+static int speed_to_baud(speed_t speed)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+        if (speeds[i].speed == speed)
+            return speeds[i].baudrate;
+    return -1;
+}
+
+static void port_error(struct port *port, char const *what)
+{
+    char errbuf[256];
+    fprintf(stderr, "%s: %s failed: %s\n", port->link, what,
+            cdc_get_error_string(port->cdc, errbuf, sizeof(errbuf)));
+}
+
+/* apply the slave's termios to the port, see TIOCPKT_IOCTL */
+static void sync_termios(struct port *port)
+{
+    struct termios tio;
+    enum cdc_bits_type bits;
+    enum cdc_parity_type parity = NONE;
+    speed_t speed;
+
+    if (tcgetattr(port->master, &tio) < 0)
+        return;
+
+    /* applications replacing the flags drop EXTPROC, and with it the notifications */
+    if (!(tio.c_lflag & EXTPROC))
+    {
+        tio.c_lflag |= EXTPROC;
+        tcsetattr(port->master, TCSANOW, &tio);
+    }
+
+    speed = cfgetospeed(&tio);
+    if (speed == B0)
+    {
+        if (port->dtr && cdc_setdtr_rts(port->cdc, 0, 0) < 0)
+            port_error(port, "cdc_setdtr_rts");
+        port->dtr = 0;
+        return;
+    }
+    if (!port->dtr)
+    {
+        if (cdc_setdtr_rts(port->cdc, 1, 1) < 0)
+            port_error(port, "cdc_setdtr_rts");
+        port->dtr = 1;
+    }
+
+    if (speed == port->speed && (tio.c_cflag & (CSIZE | CSTOPB | PARENB | PARODD | CMSPAR)) ==
+                                (port->cflag & (CSIZE | CSTOPB | PARENB | PARODD | CMSPAR)))
+        return;
+    if (speed_to_baud(speed) < 0)
+    {
+        fprintf(stderr, "%s: unsupported speed\n", port->link);
+        return;
+    }
+
+    switch (tio.c_cflag & CSIZE)
+    {
+        case CS5: bits = BITS_5; break;
+        case CS6: bits = BITS_6; break;
+        case CS7: bits = BITS_7; break;
+        default: bits = BITS_8; break;
+    }
+    if (tio.c_cflag & PARENB)
+    {
+        if (tio.c_cflag & CMSPAR)
+            parity = (tio.c_cflag & PARODD) ? MARK : SPACE;
+        else
+            parity = (tio.c_cflag & PARODD) ? ODD : EVEN;
+    }
+
+    if (cdc_set_line_coding(port->cdc, speed_to_baud(speed), bits,
+                            (tio.c_cflag & CSTOPB) ? STOP_BIT_2 : STOP_BIT_1, parity) < 0)
+        port_error(port, "cdc_set_line_coding");
+    port->speed = speed;
+    port->cflag = tio.c_cflag;
+}
+
+/* move data both ways until the port or the pty would block */
+static int pump(struct port *port)
+{
+    unsigned char *data, status;
+    struct iovec iov[2];
+    ssize_t n;
+    int avail;
+
+    /* port to pty */
+    while ((avail = cdc_rx_peek(port->cdc, &data)) > 0)
+    {
+        n = write(port->master, data, avail);
+        if (n <= 0)
+            break;
+        cdc_rx_consume(port->cdc, n);
+    }
+    if (avail < 0)
+    {
+        port_error(port, "receive");
+        return -1;
+    }
+
+    /* pty to port; packet mode prefixes every read with a status byte */
+    while ((avail = cdc_tx_reserve(port->cdc, &data)) > 0)
+    {
+        iov[0].iov_base = &status;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = data;
+        iov[1].iov_len = avail;
+        n = readv(port->master, iov, 2);
+        if (n <= 0)
+        {
+            /* release the space, or the data queued before it is held back */
+            cdc_tx_commit(port->cdc, 0);
+            break;
+        }
+        if (status != TIOCPKT_DATA)
+        {
+            if (status & TIOCPKT_IOCTL)
+                sync_termios(port);
+            continue;
+        }
+        cdc_tx_commit(port->cdc, n - 1);
+    }
+    if (avail < 0)
+    {
+        port_error(port, "transmit");
+        return -1;
+    }
+    return 0;
+}
+
+static int setup_pty(struct port *port, char const *prefix, int baudrate)
+{
+    struct termios tio;
+    int one = 1;
+    char *name;
+
+    port->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (port->master < 0 || grantpt(port->master) < 0 || unlockpt(port->master) < 0 ||
+        (name = ptsname(port->master)) == NULL)
+    {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    /* keep the slave open so the master never sees a hangup between clients */
+    port->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (port->slave < 0 || tcgetattr(port->slave, &tio) < 0)
+    {
+        perror(name);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_lflag |= EXTPROC;
+    cfsetispeed(&tio, baud_to_speed(baudrate));
+    cfsetospeed(&tio, baud_to_speed(baudrate));
+    tcsetattr(port->slave, TCSANOW, &tio);
+    port->speed = cfgetospeed(&tio);
+    port->cflag = tio.c_cflag;
+    port->dtr = 1;
+
+    if (ioctl(port->master, TIOCPKT, &one) < 0)
+    {
+        perror("TIOCPKT");
+        return -1;
+    }
+
+    snprintf(port->link, sizeof(port->link), "%s%d", prefix, nports);
+    return 0;
+}
+
+/* publish the pty once the port behind it is set up */
+static int link_pty(struct port *port)
+{
+    char *name = ptsname(port->master);
+
+    unlink(port->link);
+    if (name == NULL || symlink(name, port->link) < 0)
+    {
+        perror(port->link);
+        return -1;
+    }
+    printf("%s -> %s\n", port->link, name);
+    return 0;
+}
+
+static int add_port(struct cdc_ctx *cdc, char const *prefix, int baudrate, int bufsize)
+{
+    struct port *port = &ports[nports];
+    char errbuf[256];
+
+    port->cdc = cdc;
+    if (setup_pty(port, prefix, baudrate) < 0)
+        return -1;
+    if (cdc_async_start(cdc, 8, bufsize) < 0 ||
+        cdc_set_line_coding(cdc, baudrate, BITS_8, STOP_BIT_1, NONE) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", port->link, cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+        close(port->slave);
+        close(port->master);
+        return -1;
+    }
+    /* not fatal: ptys used for testing have no modem lines */
+    if (cdc_setdtr_rts(cdc, 1, 1) < 0)
+        port_error(port, "cdc_setdtr_rts");
+    if (link_pty(port) < 0)
+    {
+        close(port->slave);
+        close(port->master);
+        return -1;
+    }
+    nports++;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event events[64];
+    struct cdc_ctx *cdc;
+    char errbuf[256];
+    char const *prefix = "/tmp/ttyCDC";
+    char const *ttys[MAX_PORTS];
+    int nttys = 0, vid = 0, pid = 0, baudrate = 115200, bufsize = 65536;
+    int ep, sfd, i, running = 1;
+    sigset_t mask;
+
+    while ((i = getopt(argc, argv, "v:p:t:l:b:s:")) != -1)
+    {
+        switch (i)
+        {
+            case 'v':
+                vid = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pid = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                if (nttys < MAX_PORTS)
+                    ttys[nttys++] = optarg;
+                break;
+            case 'l':
+                prefix = optarg;
+                break;
+            case 'b':
+                baudrate = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                bufsize = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v vid] [-p pid] [-t tty]... [-l link prefix] [-b baudrate] [-s buffer size]\n", *argv);
+                exit(-1);
+        }
+    }
+
+    if (nttys)
+    {
+        for (i = 0; i < nttys; i++)
+        {
+            if ((cdc = cdc_new()) == NULL || cdc_tty_open(cdc, ttys[i]) < 0)
+            {
+                fprintf(stderr, "unable to open %s: %s\n", ttys[i], cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                continue;
+            }
+            if (add_port(cdc, prefix, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+    }
+    else
+    {
+        struct cdc_device_list *devlist, *curdev;
+        struct cdc_ctx *finder = cdc_new();
+
+        if (finder == NULL || cdc_usb_find_all(finder, &devlist, vid, pid) < 0)
+        {
+            fprintf(stderr, "unable to list devices\n");
+            return EXIT_FAILURE;
+        }
+        for (curdev = devlist; curdev != NULL && nports < MAX_PORTS; curdev = curdev->next)
+        {
+            /* every port gets its own context, so open it again by address */
+            if ((cdc = cdc_new()) == NULL ||
+                cdc_usb_open_bus_addr(cdc, libusb_get_bus_number(curdev->dev),
+                                      libusb_get_device_address(curdev->dev)) < 0)
+            {
+                fprintf(stderr, "unable to open device: %s\n", cdc_get_error_string(cdc, errbuf, sizeof(errbuf)));
+                cdc_free(cdc);
+                continue;
+            }
+            if (add_port(cdc, prefix, baudrate, bufsize) < 0)
+                cdc_free(cdc);
+        }
+        cdc_list_free(&devlist);
+        cdc_free(finder);
+    }
+    if (nports == 0)
+    {
+        fprintf(stderr, "no ports\n");
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    /* edge triggered: every event is followed by pumping until EAGAIN */
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    for (i = 0; i < nports; i++)
+    {
+        struct pollfd fds[MAX_POLLFDS];
+        struct epoll_event ev;
+        int n, f;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = (uint64_t)i << 1 | 1;
+        epoll_ctl(ep, EPOLL_CTL_ADD, ports[i].master, &ev);
+
+        n = cdc_get_pollfds(ports[i].cdc, fds, MAX_POLLFDS);
+        for (f = 0; f < n && f < MAX_POLLFDS; f++)
+        {
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.u64 = (uint64_t)i << 1;
+            epoll_ctl(ep, EPOLL_CTL_ADD, fds[f].fd, &ev);
+        }
+    }
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = UINT64_MAX;
+        epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+    }
+
+    while (running)
+    {
+        int n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), -1);
+        for (i = 0; i < n; i++)
+        {
+            struct port *port;
+            if (events[i].data.u64 == UINT64_MAX)
+            {
+                running = 0;
+                continue;
+            }
+            port = &ports[events[i].data.u64 >> 1];
+            if (port->cdc == NULL)
+                continue;
+            if (!(events[i].data.u64 & 1) && cdc_handle_events(port->cdc, 0) < 0)
+                port_error(port, "cdc_handle_events");
+            if (pump(port) < 0)
+            {
+                /* the device is gone: remove its link and stop serving it */
+                unlink(port->link);
+                cdc_usb_close(port->cdc);
+                cdc_free(port->cdc);
+                close(port->slave);
+                close(port->master);
+                port->cdc = NULL;
+            }
+        }
+    }
+
+    for (i = 0; i < nports; i++)
+    {
+        if (ports[i].cdc == NULL)
+            continue;
+        unlink(ports[i].link);
+        cdc_usb_close(ports[i].cdc);
+        cdc_free(ports[i].cdc);
+        close(ports[i].slave);
+        close(ports[i].master);
+    }
+    close(ep);
+    close(sfd);
+    return EXIT_SUCCESS;
+}